@@ -0,0 +1,200 @@
+// Latency of sending setpoint frames through SocketCAN and libEposCmd.
+//
+// Sends RPDO-sized frames on a CAN interface, one per syscall, batched with
+// sendmmsg() and (with -V) one per VCS_SendCANFrame() call through the port
+// configured in settings.h. For single frames the time until the frame is
+// received on a second socket (kernel receive timestamp) is measured as well.
+// Works on a vcan interface (see if_vcan) without hardware, except for -V
+// which needs the interface the library is configured for.
+
+#include "../epos.h"
+#include "../socketcan.h"
+#include "../util.h"
+#include "../settings.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint16_t node_id = 2;
+
+static int cmp_u64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a;
+        uint64_t y = *(const uint64_t *)b;
+        return (x > y) - (x < y);
+}
+
+// Print statistics of n samples, each covering frames_per_sample frames.
+static void report(const char *what, uint64_t *samples, size_t n,
+                   unsigned frames_per_sample)
+{
+        if (n == 0) {
+                printf("%-28s no samples\n", what);
+                return;
+        }
+
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; i++) {
+                sum += samples[i];
+        }
+
+        qsort(samples, n, sizeof(uint64_t), cmp_u64);
+        double scale = 1e3 * frames_per_sample;
+        printf("%-28s mean %7.2fus  p50 %7.2fus  p99 %7.2fus  max %8.2fus  "
+               "(per frame, %zu samples)\n", what, sum / (double)n / scale,
+               samples[n / 2] / scale, samples[n * 99 / 100] / scale,
+               samples[n - 1] / scale, n);
+}
+
+static void fill_frames(struct can_frame *frames, size_t n)
+{
+        for (size_t i = 0; i < n; i++) {
+                memset(&frames[i], 0, sizeof(frames[i]));
+                frames[i].can_id = 0x200 + node_id; // RPDO1
+                frames[i].can_dlc = 6; // controlword + target velocity
+                memcpy(frames[i].data, &i, 4);
+        }
+}
+
+static void bench_single(const char *ifname, unsigned nframes)
+{
+        struct can_sock *tx = can_open(ifname);
+        struct can_sock *rx = can_open(ifname);
+        if (!tx || !rx) {
+                perror("can_open");
+                exit(1);
+        }
+
+        uint64_t *call = calloc(nframes, sizeof(uint64_t));
+        uint64_t *wire = calloc(nframes, sizeof(uint64_t));
+        size_t nwire = 0;
+        struct can_frame frame;
+        fill_frames(&frame, 1);
+        for (unsigned i = 0; i < nframes; i++) {
+                uint64_t start = now_ns();
+                if (can_send(tx, &frame, 1) != 1) {
+                        perror("can_send");
+                        exit(1);
+                }
+
+                call[i] = now_ns() - start;
+
+                struct can_frame received;
+                uint64_t stamp;
+                if (can_recv(rx, &received, &stamp, 1, 100) == 1) {
+                        wire[nwire++] = stamp - start;
+                }
+        }
+
+        report("socketcan send", call, nframes, 1);
+        report("socketcan send to receive", wire, nwire, 1);
+
+        free(call);
+        free(wire);
+        can_close(rx);
+        can_close(tx);
+}
+
+static void bench_batch(const char *ifname, unsigned nframes, unsigned batch)
+{
+        struct can_sock *tx = can_open(ifname);
+        if (!tx) {
+                perror("can_open");
+                exit(1);
+        }
+
+        struct can_frame frames[CAN_BATCH_MAX];
+        fill_frames(frames, batch);
+        size_t nsamples = nframes / batch;
+        uint64_t *call = calloc(nsamples, sizeof(uint64_t));
+        for (size_t i = 0; i < nsamples; i++) {
+                uint64_t start = now_ns();
+                if (can_send(tx, frames, batch) != (int)batch) {
+                        perror("can_send");
+                        exit(1);
+                }
+
+                call[i] = now_ns() - start;
+        }
+
+        char what[64];
+        snprintf(what, sizeof(what), "socketcan sendmmsg x%u", batch);
+        report(what, call, nsamples, batch);
+
+        free(call);
+        can_close(tx);
+}
+
+static void bench_vcs(unsigned nframes)
+{
+        // the library takes the names as char *
+        uint32_t err;
+        void *port = VCS_OpenDevice((char *)DEV_NAME, (char *)PROTO_NAME,
+                                    (char *)IF_NAME, (char *)PORT_NAME, &err);
+        if (!port) {
+                die("failed to open port", err);
+        }
+
+        if (!VCS_SetProtocolStackSettings(port, BAUDRATE, TIMEOUT, &err)) {
+                die("failed to set port settings", err);
+        }
+
+        uint64_t *call = calloc(nframes, sizeof(uint64_t));
+        struct can_frame frame;
+        fill_frames(&frame, 1);
+        for (unsigned i = 0; i < nframes; i++) {
+                uint64_t start = now_ns();
+                if (!VCS_SendCANFrame(port, frame.can_id, frame.can_dlc,
+                                      frame.data, &err)) {
+                        die("failed to send CAN frame", err);
+                }
+
+                call[i] = now_ns() - start;
+        }
+
+        report("VCS_SendCANFrame", call, nframes, 1);
+
+        free(call);
+        VCS_CloseDevice(port, &err);
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr, "usage: %s [-i ifname] [-N node_id] [-n frames] "
+                "[-b batch] [-V]\n", name);
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        const char *ifname = "vcan0";
+        unsigned nframes = 10000;
+        unsigned batch = 16;
+        int vcs = 0;
+
+        int opt;
+        while ((opt = getopt(argc, argv, "i:N:n:b:V")) != -1) {
+                switch (opt) {
+                case 'i': ifname = optarg; break;
+                case 'N': node_id = atoi(optarg); break;
+                case 'n': nframes = atoi(optarg); break;
+                case 'b': batch = atoi(optarg); break;
+                case 'V': vcs = 1; break;
+                default: usage(argv[0]);
+                }
+        }
+
+        if (nframes == 0 || batch == 0 || batch > CAN_BATCH_MAX) {
+                usage(argv[0]);
+        }
+
+        bench_single(ifname, nframes);
+        bench_batch(ifname, nframes, batch);
+        if (vcs) {
+                bench_vcs(nframes);
+        }
+
+        return 0;
+}
@@ -0,0 +1,384 @@
+// Load generator for the TCP command server.
+//
+// Measures the rate at which connections can be established (connect, one
+// NOP round trip, close) and the throughput and round-trip latency of
+// commands while an increasing number of clients is connected concurrently.
+// Every client cycles through the commands given with -o and keeps up to -w
+// of them in flight. The default, NOP, is answered by the server without
+// touching the bus, so it measures the network path only; the others measure
+// the whole path down to the library, e.g. against the simulated library
+// (make bench-sim).
+
+#include "../proto.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define MAX_WINDOW      32 // requests in flight per client, as many as the
+                           // server accepts per connection
+#define MAX_COMMANDS    16
+
+// commands the load can be made of
+struct command {
+        const char *name;
+        uint8_t op;
+        uint8_t payload[PROTO_MAX_PAYLOAD];
+        uint16_t len;
+};
+
+static const struct command commands[] = {
+        { "nop", OP_NOP, { 0 }, 0 },
+        { "get_state", OP_GET_STATE, { 0 }, 0 },
+        { "get_telemetry", OP_GET_TELEMETRY, { 0 }, 0 },
+        // statusword
+        { "get_object", OP_GET_OBJECT, { 0x41, 0x60, 0x00, 2 }, 4 },
+        // RPDO1: controlword (enable operation) and target velocity 0
+        { "setpoint", OP_PDO_SETPOINT, { 1, 0x0f, 0, 0, 0, 0, 0, 0, 0 }, 9 },
+        { "sync", OP_SYNC, { 0 }, 0 },
+};
+
+// buffered reader of response frames
+struct reader {
+        int fd;
+        uint8_t buf[65536];
+        size_t start;
+        size_t end;
+};
+
+struct client {
+        pthread_t thread;
+        struct reader reader;
+        uint64_t *samples;
+        size_t nsamples;
+        size_t cap;
+        unsigned long nerrors; // responses with an error code
+        int failed;
+};
+
+static struct sockaddr_in server_addr;
+static uint8_t node_id = 2;
+static const struct command *load[MAX_COMMANDS];
+static size_t nload;
+static unsigned window = 1;
+static atomic_int stop;
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int client_connect(void)
+{
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1) {
+                return -1;
+        }
+
+        if (connect(fd, (struct sockaddr *)&server_addr,
+                    sizeof(server_addr)) == -1) {
+                close(fd);
+                return -1;
+        }
+
+        const int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        return fd;
+}
+
+static int send_request(int fd, const struct command *command)
+{
+        uint8_t req[PROTO_HDR_SIZE + PROTO_MAX_PAYLOAD];
+        uint16_t len = PROTO_HDR_SIZE - PROTO_LEN_SIZE + command->len;
+        req[0] = len;
+        req[1] = len >> 8;
+        req[2] = command->op;
+        req[3] = node_id;
+        memcpy(req + PROTO_HDR_SIZE, command->payload, command->len);
+        ssize_t size = PROTO_LEN_SIZE + len;
+        return write(fd, req, size) == size ? 0 : -1;
+}
+
+// Read the next response frame and return its error code in *err.
+static int read_response(struct reader *reader, uint32_t *err)
+{
+        while (1) {
+                size_t avail = reader->end - reader->start;
+                const uint8_t *frame = reader->buf + reader->start;
+                if (avail >= PROTO_LEN_SIZE) {
+                        size_t size = PROTO_LEN_SIZE +
+                                      (frame[0] | frame[1] << 8);
+                        if (size < PROTO_RESP_HDR_SIZE) {
+                                return -1;
+                        } else if (avail >= size) {
+                                *err = frame[4] | frame[5] << 8 |
+                                       frame[6] << 16 |
+                                       (uint32_t)frame[7] << 24;
+                                reader->start += size;
+                                return 0;
+                        }
+                }
+
+                memmove(reader->buf, frame, avail);
+                reader->start = 0;
+                reader->end = avail;
+                ssize_t nread = read(reader->fd, reader->buf + reader->end,
+                                     sizeof(reader->buf) - reader->end);
+                if (nread <= 0) {
+                        return -1;
+                }
+
+                reader->end += nread;
+        }
+}
+
+// Send a NOP request and wait for its response.
+static int nop_round_trip(int fd)
+{
+        struct reader reader = { .fd = fd };
+        uint32_t err;
+        if (send_request(fd, &commands[0]) == -1) {
+                return -1;
+        }
+
+        return read_response(&reader, &err);
+}
+
+static void client_record(struct client *client, uint64_t ns)
+{
+        if (client->nsamples == client->cap) {
+                client->cap = client->cap ? client->cap * 2 : 4096;
+                client->samples = realloc(client->samples,
+                                          client->cap * sizeof(uint64_t));
+        }
+
+        client->samples[client->nsamples++] = ns;
+}
+
+static void *client_run(void *arg)
+{
+        struct client *client = arg;
+        int fd = client_connect();
+        if (fd == -1) {
+                client->failed = 1;
+                return NULL;
+        }
+
+        // responses come in request order, so the send times of the requests
+        // in flight form a queue
+        client->reader.fd = fd;
+        uint64_t sent[MAX_WINDOW];
+        unsigned head = 0;
+        unsigned tail = 0;
+        size_t next = 0;
+        while (1) {
+                while (!atomic_load(&stop) && tail - head < window) {
+                        sent[tail++ % MAX_WINDOW] = now_ns();
+                        if (send_request(fd, load[next++ % nload]) == -1) {
+                                client->failed = 1;
+                                goto out;
+                        }
+                }
+
+                if (head == tail) {
+                        break;
+                }
+
+                uint32_t err;
+                if (read_response(&client->reader, &err) == -1) {
+                        client->failed = 1;
+                        break;
+                }
+
+                client_record(client, now_ns() - sent[head++ % MAX_WINDOW]);
+                client->nerrors += err != 0;
+        }
+
+out:
+        close(fd);
+        return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a;
+        uint64_t y = *(const uint64_t *)b;
+        return (x > y) - (x < y);
+}
+
+static void bench_connection_rate(unsigned seconds)
+{
+        uint64_t end = now_ns() + (uint64_t)seconds * 1000000000;
+        unsigned long nconns = 0;
+        unsigned long nfailed = 0;
+        uint64_t start = now_ns();
+        while (now_ns() < end) {
+                int fd = client_connect();
+                if (fd == -1 || nop_round_trip(fd) == -1) {
+                        nfailed++;
+                } else {
+                        nconns++;
+                }
+
+                if (fd != -1) {
+                        close(fd);
+                }
+        }
+
+        double elapsed = (now_ns() - start) / 1e9;
+        printf("connection rate: %.0f conn/s (%lu connections, %lu failed)\n",
+               nconns / elapsed, nconns, nfailed);
+}
+
+static void bench_latency(int nclients, unsigned seconds)
+{
+        struct client *clients = calloc(nclients, sizeof(*clients));
+        atomic_store(&stop, 0);
+
+        uint64_t start = now_ns();
+        for (int i = 0; i < nclients; i++) {
+                pthread_create(&clients[i].thread, NULL, client_run,
+                               &clients[i]);
+        }
+
+        sleep(seconds);
+        atomic_store(&stop, 1);
+
+        size_t total = 0;
+        unsigned long nerrors = 0;
+        int nfailed = 0;
+        for (int i = 0; i < nclients; i++) {
+                pthread_join(clients[i].thread, NULL);
+                total += clients[i].nsamples;
+                nerrors += clients[i].nerrors;
+                nfailed += clients[i].failed;
+        }
+
+        double elapsed = (now_ns() - start) / 1e9;
+
+        uint64_t *samples = malloc((total ? total : 1) * sizeof(uint64_t));
+        size_t n = 0;
+        uint64_t sum = 0;
+        for (int i = 0; i < nclients; i++) {
+                memcpy(samples + n, clients[i].samples,
+                       clients[i].nsamples * sizeof(uint64_t));
+                n += clients[i].nsamples;
+                free(clients[i].samples);
+        }
+
+        for (size_t i = 0; i < n; i++) {
+                sum += samples[i];
+        }
+
+        qsort(samples, n, sizeof(uint64_t), cmp_u64);
+        if (n > 0) {
+                printf("%3d clients: %8.0f cmd/s  mean %7.1fus  p50 %7.1fus  "
+                       "p99 %7.1fus  p999 %7.1fus  max %8.1fus  "
+                       "(%lu errors, %d failed)\n", nclients, n / elapsed,
+                       sum / (double)n / 1e3, samples[n / 2] / 1e3,
+                       samples[n * 99 / 100] / 1e3,
+                       samples[n * 999 / 1000] / 1e3, samples[n - 1] / 1e3,
+                       nerrors, nfailed);
+        } else {
+                printf("%3d clients: no samples (%d failed)\n", nclients,
+                       nfailed);
+        }
+
+        free(samples);
+        free(clients);
+}
+
+// Parse the comma-separated list of commands in spec into load.
+static int parse_load(char *spec)
+{
+        nload = 0;
+        for (char *name = strtok(spec, ","); name; name = strtok(NULL, ",")) {
+                size_t i = 0;
+                while (i < sizeof(commands) / sizeof(commands[0]) &&
+                       strcmp(commands[i].name, name) != 0) {
+                        i++;
+                }
+
+                if (i == sizeof(commands) / sizeof(commands[0]) ||
+                    nload == MAX_COMMANDS) {
+                        return -1;
+                }
+
+                load[nload++] = &commands[i];
+        }
+
+        return nload ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr, "usage: %s [-H host] [-p port] [-n node_id] "
+                "[-c max_clients] [-d seconds] [-o command,...] "
+                "[-w window]\n", name);
+        fprintf(stderr, "commands:");
+        for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+                fprintf(stderr, " %s", commands[i].name);
+        }
+
+        fprintf(stderr, "\n");
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        const char *host = "127.0.0.1";
+        int port = 12345;
+        int max_clients = 32;
+        unsigned seconds = 2;
+        load[nload++] = &commands[0];
+
+        int opt;
+        while ((opt = getopt(argc, argv, "H:p:n:c:d:o:w:")) != -1) {
+                switch (opt) {
+                case 'H': host = optarg; break;
+                case 'p': port = atoi(optarg); break;
+                case 'n': node_id = atoi(optarg); break;
+                case 'c': max_clients = atoi(optarg); break;
+                case 'd': seconds = atoi(optarg); break;
+                case 'o':
+                        if (parse_load(optarg) == -1) {
+                                usage(argv[0]);
+                        }
+                        break;
+                case 'w': window = atoi(optarg); break;
+                default: usage(argv[0]);
+                }
+        }
+
+        if (window < 1 || window > MAX_WINDOW) {
+                fprintf(stderr, "window must be between 1 and %d\n",
+                        MAX_WINDOW);
+                return 1;
+        }
+
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1) {
+                fprintf(stderr, "invalid host '%s'\n", host);
+                return 1;
+        }
+
+        bench_connection_rate(seconds);
+        for (int nclients = 1; nclients <= max_clients; nclients *= 2) {
+                bench_latency(nclients, seconds);
+        }
+
+        return 0;
+}
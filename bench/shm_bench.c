@@ -0,0 +1,127 @@
+// Round-trip latency of the shared-memory transport against TCP.
+//
+// Sends the same command over a TCP connection and over a shared-memory
+// connection (see shm.h), one at a time, and reports the distribution of the
+// time from submitting it to handling its response. Both paths share
+// everything behind the transport (bus thread and library), so the
+// difference is the cost of the transport itself. Run against the server,
+// e.g. the one linked against the simulated library (make sim).
+
+#include "../client/client.h"
+#include "../proto.h"
+#include "../util.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int cmp_u64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a;
+        uint64_t y = *(const uint64_t *)b;
+        return (x > y) - (x < y);
+}
+
+static void report(const char *what, uint64_t *samples, size_t n)
+{
+        qsort(samples, n, sizeof(uint64_t), cmp_u64);
+        printf("%-6s p50 %7.2fus  p90 %7.2fus  p99 %7.2fus  "
+               "p99.9 %7.2fus  max %8.2fus\n", what,
+               samples[n / 2] / 1e3, samples[n * 9 / 10] / 1e3,
+               samples[n * 99 / 100] / 1e3, samples[n * 999 / 1000] / 1e3,
+               samples[n - 1] / 1e3);
+}
+
+// Time n round trips of op to node. Returns -1 if a call failed.
+static int measure(struct client *client, uint8_t op, uint8_t node,
+                   uint64_t *samples, size_t n)
+{
+        for (size_t i = 0; i < n; i++) {
+                uint64_t start = now_ns();
+                if (client_call(client, op, node, NULL, 0, NULL, 0,
+                                NULL) != 0) {
+                        return -1;
+                }
+
+                samples[i] = now_ns() - start;
+        }
+
+        return 0;
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr, "usage: %s [-H host] [-p port] [-s socket] "
+                "[-o nop|get_state|get_telemetry] [-N node] [-n calls]\n",
+                name);
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        const char *host = "127.0.0.1";
+        unsigned port = 12345;
+        const char *path = "/tmp/epos.sock";
+        uint8_t op = OP_NOP;
+        uint8_t node = 2;
+        size_t n = 100000;
+
+        int opt;
+        while ((opt = getopt(argc, argv, "H:p:s:o:N:n:")) != -1) {
+                switch (opt) {
+                case 'H': host = optarg; break;
+                case 'p': port = atoi(optarg); break;
+                case 's': path = optarg; break;
+                case 'N': node = atoi(optarg); break;
+                case 'n': n = atol(optarg); break;
+                case 'o':
+                        if (strcmp(optarg, "nop") == 0) {
+                                op = OP_NOP;
+                        } else if (strcmp(optarg, "get_state") == 0) {
+                                op = OP_GET_STATE;
+                        } else if (strcmp(optarg, "get_telemetry") == 0) {
+                                op = OP_GET_TELEMETRY;
+                        } else {
+                                usage(argv[0]);
+                        }
+                        break;
+                default: usage(argv[0]);
+                }
+        }
+
+        if (n < 1000) {
+                usage(argv[0]);
+        }
+
+        struct client *tcp = client_connect(host, port);
+        if (!tcp) {
+                perror("failed to connect over TCP");
+                return 1;
+        }
+
+        struct client *shm = client_connect_shm(path);
+        if (!shm) {
+                perror("failed to connect over shared memory");
+                return 1;
+        }
+
+        uint64_t *samples = malloc(n * sizeof(uint64_t));
+        printf("%zu round trips each\n", n);
+        if (measure(tcp, op, node, samples, n) == -1) {
+                fprintf(stderr, "call over TCP failed\n");
+                return 1;
+        }
+
+        report("tcp", samples, n);
+        if (measure(shm, op, node, samples, n) == -1) {
+                fprintf(stderr, "call over shared memory failed\n");
+                return 1;
+        }
+
+        report("shm", samples, n);
+        free(samples);
+        client_close(tcp);
+        client_close(shm);
+        return 0;
+}
@@ -0,0 +1,142 @@
+// Time it takes to plan and sample jerk-limited trajectories (see traj.h).
+//
+// Plans random multi-axis trajectories, samples them into per-cycle setpoints
+// with traj_sample() and with a scalar reference which evaluates every
+// sample on its own through traj_at(), checks that both agree and reports
+// the time per trajectory and per sample of all axes.
+
+#include "../traj.h"
+#include "../util.h"
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int cmp_u64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a;
+        uint64_t y = *(const uint64_t *)b;
+        return (x > y) - (x < y);
+}
+
+// Print statistics of n runs, each covering units of what is reported.
+static void report(const char *what, uint64_t *samples, size_t n,
+                   size_t units, const char *unit)
+{
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; i++) {
+                sum += samples[i];
+        }
+
+        qsort(samples, n, sizeof(uint64_t), cmp_u64);
+        printf("%-20s mean %9.2fus  p50 %9.2fus  max %9.2fus  "
+               "(%7.2fns per %s)\n", what, sum / (double)n / 1e3,
+               samples[n / 2] / 1e3, samples[n - 1] / 1e3,
+               samples[n / 2] / (double)units, unit);
+}
+
+// The straightforward way: evaluate every sample on its own.
+static void sample_scalar(const struct traj *traj, size_t naxes,
+                          double period, size_t n, int32_t *out)
+{
+        double positions[TRAJ_MAX_AXES];
+        for (size_t k = 0; k < n; k++) {
+                traj_at(traj, k * period, positions, NULL);
+                for (size_t a = 0; a < naxes; a++) {
+                        out[a * n + k] = lround(positions[a]);
+                }
+        }
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr, "usage: %s [-a axes] [-w waypoints] [-p period_us] "
+                "[-n runs]\n", name);
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        unsigned naxes = 12;
+        unsigned nwaypoints = 16;
+        unsigned period_us = 1000;
+        unsigned runs = 200;
+
+        int opt;
+        while ((opt = getopt(argc, argv, "a:w:p:n:")) != -1) {
+                switch (opt) {
+                case 'a': naxes = atoi(optarg); break;
+                case 'w': nwaypoints = atoi(optarg); break;
+                case 'p': period_us = atoi(optarg); break;
+                case 'n': runs = atoi(optarg); break;
+                default: usage(argv[0]);
+                }
+        }
+
+        if (naxes == 0 || naxes > TRAJ_MAX_AXES || nwaypoints < 2 ||
+            period_us == 0 || runs == 0) {
+                usage(argv[0]);
+        }
+
+        struct traj_limits limits[TRAJ_MAX_AXES];
+        for (unsigned a = 0; a < naxes; a++) {
+                limits[a] = (struct traj_limits){
+                        .velocity = 100000 + 10000 * a,
+                        .acceleration = 1000000,
+                        .jerk = 20000000,
+                };
+        }
+
+        double period = period_us / 1e6;
+        double *waypoints = malloc(naxes * nwaypoints * sizeof(double));
+        uint64_t *plan = malloc(runs * sizeof(uint64_t));
+        uint64_t *vector = malloc(runs * sizeof(uint64_t));
+        uint64_t *scalar = malloc(runs * sizeof(uint64_t));
+        size_t total = 0;
+        long max_diff = 0;
+        srand(1);
+        for (unsigned r = 0; r < runs; r++) {
+                for (unsigned i = 0; i < naxes * nwaypoints; i++) {
+                        waypoints[i] = rand() % 200001 - 100000;
+                }
+
+                uint64_t start = now_ns();
+                struct traj *traj = traj_plan(waypoints, nwaypoints, naxes,
+                                              limits);
+                plan[r] = now_ns() - start;
+
+                size_t n = traj_samples(traj, period);
+                int32_t *out = malloc(naxes * n * sizeof(int32_t));
+                int32_t *ref = malloc(naxes * n * sizeof(int32_t));
+                start = now_ns();
+                traj_sample(traj, period, 0, n, out, n);
+                vector[r] = now_ns() - start;
+                start = now_ns();
+                sample_scalar(traj, naxes, period, n, ref);
+                scalar[r] = now_ns() - start;
+
+                for (size_t i = 0; i < naxes * n; i++) {
+                        long diff = labs((long)out[i] - ref[i]);
+                        max_diff = diff > max_diff ? diff : max_diff;
+                }
+
+                total += n;
+                free(out);
+                free(ref);
+                traj_free(traj);
+        }
+
+        size_t n = total / runs;
+        printf("%u axes, %u waypoints, %zu samples of %uus per "
+               "trajectory\n", naxes, nwaypoints, n, period_us);
+        report("traj_plan", plan, runs, nwaypoints - 1, "move");
+        report("traj_sample", vector, runs, n, "sample");
+        report("scalar reference", scalar, runs, n, "sample");
+        printf("largest difference %ld inc\n", max_diff);
+        free(waypoints);
+        free(plan);
+        free(vector);
+        free(scalar);
+        return max_diff > 1;
+}
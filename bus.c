@@ -0,0 +1,911 @@
+#include "bus.h"
+#include "busload.h"
+#include "cycle.h"
+#include "evlog.h"
+#include "fault.h"
+#include "sdo.h"
+#include "socketcan.h"
+#include "util.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define BUS_MAX_POLLERS 8
+
+// requests held back until they have something to report, see proto_wait()
+#define BUS_MAX_WAITING 64
+
+// repetitions of a request after transient errors and the pause before the
+// first one in ms, which doubles with every further one
+#define BUS_MAX_RETRIES 2
+#define BUS_RETRY_PAUSE 5
+
+// pauses between attempts to reopen a failed port in ms, doubling from the
+// first to the last
+#define BUS_REOPEN_MIN  10
+#define BUS_REOPEN_MAX  1000
+
+struct bus_poller {
+        bus_poll_fn poll;
+        void *ctx;
+        uint64_t due; // now_ns() at which to run next, 0 if disabled
+};
+
+enum bus_batch_kind {
+        BATCH_NONE,
+        BATCH_FRAMES, // frames sent without response, see proto_frame()
+        BATCH_SDO,    // concurrent SDO transfers, see proto_sdo()
+        BATCH_SETPOINTS, // setpoints carried out through the library
+};
+
+// request answered once the batch it is part of has been flushed
+struct bus_pending {
+        struct bus_client *client;
+        struct bus_tag tag;
+        uint8_t op;
+        uint8_t node;
+        enum bus_batch_kind kind; // BATCH_NONE if answered with err only
+        uint32_t err;
+        size_t index;             // of its frame, transfer or setpoint
+        int setpoint;             // see proto_setpoint()
+        uint32_t key;
+};
+
+// see bus_hold()
+struct bus_waiting {
+        struct bus_cmd cmd;
+        uint64_t deadline;
+};
+
+// see bus_urgent()
+struct bus_urgent_cmd {
+        struct bus_client *client;
+        uint8_t op;
+        uint8_t node;
+        uint64_t due;
+};
+
+struct bus {
+        void *port;
+        struct mpsc_ring cmds;   // of struct bus_cmd
+        struct mpsc_ring urgent; // of struct bus_urgent_cmd, served first
+        struct sdo *sdo;
+
+        // nodes commands may be addressed to, all if there is no node table
+        int routed;
+        uint8_t known_nodes[256];
+
+        // current batch, see bus_batch()
+        struct can_sock *can;
+        enum bus_batch_kind batch;
+        struct can_frame frames[CAN_BATCH_MAX];
+        size_t nframes;
+        struct sdo_req sdo_reqs[CAN_BATCH_MAX];
+        size_t nsdo;
+        struct bus_cmd setpoints[CAN_BATCH_MAX];
+        size_t nsetpoints;
+        struct bus_pending pending[CAN_BATCH_MAX];
+        size_t npending;
+
+        struct bus_poller pollers[BUS_MAX_POLLERS];
+        size_t npollers;
+
+        struct bus_waiting waiting[BUS_MAX_WAITING];
+        size_t nwaiting;
+        struct bus_completion scratch; // response of a held request
+
+        // see bus_set_recovery()
+        int recover;
+        struct fault_port recovery;
+        int down;          // the port failed and is not open again yet
+        uint64_t reopen;   // now_ns() of the next attempt to reopen it
+        unsigned pause;    // ms until the attempt after that
+        uint32_t attempts; // to reopen it since it failed
+
+        // the bus thread blocks on wake_fd while sleeping is set
+        _Atomic int sleeping;
+        int wake_fd;
+
+        pthread_t thread;
+};
+
+// only accessed by the bus thread
+static struct bus_setpoint_stats setpoint_stats[256];
+static struct bus_urgent_stats urgent_stats;
+
+static void notify(int fd)
+{
+        // can only fail if interrupted, the counter never gets near overflow
+        const uint64_t one = 1;
+        while (write(fd, &one, sizeof(one)) == -1 && errno == EINTR) {
+        }
+}
+
+// Block until there is a command to execute or timeout ms passed (-1 to
+// wait indefinitely).
+static void bus_wait(struct bus *bus, int timeout)
+{
+        atomic_store(&bus->sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (mpsc_peek(&bus->cmds) || mpsc_peek(&bus->urgent)) {
+                atomic_store(&bus->sleeping, 0);
+                return;
+        }
+
+        struct pollfd pfd = { .fd = bus->wake_fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout) == 1) {
+                uint64_t count;
+                if (read(bus->wake_fd, &count, sizeof(count)) == -1) {
+                        // interrupted, the caller checks the queue anyway
+                }
+        }
+
+        atomic_store(&bus->sleeping, 0);
+}
+
+// Run all pollers that are due. Returns the time in ms until the next one is
+// due or -1 if there is none.
+static int bus_poll(struct bus *bus)
+{
+        uint64_t now = now_ns();
+        uint64_t next = 0;
+        for (size_t i = 0; i < bus->npollers; i++) {
+                struct bus_poller *poller = &bus->pollers[i];
+                if (poller->due == 0) {
+                        continue;
+                }
+
+                if (poller->due <= now) {
+                        int interval = poller->poll(bus->port, poller->ctx);
+                        now = now_ns();
+                        poller->due = interval == -1 ?
+                                      0 : now + interval * 1000000ull;
+                }
+
+                if (poller->due && (next == 0 || poller->due < next)) {
+                        next = poller->due;
+                }
+        }
+
+        if (next == 0) {
+                return -1;
+        }
+
+        return next > now ? (next - now + 999999) / 1000000 : 0;
+}
+
+static uint32_t bus_err(const struct bus_completion *completion)
+{
+        uint32_t err;
+        memcpy(&err, completion->frame + PROTO_HDR_SIZE, sizeof(err));
+        return le32toh(err);
+}
+
+// Log the response in completion if it reports a failure. Superseded
+// setpoints are business as usual, and so are held requests timing out.
+// Requests rejected while the port is down are covered by EV_PORT_DOWN.
+static void bus_log(const struct bus_completion *completion)
+{
+        uint32_t err = bus_err(completion);
+        if (err && err != PROTO_ERR_SUPERSEDED &&
+            err != PROTO_ERR_TIMED_OUT && err != PROTO_ERR_PORT_DOWN) {
+                evlog(EV_CMD_FAILED,
+                      completion->frame[2] & ~PROTO_OP_RESPONSE,
+                      completion->frame[3], err);
+        }
+}
+
+static struct bus_completion *bus_claim_completion(struct bus_client *client)
+{
+        // clients never have more commands in flight than their ring holds, so
+        // this only spins if a client misbehaves
+        struct bus_completion *completion;
+        while (!(completion = spsc_claim(&client->completions))) {
+                sched_yield();
+        }
+
+        return completion;
+}
+
+static int bus_cancelled(const struct bus_client *client)
+{
+        return atomic_load_explicit(&client->cancelled, memory_order_relaxed);
+}
+
+// Answer with a response built outside the client's ring.
+static void bus_publish(struct bus_client *client,
+                        const struct bus_completion *done)
+{
+        struct bus_completion *completion = bus_claim_completion(client);
+        completion->tag = done->tag;
+        completion->len = done->len;
+        memcpy(completion->frame, done->frame, done->len);
+        bus_log(completion);
+        spsc_publish(&client->completions);
+        notify(client->notify_fd);
+}
+
+// Execute a tagged request which may wait for something to report (see
+// proto_wait()) and hold it back if there is nothing yet. Returns 0 if cmd
+// has to be executed the usual way.
+static int bus_hold(struct bus *bus, const struct bus_cmd *cmd)
+{
+        uint32_t timeout;
+        if (!cmd->tag.tagged || bus->nwaiting == BUS_MAX_WAITING ||
+            !proto_wait(cmd->op, cmd->payload, cmd->len, &timeout) ||
+            timeout == 0) {
+                return 0;
+        }
+
+        struct bus_completion *done = &bus->scratch;
+        done->tag = cmd->tag;
+        done->len = proto_execute(bus->port, cmd->op, cmd->node, cmd->payload,
+                                  cmd->len, done->frame);
+        if (bus_err(done) != PROTO_ERR_TIMED_OUT) {
+                bus_publish(cmd->client, done);
+                return 1;
+        }
+
+        bus->waiting[bus->nwaiting++] = (struct bus_waiting){
+                .cmd = *cmd,
+                .deadline = now_ns() + timeout * 1000000ull,
+        };
+        return 1;
+}
+
+// Execute the requests held back again and answer those which have something
+// to report by now, whose timeout passed or whose client was cancelled. They
+// only read what pollers collected, so this is cheap. Returns the time in ms
+// until the first of the others times out or -1 if there are none.
+static int bus_run_waiting(struct bus *bus)
+{
+        uint64_t now = now_ns();
+        uint64_t next = 0;
+        size_t n = 0;
+        for (size_t i = 0; i < bus->nwaiting; i++) {
+                const struct bus_waiting *waiting = &bus->waiting[i];
+                const struct bus_cmd *cmd = &waiting->cmd;
+                struct bus_completion *done = &bus->scratch;
+                done->tag = cmd->tag;
+                if (bus_cancelled(cmd->client)) {
+                        done->len = proto_response(done->frame, cmd->op,
+                                                   cmd->node,
+                                                   PROTO_ERR_CANCELLED);
+                } else {
+                        done->len = proto_execute(bus->port, cmd->op,
+                                                  cmd->node, cmd->payload,
+                                                  cmd->len, done->frame);
+                        if (bus_err(done) == PROTO_ERR_TIMED_OUT &&
+                            waiting->deadline > now) {
+                                if (next == 0 || waiting->deadline < next) {
+                                        next = waiting->deadline;
+                                }
+
+                                bus->waiting[n++] = *waiting;
+                                continue;
+                        }
+                }
+
+                bus_publish(cmd->client, done);
+        }
+
+        bus->nwaiting = n;
+        if (next == 0) {
+                return -1;
+        }
+
+        return (next - now + 999999) / 1000000;
+}
+
+// Take the frames and setpoints of clients cancelled since they were batched
+// out of the current batch, so an urgent stop is not undone by them.
+static void bus_drop_cancelled(struct bus *bus)
+{
+        int live[CAN_BATCH_MAX] = { 0 };
+        int dropped = 0;
+        for (size_t i = 0; i < bus->npending; i++) {
+                struct bus_pending *pending = &bus->pending[i];
+                if (pending->kind != BATCH_FRAMES &&
+                    pending->kind != BATCH_SETPOINTS) {
+                        continue;
+                } else if (bus_cancelled(pending->client)) {
+                        dropped |= pending->kind == BATCH_FRAMES;
+                        pending->kind = BATCH_NONE;
+                        pending->err = PROTO_ERR_CANCELLED;
+                        pending->setpoint = 0;
+                } else if (pending->kind == BATCH_FRAMES) {
+                        live[pending->index] = 1;
+                }
+        }
+
+        if (!dropped) {
+                return;
+        }
+
+        // a superseding frame reuses an earlier index, so the frames are
+        // moved in index rather than request order
+        size_t moved[CAN_BATCH_MAX];
+        size_t nframes = 0;
+        for (size_t i = 0; i < bus->nframes; i++) {
+                moved[i] = nframes;
+                if (live[i]) {
+                        bus->frames[nframes++] = bus->frames[i];
+                }
+        }
+
+        for (size_t i = 0; i < bus->npending; i++) {
+                if (bus->pending[i].kind == BATCH_FRAMES) {
+                        bus->pending[i].index = moved[bus->pending[i].index];
+                }
+        }
+
+        bus->nframes = nframes;
+}
+
+// Send the frames or run the SDO transfers of the current batch and answer
+// the requests they belong to. Completions can only be written now since a
+// client's ring only allows a single outstanding claim.
+static void bus_flush(struct bus *bus)
+{
+        if (bus->npending == 0) {
+                return;
+        }
+
+        bus_drop_cancelled(bus);
+
+        // with the cycle thread running, frames go out with its next SYNC
+        int cyclic = cycle_running();
+        int sent = 0;
+        if (cyclic) {
+                while (sent < (int)bus->nframes &&
+                       cycle_queue(&bus->frames[sent]) == 0) {
+                        sent++;
+                }
+        } else if (bus->nframes) {
+                sent = can_send(bus->can, bus->frames, bus->nframes);
+        }
+
+        sdo_transfer(bus->sdo, bus->sdo_reqs, bus->nsdo, 0);
+
+        for (size_t i = 0; i < bus->npending; i++) {
+                struct bus_pending *pending = &bus->pending[i];
+                struct bus_completion *completion =
+                        bus_claim_completion(pending->client);
+                completion->tag = pending->tag;
+                if (pending->kind == BATCH_SDO) {
+                        completion->len = proto_sdo_response(
+                                completion->frame, pending->op, pending->node,
+                                &bus->sdo_reqs[pending->index]);
+                } else if (pending->kind == BATCH_SETPOINTS) {
+                        // carried out in request order, like all commands
+                        // which are not batched
+                        const struct bus_cmd *cmd =
+                                &bus->setpoints[pending->index];
+                        completion->len = proto_execute(bus->port, cmd->op,
+                                                        cmd->node,
+                                                        cmd->payload,
+                                                        cmd->len,
+                                                        completion->frame);
+                } else {
+                        if (pending->kind == BATCH_FRAMES &&
+                            (int)pending->index >= sent) {
+                                pending->err = cyclic ?
+                                               PROTO_ERR_BUFFER_FULL :
+                                               PROTO_ERR_TX_FAILED;
+                                setpoint_stats[pending->node].dropped +=
+                                        pending->setpoint;
+                        }
+
+                        completion->len = proto_response(completion->frame,
+                                                         pending->op,
+                                                         pending->node,
+                                                         pending->err);
+                }
+
+                bus_log(completion);
+                spsc_publish(&pending->client->completions);
+
+                // one notification per run of completions of the same client
+                if (i + 1 == bus->npending ||
+                    bus->pending[i + 1].client != pending->client) {
+                        notify(pending->client->notify_fd);
+                }
+        }
+
+        bus->batch = BATCH_NONE;
+        bus->nframes = 0;
+        bus->nsdo = 0;
+        bus->nsetpoints = 0;
+        bus->npending = 0;
+}
+
+// Request in the current batch which the setpoint with key replaces, NULL if
+// there is none.
+static struct bus_pending *bus_superseded(struct bus *bus, uint32_t key)
+{
+        for (size_t i = bus->npending; i-- > 0;) {
+                struct bus_pending *pending = &bus->pending[i];
+                if (pending->setpoint && pending->key == key &&
+                    pending->kind != BATCH_NONE) {
+                        return pending;
+                }
+        }
+
+        return NULL;
+}
+
+// Add cmd to the current batch if it does not need to go through the library
+// right away: cancelled requests, requests to nodes not in the node table,
+// frames sent without response, SDO transfers which can run concurrently and
+// setpoints. A batch holds only one kind of them, so switching between kinds
+// flushes it. Returns 0 if the request has to be executed through the library
+// instead.
+static int bus_batch(struct bus *bus, const struct bus_cmd *cmd)
+{
+        enum bus_batch_kind kind = BATCH_NONE;
+        uint32_t err = 0;
+        struct can_frame frame;
+        struct sdo_req req;
+        uint32_t key = 0;
+        int setpoint = proto_setpoint(cmd->op, cmd->node, cmd->payload,
+                                      cmd->len, &key);
+        if (bus_cancelled(cmd->client)) {
+                err = PROTO_ERR_CANCELLED;
+        } else if (bus->routed && !bus->known_nodes[cmd->node] &&
+                   proto_addressed(cmd->op)) {
+                err = PROTO_ERR_UNKNOWN_NODE;
+        } else if (bus->can &&
+                   (err = proto_frame(cmd->op, cmd->node, cmd->payload,
+                                      cmd->len, &frame)) !=
+                   PROTO_ERR_UNKNOWN_OP) {
+                kind = err ? BATCH_NONE : BATCH_FRAMES;
+        } else if (sdo_concurrent(bus->sdo) &&
+                   (err = proto_sdo(cmd->op, cmd->node, cmd->payload,
+                                    cmd->len, &req)) !=
+                   PROTO_ERR_UNKNOWN_OP) {
+                kind = err ? BATCH_NONE : BATCH_SDO;
+        } else if (setpoint) {
+                kind = BATCH_SETPOINTS;
+        } else {
+                return 0;
+        }
+
+        if (kind == BATCH_FRAMES && cmd->op == OP_SYNC && cycle_running()) {
+                kind = BATCH_NONE;
+                err = PROTO_ERR_CYCLIC;
+        }
+
+        // setpoints sent with every SYNC are a stream per RPDO, which has to
+        // fit on the bus first
+        if (kind == BATCH_FRAMES && cmd->op == OP_PDO_SETPOINT &&
+            cycle_running() &&
+            busload_reserve(frame.can_id, frame.can_dlc,
+                            busload_rate(CAN_COB_ID_SYNC),
+                            BUSLOAD_EXPIRES) == -1) {
+                kind = BATCH_NONE;
+                err = PROTO_ERR_BUS_LOAD;
+        }
+
+        if (kind != BATCH_NONE && bus->batch != BATCH_NONE &&
+            bus->batch != kind) {
+                bus_flush(bus);
+        }
+
+        // a setpoint takes over the slot of the one it replaces
+        struct bus_pending *prev = setpoint && kind != BATCH_NONE ?
+                                   bus_superseded(bus, key) : NULL;
+        size_t index = 0;
+        if (kind == BATCH_FRAMES) {
+                index = prev ? prev->index : bus->nframes++;
+                bus->frames[index] = frame;
+                bus->batch = kind;
+        } else if (kind == BATCH_SDO) {
+                index = bus->nsdo++;
+                bus->sdo_reqs[index] = req;
+                bus->batch = kind;
+        } else if (kind == BATCH_SETPOINTS) {
+                index = prev ? prev->index : bus->nsetpoints++;
+                bus->setpoints[index] = *cmd;
+                bus->batch = kind;
+        }
+
+        if (prev) {
+                prev->kind = BATCH_NONE;
+                prev->err = PROTO_ERR_SUPERSEDED;
+                prev->setpoint = 0;
+                setpoint_stats[prev->node].superseded++;
+        }
+
+        bus->pending[bus->npending++] = (struct bus_pending){
+                .client = cmd->client,
+                .tag = cmd->tag,
+                .op = cmd->op,
+                .node = cmd->node,
+                .kind = kind,
+                .err = err,
+                .index = index,
+                .setpoint = setpoint,
+                .key = key,
+        };
+        return 1;
+}
+
+static void bus_record_urgent(uint64_t reaction_ns)
+{
+        uint32_t reaction_us = reaction_ns / 1000;
+        unsigned bucket = 0;
+        while (bucket < BUS_URGENT_HIST_BUCKETS - 1 &&
+               reaction_us >= 1u << bucket) {
+                bucket++;
+        }
+
+        urgent_stats.hist[bucket]++;
+        urgent_stats.count++;
+        if (reaction_us > urgent_stats.max_reaction_us) {
+                urgent_stats.max_reaction_us = reaction_us;
+        }
+}
+
+// Carry out the urgent commands. A batch being collected is left alone, its
+// requests were queued after the urgent ones anyway. Returns whether one of
+// them was addressed to node.
+static int bus_run_urgent(struct bus *bus, uint16_t node)
+{
+        int hit = 0;
+        struct bus_urgent_cmd *cmd;
+        while ((cmd = mpsc_peek(&bus->urgent))) {
+                hit |= cmd->node == node;
+                struct bus_client *client = cmd->client;
+                struct bus_completion *completion =
+                        bus_claim_completion(client);
+                uint64_t reaction = now_ns() - cmd->due;
+                bus_record_urgent(reaction);
+                evlog(EV_URGENT, cmd->op, cmd->node, reaction);
+                completion->tag = (struct bus_tag){ 0 };
+                if (bus->down) {
+                        completion->len = proto_response(completion->frame,
+                                                         cmd->op, cmd->node,
+                                                         PROTO_ERR_PORT_DOWN);
+                } else {
+                        completion->len = proto_execute(bus->port, cmd->op,
+                                                        cmd->node, NULL, 0,
+                                                        completion->frame);
+                }
+                bus_log(completion);
+                spsc_publish(&client->completions);
+                mpsc_release(&bus->urgent);
+                notify(client->notify_fd);
+        }
+
+        return hit;
+}
+
+// Pause for ms before a request to node is repeated, carrying out urgent
+// commands meanwhile. Returns whether one of them was addressed to node.
+static int bus_pause(struct bus *bus, uint16_t node, unsigned ms)
+{
+        int hit = 0;
+        uint64_t end = now_ns() + ms * 1000000ull;
+        for (uint64_t now = now_ns(); now < end; now = now_ns()) {
+                hit |= bus_run_urgent(bus, node);
+                uint64_t ns = end - now < 1000000 ? end - now : 1000000;
+                struct timespec ts = { .tv_nsec = ns };
+                nanosleep(&ts, NULL);
+        }
+
+        return hit;
+}
+
+// Execute a request through the library, repeating it with growing pauses
+// while it fails with a transient error if it may be repeated (see
+// proto_retry()) and the port did not fail. A request is not repeated, but
+// cancelled, once its client was cancelled or an urgent command, like the
+// quick stop of an expired watchdog, went to its node during a pause; a move
+// repeated after that would start the motor again.
+static void bus_execute(struct bus *bus, const struct bus_cmd *cmd,
+                        struct bus_completion *completion)
+{
+        completion->len = proto_execute(bus->port, cmd->op, cmd->node,
+                                        cmd->payload, cmd->len,
+                                        completion->frame);
+        if (!bus->recover || !proto_retry(cmd->op, cmd->payload, cmd->len)) {
+                return;
+        }
+
+        unsigned pause = BUS_RETRY_PAUSE;
+        for (int i = 0; i < BUS_MAX_RETRIES &&
+             fault_class(bus_err(completion)) == FAULT_TRANSIENT &&
+             !fault_port_failed(); i++) {
+                if (bus_pause(bus, cmd->node, pause) ||
+                    bus_cancelled(cmd->client)) {
+                        completion->len = proto_response(completion->frame,
+                                                         cmd->op, cmd->node,
+                                                         PROTO_ERR_CANCELLED);
+                        return;
+                }
+
+                pause *= 2;
+                completion->len = proto_execute(bus->port, cmd->op, cmd->node,
+                                                cmd->payload, cmd->len,
+                                                completion->frame);
+                fault_retried(bus_err(completion) == 0);
+        }
+}
+
+// Answer a request right away with err.
+static void bus_reject(struct bus *bus, const struct bus_cmd *cmd,
+                       uint32_t err)
+{
+        struct bus_completion *done = &bus->scratch;
+        done->tag = cmd->tag;
+        done->len = proto_response(done->frame, cmd->op, cmd->node, err);
+        bus_publish(cmd->client, done);
+}
+
+// Close the port once calls show it failed and try to open it again whenever
+// an attempt is due, with growing pauses in between. Returns the time in ms
+// until the next attempt or -1 if the port is up.
+static int bus_recover(struct bus *bus)
+{
+        uint64_t now = now_ns();
+        if (!bus->down) {
+                if (!fault_port_failed()) {
+                        return -1;
+                }
+
+                // a batch of setpoints would still go through the port
+                bus_flush(bus);
+                struct fault_stats stats;
+                fault_stats(&stats);
+                evlog(EV_PORT_DOWN, stats.err, 0, 0);
+                fault_close(bus->port);
+                bus->down = 1;
+                bus->reopen = now;
+                bus->pause = BUS_REOPEN_MIN;
+                bus->attempts = 0;
+        }
+
+        if (now < bus->reopen) {
+                return (bus->reopen - now + 999999) / 1000000;
+        }
+
+        uint16_t nodes[256];
+        size_t n = 0;
+        for (int id = 1; id < 256; id++) {
+                if (bus->known_nodes[id]) {
+                        nodes[n++] = id;
+                }
+        }
+
+        bus->attempts++;
+        void *port = fault_reopen(&bus->recovery, nodes, n);
+        if (!port) {
+                bus->reopen = now_ns() + bus->pause * 1000000ull;
+                bus->pause = bus->pause * 2 < BUS_REOPEN_MAX ?
+                             bus->pause * 2 : BUS_REOPEN_MAX;
+                return (bus->reopen - now + 999999) / 1000000;
+        }
+
+        struct fault_stats stats;
+        fault_stats(&stats);
+        evlog(EV_PORT_UP, stats.last_recovery_ms, bus->attempts, 0);
+        bus->port = port;
+        sdo_set_port(bus->sdo, port);
+        bus->down = 0;
+        return -1;
+}
+
+static void *bus_run(void *arg)
+{
+        struct bus *bus = arg;
+        evlog_thread("bus");
+        while (1) {
+                bus_run_urgent(bus, 0);
+
+                // pollers run between commands so they cannot be starved, but
+                // not while a batch is being collected and not while the port
+                // is down
+                int timeout = bus->recover ? bus_recover(bus) : -1;
+                if (!bus->down) {
+                        int poll = bus->npending ? 0 : bus_poll(bus);
+                        if (poll != -1 && (timeout == -1 || poll < timeout)) {
+                                timeout = poll;
+                        }
+                }
+
+                if (!bus->npending && bus->nwaiting) {
+                        int waiting = bus_run_waiting(bus);
+                        if (waiting != -1 &&
+                            (timeout == -1 || waiting < timeout)) {
+                                timeout = waiting;
+                        }
+                }
+
+                struct bus_cmd *cmd = mpsc_peek(&bus->cmds);
+                if (!cmd) {
+                        bus_flush(bus);
+                        bus_wait(bus, timeout);
+                        continue;
+                }
+
+                if (bus->down && !proto_local(cmd->op)) {
+                        bus_flush(bus);
+                        bus_reject(bus, cmd, PROTO_ERR_PORT_DOWN);
+                        mpsc_release(&bus->cmds);
+                        continue;
+                }
+
+                if (bus_batch(bus, cmd)) {
+                        mpsc_release(&bus->cmds);
+                        if (bus->npending == CAN_BATCH_MAX) {
+                                bus_flush(bus);
+                        }
+
+                        continue;
+                }
+
+                // keep the responses in request order
+                bus_flush(bus);
+
+                if (bus_hold(bus, cmd)) {
+                        mpsc_release(&bus->cmds);
+                        continue;
+                }
+
+                struct bus_client *client = cmd->client;
+                struct bus_completion *completion =
+                        bus_claim_completion(client);
+                completion->tag = cmd->tag;
+                bus_execute(bus, cmd, completion);
+                bus_log(completion);
+                spsc_publish(&client->completions);
+                mpsc_release(&bus->cmds);
+                notify(client->notify_fd);
+        }
+
+        return NULL;
+}
+
+struct bus *bus_create(void *port, struct sdo *sdo, size_t queue_size)
+{
+        struct bus *bus = calloc(1, sizeof(*bus));
+        if (!bus || mpsc_init(&bus->cmds, queue_size,
+                              sizeof(struct bus_cmd)) == -1 ||
+            mpsc_init(&bus->urgent, BUS_URGENT_SIZE,
+                      sizeof(struct bus_urgent_cmd)) == -1) {
+                die("failed to allocate command queue", 0);
+        }
+
+        bus->port = port;
+        bus->sdo = sdo;
+        atomic_init(&bus->sleeping, 0);
+        bus->wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (bus->wake_fd == -1) {
+                die("failed to create eventfd", 0);
+        }
+
+        return bus;
+}
+
+void bus_add_poller(struct bus *bus, bus_poll_fn poll, void *ctx)
+{
+        if (bus->npollers == BUS_MAX_POLLERS) {
+                die("too many bus pollers", 0);
+        }
+
+        bus->pollers[bus->npollers++] = (struct bus_poller){
+                .poll = poll,
+                .ctx = ctx,
+                .due = 1,
+        };
+}
+
+void bus_set_can(struct bus *bus, struct can_sock *can)
+{
+        bus->can = can;
+}
+
+void bus_set_nodes(struct bus *bus, const uint16_t *node_ids, size_t n)
+{
+        bus->routed = 1;
+        for (size_t i = 0; i < n; i++) {
+                bus->known_nodes[node_ids[i]] = 1;
+        }
+}
+
+void bus_set_recovery(struct bus *bus, const struct fault_port *config)
+{
+        bus->recover = 1;
+        bus->recovery = *config;
+}
+
+void bus_start(struct bus *bus)
+{
+        printf("starting bus thread (%zu pollers)...\n", bus->npollers);
+        if (bus->recover) {
+                // failures during startup were handled there
+                fault_watch();
+        }
+
+        if (pthread_create(&bus->thread, NULL, bus_run, bus) != 0) {
+                die("failed to start bus thread", 0);
+        }
+}
+
+int bus_client_init(struct bus_client *client, size_t capacity,
+                    int notify_fd)
+{
+        client->notify_fd = notify_fd;
+        atomic_init(&client->cancelled, 0);
+        return spsc_init(&client->completions, capacity,
+                         sizeof(struct bus_completion));
+}
+
+void bus_client_destroy(struct bus_client *client)
+{
+        spsc_destroy(&client->completions);
+}
+
+void bus_cancel(struct bus_client *client)
+{
+        atomic_store(&client->cancelled, 1);
+}
+
+void bus_resume(struct bus_client *client)
+{
+        atomic_store(&client->cancelled, 0);
+}
+
+struct bus_cmd *bus_claim(struct bus *bus)
+{
+        return mpsc_claim(&bus->cmds);
+}
+
+void bus_submit(struct bus *bus, struct bus_cmd *cmd)
+{
+        mpsc_publish(&bus->cmds, cmd);
+}
+
+int bus_urgent(struct bus *bus, struct bus_client *client, uint8_t op,
+               uint8_t node, uint64_t due)
+{
+        struct bus_urgent_cmd *cmd = mpsc_claim(&bus->urgent);
+        if (!cmd) {
+                return -1;
+        }
+
+        *cmd = (struct bus_urgent_cmd){
+                .client = client,
+                .op = op,
+                .node = node,
+                .due = due,
+        };
+        mpsc_publish(&bus->urgent, cmd);
+        return 0;
+}
+
+void bus_setpoint_stats(uint8_t node, struct bus_setpoint_stats *stats)
+{
+        *stats = setpoint_stats[node];
+}
+
+void bus_urgent_stats(struct bus_urgent_stats *stats)
+{
+        *stats = urgent_stats;
+}
+
+void bus_kick(struct bus *bus)
+{
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_exchange(&bus->sleeping, 0)) {
+                notify(bus->wake_fd);
+        }
+}
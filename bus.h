@@ -0,0 +1,145 @@
+#pragma once
+
+#include "proto.h"
+#include "ring.h"
+
+#include <stdint.h>
+
+// The bus thread is the only thread calling into libEposCmd once it has been
+// started. Network threads queue commands on a lock-free MPSC ring and get
+// the response frames back through a per-client SPSC ring, so a slow SDO
+// transfer never blocks the network side and access to the library is
+// serialized without a mutex.
+//
+// Consecutive setpoints (see proto_setpoint()) are collected into a batch
+// before any of them is carried out. A setpoint replaces the one with the same
+// key already in the batch, which is answered with PROTO_ERR_SUPERSEDED, so a
+// backlog of setpoints shrinks to the latest one per node and kind. All other
+// commands end the batch, so they are never reordered with setpoints.
+//
+// Urgent commands (see bus_urgent()) are queued separately and carried out
+// ahead of everything else, even while a batch is being collected.
+
+// urgent commands that can be queued by all threads together
+#define BUS_URGENT_SIZE         256
+
+// bucket i counts reaction times below 2^i us, the last one all others
+#define BUS_URGENT_HIST_BUCKETS 16
+
+struct bus;
+struct can_sock;
+struct fault_port;
+struct sdo;
+
+// Completion channel of a client. The submitting thread is the only consumer
+// of the ring and must not have more commands in flight than the ring holds.
+struct bus_client {
+        struct spsc_ring completions; // of struct bus_completion
+        int notify_fd;                // eventfd signalled for each completion
+        _Atomic int cancelled;        // see bus_cancel()
+};
+
+// The tag of a request (see proto.h) is handed back with its completion.
+struct bus_tag {
+        uint8_t tagged;
+        uint32_t id;
+};
+
+struct bus_cmd {
+        struct bus_client *client;
+        struct bus_tag tag;
+        uint8_t op;
+        uint8_t node;
+        uint16_t len;
+        uint8_t payload[PROTO_MAX_PAYLOAD];
+};
+
+struct bus_completion {
+        struct bus_tag tag;
+        uint16_t len;
+        uint8_t frame[PROTO_MAX_FRAME];
+};
+
+struct bus_setpoint_stats {
+        uint64_t superseded; // replaced by a newer setpoint in the batch
+        uint64_t dropped;    // could not be sent or queued for the cycle
+};
+
+struct bus_urgent_stats {
+        uint64_t count;
+        uint32_t max_reaction_us; // largest time from due to being issued
+        uint32_t hist[BUS_URGENT_HIST_BUCKETS];
+};
+
+// Background work done by the bus thread between commands, e.g. receiving
+// telemetry. Returns the time in ms until the poller wants to run again or -1
+// if it has nothing to do anymore.
+typedef int (*bus_poll_fn)(void *port, void *ctx);
+
+// Create the bus for port. Object dictionary requests are run through sdo
+// where it allows transfers to different nodes to overlap. queue_size is the
+// number of commands that can be queued by all clients together.
+struct bus *bus_create(void *port, struct sdo *sdo, size_t queue_size);
+
+// Only accept commands addressed to the given nodes, all others are answered
+// with PROTO_ERR_UNKNOWN_NODE. Only allowed before bus_start().
+void bus_set_nodes(struct bus *bus, const uint16_t *node_ids, size_t n);
+
+// Register a poller, only allowed before bus_start().
+void bus_add_poller(struct bus *bus, bus_poll_fn poll, void *ctx);
+
+// Send requests which only consist of a single CAN frame (see proto_frame())
+// on can instead of through the library. Consecutive ones are batched into a
+// single can_send(). Only allowed before bus_start().
+void bus_set_can(struct bus *bus, struct can_sock *can);
+
+// Recover from failures of the port (see fault.h): requests which may be
+// repeated are repeated after transient errors, unless their client was
+// cancelled or an urgent command went to their node in between, and once the
+// port failed it is closed and opened again with config. Meanwhile pollers
+// are paused and requests which need the library are answered with
+// PROTO_ERR_PORT_DOWN.
+// Only allowed before bus_start().
+void bus_set_recovery(struct bus *bus, const struct fault_port *config);
+
+// Start the bus thread which takes over the port.
+void bus_start(struct bus *bus);
+
+// Set up the completion ring of a client for up to capacity commands in
+// flight. Returns -1 if out of memory.
+int bus_client_init(struct bus_client *client, size_t capacity,
+                    int notify_fd);
+
+void bus_client_destroy(struct bus_client *client);
+
+// Answer the commands of client still queued with PROTO_ERR_CANCELLED instead
+// of carrying them out, including those already collected into a batch, until
+// bus_resume() is called. Callable from any thread.
+void bus_cancel(struct bus_client *client);
+
+void bus_resume(struct bus_client *client);
+
+// Claim a command slot, NULL if the queue is full. The slot has to be filled
+// in and handed to bus_submit().
+struct bus_cmd *bus_claim(struct bus *bus);
+
+void bus_submit(struct bus *bus, struct bus_cmd *cmd);
+
+// Queue op, a request without payload such as OP_SET_QUICK_STOP_STATE, for
+// node ahead of all commands queued with bus_submit(). It is answered to
+// client like those, untagged. due is the now_ns() of the event the command
+// reacts to; the time until the bus thread issues it is recorded (see
+// bus_urgent_stats()). Callable from any thread, call bus_kick() afterwards.
+// Returns -1 if BUS_URGENT_SIZE commands are queued already.
+int bus_urgent(struct bus *bus, struct bus_client *client, uint8_t op,
+               uint8_t node, uint64_t due);
+
+// Setpoint counters of a node. Must only be used by the bus thread.
+void bus_setpoint_stats(uint8_t node, struct bus_setpoint_stats *stats);
+
+// Reaction times of urgent commands. Must only be used by the bus thread.
+void bus_urgent_stats(struct bus_urgent_stats *stats);
+
+// Wake up the bus thread if it is waiting for commands. Call once after
+// submitting a batch of commands.
+void bus_kick(struct bus *bus);
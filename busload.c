@@ -0,0 +1,470 @@
+#include "busload.h"
+#include "socketcan.h"
+#include "stats.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define BUSLOAD_BUCKET_NS       (BUSLOAD_BUCKET_MS * 1000000ull)
+
+// the buckets of the longest window plus the one being filled
+#define BUSLOAD_SLOTS           (BUSLOAD_BUCKETS + 1)
+
+// stuffed part of a data frame: start of frame, identifier, RTR, IDE and r0
+// bits, DLC, data and CRC
+#define BUSLOAD_MAX_STUFFED     (1 + 11 + 3 + 4 + 64 + 15)
+
+// CRC delimiter, ACK slot and delimiter, end of frame and interframe space
+#define BUSLOAD_TRAILER_BITS    (1 + 2 + 7 + 3)
+
+#define BUSLOAD_CRC_POLY        0x4599 // CRC-15/CAN
+
+#define BUSLOAD_COB_ID_NMT      0x000
+#define BUSLOAD_COB_ID_EMCY     0x080 // + node id
+#define BUSLOAD_COB_ID_PDO      0x180 // first TPDO, up to the last RPDO
+#define BUSLOAD_COB_ID_SDO      0x580 // responses, then requests
+#define BUSLOAD_COB_ID_LAST_SDO 0x67f
+#define BUSLOAD_COB_ID_HEARTBEAT 0x700
+
+// Bits accounted by one thread, only ever written by it. Threads are
+// long-lived, so meters are never freed.
+struct busload_meter {
+        struct busload_meter *next;
+        _Atomic uint64_t buckets[BUSLOAD_SLOTS]; // held by each slot, 0 if
+                                                 // none
+        _Atomic uint32_t classes[BUSLOAD_SLOTS][BUSLOAD_CLASSES];
+        _Atomic uint32_t nodes[BUSLOAD_SLOTS][BUSLOAD_NODES];
+};
+
+struct busload_stream {
+        double rate;  // frames per second
+        uint32_t bps; // 0 if not reserved
+        int expires;
+        uint64_t seen; // now_ns() of the last busload_reserve()
+};
+
+static _Atomic(struct busload_meter *) meters;
+static _Thread_local struct busload_meter *self;
+
+// windows reported by busload_stats(), in buckets
+static const unsigned windows[BUSLOAD_WINDOWS] = { 1, 10, BUSLOAD_BUCKETS };
+
+// only accessed by the bus thread once it is started
+static uint32_t bitrate;
+static uint32_t limit;
+static struct busload_stream streams[CAN_SFF_MASK + 1];
+static uint32_t reserved;
+static uint32_t nstreams;
+static uint32_t rejected;
+static uint32_t reduced;
+
+// SDO transfers (request and response) a library call causes, estimated
+// from the objects it reads and writes
+static const uint8_t call_transfers[STAT_FNS] = {
+        [STAT_VCS_SetMotorType] = 1,
+        [STAT_VCS_SetDcMotorParameterEx] = 4,
+        [STAT_VCS_SetObject] = 1,
+        [STAT_VCS_GetObject] = 1,
+        [STAT_VCS_GetState] = 1,
+        [STAT_VCS_SetEnableState] = 2,          // statusword, controlword
+        [STAT_VCS_SetDisableState] = 2,
+        [STAT_VCS_SetQuickStopState] = 2,
+        [STAT_VCS_ClearFault] = 2,
+        [STAT_VCS_SetOperationMode] = 1,
+        [STAT_VCS_ActivateVelocityMode] = 1,
+        [STAT_VCS_MoveWithVelocity] = 2,        // target, controlword
+        [STAT_VCS_MoveToPosition] = 2,
+        [STAT_VCS_HaltVelocityMovement] = 2,
+        [STAT_VCS_HaltPositionMovement] = 2,
+        [STAT_VCS_SetVelocityProfile] = 2,
+        [STAT_VCS_SetPositionProfile] = 3,
+        [STAT_VCS_GetPositionIs] = 1,
+        [STAT_VCS_GetVelocityIs] = 1,
+        [STAT_VCS_GetCurrentIsEx] = 1,
+        [STAT_VCS_ActivateInterpolatedPositionMode] = 1,
+        [STAT_VCS_ClearIpmBuffer] = 1,
+        [STAT_VCS_GetIpmBufferParameter] = 2,
+        [STAT_VCS_GetFreeIpmBufferSize] = 1,
+        [STAT_VCS_AddPvtValueToIpmBuffer] = 2,  // segmented, 8 bytes
+        [STAT_VCS_StartIpmTrajectory] = 1,
+        [STAT_VCS_StopIpmTrajectory] = 1,
+        [STAT_VCS_GetIpmStatus] = 2,
+        [STAT_VCS_Store] = 1,
+        [STAT_VCS_SetRecorderParameter] = 2,
+        [STAT_VCS_EnableTrigger] = 1,
+        [STAT_VCS_DisableAllTriggers] = 1,
+        [STAT_VCS_ActivateChannel] = 3,
+        [STAT_VCS_DeactivateAllChannels] = 1,
+        [STAT_VCS_StartRecorder] = 1,
+        [STAT_VCS_StopRecorder] = 1,
+        [STAT_VCS_ForceTrigger] = 1,
+        [STAT_VCS_IsRecorderRunning] = 1,
+        [STAT_VCS_IsRecorderTriggered] = 1,
+        [STAT_VCS_ReadDataBuffer] = 1,          // plus the segments, see
+                                                // rec.c
+        [STAT_VCS_SetPositionMust] = 1,
+        [STAT_VCS_SetCurrentMustEx] = 1,
+        [STAT_VCS_GetVersion] = 4,
+        [STAT_VCS_ActivateHomingMode] = 1,
+        [STAT_VCS_SetHomingParameter] = 6,
+        [STAT_VCS_FindHome] = 3,                // method, controlword twice
+        [STAT_VCS_StopHoming] = 1,
+        [STAT_VCS_GetHomingState] = 1,
+        [STAT_VCS_SetPositionMarkerParameter] = 2,
+        [STAT_VCS_ActivatePositionMarker] = 2,  // input, polarity
+        [STAT_VCS_DeactivatePositionMarker] = 1,
+        [STAT_VCS_ReadPositionMarkerCounter] = 1,
+        [STAT_VCS_ReadPositionMarkerCapturedPosition] = 1,
+        [STAT_VCS_ResetPositionMarkerCounter] = 1,
+        [STAT_VCS_SetPositionCompareParameter] = 6,
+        [STAT_VCS_SetPositionCompareReferencePosition] = 1,
+        [STAT_VCS_ActivatePositionCompare] = 2, // output, polarity
+        [STAT_VCS_DeactivatePositionCompare] = 1,
+        [STAT_VCS_EnablePositionCompare] = 1,
+        [STAT_VCS_DisablePositionCompare] = 1,
+};
+
+void busload_init(uint32_t rate, double threshold)
+{
+        bitrate = rate;
+        limit = rate * threshold;
+}
+
+unsigned busload_frame_bits(const struct can_frame *frame)
+{
+        uint8_t bits[BUSLOAD_MAX_STUFFED];
+        unsigned n = 0;
+        int rtr = !!(frame->can_id & CAN_RTR_FLAG);
+        uint8_t dlc = frame->can_dlc > 8 ? 8 : frame->can_dlc;
+
+        bits[n++] = 0;
+        for (int i = 10; i >= 0; i--) {
+                bits[n++] = frame->can_id >> i & 1;
+        }
+
+        bits[n++] = rtr;
+        bits[n++] = 0;
+        bits[n++] = 0;
+        for (int i = 3; i >= 0; i--) {
+                bits[n++] = dlc >> i & 1;
+        }
+
+        for (uint8_t byte = 0; byte < (rtr ? 0 : dlc); byte++) {
+                for (int i = 7; i >= 0; i--) {
+                        bits[n++] = frame->data[byte] >> i & 1;
+                }
+        }
+
+        uint16_t crc = 0;
+        for (unsigned i = 0; i < n; i++) {
+                int flip = bits[i] ^ (crc >> 14 & 1);
+                crc = crc << 1 & 0x7fff;
+                if (flip) {
+                        crc ^= BUSLOAD_CRC_POLY;
+                }
+        }
+
+        for (int i = 14; i >= 0; i--) {
+                bits[n++] = crc >> i & 1;
+        }
+
+        // a bit of the opposite level follows every five equal ones and
+        // counts towards the next run
+        unsigned stuff = 0;
+        unsigned run = 0;
+        int level = -1;
+        for (unsigned i = 0; i < n; i++) {
+                if (bits[i] == level) {
+                        run++;
+                } else {
+                        level = bits[i];
+                        run = 1;
+                }
+
+                if (run == 5) {
+                        stuff++;
+                        level = !level;
+                        run = 1;
+                }
+        }
+
+        return n + stuff + BUSLOAD_TRAILER_BITS;
+}
+
+unsigned busload_worst_bits(uint8_t dlc)
+{
+        unsigned stuffed = BUSLOAD_MAX_STUFFED - 64 + 8 * dlc;
+        return stuffed + (stuffed - 1) / 4 + BUSLOAD_TRAILER_BITS;
+}
+
+static enum busload_class busload_classify(const struct can_frame *frame,
+                                           uint8_t *node)
+{
+        uint16_t cob_id = frame->can_id & CAN_SFF_MASK;
+        *node = cob_id & 0x7f;
+        if (cob_id == BUSLOAD_COB_ID_NMT) {
+                *node = frame->can_dlc >= 2 ? frame->data[1] & 0x7f : 0;
+                return BUSLOAD_NMT;
+        } else if (cob_id == CAN_COB_ID_SYNC) {
+                return BUSLOAD_SYNC;
+        } else if (cob_id > BUSLOAD_COB_ID_EMCY &&
+                   cob_id < BUSLOAD_COB_ID_EMCY + BUSLOAD_NODES) {
+                return BUSLOAD_EMCY;
+        } else if (cob_id > BUSLOAD_COB_ID_PDO &&
+                   cob_id < BUSLOAD_COB_ID_SDO) {
+                return BUSLOAD_PDO;
+        } else if (cob_id > BUSLOAD_COB_ID_SDO &&
+                   cob_id <= BUSLOAD_COB_ID_LAST_SDO) {
+                return BUSLOAD_SDO;
+        } else if (cob_id > BUSLOAD_COB_ID_HEARTBEAT &&
+                   cob_id < BUSLOAD_COB_ID_HEARTBEAT + BUSLOAD_NODES) {
+                return BUSLOAD_NMT;
+        }
+
+        *node = 0;
+        return BUSLOAD_OTHER;
+}
+
+void busload_attach(void)
+{
+        if (self) {
+                return;
+        }
+
+        self = calloc(1, sizeof(*self));
+        if (!self) {
+                die("failed to allocate bus load meter", 0);
+        }
+
+        self->next = atomic_load(&meters);
+        while (!atomic_compare_exchange_weak(&meters, &self->next, self)) {
+        }
+}
+
+// Slot of the current bucket in the meter of the calling thread, cleared
+// first if it still holds an older bucket.
+static unsigned busload_slot(void)
+{
+        busload_attach();
+        uint64_t bucket = now_ns() / BUSLOAD_BUCKET_NS;
+        unsigned slot = bucket % BUSLOAD_SLOTS;
+        if (atomic_load_explicit(&self->buckets[slot],
+                                 memory_order_relaxed) == bucket) {
+                return slot;
+        }
+
+        // readers skip the slot while it is being cleared
+        atomic_store(&self->buckets[slot], 0);
+        for (int i = 0; i < BUSLOAD_CLASSES; i++) {
+                atomic_store_explicit(&self->classes[slot][i], 0,
+                                      memory_order_relaxed);
+        }
+
+        for (int i = 0; i < BUSLOAD_NODES; i++) {
+                atomic_store_explicit(&self->nodes[slot][i], 0,
+                                      memory_order_relaxed);
+        }
+
+        atomic_store_explicit(&self->buckets[slot], bucket,
+                              memory_order_release);
+        return slot;
+}
+
+// Only the owning thread writes, so a plain load and store is enough to
+// increment without losing updates.
+static void add(_Atomic uint32_t *counter, uint32_t value)
+{
+        atomic_store_explicit(counter,
+                              atomic_load_explicit(counter,
+                                                   memory_order_relaxed) +
+                              value, memory_order_relaxed);
+}
+
+static void busload_add(unsigned slot, enum busload_class class,
+                        uint8_t node, unsigned bits)
+{
+        add(&self->classes[slot][class], bits);
+        add(&self->nodes[slot][node % BUSLOAD_NODES], bits);
+}
+
+void busload_frames(const struct can_frame *frames, size_t n)
+{
+        if (n == 0) {
+                return;
+        }
+
+        unsigned slot = busload_slot();
+        for (size_t i = 0; i < n; i++) {
+                uint8_t node;
+                enum busload_class class = busload_classify(&frames[i],
+                                                            &node);
+                busload_add(slot, class, node,
+                            busload_frame_bits(&frames[i]));
+        }
+}
+
+void busload_expect(enum busload_class class, uint8_t node, uint8_t dlc,
+                    unsigned n)
+{
+        if (n) {
+                busload_add(busload_slot(), class, node,
+                            n * busload_worst_bits(dlc));
+        }
+}
+
+void busload_call(unsigned fn, uint16_t node)
+{
+        if (fn == STAT_VCS_SendNMTService) {
+                busload_expect(BUSLOAD_NMT, node, 2, 1);
+        } else if (fn < STAT_FNS) {
+                busload_expect(BUSLOAD_SDO, node, 8, 2 * call_transfers[fn]);
+        }
+}
+
+// Bits accounted by all threads over the last n completed buckets by class,
+// and those of node.
+static void busload_sum(unsigned n, uint8_t node,
+                        uint64_t classes[BUSLOAD_CLASSES], uint64_t *node_bits)
+{
+        uint64_t current = now_ns() / BUSLOAD_BUCKET_NS;
+        for (int i = 0; i < BUSLOAD_CLASSES; i++) {
+                classes[i] = 0;
+        }
+
+        *node_bits = 0;
+        for (struct busload_meter *meter = atomic_load(&meters); meter;
+             meter = meter->next) {
+                for (uint64_t bucket = current - n; bucket < current;
+                     bucket++) {
+                        unsigned slot = bucket % BUSLOAD_SLOTS;
+                        if (atomic_load_explicit(&meter->buckets[slot],
+                                                 memory_order_acquire) !=
+                            bucket) {
+                                continue;
+                        }
+
+                        for (int i = 0; i < BUSLOAD_CLASSES; i++) {
+                                classes[i] += atomic_load_explicit(
+                                        &meter->classes[slot][i],
+                                        memory_order_relaxed);
+                        }
+
+                        *node_bits += atomic_load_explicit(
+                                &meter->nodes[slot][node % BUSLOAD_NODES],
+                                memory_order_relaxed);
+                }
+        }
+}
+
+static uint32_t busload_bps(uint64_t bits, unsigned buckets)
+{
+        return bits * 1000 / (buckets * BUSLOAD_BUCKET_MS);
+}
+
+// Drop the streams that expire and have been idle for long enough.
+static void busload_expire(void)
+{
+        uint64_t now = now_ns();
+        for (size_t i = 0; i <= CAN_SFF_MASK; i++) {
+                struct busload_stream *stream = &streams[i];
+                if (stream->bps && stream->expires &&
+                    now - stream->seen > BUSLOAD_STREAM_IDLE_MS * 1000000ull) {
+                        reserved -= stream->bps;
+                        nstreams--;
+                        stream->bps = 0;
+                }
+        }
+}
+
+// Request-driven traffic measured over the longest window in bit/s.
+static uint32_t busload_requests(void)
+{
+        uint64_t classes[BUSLOAD_CLASSES];
+        uint64_t node_bits;
+        busload_sum(BUSLOAD_BUCKETS, 0, classes, &node_bits);
+        return busload_bps(classes[BUSLOAD_NMT] + classes[BUSLOAD_EMCY] +
+                           classes[BUSLOAD_SDO] + classes[BUSLOAD_OTHER],
+                           BUSLOAD_BUCKETS);
+}
+
+int busload_reserve(uint16_t cob_id, uint8_t dlc, double rate, int flags)
+{
+        struct busload_stream *stream = &streams[cob_id & CAN_SFF_MASK];
+        uint32_t bps = ceil(busload_worst_bits(dlc) * rate);
+        if (stream->bps == bps && bps) {
+                stream->seen = now_ns();
+                return 0;
+        }
+
+        busload_expire();
+        uint64_t load = (uint64_t)reserved - stream->bps + bps;
+        if (flags & BUSLOAD_EXPIRES) {
+                load += busload_requests();
+        }
+
+        if (bps > stream->bps && load > limit) {
+                rejected++;
+                return -1;
+        }
+
+        if (!stream->bps && bps) {
+                nstreams++;
+        } else if (stream->bps && !bps) {
+                nstreams--;
+        }
+
+        reserved += bps - stream->bps;
+        reduced += !!(flags & BUSLOAD_REDUCED);
+        *stream = (struct busload_stream){
+                .rate = rate,
+                .bps = bps,
+                .expires = !!(flags & BUSLOAD_EXPIRES),
+                .seen = now_ns(),
+        };
+        return 0;
+}
+
+double busload_rate(uint16_t cob_id)
+{
+        const struct busload_stream *stream = &streams[cob_id & CAN_SFF_MASK];
+        return stream->bps ? stream->rate : 0;
+}
+
+uint32_t busload_headroom(void)
+{
+        busload_expire();
+        return reserved < limit ? limit - reserved : 0;
+}
+
+void busload_stats(uint8_t node, struct busload_stats *stats)
+{
+        busload_expire();
+        *stats = (struct busload_stats){
+                .bitrate = bitrate,
+                .limit = limit,
+                .reserved = reserved,
+                .streams = nstreams,
+                .rejected = rejected,
+                .reduced = reduced,
+        };
+
+        for (int i = 0; i < BUSLOAD_WINDOWS; i++) {
+                struct busload_window *window = &stats->windows[i];
+                uint64_t classes[BUSLOAD_CLASSES];
+                uint64_t node_bits;
+                busload_sum(windows[i], node, classes, &node_bits);
+
+                uint64_t total = 0;
+                for (int j = 0; j < BUSLOAD_CLASSES; j++) {
+                        window->classes[j] = busload_bps(classes[j],
+                                                         windows[i]);
+                        total += classes[j];
+                }
+
+                window->ms = windows[i] * BUSLOAD_BUCKET_MS;
+                window->total = busload_bps(total, windows[i]);
+                window->node = busload_bps(node_bits, windows[i]);
+        }
+}
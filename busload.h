@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/can.h>
+
+// CAN bus load accounting and admission control of periodic streams.
+//
+// Every frame sent or received is accounted with its length on the wire:
+// frames whose content is known (everything going through SocketCAN or
+// VCS_SendCANFrame and VCS_ReadCANFrame) with the exact number of stuff bits,
+// those only expected (SDO transfers the library does on its own) with the
+// worst case. Every thread accounts into a meter of its own made of
+// BUSLOAD_BUCKET_MS buckets, by traffic class and by node, from which the
+// load over the last 10 ms, 100 ms and 1 s is computed.
+//
+// Periodic streams (TPDO telemetry, SYNC, setpoints sent with every SYNC)
+// reserve their share of the bus before they start. Streams set up at
+// startup never expire and are only checked against the other reservations,
+// the margin left by BUSLOAD_THRESHOLD is what request-driven traffic gets.
+// Streams that expire once idle for BUSLOAD_STREAM_IDLE_MS are admitted at
+// runtime against the reservations plus the request-driven traffic measured
+// over the last second. A stream that does not fit is rejected, or set up
+// at a lower rate where its producer allows.
+
+#define BUSLOAD_BUCKET_MS       10
+#define BUSLOAD_BUCKETS         100 // buckets in the longest window
+#define BUSLOAD_WINDOWS         3   // 10 ms, 100 ms and 1 s
+
+// largest node id accounted separately, 0 is for broadcasts (SYNC, NMT to
+// all nodes)
+#define BUSLOAD_NODES           128
+
+#define BUSLOAD_STREAM_IDLE_MS  1000
+
+// busload_reserve() flags
+#define BUSLOAD_EXPIRES         1 // drop the stream once idle
+#define BUSLOAD_REDUCED         2 // admitted at less than the rate asked for
+
+// traffic classes by COB-ID (CANopen predefined connection set)
+enum busload_class {
+        BUSLOAD_NMT,   // NMT commands and heartbeats
+        BUSLOAD_SYNC,
+        BUSLOAD_EMCY,
+        BUSLOAD_PDO,
+        BUSLOAD_SDO,
+        BUSLOAD_OTHER,
+        BUSLOAD_CLASSES
+};
+
+struct busload_window {
+        uint32_t ms;
+        uint32_t total; // bit/s
+        uint32_t node;  // bit/s to or from the node asked for
+        uint32_t classes[BUSLOAD_CLASSES]; // bit/s
+};
+
+struct busload_stats {
+        uint32_t bitrate;
+        uint32_t limit;    // bit/s streams may take together
+        uint32_t reserved; // bit/s taken by streams
+        uint32_t streams;
+        uint32_t rejected; // streams (setpoints) not admitted
+        uint32_t reduced;  // streams admitted at a lower rate
+        struct busload_window windows[BUSLOAD_WINDOWS];
+};
+
+// Set the bitrate of the bus and the share of it, 0 to 1, that streams may
+// reserve together.
+void busload_init(uint32_t bitrate, double threshold);
+
+// Bits a data frame with an 11-bit COB-ID takes on the wire including stuff
+// bits, the interframe space and the CRC. busload_worst_bits() is the
+// longest a frame with dlc bytes can take with stuffing.
+unsigned busload_frame_bits(const struct can_frame *frame);
+unsigned busload_worst_bits(uint8_t dlc);
+
+// Account for frames sent or received by the calling thread.
+void busload_frames(const struct can_frame *frames, size_t n);
+
+// Account for n frames of dlc bytes whose content is not known.
+void busload_expect(enum busload_class class, uint8_t node, uint8_t dlc,
+                    unsigned n);
+
+// Account for the frames a library call to node causes (see STAT()), fn is
+// its enum stat_fn. Calls sending or receiving frames given to them are
+// accounted by the caller with busload_frames().
+void busload_call(unsigned fn, uint16_t node);
+
+// Set up the meter of the calling thread, which otherwise happens when it
+// accounts its first frame. Real-time threads call this before their loop.
+void busload_attach(void);
+
+// Reserve the bus for a stream of frames with cob_id and dlc bytes sent or
+// expected rate times per second. Reserving an existing stream again only
+// updates its rate (and keeps a stream that expires alive). Returns -1 if
+// the stream does not fit. Must only be used by the bus thread once it has
+// been started.
+int busload_reserve(uint16_t cob_id, uint8_t dlc, double rate, int flags);
+
+// Frames per second reserved for cob_id, 0 if none.
+double busload_rate(uint16_t cob_id);
+
+// Bit/s that streams which never expire can still reserve.
+uint32_t busload_headroom(void);
+
+// Load of the bus, node selects whose share is reported. Must only be used
+// by the bus thread once it has been started.
+void busload_stats(uint8_t node, struct busload_stats *stats);
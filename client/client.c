@@ -0,0 +1,623 @@
+#define _GNU_SOURCE
+
+#include "client.h"
+#include "../proto.h"
+#include "../shm.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// largest tagged request frame
+#define CLIENT_MAX_REQUEST      (PROTO_TAG_HDR_SIZE + 2 + PROTO_MAX_PAYLOAD)
+
+// largest tagged response frame
+#define CLIENT_MAX_RESPONSE     (PROTO_TAG_SIZE + PROTO_MAX_FRAME)
+
+// request ids are the slot in the lower bits and a sequence number in the
+// upper ones, so a stale id never matches a reused slot
+#define CLIENT_SLOT_BITS        8
+
+// time a shared-memory client polls for responses before going to sleep
+#define CLIENT_SPIN_US          50
+
+struct client_slot {
+        uint32_t id;
+        int busy;
+        client_done_fn done;
+        void *ctx;
+};
+
+struct client {
+        int fd;
+        // set for shared-memory clients (see shm.h), which bypass the buffers
+        struct shm_region *shm;
+        int req_fd;
+        int resp_fd;
+
+        uint32_t seq;
+        size_t inflight;
+        struct client_slot slots[CLIENT_MAX_INFLIGHT];
+
+        // queued requests not yet sent are wbuf[wpos, wlen)
+        size_t wpos;
+        size_t wlen;
+        uint8_t wbuf[CLIENT_MAX_INFLIGHT * CLIENT_MAX_REQUEST];
+
+        // received bytes not yet handled are rbuf[rpos, rlen)
+        size_t rpos;
+        size_t rlen;
+        uint8_t rbuf[65536];
+};
+
+// response of client_call()
+struct client_result {
+        int done;
+        uint32_t err;
+        void *out;
+        uint16_t max;
+        uint16_t len;
+};
+
+static uint16_t get_u16(const uint8_t *p)
+{
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        return le16toh(v);
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return le32toh(v);
+}
+
+static void put_u16(uint8_t *p, uint16_t v)
+{
+        v = htole16(v);
+        memcpy(p, &v, sizeof(v));
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+        v = htole32(v);
+        memcpy(p, &v, sizeof(v));
+}
+
+static uint64_t client_now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct client *client_connect(const char *host, uint16_t port)
+{
+        char service[8];
+        snprintf(service, sizeof(service), "%u", port);
+        const struct addrinfo hints = {
+                .ai_family = AF_UNSPEC,
+                .ai_socktype = SOCK_STREAM,
+        };
+        struct addrinfo *addrs;
+        int err = getaddrinfo(host, service, &hints, &addrs);
+        if (err) {
+                errno = err == EAI_SYSTEM ? errno : EHOSTUNREACH;
+                return NULL;
+        }
+
+        int fd = -1;
+        for (struct addrinfo *addr = addrs; addr; addr = addr->ai_next) {
+                fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC,
+                            addr->ai_protocol);
+                if (fd == -1) {
+                        continue;
+                }
+
+                if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+                        break;
+                }
+
+                close(fd);
+                fd = -1;
+        }
+
+        freeaddrinfo(addrs);
+        if (fd == -1) {
+                return NULL;
+        }
+
+        // the socket stays blocking, sends and receives which must not wait
+        // pass MSG_DONTWAIT
+        const int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        struct client *client = calloc(1, sizeof(*client));
+        if (!client) {
+                close(fd);
+                return NULL;
+        }
+
+        client->fd = fd;
+        return client;
+}
+
+// Receive the region and eventfds passed by the server (see shm.c).
+static int client_recv_fds(int sock, int *fds, size_t n)
+{
+        union {
+                char buf[CMSG_SPACE(3 * sizeof(int))];
+                struct cmsghdr align;
+        } control;
+        uint32_t magic = 0;
+        struct iovec iov = { &magic, sizeof(magic) };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = control.buf,
+                .msg_controllen = CMSG_SPACE(n * sizeof(int)),
+        };
+        if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(magic)) {
+                return -1;
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(n * sizeof(int))) {
+                errno = EPROTO;
+                return -1;
+        }
+
+        memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+        if (magic != SHM_MAGIC) {
+                for (size_t i = 0; i < n; i++) {
+                        close(fds[i]);
+                }
+
+                errno = EPROTO;
+                return -1;
+        }
+
+        return 0;
+}
+
+struct client *client_connect_shm(const char *path)
+{
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                errno = ENAMETOOLONG;
+                return NULL;
+        }
+
+        strcpy(addr.sun_path, path);
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock == -1) {
+                return NULL;
+        }
+
+        int fds[3];
+        if (connect(sock, (const struct sockaddr *)&addr,
+                    sizeof(addr)) == -1 ||
+            client_recv_fds(sock, fds, 3) == -1) {
+                close(sock);
+                return NULL;
+        }
+
+        struct client *client = calloc(1, sizeof(*client));
+        void *region = mmap(NULL, sizeof(struct shm_region),
+                            PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+        close(fds[0]);
+        if (!client || region == MAP_FAILED) {
+                if (region != MAP_FAILED) {
+                        munmap(region, sizeof(struct shm_region));
+                }
+
+                free(client);
+                close(fds[1]);
+                close(fds[2]);
+                close(sock);
+                return NULL;
+        }
+
+        client->fd = sock;
+        client->shm = region;
+        client->req_fd = fds[1];
+        client->resp_fd = fds[2];
+        return client;
+}
+
+void client_close(struct client *client)
+{
+        if (client) {
+                if (client->shm) {
+                        munmap(client->shm, sizeof(*client->shm));
+                        close(client->req_fd);
+                        close(client->resp_fd);
+                }
+
+                close(client->fd);
+                free(client);
+        }
+}
+
+int client_fd(const struct client *client)
+{
+        return client->shm ? client->resp_fd : client->fd;
+}
+
+size_t client_inflight(const struct client *client)
+{
+        return client->inflight;
+}
+
+int client_pending(const struct client *client)
+{
+        return client->wpos < client->wlen;
+}
+
+int client_submit(struct client *client, uint8_t op, uint8_t node,
+                  const void *payload, uint16_t len, client_done_fn done,
+                  void *ctx)
+{
+        if (len > PROTO_MAX_PAYLOAD) {
+                errno = EMSGSIZE;
+                return -1;
+        } else if (client->inflight == CLIENT_MAX_INFLIGHT) {
+                errno = EAGAIN;
+                return -1;
+        }
+
+        // the server's ring has room for more requests than are let in
+        // flight, so this only fails if it is stuck
+        struct shm_slot *shm_slot = NULL;
+        if (client->shm &&
+            !(shm_slot = shm_claim(&client->shm->requests))) {
+                errno = EAGAIN;
+                return -1;
+        }
+
+        size_t slot = 0;
+        while (client->slots[slot].busy) {
+                slot++;
+        }
+
+        // every in-flight request has room in wbuf, only sent ones have to
+        // be moved out of the way
+        if (!shm_slot &&
+            sizeof(client->wbuf) - client->wlen < CLIENT_MAX_REQUEST) {
+                client->wlen -= client->wpos;
+                memmove(client->wbuf, client->wbuf + client->wpos,
+                        client->wlen);
+                client->wpos = 0;
+        }
+
+        uint32_t id = ++client->seq << CLIENT_SLOT_BITS | slot;
+        client->slots[slot] = (struct client_slot){
+                .id = id,
+                .busy = 1,
+                .done = done,
+                .ctx = ctx,
+        };
+        client->inflight++;
+
+        uint8_t *frame = shm_slot ? shm_slot->frame :
+                         client->wbuf + client->wlen;
+        size_t frame_len = PROTO_TAG_HDR_SIZE + 2 + len;
+        put_u16(frame, (frame_len - PROTO_LEN_SIZE) | PROTO_LEN_TAGGED);
+        put_u32(frame + PROTO_LEN_SIZE, id);
+        frame[PROTO_TAG_HDR_SIZE] = op;
+        frame[PROTO_TAG_HDR_SIZE + 1] = node;
+        if (len) {
+                memcpy(frame + PROTO_TAG_HDR_SIZE + 2, payload, len);
+        }
+
+        // published right away, the server picks it up if it is polling
+        if (shm_slot) {
+                shm_slot->len = frame_len;
+                shm_publish(&client->shm->requests);
+        } else {
+                client->wlen += frame_len;
+        }
+
+        return 0;
+}
+
+int client_flush(struct client *client)
+{
+        if (client->shm) {
+                shm_wake(&client->shm->requests, client->req_fd);
+                return 0;
+        }
+
+        while (client->wpos < client->wlen) {
+                ssize_t nwritten = send(client->fd,
+                                        client->wbuf + client->wpos,
+                                        client->wlen - client->wpos,
+                                        MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (nwritten == -1) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                return 0;
+                        } else if (errno == EINTR) {
+                                continue;
+                        }
+
+                        return -1;
+                }
+
+                client->wpos += nwritten;
+        }
+
+        client->wpos = client->wlen = 0;
+        return 0;
+}
+
+// Length of the response frame starting at frame, of which avail bytes are
+// at hand. Returns 0 if it is incomplete and -1 if it is malformed.
+static ssize_t client_frame_len(const uint8_t *frame, size_t avail)
+{
+        if (avail < PROTO_LEN_SIZE) {
+                return 0;
+        }
+
+        uint16_t frame_len = get_u16(frame);
+        if (!(frame_len & PROTO_LEN_TAGGED)) {
+                return -1; // only tagged requests are sent
+        }
+
+        frame_len &= ~PROTO_LEN_TAGGED;
+        if (frame_len < CLIENT_MAX_RESPONSE - PROTO_LEN_SIZE -
+                        PROTO_MAX_PAYLOAD ||
+            frame_len > CLIENT_MAX_RESPONSE - PROTO_LEN_SIZE) {
+                return -1;
+        }
+
+        return avail < PROTO_LEN_SIZE + frame_len ? 0 :
+               PROTO_LEN_SIZE + frame_len;
+}
+
+// Hand a response frame of size bytes to the callback of its request. Returns
+// -1 if it does not belong to a request in flight.
+static int client_complete(struct client *client, const uint8_t *frame,
+                           size_t size)
+{
+        uint32_t id = get_u32(frame + PROTO_LEN_SIZE);
+        size_t index = id & ((1 << CLIENT_SLOT_BITS) - 1);
+        struct client_slot *slot = &client->slots[index];
+        if (index >= CLIENT_MAX_INFLIGHT || !slot->busy || slot->id != id) {
+                return -1;
+        }
+
+        // the slot is free before the callback may submit again
+        slot->busy = 0;
+        client->inflight--;
+
+        const uint8_t *resp = frame + PROTO_TAG_SIZE;
+        uint32_t err = get_u32(resp + 4);
+        uint16_t len = size - (PROTO_TAG_SIZE + PROTO_RESP_HDR_SIZE);
+        if (slot->done) {
+                slot->done(slot->ctx, err, resp + PROTO_RESP_HDR_SIZE, len);
+        }
+
+        return 0;
+}
+
+// Hand the complete response frames in rbuf to their callbacks. Returns the
+// number of responses handled or -1 if a frame is malformed.
+static int client_dispatch(struct client *client)
+{
+        int handled = 0;
+        while (1) {
+                const uint8_t *frame = client->rbuf + client->rpos;
+                ssize_t size = client_frame_len(frame,
+                                                client->rlen - client->rpos);
+                if (size == 0) {
+                        break;
+                }
+
+                client->rpos += size;
+                if (size == -1 || client_complete(client, frame, size) == -1) {
+                        return -1;
+                }
+
+                handled++;
+        }
+
+        client->rlen -= client->rpos;
+        memmove(client->rbuf, client->rbuf + client->rpos, client->rlen);
+        client->rpos = 0;
+        return handled;
+}
+
+// Hand the responses in the response ring to their callbacks. Returns the
+// number of responses handled or -1 if a frame is malformed.
+static int client_take(struct client *client)
+{
+        int handled = 0;
+        struct shm_slot *slot;
+        while ((slot = shm_peek(&client->shm->responses))) {
+                // released only afterwards, so the server leaves it alone
+                size_t avail = slot->len < sizeof(slot->frame) ?
+                               slot->len : sizeof(slot->frame);
+                ssize_t size = client_frame_len(slot->frame, avail);
+                if (size <= 0 ||
+                    client_complete(client, slot->frame, size) == -1) {
+                        return -1;
+                }
+
+                shm_release(&client->shm->responses);
+                handled++;
+        }
+
+        return handled;
+}
+
+// client_poll() for shared-memory clients: poll the response ring for
+// CLIENT_SPIN_US, then sleep on the eventfd.
+static int client_poll_shm(struct client *client, int timeout_ms)
+{
+        client_flush(client);
+        eventfd_t count;
+        eventfd_read(client->resp_fd, &count);
+
+        static long ncpus;
+        if (!ncpus) {
+                ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+
+        uint64_t spin_ns = ncpus > 1 ? CLIENT_SPIN_US * 1000ull : 0;
+        uint64_t start = client_now_ns();
+        int handled;
+        while ((handled = client_take(client)) == 0 &&
+               client->inflight > 0 && timeout_ms != 0) {
+                uint64_t elapsed = client_now_ns() - start;
+                if (timeout_ms > 0 && elapsed >= timeout_ms * 1000000ull) {
+                        break;
+                } else if (elapsed < spin_ns ||
+                           !shm_sleep(&client->shm->responses)) {
+                        continue;
+                }
+
+                // the socket only tells whether the server went away
+                struct pollfd pfds[2] = {
+                        { .fd = client->resp_fd, .events = POLLIN },
+                        { .fd = client->fd, .events = POLLRDHUP },
+                };
+                int wait = timeout_ms < 0 ? -1 :
+                           timeout_ms - (int)(elapsed / 1000000);
+                int ready = poll(pfds, 2, wait);
+                atomic_store(&client->shm->responses.sleeping, 0);
+                if (ready == -1 && errno != EINTR) {
+                        return -1;
+                } else if (ready > 0 && pfds[1].revents) {
+                        errno = ECONNRESET;
+                        return -1;
+                }
+
+                eventfd_read(client->resp_fd, &count);
+        }
+
+        if (handled == -1) {
+                errno = EPROTO;
+                return -1;
+        }
+
+        // with a timeout of 0 the caller waits for client_fd() itself
+        if (timeout_ms == 0 && client->inflight > 0 &&
+            !shm_sleep(&client->shm->responses)) {
+                eventfd_write(client->resp_fd, 1);
+        }
+
+        return handled;
+}
+
+int client_poll(struct client *client, int timeout_ms)
+{
+        if (client->shm) {
+                return client_poll_shm(client, timeout_ms);
+        }
+
+        if (client_flush(client) == -1) {
+                return -1;
+        }
+
+        if (client->inflight == 0) {
+                return 0;
+        }
+
+        struct pollfd pfd = {
+                .fd = client->fd,
+                .events = POLLIN | (client_pending(client) ? POLLOUT : 0),
+        };
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready == -1) {
+                return errno == EINTR ? 0 : -1;
+        } else if (ready == 0) {
+                return 0;
+        }
+
+        if (client_flush(client) == -1) {
+                return -1;
+        }
+
+        // read everything that arrived, so a burst of responses is handled
+        // with as few calls as possible
+        int handled = 0;
+        while (1) {
+                ssize_t nread = recv(client->fd, client->rbuf + client->rlen,
+                                     sizeof(client->rbuf) - client->rlen,
+                                     MSG_DONTWAIT);
+                if (nread == -1) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                break;
+                        } else if (errno == EINTR) {
+                                continue;
+                        }
+
+                        return -1;
+                } else if (nread == 0) {
+                        errno = ECONNRESET;
+                        return -1;
+                }
+
+                client->rlen += nread;
+                int n = client_dispatch(client);
+                if (n == -1) {
+                        errno = EPROTO;
+                        return -1;
+                }
+
+                handled += n;
+        }
+
+        return handled;
+}
+
+static void client_result(void *ctx, uint32_t err, const uint8_t *payload,
+                          uint16_t len)
+{
+        struct client_result *result = ctx;
+        result->done = 1;
+        result->err = err;
+        result->len = len;
+        if (result->out) {
+                memcpy(result->out, payload,
+                       len < result->max ? len : result->max);
+        }
+}
+
+int64_t client_call(struct client *client, uint8_t op, uint8_t node,
+                    const void *payload, uint16_t payload_len, void *out,
+                    uint16_t max, uint16_t *len)
+{
+        struct client_result result = { .out = out, .max = max };
+        while (client_submit(client, op, node, payload, payload_len,
+                             client_result, &result) == -1) {
+                if (errno != EAGAIN || client_poll(client, -1) == -1) {
+                        return -1;
+                }
+        }
+
+        while (!result.done) {
+                if (client_poll(client, -1) == -1) {
+                        return -1;
+                }
+        }
+
+        if (len) {
+                *len = result.len;
+        }
+
+        return result.err;
+}
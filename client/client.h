@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Client library for the command server, connected over TCP or, on the same
+// machine, over shared memory (see shm.h).
+//
+// Requests are sent tagged (see proto.h), so any number of them up to the
+// limit given to client_connect() can be in flight at once and their
+// responses are matched by id in whatever order they come back. Requests are
+// queued by client_submit() and sent together by the next client_flush() or
+// client_poll(), which also reads the responses and hands each one to the
+// callback given with its request:
+//
+//   client_submit(c, OP_GET_TELEMETRY, 1, NULL, 0, on_telemetry, axis1);
+//   client_submit(c, OP_GET_TELEMETRY, 2, NULL, 0, on_telemetry, axis2);
+//   while (client_inflight(c) > 0) {
+//           client_poll(c, -1);
+//   }
+//
+// Callbacks run inside client_poll() and may submit further requests. A
+// client must only be used by one thread at a time; the library does not
+// create any threads, so client_fd() can be added to an event loop of the
+// caller's.
+
+// requests in flight per connection the server accepts (see comm.h)
+#define CLIENT_MAX_INFLIGHT     32
+
+struct client;
+
+// Called with the response to a request. payload is only valid during the
+// call and empty unless err is 0.
+typedef void (*client_done_fn)(void *ctx, uint32_t err,
+                               const uint8_t *payload, uint16_t len);
+
+// Connect to the server at host (a name or address) and port. Returns NULL
+// with errno set if that fails.
+struct client *client_connect(const char *host, uint16_t port);
+
+// Connect to the server on the same machine through shared memory (see
+// shm.h), path being its UNIX socket. Returns NULL with errno set if that
+// fails.
+struct client *client_connect_shm(const char *path);
+
+// Close the connection. Requests still in flight are dropped without calling
+// their callbacks.
+void client_close(struct client *client);
+
+// The descriptor to wait for becoming readable (and writable while
+// client_pending() is true) before calling client_poll(), for callers with
+// an event loop of their own. Over TCP this is the socket. Over shared memory
+// it is an eventfd, which only becomes readable for responses arriving after
+// a client_poll() with timeout 0 returned.
+int client_fd(const struct client *client);
+
+// Queue a request. done is called with ctx once the response arrived. Returns
+// 0, or -1 with errno set to EAGAIN if CLIENT_MAX_INFLIGHT requests are in
+// flight already or EMSGSIZE if the payload is too large.
+int client_submit(struct client *client, uint8_t op, uint8_t node,
+                  const void *payload, uint16_t len, client_done_fn done,
+                  void *ctx);
+
+// Send as much of the queued requests as the socket accepts. Returns -1 with
+// errno set if the connection is broken.
+int client_flush(struct client *client);
+
+// Send the queued requests and wait up to timeout_ms (-1 for no limit) for
+// responses, calling the callbacks of all which arrived. Returns immediately
+// if nothing is in flight. Shared-memory clients poll for a few microseconds
+// before going to sleep, so responses are picked up without a syscall.
+// Returns the number of responses handled, or -1 with errno set if the
+// connection is broken or the server sent a malformed frame.
+int client_poll(struct client *client, int timeout_ms);
+
+// Number of requests whose responses have not been handled yet.
+size_t client_inflight(const struct client *client);
+
+// Whether queued requests are waiting for the socket to become writable.
+int client_pending(const struct client *client);
+
+// Send a request and wait for its response, handling the responses to other
+// requests in flight meanwhile. Up to max bytes of the response payload are
+// copied to out and its full length is stored in len. Returns the error code
+// of the response, or -1 with errno set if the request could not be sent or
+// the connection broke.
+int64_t client_call(struct client *client, uint8_t op, uint8_t node,
+                    const void *payload, uint16_t payload_len, void *out,
+                    uint16_t max, uint16_t *len);
@@ -0,0 +1,523 @@
+#define _GNU_SOURCE
+
+#include "comm.h"
+#include "evlog.h"
+#include "proto.h"
+#include "udp.h"
+#include "util.h"
+#include "watchdog.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+
+#define COMM_MAX_EVENTS 64
+
+struct conn {
+        struct bus_client client;
+        struct comm *comm;
+
+        // -1 once closed, the slot is reused when no command is in flight
+        int fd;
+        struct conn *next_free;
+
+        unsigned inflight;
+        // set when a request had to be held back because of inflight
+        int blocked;
+
+        struct watchdog_session session;
+
+        // received bytes not yet submitted are rbuf[rpos, rlen)
+        size_t rpos;
+        size_t rlen;
+        // the part of a response the socket did not take is wbuf[wpos, wlen)
+        size_t wpos;
+        size_t wlen;
+
+        uint8_t rbuf[COMM_BUF_SIZE];
+        uint8_t wbuf[PROTO_TAG_HDR_SIZE + PROTO_MAX_FRAME];
+        // headers of the tagged responses being sent
+        uint8_t tags[COMM_MAX_INFLIGHT][PROTO_TAG_HDR_SIZE];
+};
+
+struct comm {
+        struct bus *bus;
+        int epoll_fd;
+        int server_fd;
+        // signalled by the bus thread whenever a command completed
+        int notify_fd;
+
+        struct conn *conns;
+        struct conn *free_conns;
+        int nconns;
+        int max_conns;
+
+        struct udp *udp; // NULL if disabled
+        struct watchdog watchdog;
+};
+
+static void conn_free(struct comm *comm, struct conn *conn)
+{
+        conn->next_free = comm->free_conns;
+        comm->free_conns = conn;
+}
+
+static void conn_close(struct comm *comm, struct conn *conn)
+{
+        evlog(EV_CONN_CLOSE, conn->fd, 0, 0);
+        watchdog_close(&comm->watchdog, &conn->session);
+
+        // closing the fd also removes it from the epoll set
+        close(conn->fd);
+        conn->fd = -1;
+        comm->nconns--;
+
+        // completions of commands still in flight are discarded as they come
+        // in, the slot can only be reused afterwards
+        if (conn->inflight == 0) {
+                conn_free(comm, conn);
+        }
+}
+
+static void conn_expired(void *owner)
+{
+        struct conn *conn = owner;
+        evlog(EV_WATCHDOG_EXPIRED, conn->fd, 0, 0);
+        conn_close(conn->comm, conn);
+}
+
+// Hand the oldest completion back to the bus thread.
+static void conn_release(struct comm *comm, struct conn *conn)
+{
+        spsc_release(&conn->client.completions);
+        if (--conn->inflight == 0 && conn->fd == -1) {
+                conn_free(comm, conn);
+        }
+}
+
+// Send the rest of a partially sent response. Returns -1 if the connection is
+// broken.
+static int conn_flush(struct conn *conn)
+{
+        while (conn->wpos < conn->wlen) {
+                ssize_t nwritten = send(conn->fd, conn->wbuf + conn->wpos,
+                                        conn->wlen - conn->wpos, MSG_NOSIGNAL);
+                if (nwritten == -1) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                return 0;
+                        } else if (errno == EINTR) {
+                                continue;
+                        }
+
+                        return -1;
+                }
+
+                conn->wpos += nwritten;
+        }
+
+        conn->wpos = conn->wlen = 0;
+        return 0;
+}
+
+// Send the completed responses straight from the completion ring, all of them
+// with a single writev(). A response the socket only takes part of is moved to
+// wbuf, so its slot can be released. Returns the number of bytes written or -1
+// if the connection is broken.
+static ssize_t conn_writev(struct conn *conn)
+{
+        struct iovec iov[2 * COMM_MAX_INFLIGHT];
+        int niov = 0;
+        struct bus_completion *completion;
+        for (size_t i = 0; i < COMM_MAX_INFLIGHT &&
+             (completion = spsc_peek_at(&conn->client.completions, i)); i++) {
+                if (completion->tag.tagged) {
+                        proto_tag(conn->tags[i], completion->frame,
+                                  completion->tag.id);
+                        iov[niov++] = (struct iovec){
+                                conn->tags[i], PROTO_TAG_HDR_SIZE
+                        };
+                        iov[niov++] = (struct iovec){
+                                completion->frame + PROTO_LEN_SIZE,
+                                completion->len - PROTO_LEN_SIZE
+                        };
+                } else {
+                        iov[niov++] = (struct iovec){
+                                completion->frame, completion->len
+                        };
+                }
+        }
+
+        if (niov == 0) {
+                return 0;
+        }
+
+        ssize_t nwritten;
+        do {
+                nwritten = writev(conn->fd, iov, niov);
+        } while (nwritten == -1 && errno == EINTR);
+
+        if (nwritten == -1) {
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        // responses span one or two iovecs, tagged ones the tag and the frame
+        size_t left = nwritten;
+        for (int i = 0; i < niov && left > 0;) {
+                completion = spsc_peek(&conn->client.completions);
+                int n = completion->tag.tagged ? 2 : 1;
+                size_t len = iov[i].iov_len + (n == 2 ? iov[i + 1].iov_len : 0);
+                if (left < len) {
+                        for (int k = i; k < i + n; k++) {
+                                memcpy(conn->wbuf + conn->wlen,
+                                       iov[k].iov_base, iov[k].iov_len);
+                                conn->wlen += iov[k].iov_len;
+                        }
+
+                        conn->wpos = left;
+                        left = len;
+                }
+
+                left -= len;
+                i += n;
+                conn_release(conn->comm, conn);
+        }
+
+        return nwritten;
+}
+
+// Send the completed responses. Returns -1 if the connection is closed.
+static int conn_drain(struct comm *comm, struct conn *conn)
+{
+        while (conn->fd != -1) {
+                if (conn_flush(conn) == -1) {
+                        conn_close(comm, conn);
+                        break;
+                }
+
+                if (conn->wlen > 0) {
+                        // resumed once the socket is writable
+                        return 0;
+                }
+
+                ssize_t nwritten = conn_writev(conn);
+                if (nwritten == -1) {
+                        conn_close(comm, conn);
+                        break;
+                } else if (nwritten == 0) {
+                        return 0;
+                }
+        }
+
+        // nobody is left to send the responses to
+        while (conn->inflight > 0 && spsc_peek(&conn->client.completions)) {
+                conn_release(comm, conn);
+        }
+
+        return -1;
+}
+
+static int conn_submit(void *ctx, uint8_t op, uint8_t node,
+                       const uint8_t *payload, uint16_t len, int tagged,
+                       uint32_t id)
+{
+        struct conn *conn = ctx;
+        if (conn->inflight == COMM_MAX_INFLIGHT) {
+                conn->blocked = 1;
+                return -1;
+        }
+
+        struct bus_cmd *cmd = bus_claim(conn->comm->bus);
+        if (!cmd) {
+                conn->blocked = 1;
+                return -1;
+        }
+
+        cmd->client = &conn->client;
+        cmd->tag = (struct bus_tag){ .tagged = tagged, .id = id };
+        cmd->op = op;
+        cmd->node = node;
+        cmd->len = len;
+        memcpy(cmd->payload, payload, len);
+        bus_submit(conn->comm->bus, cmd);
+        conn->inflight++;
+        watchdog_request(&conn->comm->watchdog, &conn->session, op, node,
+                         payload, len);
+        return 0;
+}
+
+// Make as much progress on a connection as possible: send completed
+// responses, submit buffered requests and read more requests until the
+// socket would block. Since the socket is registered edge-triggered, reading
+// only stops early while too many requests are in flight; the connection is
+// serviced again when their completions come in.
+static void conn_service(struct comm *comm, struct conn *conn)
+{
+        if (conn_drain(comm, conn) == -1) {
+                return;
+        }
+
+        while (1) {
+                conn->blocked = 0;
+                ssize_t consumed = proto_process(conn->rbuf + conn->rpos,
+                                                 conn->rlen - conn->rpos,
+                                                 conn_submit, conn);
+                if (consumed == -1) {
+                        evlog(EV_CONN_MALFORMED, conn->fd, 0, 0);
+                        conn_close(comm, conn);
+                        return;
+                }
+
+                conn->rpos += consumed;
+                if (consumed > 0) {
+                        bus_kick(comm->bus);
+                        watchdog_feed(&conn->session);
+                }
+
+                if (conn->blocked) {
+                        return;
+                }
+
+                // only an incomplete frame is left, move it to the front
+                conn->rlen -= conn->rpos;
+                memmove(conn->rbuf, conn->rbuf + conn->rpos, conn->rlen);
+                conn->rpos = 0;
+
+                ssize_t nread = read(conn->fd, conn->rbuf + conn->rlen,
+                                     sizeof(conn->rbuf) - conn->rlen);
+                if (nread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        return;
+                } else if (nread == -1 && errno == EINTR) {
+                        continue;
+                } else if (nread <= 0) {
+                        conn_close(comm, conn);
+                        return;
+                }
+
+                conn->rlen += nread;
+        }
+}
+
+// Time in ms until the next deadline of a connection or UDP stream, -1 if
+// there is none.
+static int comm_timeout(const struct comm *comm, uint64_t now)
+{
+        int timeout = watchdog_timeout(&comm->watchdog, now);
+        int udp = comm->udp ? udp_timeout(comm->udp, now) : -1;
+        return timeout == -1 || (udp != -1 && udp < timeout) ? udp : timeout;
+}
+
+// Called whenever the bus thread signalled completions.
+static void comm_complete(struct comm *comm)
+{
+        // reset the eventfd before looking at the rings so no signal is lost
+        uint64_t count;
+        if (read(comm->notify_fd, &count, sizeof(count)) == -1) {
+                // EAGAIN, nothing to reset
+        }
+
+        if (comm->udp) {
+                udp_complete(comm->udp);
+        }
+
+        watchdog_complete(&comm->watchdog);
+
+        for (int i = 0; i < comm->max_conns; i++) {
+                struct conn *conn = &comm->conns[i];
+                if (conn->inflight == 0) {
+                        continue;
+                }
+
+                if (conn->fd == -1) {
+                        conn_drain(comm, conn);
+                } else {
+                        conn_service(comm, conn);
+                }
+        }
+}
+
+static void comm_accept(struct comm *comm)
+{
+        while (1) {
+                int client_fd = accept4(comm->server_fd, NULL, NULL,
+                                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (client_fd == -1) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                return;
+                        } else if (errno == EINTR || errno == ECONNABORTED) {
+                                continue;
+                        }
+
+                        die("failed to accept connection", 0);
+                }
+
+                struct conn *conn = comm->free_conns;
+                if (!conn) {
+                        evlog(EV_CONN_REFUSE, client_fd, 0, 0);
+                        close(client_fd);
+                        continue;
+                }
+
+                const int enable = 1;
+                setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &enable,
+                           sizeof(enable));
+
+                comm->free_conns = conn->next_free;
+                conn->fd = client_fd;
+                conn->rpos = conn->rlen = 0;
+                conn->wpos = conn->wlen = 0;
+                watchdog_open(&conn->session, conn, &conn->client);
+                bus_resume(&conn->client);
+
+                struct epoll_event event = {
+                        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                        .data.ptr = conn,
+                };
+                if (epoll_ctl(comm->epoll_fd, EPOLL_CTL_ADD, client_fd,
+                              &event) == -1) {
+                        die("failed to register connection", 0);
+                }
+
+                comm->nconns++;
+                evlog(EV_CONN_ACCEPT, client_fd, comm->nconns,
+                      comm->max_conns);
+
+                // data may have arrived before registering the socket
+                conn_service(comm, conn);
+        }
+}
+
+static void comm_register(struct comm *comm, int fd, void *ptr)
+{
+        struct epoll_event event = {
+                .events = EPOLLIN | EPOLLET,
+                .data.ptr = ptr,
+        };
+        if (epoll_ctl(comm->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+                die("failed to register fd with epoll", 0);
+        }
+}
+
+void comm_start(struct bus *bus, const struct comm_config *config)
+{
+        printf("entering communication loop...\n");
+        evlog_thread("comm");
+
+        int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+                               SOCK_CLOEXEC, 0);
+        if (server_fd == -1) {
+                die("failed to instantiate sockfd", 0);
+        }
+
+        printf("|-> created socket with sockfd=%d\n", server_fd);
+
+        const int enable = 1;
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT,
+                       &enable, sizeof(enable)) == -1) {
+                die("failed to set socket options", 0);
+        }
+
+        const struct sockaddr_in sockaddr = {
+                .sin_addr.s_addr = INADDR_ANY,
+                .sin_family = AF_INET,
+                .sin_port = htons(config->port),
+        };
+
+        if (bind(server_fd, (const struct sockaddr *)&sockaddr,
+                 sizeof(sockaddr)) == -1) {
+                die("failed to bind socket", 0);
+        }
+
+        if (listen(server_fd, config->backlog) == -1) {
+                die("failed to put socket in listen mode", 0);
+        }
+
+        printf("|-> listening on port %u (backlog=%d, max_conns=%d)\n",
+               config->port, config->backlog, config->max_conns);
+
+        struct comm comm = {
+                .bus = bus,
+                .server_fd = server_fd,
+                .notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+                .conns = aligned_alloc(RING_CACHELINE, config->max_conns *
+                                       sizeof(struct conn)),
+                .max_conns = config->max_conns,
+        };
+        if (comm.notify_fd == -1) {
+                die("failed to create eventfd", 0);
+        }
+
+        if (!comm.conns) {
+                die("failed to allocate connections", 0);
+        }
+
+        memset(comm.conns, 0, config->max_conns * sizeof(struct conn));
+        for (int i = config->max_conns - 1; i >= 0; i--) {
+                struct conn *conn = &comm.conns[i];
+                if (bus_client_init(&conn->client, COMM_MAX_INFLIGHT,
+                                    comm.notify_fd) == -1) {
+                        die("failed to allocate completion queue", 0);
+                }
+
+                conn->comm = &comm;
+                conn->fd = -1;
+                conn_free(&comm, conn);
+        }
+
+        watchdog_init(&comm.watchdog, bus, comm.notify_fd, conn_expired);
+        comm.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (comm.epoll_fd == -1) {
+                die("failed to create epoll instance", 0);
+        }
+
+        // the listening socket, the completion eventfd and the UDP socket
+        // are told apart from connections by their pointers
+        comm_register(&comm, server_fd, &comm.server_fd);
+        comm_register(&comm, comm.notify_fd, &comm.notify_fd);
+        if (config->udp_port) {
+                comm.udp = udp_open(bus, config->udp_port, comm.notify_fd,
+                                    config->udp_timeout_ms,
+                                    config->udp_stop_op);
+                comm_register(&comm, udp_fd(comm.udp), comm.udp);
+        }
+
+        struct epoll_event events[COMM_MAX_EVENTS];
+        while (1) {
+                int nevents = epoll_wait(comm.epoll_fd, events,
+                                         COMM_MAX_EVENTS,
+                                         comm_timeout(&comm, now_ns()));
+                if (nevents == -1) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+
+                        die("failed to wait for events", 0);
+                }
+
+                // deadlines go first, their stops must not wait for the
+                // requests that came in meanwhile
+                watchdog_run(&comm.watchdog, now_ns());
+                if (comm.udp) {
+                        udp_run(comm.udp, now_ns());
+                }
+
+                for (int i = 0; i < nevents; i++) {
+                        void *ptr = events[i].data.ptr;
+                        if (ptr == &comm.server_fd) {
+                                comm_accept(&comm);
+                        } else if (ptr == &comm.notify_fd) {
+                                comm_complete(&comm);
+                        } else if (comm.udp && ptr == comm.udp) {
+                                udp_receive(comm.udp);
+                        } else if (((struct conn *)ptr)->fd != -1) {
+                                conn_service(&comm, ptr);
+                        }
+                }
+        }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "bus.h"
+
+#include <netinet/in.h>
+
+// size of the per-connection receive buffer
+#define COMM_BUF_SIZE 4096
+
+// commands a connection may have queued on the bus before reading from it is
+// paused until some of them completed
+#define COMM_MAX_INFLIGHT 32
+
+struct comm_config {
+        in_port_t port;     // TCP port to listen on
+        in_port_t udp_port; // UDP port for setpoints (see udp.h), 0 for none
+        uint32_t udp_timeout_ms; // silence until the nodes of a UDP stream
+                                 // are stopped
+        uint8_t udp_stop_op;     // op stopping them (see watchdog_parse())
+        int backlog;    // length of the queue of pending connections
+        int max_conns;  // connections served concurrently, more are refused
+};
+
+// Start listening for incoming TCP connections and forward the commands
+// received on them to the bus thread (see proto.h for the wire format). All
+// connections, and the UDP setpoint channel if enabled, are served from a
+// single thread by an edge-triggered epoll event loop. Does not return.
+void comm_start(struct bus *bus, const struct comm_config *config);
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+
+#include "cycle.h"
+#include "busload.h"
+#include "ring.h"
+#include "socketcan.h"
+#include "util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+// stack prefaulted before entering the loop, so page faults cannot delay a
+// cycle once the memory is locked
+#define CYCLE_STACK_PREFAULT    (64 * 1024)
+
+struct cycle {
+        struct can_sock *can;
+        struct cycle_config config;
+        struct spsc_ring queue; // of struct can_frame
+        pthread_t thread;
+        _Atomic int running;
+
+        // written by the cycle thread, read by everyone
+        _Atomic uint32_t cycles;
+        _Atomic uint32_t overruns;
+        _Atomic uint32_t max_latency_us;
+        _Atomic uint32_t hist[CYCLE_HIST_BUCKETS];
+        _Atomic uint32_t superseded;
+};
+
+static struct cycle cycle;
+
+static void cycle_record(uint64_t latency_ns, uint64_t missed)
+{
+        uint32_t latency_us = latency_ns / 1000;
+        unsigned bucket = 0;
+        while (bucket < CYCLE_HIST_BUCKETS - 1 &&
+               latency_us >= 1u << bucket) {
+                bucket++;
+        }
+
+        atomic_fetch_add_explicit(&cycle.hist[bucket], 1,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&cycle.cycles, 1, memory_order_relaxed);
+        if (missed) {
+                atomic_fetch_add_explicit(&cycle.overruns, missed,
+                                          memory_order_relaxed);
+        }
+
+        if (latency_us > atomic_load_explicit(&cycle.max_latency_us,
+                                              memory_order_relaxed)) {
+                atomic_store_explicit(&cycle.max_latency_us, latency_us,
+                                      memory_order_relaxed);
+        }
+}
+
+// Drop every frame of which a later one with the same COB-ID follows, keeping
+// the order of the others. Returns the number of frames left.
+static size_t cycle_coalesce(struct can_frame *frames, size_t n)
+{
+        uint8_t seen[(CAN_SFF_MASK + 1) / 8] = { 0 };
+        size_t kept = n;
+        for (size_t i = n; i-- > 0;) {
+                canid_t id = frames[i].can_id & CAN_SFF_MASK;
+                if (seen[id / 8] & 1 << id % 8) {
+                        continue;
+                }
+
+                seen[id / 8] |= 1 << id % 8;
+                frames[--kept] = frames[i];
+        }
+
+        if (kept) {
+                memmove(frames, frames + kept, (n - kept) * sizeof(*frames));
+                atomic_fetch_add_explicit(&cycle.superseded, kept,
+                                          memory_order_relaxed);
+        }
+
+        return n - kept;
+}
+
+static void cycle_setup_rt(void)
+{
+        struct sched_param param = { .sched_priority = cycle.config.priority };
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err) {
+                fprintf(stderr, "|-> cycle: failed to set SCHED_FIFO: %s\n",
+                        strerror(err));
+        }
+
+        if (cycle.config.cpu >= 0) {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(cycle.config.cpu, &cpus);
+                err = pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+                                             &cpus);
+                if (err) {
+                        fprintf(stderr, "|-> cycle: failed to pin to CPU %d: "
+                                "%s\n", cycle.config.cpu, strerror(err));
+                }
+        }
+
+        volatile char stack[CYCLE_STACK_PREFAULT];
+        memset((char *)stack, 0, sizeof(stack));
+        busload_attach();
+}
+
+static void *cycle_run(void *arg)
+{
+        cycle_setup_rt();
+
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (fd == -1) {
+                die("failed to create cycle timer", 0);
+        }
+
+        uint64_t period = cycle.config.period_us * 1000ull;
+        uint64_t expected = now_ns() + period;
+        struct itimerspec spec = {
+                .it_interval = { 0, period },
+                .it_value = {
+                        expected / 1000000000, expected % 1000000000
+                },
+        };
+        if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+                die("failed to start cycle timer", 0);
+        }
+
+        struct can_frame frames[CYCLE_QUEUE_SIZE + 1];
+        while (1) {
+                uint64_t expirations;
+                if (read(fd, &expirations, sizeof(expirations)) !=
+                    sizeof(expirations)) {
+                        continue;
+                }
+
+                uint64_t now = now_ns();
+                expected += (expirations - 1) * period;
+                cycle_record(now > expected ? now - expected : 0,
+                             expirations - 1);
+                expected += period;
+
+                size_t n = 0;
+                struct can_frame *frame;
+                while (n < CYCLE_QUEUE_SIZE &&
+                       (frame = spsc_peek(&cycle.queue))) {
+                        frames[n++] = *frame;
+                        spsc_release(&cycle.queue);
+                }
+
+                n = cycle_coalesce(frames, n);
+                frames[n++] = (struct can_frame){
+                        .can_id = CAN_COB_ID_SYNC,
+                        .can_dlc = 0,
+                };
+                can_send(cycle.can, frames, n);
+        }
+
+        return NULL;
+}
+
+void cycle_start(struct can_sock *can, const struct cycle_config *config)
+{
+        printf("starting cycle thread (period=%uus, priority=%d, cpu=%d)...\n",
+               config->period_us, config->priority, config->cpu);
+
+        if (config->period_us < CYCLE_MIN_PERIOD_US ||
+            config->period_us > CYCLE_MAX_PERIOD_US) {
+                die("cycle period out of range", 0);
+        }
+
+        // the RPDOs sent with it reserve their share once they are queued
+        if (busload_reserve(CAN_COB_ID_SYNC, 0, 1e6 / config->period_us,
+                            0) == -1) {
+                die("no room on the bus for SYNC", 0);
+        }
+
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+                perror("|-> cycle: mlockall");
+        }
+
+        cycle.can = can;
+        cycle.config = *config;
+        if (spsc_init(&cycle.queue, CYCLE_QUEUE_SIZE,
+                      sizeof(struct can_frame)) == -1) {
+                die("failed to allocate cycle queue", 0);
+        }
+
+        if (pthread_create(&cycle.thread, NULL, cycle_run, NULL) != 0) {
+                die("failed to start cycle thread", 0);
+        }
+
+        atomic_store(&cycle.running, 1);
+}
+
+int cycle_running(void)
+{
+        return atomic_load_explicit(&cycle.running, memory_order_relaxed);
+}
+
+int cycle_queue(const struct can_frame *frame)
+{
+        struct can_frame *slot = spsc_claim(&cycle.queue);
+        if (!slot) {
+                return -1;
+        }
+
+        *slot = *frame;
+        spsc_publish(&cycle.queue);
+        return 0;
+}
+
+void cycle_stats(struct cycle_stats *stats)
+{
+        stats->cycles = atomic_load_explicit(&cycle.cycles,
+                                             memory_order_relaxed);
+        stats->overruns = atomic_load_explicit(&cycle.overruns,
+                                               memory_order_relaxed);
+        stats->max_latency_us = atomic_load_explicit(&cycle.max_latency_us,
+                                                     memory_order_relaxed);
+        for (int i = 0; i < CYCLE_HIST_BUCKETS; i++) {
+                stats->hist[i] = atomic_load_explicit(&cycle.hist[i],
+                                                      memory_order_relaxed);
+        }
+
+        stats->superseded = atomic_load_explicit(&cycle.superseded,
+                                                 memory_order_relaxed);
+}
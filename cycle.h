@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <linux/can.h>
+
+// Cyclic executor sending SYNC at a fixed period.
+//
+// A real-time thread (SCHED_FIFO, pinned to a CPU, memory locked) is woken
+// by a timerfd every period. Setpoints queued since the last cycle are sent
+// in one burst right in front of the SYNC, so synchronous RPDOs of all nodes
+// take effect at the same instant. Only the latest frame queued per COB-ID is
+// sent, the earlier ones would be overwritten at the SYNC anyway. The wake-up
+// latency of every cycle is recorded in a histogram to verify the timing.
+
+#define CYCLE_MIN_PERIOD_US     1000
+#define CYCLE_MAX_PERIOD_US     10000
+
+// frames that can be queued for a single cycle
+#define CYCLE_QUEUE_SIZE        256
+
+// bucket i counts wake-up latencies below 2^i us, the last one all others
+#define CYCLE_HIST_BUCKETS      16
+
+struct can_sock;
+
+struct cycle_config {
+        unsigned period_us; // CYCLE_MIN_PERIOD_US to CYCLE_MAX_PERIOD_US
+        int priority;       // SCHED_FIFO priority
+        int cpu;            // CPU to pin the thread to, -1 for any
+};
+
+struct cycle_stats {
+        uint32_t cycles;
+        uint32_t overruns;       // cycles missed because a wake-up was late
+        uint32_t max_latency_us; // largest wake-up latency
+        uint32_t hist[CYCLE_HIST_BUCKETS];
+        uint32_t superseded;     // frames dropped for a later one with the
+                                 // same COB-ID queued for the same cycle
+};
+
+// Start the cycle thread sending on can, which it takes over, and reserve the
+// bus for its SYNC (see busload.h). Real-time scheduling, affinity and memory
+// locking are best effort, a warning is printed if they cannot be set up
+// (e.g. lacking privileges).
+void cycle_start(struct can_sock *can, const struct cycle_config *config);
+
+// Whether the cycle thread is running, in which case it sends all SYNCs.
+int cycle_running(void);
+
+// Queue a frame to be sent with the next SYNC. Must only be called by a
+// single thread (the bus thread). Returns -1 if the queue is full.
+int cycle_queue(const struct can_frame *frame);
+
+// Snapshot of the timing statistics.
+void cycle_stats(struct cycle_stats *stats);
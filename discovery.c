@@ -0,0 +1,406 @@
+#include "discovery.h"
+#include "epos.h"
+#include "sdo.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// device type, which every CANopen device has
+#define DISCOVERY_INDEX         0x1000
+
+// levels of the library's port selection: device, protocol stack,
+// interface, port
+#define DISCOVERY_LEVELS        4
+
+// names per level and baudrates per port tried at most
+#define DISCOVERY_MAX_NAMES     16
+#define DISCOVERY_MAX_BAUDRATES 16
+
+struct discovery_run {
+        const struct discovery_config *config;
+        const struct discovery *cached; // NULL if there is no cache
+        struct discovery *found;
+};
+
+static int discovery_load(const char *path, struct discovery *cached)
+{
+        FILE *file = fopen(path, "r");
+        if (!file) {
+                return -1;
+        }
+
+        memset(cached, 0, sizeof(*cached));
+        char line[2 * MAX_STR_SIZE];
+        while (fgets(line, sizeof(line), file)) {
+                char key[16];
+                char value[MAX_STR_SIZE];
+                if (sscanf(line, "%15s %63[^\n]", key, value) != 2) {
+                        continue;
+                }
+
+                if (strcmp(key, "device") == 0) {
+                        strcpy(cached->device, value);
+                } else if (strcmp(key, "protocol") == 0) {
+                        strcpy(cached->protocol, value);
+                } else if (strcmp(key, "interface") == 0) {
+                        strcpy(cached->interface, value);
+                } else if (strcmp(key, "port") == 0) {
+                        strcpy(cached->port, value);
+                } else if (strcmp(key, "baudrate") == 0) {
+                        cached->baudrate = strtoul(value, NULL, 10);
+                } else if (strcmp(key, "node") == 0 &&
+                           cached->n < NODES_MAX) {
+                        cached->nodes[cached->n++].id = atoi(value);
+                }
+        }
+
+        fclose(file);
+        return cached->device[0] && cached->protocol[0] &&
+               cached->interface[0] && cached->port[0] &&
+               cached->baudrate && cached->n ? 0 : -1;
+}
+
+static void discovery_save(const char *path, const struct discovery *found)
+{
+        // replaced at once so that a crash never leaves half a cache
+        char tmp[256];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        FILE *file = fopen(tmp, "w");
+        if (!file) {
+                perror("|-> failed to write discovery cache");
+                return;
+        }
+
+        fprintf(file, "device %s\nprotocol %s\ninterface %s\nport %s\n"
+                "baudrate %u\n", found->device, found->protocol,
+                found->interface, found->port, found->baudrate);
+        for (size_t i = 0; i < found->n; i++) {
+                fprintf(file, "node %u\n", found->nodes[i].id);
+        }
+
+        if (fclose(file) != 0 || rename(tmp, path) == -1) {
+                perror("|-> failed to write discovery cache");
+                unlink(tmp);
+        }
+}
+
+// Probe ids on port, which is set to the probe timeout, and store those
+// answering in found->nodes. The probes overlap on can if it is not NULL.
+static void discovery_probe(void *port, const struct discovery_config *config,
+                            struct can_sock *can, const uint16_t *ids,
+                            size_t nids, struct discovery *found)
+{
+        found->n = 0;
+        if (can) {
+                struct sdo_req reqs[NODES_MAX];
+                for (size_t i = 0; i < nids; i++) {
+                        reqs[i] = (struct sdo_req){
+                                .node = ids[i],
+                                .upload = 1,
+                                .index = DISCOVERY_INDEX,
+                                .len = 4,
+                        };
+                }
+
+                struct sdo *sdo = sdo_create(port, can, ids, nids,
+                                             config->probe_timeout);
+                sdo_transfer(sdo, reqs, nids, 0);
+                sdo_destroy(sdo);
+
+                // even an abort means there is a node with the id
+                for (size_t i = 0; i < nids; i++) {
+                        if (reqs[i].err != SDO_ERR_TIMEOUT &&
+                            reqs[i].err != SDO_ERR_GENERAL) {
+                                found->nodes[found->n++].id = ids[i];
+                        }
+                }
+
+                // the versions are only reported, a node not answering
+                // these is kept
+                for (size_t i = 0; i < found->n; i++) {
+                        struct discovery_node *node = &found->nodes[i];
+                        uint32_t err;
+                        STAT(VCS_GetVersion, node->id, err, port, node->id,
+                             &node->hardware, &node->software,
+                             &node->application,
+                             &node->application_version, &err);
+                }
+
+                return;
+        }
+
+        for (size_t i = 0; i < nids; i++) {
+                struct discovery_node *node = &found->nodes[found->n];
+                uint32_t err;
+                if (STAT(VCS_GetVersion, ids[i], err, port, ids[i],
+                         &node->hardware, &node->software,
+                         &node->application, &node->application_version,
+                         &err)) {
+                        node->id = ids[i];
+                        found->n++;
+                }
+        }
+}
+
+// Whether the port selected in found at baudrate is the given one.
+static int discovery_is(const struct discovery *found, uint32_t baudrate,
+                        const char *device, const char *protocol,
+                        const char *interface, const char *port,
+                        uint32_t port_baudrate)
+{
+        return baudrate == port_baudrate &&
+               strcmp(found->device, device) == 0 &&
+               strcmp(found->protocol, protocol) == 0 &&
+               strcmp(found->interface, interface) == 0 &&
+               strcmp(found->port, port) == 0;
+}
+
+// Whether the port selected in found at baudrate was tried already.
+static int discovery_tried(const struct discovery_run *run, uint32_t baudrate)
+{
+        const struct discovery_config *config = run->config;
+        const struct discovery *cached = run->cached;
+        return discovery_is(run->found, baudrate, config->device,
+                            config->protocol, config->interface,
+                            config->port, config->baudrate) ||
+               (cached && discovery_is(run->found, baudrate, cached->device,
+                                       cached->protocol, cached->interface,
+                                       cached->port, cached->baudrate));
+}
+
+// Whether the port selected in found at baudrate is the one behind the
+// SocketCAN interface of the configuration, which runs at the configured
+// baudrate.
+static int discovery_on_can(const struct discovery_run *run,
+                            uint32_t baudrate)
+{
+        const struct discovery_config *config = run->config;
+        return config->can &&
+               discovery_is(run->found, baudrate, config->device,
+                            config->protocol, config->interface,
+                            config->port, config->baudrate);
+}
+
+// Open the port selected in found and probe all node ids at each of the
+// baudrates until nodes answer. known are probed alone first and if all of
+// them answer, the others are not probed. Returns the port, set to the
+// baudrate stored in found, or NULL.
+static void *discovery_try(struct discovery_run *run,
+                           const uint32_t *baudrates, size_t nbaudrates,
+                           const struct discovery *known)
+{
+        const struct discovery_config *config = run->config;
+        struct discovery *found = run->found;
+
+        uint32_t err;
+        void *port = STAT(VCS_OpenDevice, 0, err, found->device,
+                          found->protocol, found->interface, found->port,
+                          &err);
+        if (!port) {
+                return NULL;
+        }
+
+        uint16_t ids[NODES_MAX];
+        for (size_t i = 0; i < NODES_MAX; i++) {
+                ids[i] = i + 1;
+        }
+
+        for (size_t i = 0; i < nbaudrates; i++) {
+                if (!STAT(VCS_SetProtocolStackSettings, 0, err, port,
+                          baudrates[i], config->probe_timeout, &err)) {
+                        continue;
+                }
+
+                // probes only go out on the socket if it sits behind the port
+                struct can_sock *can = discovery_on_can(run, baudrates[i]) ?
+                                       config->can : NULL;
+                found->n = 0;
+                if (known) {
+                        uint16_t known_ids[NODES_MAX];
+                        for (size_t k = 0; k < known->n; k++) {
+                                known_ids[k] = known->nodes[k].id;
+                        }
+
+                        discovery_probe(port, config, can, known_ids,
+                                        known->n, found);
+                }
+
+                if (!known || found->n < known->n) {
+                        discovery_probe(port, config, can, ids, NODES_MAX,
+                                        found);
+                }
+
+                if (found->n == 0) {
+                        continue;
+                }
+
+                if (!STAT(VCS_SetProtocolStackSettings, 0, err, port,
+                          baudrates[i], config->timeout, &err)) {
+                        die("failed to set port settings", err);
+                }
+
+                found->baudrate = baudrates[i];
+                return port;
+        }
+
+        STAT(VCS_CloseDevice, 0, err, port, &err);
+        return NULL;
+}
+
+// Names the library lists on one level of the port selection, below the
+// names chosen for the levels above in found. Returns how many.
+static size_t discovery_names(const struct discovery *found, int level,
+                              char names[][MAX_STR_SIZE], size_t max)
+{
+        // the library takes the names as char *
+        char *device = (char *)found->device;
+        char *protocol = (char *)found->protocol;
+        char *interface = (char *)found->interface;
+
+        size_t n = 0;
+        int end = 0;
+        for (int start = 1; !end && n < max; start = 0) {
+                uint32_t err;
+                int ok = 0;
+                switch (level) {
+                case 0:
+                        ok = STAT(VCS_GetDeviceNameSelection, 0, err, start,
+                                  names[n], MAX_STR_SIZE, &end, &err);
+                        break;
+                case 1:
+                        ok = STAT(VCS_GetProtocolStackNameSelection, 0, err,
+                                  device, start, names[n], MAX_STR_SIZE,
+                                  &end, &err);
+                        break;
+                case 2:
+                        ok = STAT(VCS_GetInterfaceNameSelection, 0, err,
+                                  device, protocol, start, names[n],
+                                  MAX_STR_SIZE, &end, &err);
+                        break;
+                case 3:
+                        ok = STAT(VCS_GetPortNameSelection, 0, err, device,
+                                  protocol, interface, start, names[n],
+                                  MAX_STR_SIZE, &end, &err);
+                        break;
+                }
+
+                if (!ok) {
+                        break;
+                }
+
+                n++;
+        }
+
+        return n;
+}
+
+// Try every port the library lists from level on at every baudrate it
+// supports, the configured one first.
+static void *discovery_scan(struct discovery_run *run, int level)
+{
+        struct discovery *found = run->found;
+        if (level == DISCOVERY_LEVELS) {
+                // the bitrate of the SocketCAN interface is set with ip link
+                // and the configured one was tried already
+                if (discovery_on_can(run, run->config->baudrate)) {
+                        return NULL;
+                }
+
+                uint32_t baudrates[DISCOVERY_MAX_BAUDRATES];
+                size_t n = 0;
+                if (!discovery_tried(run, run->config->baudrate)) {
+                        baudrates[n++] = run->config->baudrate;
+                }
+
+                int end = 0;
+                for (int start = 1; !end && n < DISCOVERY_MAX_BAUDRATES;
+                     start = 0) {
+                        uint32_t err;
+                        if (!STAT(VCS_GetBaudrateSelection, 0, err,
+                                  found->device, found->protocol,
+                                  found->interface, found->port, start,
+                                  &baudrates[n], &end, &err)) {
+                                break;
+                        }
+
+                        if (baudrates[n] != run->config->baudrate &&
+                            !discovery_tried(run, baudrates[n])) {
+                                n++;
+                        }
+                }
+
+                return n ? discovery_try(run, baudrates, n, NULL) : NULL;
+        }
+
+        char *fields[DISCOVERY_LEVELS] = {
+                found->device, found->protocol, found->interface, found->port
+        };
+
+        char names[DISCOVERY_MAX_NAMES][MAX_STR_SIZE];
+        size_t n = discovery_names(found, level, names, DISCOVERY_MAX_NAMES);
+        for (size_t i = 0; i < n; i++) {
+                strcpy(fields[level], names[i]);
+                void *port = discovery_scan(run, level + 1);
+                if (port) {
+                        return port;
+                }
+        }
+
+        return NULL;
+}
+
+void *discover(const struct discovery_config *config,
+               struct discovery *found)
+{
+        static struct discovery cached;
+        struct discovery_run run = {
+                .config = config,
+                .found = found,
+        };
+
+        uint64_t start = now_ns();
+        void *port = NULL;
+        if (discovery_load(config->cache, &cached) == 0) {
+                printf("|-> trying port '%s' at %ukbit/s from '%s'...\n",
+                       cached.port, cached.baudrate / 1000, config->cache);
+                run.cached = &cached;
+                *found = cached;
+                port = discovery_try(&run, &cached.baudrate, 1, &cached);
+        }
+
+        if (!port) {
+                printf("|-> trying port '%s' at %ukbit/s...\n", config->port,
+                       config->baudrate / 1000);
+                snprintf(found->device, MAX_STR_SIZE, "%s", config->device);
+                snprintf(found->protocol, MAX_STR_SIZE, "%s",
+                         config->protocol);
+                snprintf(found->interface, MAX_STR_SIZE, "%s",
+                         config->interface);
+                snprintf(found->port, MAX_STR_SIZE, "%s", config->port);
+                if (!run.cached ||
+                    !discovery_is(found, config->baudrate, cached.device,
+                                  cached.protocol, cached.interface,
+                                  cached.port, cached.baudrate)) {
+                        port = discovery_try(&run, &config->baudrate, 1,
+                                             NULL);
+                }
+        }
+
+        if (!port) {
+                printf("|-> scanning all ports...\n");
+                port = discovery_scan(&run, 0);
+        }
+
+        if (!port) {
+                return NULL;
+        }
+
+        printf("|-> found %zu nodes on port '%s' of '%s' at %ukbit/s in "
+               "%.0fms\n", found->n, found->port, found->interface,
+               found->baudrate / 1000, (now_ns() - start) / 1e6);
+        discovery_save(config->cache, found);
+        return port;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "nodes.h"
+#include "util.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Discovery of the port and the nodes on the bus at startup.
+//
+// Instead of trusting the configured port settings and the node table, the
+// server can find out itself which port the nodes are attached to and which
+// node ids answer. Candidate ports are tried in this order: the one found at
+// the last start (read from a cache file), the configured one and then every
+// device, protocol stack, interface, port and baudrate the library lists.
+// The first candidate on which any node answers is taken.
+//
+// On a candidate all node ids are probed with a short timeout. On the
+// configured port, given a SocketCAN socket on the interface behind it, the
+// probes (SDO uploads of the device type, 0x1000) are sent to all ids at once
+// and the answers collected as they arrive, so a full scan takes about one
+// timeout. As the bitrate of that interface is set with ip link, the port is
+// only tried at the configured baudrate. On every other candidate the probes
+// go through the library (VCS_GetVersion), serialized, and every absent id
+// costs a timeout.
+// If the cached port is still right and all nodes cached answer, only those
+// are probed.
+
+struct can_sock;
+
+struct discovery_config {
+        // tried after the cached port, before enumerating all
+        const char *device;
+        const char *protocol;
+        const char *interface;
+        const char *port;
+        uint32_t baudrate;
+
+        uint32_t probe_timeout; // ms a node is given to answer a probe
+        uint32_t timeout;       // ms, protocol stack timeout once found
+        const char *cache;      // path of the cache file
+        struct can_sock *can;   // on the interface behind the port above,
+                                // probes there overlap on it if not NULL
+};
+
+struct discovery_node {
+        uint16_t id;
+        uint16_t hardware;      // versions reported by VCS_GetVersion
+        uint16_t software;
+        uint16_t application;
+        uint16_t application_version;
+};
+
+struct discovery {
+        char device[MAX_STR_SIZE];
+        char protocol[MAX_STR_SIZE];
+        char interface[MAX_STR_SIZE];
+        char port[MAX_STR_SIZE];
+        uint32_t baudrate;
+        size_t n;
+        struct discovery_node nodes[NODES_MAX];
+};
+
+// Find a port with nodes on it and the nodes answering. Returns the port,
+// opened and set to the baudrate found and config->timeout, or NULL if no
+// node answered on any port. The result is written to the cache file.
+void *discover(const struct discovery_config *config,
+               struct discovery *found);
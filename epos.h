@@ -0,0 +1,12 @@
+#pragma once
+
+// Definitions.h defines its type constants (MT_*, NCS_*, OMD_*, ...) as
+// non-static globals, so it can only be included by a single translation unit
+// as it is shipped. Give them internal linkage so every module can include the
+// library header. stdint.h has to be included before redefining const since
+// Definitions.h pulls it in.
+#include <stdint.h>
+
+#define const static const
+#include "deps/Definitions.h"
+#undef const
@@ -0,0 +1,83 @@
+#include "evlog.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+_Thread_local struct evlog_ring *evlog_self;
+
+static struct evlog_file *file;
+
+static struct evlog_file *evlog_map(const char *path)
+{
+        unlink(path);
+        int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd == -1) {
+                return MAP_FAILED;
+        }
+
+        // sparse until written, which makes all rings empty
+        void *mem = MAP_FAILED;
+        if (ftruncate(fd, sizeof(struct evlog_file)) == 0) {
+                mem = mmap(NULL, sizeof(struct evlog_file),
+                           PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        close(fd);
+        return mem;
+}
+
+void evlog_open(const char *path)
+{
+        struct evlog_file *mem = evlog_map(path);
+        if (mem == MAP_FAILED) {
+                perror("|-> failed to map event log, keeping it in memory");
+                mem = mmap(NULL, sizeof(struct evlog_file),
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (mem == MAP_FAILED) {
+                        die("failed to allocate event log", 0);
+                }
+        } else {
+                printf("logging events to %s\n", path);
+        }
+
+        struct timespec realtime;
+        clock_gettime(CLOCK_REALTIME, &realtime);
+        mem->realtime_offset = realtime.tv_sec * 1000000000ll +
+                               realtime.tv_nsec - (int64_t)now_ns();
+        mem->entries = EVLOG_ENTRIES;
+        mem->version = EVLOG_VERSION;
+        mem->magic = EVLOG_MAGIC;
+        file = mem;
+        evlog(EV_START, getpid(), 0, 0);
+}
+
+struct evlog_ring *evlog_attach(void)
+{
+        if (!file) {
+                return NULL;
+        }
+
+        // the decoder skips rings beyond nthreads
+        uint32_t i = atomic_load(&file->nthreads);
+        do {
+                if (i == EVLOG_MAX_THREADS) {
+                        return NULL;
+                }
+        } while (!atomic_compare_exchange_weak(&file->nthreads, &i, i + 1));
+
+        evlog_self = &file->rings[i];
+        return evlog_self;
+}
+
+void evlog_thread(const char *name)
+{
+        struct evlog_ring *ring = evlog_self ? evlog_self : evlog_attach();
+        if (ring) {
+                strncpy(ring->name, name, sizeof(ring->name) - 1);
+        }
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "util.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Binary event log for the threads serving clients and the bus.
+//
+// Writing to stdout blocks whenever the terminal or journald falls behind,
+// which would stall whatever thread logged. Events are instead recorded as
+// fixed-size binary entries (timestamp, event id and three raw arguments)
+// into a ring per thread, so logging an event costs a clock read and a few
+// stores and never blocks. The rings live in a file mapped with MAP_SHARED,
+// so the latest EVLOG_ENTRIES events of every thread survive a crash of the
+// process in the page cache. The file is formatted offline by
+// tools/evlog_dump, which merges the rings by timestamp and prints every
+// event with the format given here.
+//
+// Entries are written in place: the writer fills the slot at head and then
+// publishes it by incrementing head. A reader of a live or crashed log takes
+// the EVLOG_ENTRIES - 1 entries before head, the oldest slot may be torn.
+
+#define EVLOG_MAGIC             0x474c5645 // "EVLG"
+#define EVLOG_VERSION           1
+
+// threads that can log, further ones log nothing
+#define EVLOG_MAX_THREADS       8
+
+// entries per thread, a power of two
+#define EVLOG_ENTRIES           65536
+
+// Events and their formats, which take the arguments a (%u), b and c (%llu)
+// in this order and may leave out trailing ones.
+#define EVLOG_EVENTS(X)                                                 \
+        X(EV_START, "log opened by pid %u")                             \
+        X(EV_CONN_ACCEPT, "accepted connection with client_fd=%u "      \
+          "(%llu/%llu)")                                                \
+        X(EV_CONN_REFUSE, "refused connection with client_fd=%u: "      \
+          "connection limit reached")                                   \
+        X(EV_CONN_CLOSE, "closing connection with client_fd=%u")        \
+        X(EV_CONN_MALFORMED, "malformed frame on client_fd=%u")         \
+        X(EV_SHM_ACCEPT, "accepted shared-memory connection with "      \
+          "client_fd=%u (%llu/%llu)")                                   \
+        X(EV_SHM_REFUSE, "refused shared-memory connection with "       \
+          "client_fd=%u: connection limit reached")                     \
+        X(EV_SHM_SETUP_FAILED, "failed to set up shared-memory client " \
+          "with client_fd=%u (errno %llu)")                             \
+        X(EV_SHM_CLOSE, "closing shared-memory connection with "        \
+          "client_fd=%u")                                               \
+        X(EV_SHM_MALFORMED, "malformed frame on shared-memory "         \
+          "client_fd=%u")                                               \
+        X(EV_UDP_RECV_FAILED, "failed to receive datagrams (errno %u)") \
+        X(EV_WATCHDOG_EXPIRED, "watchdog of client_fd=%u expired")      \
+        X(EV_WATCHDOG_STOP, "watchdog stop of node %u queued (op "      \
+          "0x%02llx)")                                                  \
+        X(EV_WATCHDOG_DROPPED, "failed to queue watchdog stop of node "  \
+          "%u")                                                         \
+        X(EV_WATCHDOG_FAILED, "watchdog stop of node %u failed "        \
+          "(0x%08llx)")                                                 \
+        X(EV_URGENT, "urgent op 0x%02x to node %llu issued %llu ns "    \
+          "after due")                                                  \
+        X(EV_CMD_FAILED, "op 0x%02x to node %llu failed (0x%08llx)")     \
+        X(EV_HOME_START, "homing of node %u started (group %llu, "      \
+          "method %lld)")                                               \
+        X(EV_HOME_END, "homing of node %u ended in state %llu "         \
+          "(0x%08llx)")                                                 \
+        X(EV_PORT_DOWN, "port failed (0x%08x), reopening it")           \
+        X(EV_PORT_UP, "port reopened after %u ms (%llu attempts)")      \
+        X(EV_UDP_EXPIRED, "watchdog of UDP stream from 0x%08x port "    \
+          "%llu expired")
+
+enum evlog_event {
+#define EVLOG_ENUM(id, fmt) id,
+        EVLOG_EVENTS(EVLOG_ENUM)
+#undef EVLOG_ENUM
+        EVLOG_NEVENTS
+};
+
+struct evlog_entry {
+        uint64_t ts; // now_ns()
+        uint32_t event;
+        uint32_t a;
+        uint64_t b;
+        uint64_t c;
+};
+
+struct evlog_ring {
+        char name[16];                // of the thread, NUL-terminated
+        _Alignas(64) _Atomic uint64_t head; // entries written so far
+        _Alignas(64) struct evlog_entry entries[EVLOG_ENTRIES];
+};
+
+// layout of the file
+struct evlog_file {
+        uint32_t magic;
+        uint32_t version;
+        _Atomic uint32_t nthreads; // rings in use
+        uint32_t entries;  // EVLOG_ENTRIES
+        int64_t realtime_offset; // CLOCK_REALTIME - now_ns() when opened
+        struct evlog_ring rings[EVLOG_MAX_THREADS];
+};
+
+// ring of the calling thread once it logged
+extern _Thread_local struct evlog_ring *evlog_self;
+
+// Map the log at path, replacing an existing one. If the file cannot be set
+// up, a warning is printed and the log is kept in anonymous memory, where it
+// can still be found in a core dump. Nothing is logged before this is called.
+void evlog_open(const char *path);
+
+// Give the ring of the calling thread a name for the decoder. Threads without
+// a name log nonetheless.
+void evlog_thread(const char *name);
+
+// Assign a ring to the calling thread. Returns NULL if it cannot log.
+struct evlog_ring *evlog_attach(void);
+
+// Record event with its arguments.
+static inline void evlog(enum evlog_event event, uint32_t a, uint64_t b,
+                         uint64_t c)
+{
+        struct evlog_ring *ring = evlog_self;
+        if (!ring && !(ring = evlog_attach())) {
+                return;
+        }
+
+        uint64_t head = atomic_load_explicit(&ring->head,
+                                             memory_order_relaxed);
+        ring->entries[head % EVLOG_ENTRIES] = (struct evlog_entry){
+                .ts = now_ns(),
+                .event = event,
+                .a = a,
+                .b = b,
+                .c = c,
+        };
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
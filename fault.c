@@ -0,0 +1,174 @@
+#include "fault.h"
+#include "epos.h"
+#include "stats.h"
+#include "util.h"
+
+// error codes of the library which do not follow from their range
+#define FAULT_ERR_HANDLE        0x10000003 // handle not valid
+#define FAULT_ERR_TIMEOUT       0x1000000b // timeout
+#define FAULT_ERR_SDO_TOGGLE    0x05030000 // toggle bit not alternated
+#define FAULT_ERR_SDO_TIMEOUT   0x05040000 // SDO protocol timed out
+
+// only accessed by the thread using the port
+static int watching;
+static int failed;
+static unsigned streak; // transient failures since a node last answered
+static uint64_t answered_at;
+static uint64_t failed_at;
+static struct fault_stats stats;
+
+enum fault_class fault_class(uint32_t err)
+{
+        switch (err >> 24) {
+        case 0x00:
+                if (err == 0) {
+                        return FAULT_NONE;
+                }
+
+                break;
+        case 0x05:
+                if (err == FAULT_ERR_SDO_TOGGLE ||
+                    err == FAULT_ERR_SDO_TIMEOUT) {
+                        return FAULT_TRANSIENT;
+                }
+
+                break;
+        case 0x10:
+                // general errors of the library
+                if (err == FAULT_ERR_HANDLE) {
+                        return FAULT_PORT;
+                } else if (err == FAULT_ERR_TIMEOUT) {
+                        return FAULT_TRANSIENT;
+                }
+
+                break;
+        case 0x20:
+                // interface layer: opening, closing, configuring the port
+                return FAULT_PORT;
+        default:
+                // interfaces (RS232, CAN, USB) and protocols (CANopen, maxon
+                // serial)
+                if (err >> 28 == 0x2 || err >> 28 == 0x3) {
+                        return FAULT_TRANSIENT;
+                }
+
+                break;
+        }
+
+        return FAULT_NODE;
+}
+
+void fault_call(unsigned fn, uint32_t err)
+{
+        // VCS_ReadCANFrame times out whenever no frame comes in, which says
+        // nothing about the port
+        if (!watching || fn == STAT_VCS_ReadCANFrame) {
+                return;
+        }
+
+        switch (fault_class(err)) {
+        case FAULT_NONE:
+        case FAULT_NODE:
+                streak = 0;
+                answered_at = now_ns();
+                break;
+        case FAULT_TRANSIENT:
+                // a toggle bit not alternated came from a node, only silence
+                // hints at the port
+                if (err == FAULT_ERR_SDO_TOGGLE) {
+                        streak = 0;
+                        answered_at = now_ns();
+                        break;
+                } else if (++streak < FAULT_STREAK ||
+                           now_ns() - answered_at <
+                           FAULT_SILENCE_MS * 1000000ull) {
+                        break;
+                }
+
+                // fall through
+        case FAULT_PORT:
+                if (!failed) {
+                        failed = 1;
+                        stats.err = err;
+                }
+
+                break;
+        }
+}
+
+void fault_watch(void)
+{
+        watching = 1;
+        failed = 0;
+        streak = 0;
+        answered_at = now_ns();
+}
+
+int fault_port_failed(void)
+{
+        return failed;
+}
+
+void fault_close(void *port)
+{
+        watching = 0;
+        failed_at = now_ns();
+        stats.failures++;
+        stats.down = 1;
+
+        // the handle is given up on anyway
+        uint32_t err;
+        STAT(VCS_CloseDevice, 0, err, port, &err);
+}
+
+void *fault_reopen(const struct fault_port *config, const uint16_t *nodes,
+                   size_t n)
+{
+        stats.reopens++;
+
+        // the library takes the names as char *
+        uint32_t err;
+        void *port = STAT(VCS_OpenDevice, 0, err, (char *)config->device,
+                          (char *)config->protocol, (char *)config->interface,
+                          (char *)config->port, &err);
+        if (!port) {
+                return NULL;
+        }
+
+        // absent nodes only cost the probe timeout
+        if (STAT(VCS_SetProtocolStackSettings, 0, err, port,
+                 config->baudrate, config->probe_timeout, &err)) {
+                for (size_t i = 0; i < n; i++) {
+                        uint16_t state;
+                        if (STAT(VCS_GetState, nodes[i], err, port, nodes[i],
+                                 &state, &err) &&
+                            STAT(VCS_SetProtocolStackSettings, 0, err, port,
+                                 config->baudrate, config->timeout, &err)) {
+                                uint32_t ms = (now_ns() - failed_at) / 1000000;
+                                stats.down = 0;
+                                stats.last_recovery_ms = ms;
+                                if (ms > stats.max_recovery_ms) {
+                                        stats.max_recovery_ms = ms;
+                                }
+
+                                fault_watch();
+                                return port;
+                        }
+                }
+        }
+
+        STAT(VCS_CloseDevice, 0, err, port, &err);
+        return NULL;
+}
+
+void fault_retried(int ok)
+{
+        stats.retries++;
+        stats.retried_ok += !!ok;
+}
+
+void fault_stats(struct fault_stats *out)
+{
+        *out = stats;
+        out->down_ms = stats.down ? (now_ns() - failed_at) / 1000000 : 0;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Classification of library errors and recovery of a failed port.
+//
+// Library calls fail for three kinds of reasons, which call for different
+// reactions:
+//
+//   transient  the request or its answer got lost on the way (SDO and library
+//              timeouts, errors of the CAN and protocol layers); the same
+//              call may well succeed when repeated
+//   node       the node answered and refused (SDO aborts, device errors, bad
+//              parameters); repeating the call does not help
+//   port       the library lost the port (invalid handle, errors of the
+//              interface layer); nothing gets through until the port is
+//              closed and opened again
+//
+// Every library call made through STAT() is noted once fault_watch() was
+// called. The port counts as failed after a port-level error or after
+// FAULT_STREAK transient failures in a row without any node answering for
+// FAULT_SILENCE_MS, e.g. when the cable was pulled; errors which show that a
+// node did answer, like SDO aborts, break the streak. The bus thread then
+// closes the port and opens it again (see bus_set_recovery()), while client
+// connections and everything cached about the nodes stay as they are.
+//
+// All functions must only be used by the thread using the port.
+
+// transient failures in a row after which the port counts as failed
+#define FAULT_STREAK            4
+
+// time without any node answering after which the port counts as failed, in
+// ms, if the streak is complete
+#define FAULT_SILENCE_MS        1000
+
+enum fault_class {
+        FAULT_NONE,
+        FAULT_TRANSIENT,
+        FAULT_NODE,
+        FAULT_PORT,
+};
+
+// Settings the port is opened with again. The strings must stay valid.
+struct fault_port {
+        const char *device;
+        const char *protocol;
+        const char *interface;
+        const char *port;
+        uint32_t baudrate;
+        uint32_t timeout;       // ms
+        uint32_t probe_timeout; // ms a node is given to answer a probe
+};
+
+struct fault_stats {
+        uint64_t retries;          // requests repeated after transient errors
+        uint64_t retried_ok;       // repetitions which succeeded
+        uint32_t failures;         // times the port failed
+        uint32_t reopens;          // attempts to open it again
+        uint32_t err;              // error the port failed with last
+        uint8_t down;              // whether it is failed right now
+        uint32_t down_ms;          // for how long, if so
+        uint32_t last_recovery_ms; // from failing to reopened, last time
+        uint32_t max_recovery_ms;
+};
+
+enum fault_class fault_class(uint32_t err);
+
+// Note the outcome of a call to library function fn (see STAT()), err is 0
+// on success.
+void fault_call(unsigned fn, uint32_t err);
+
+// Start noting calls, forgetting the failures of calls made so far.
+void fault_watch(void);
+
+// Whether the calls noted show that the port failed.
+int fault_port_failed(void);
+
+// Close the failed port. Failures are not noted until it is open again.
+void fault_close(void *port);
+
+// Open the port again and probe the nodes. Returns the port or NULL, with the
+// port closed again, if it cannot be opened or no node answers.
+void *fault_reopen(const struct fault_port *config, const uint16_t *nodes,
+                   size_t n);
+
+// Note a request repeated after a transient error and whether it succeeded.
+void fault_retried(int ok);
+
+void fault_stats(struct fault_stats *stats);
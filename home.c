@@ -0,0 +1,227 @@
+#include "home.h"
+#include "epos.h"
+#include "evlog.h"
+#include "proto.h"
+#include "stats.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HOME_MAX_NODES          128
+
+// poll period while axes are queued or homing, and while none are, in ms;
+// every axis homing costs one SDO transfer per poll
+#define HOME_POLL_PERIOD        50
+#define HOME_IDLE_PERIOD        100
+
+// consecutive failed VCS_GetHomingState() calls after which an axis fails
+#define HOME_MAX_ERRORS         3
+
+struct home_node {
+        struct home_config config;
+        struct home_status status;
+        uint32_t run;     // run the axis was last queued in
+        uint64_t started; // ns
+        unsigned errors;  // consecutive failed polls
+};
+
+// only accessed by the bus thread
+static struct home_node *nodes[HOME_MAX_NODES];
+static uint16_t active[HOME_MAX_NODES];
+static size_t nactive;
+static uint32_t run;
+static int running; // axes of the current run are queued or homing
+
+static int home_busy(const struct home_node *node)
+{
+        return node->status.state == HOME_QUEUED ||
+               node->status.state == HOME_HOMING;
+}
+
+uint32_t home_start(uint16_t node_id, const struct home_config *config)
+{
+        if (node_id >= HOME_MAX_NODES) {
+                return PROTO_ERR_UNKNOWN_NODE;
+        } else if (config->timeout == 0) {
+                return PROTO_ERR_BAD_ARG;
+        }
+
+        struct home_node *node = nodes[node_id];
+        if (!node) {
+                node = calloc(1, sizeof(*node));
+                if (!node) {
+                        die("failed to allocate homing", 0);
+                }
+
+                nodes[node_id] = node;
+                active[nactive++] = node_id;
+        } else if (home_busy(node)) {
+                return PROTO_ERR_NOT_ACTIVE;
+        }
+
+        if (!running) {
+                run++;
+                running = 1;
+        }
+
+        node->config = *config;
+        node->status = (struct home_status){
+                .state = HOME_QUEUED,
+                .group = config->group,
+        };
+        node->run = run;
+        node->started = 0;
+        return 0;
+}
+
+static void home_end(struct home_node *node, uint8_t state, uint32_t err,
+                     uint64_t now)
+{
+        node->status.state = state;
+        node->status.err = err;
+        if (node->started) {
+                node->status.elapsed = (now - node->started) / 1000000;
+        }
+}
+
+uint32_t home_stop(void *port, uint16_t node_id)
+{
+        struct home_node *node = node_id < HOME_MAX_NODES ? nodes[node_id] :
+                                 NULL;
+        if (!node || !home_busy(node)) {
+                return PROTO_ERR_NOT_ACTIVE;
+        }
+
+        uint32_t err;
+        if (node->status.state == HOME_HOMING &&
+            !STAT(VCS_StopHoming, node_id, err, port, node_id, &err)) {
+                return err;
+        }
+
+        home_end(node, HOME_STOPPED, 0, now_ns());
+        return 0;
+}
+
+// Switch an axis to homing mode and start homing.
+static void home_begin(void *port, uint16_t node_id, struct home_node *node,
+                       uint64_t now)
+{
+        const struct home_config *config = &node->config;
+        node->started = now;
+        node->errors = 0;
+
+        uint32_t err;
+        if (!STAT(VCS_ActivateHomingMode, node_id, err, port, node_id,
+                  &err) ||
+            !STAT(VCS_SetHomingParameter, node_id, err, port, node_id,
+                  config->acceleration, config->speed_switch,
+                  config->speed_index, config->offset,
+                  config->current_threshold, config->position, &err) ||
+            !STAT(VCS_FindHome, node_id, err, port, node_id, config->method,
+                  &err)) {
+                home_end(node, HOME_FAILED, err, now_ns());
+                evlog(EV_HOME_END, node_id, HOME_FAILED, err);
+                return;
+        }
+
+        node->status.state = HOME_HOMING;
+        evlog(EV_HOME_START, node_id, config->group, config->method);
+}
+
+// Check whether an axis is homed, has failed or ran out of time.
+static void home_check(void *port, uint16_t node_id, struct home_node *node,
+                       uint64_t now)
+{
+        int attained;
+        int error;
+        uint32_t err;
+        uint32_t stop_err; // the failure is reported, not the stop
+        if (!STAT(VCS_GetHomingState, node_id, err, port, node_id, &attained,
+                  &error, &err)) {
+                if (++node->errors < HOME_MAX_ERRORS) {
+                        return;
+                }
+
+                STAT(VCS_StopHoming, node_id, stop_err, port, node_id,
+                     &stop_err);
+                home_end(node, HOME_FAILED, err ? err : stop_err, now);
+        } else if (error) {
+                home_end(node, HOME_FAILED, PROTO_ERR_HOMING, now);
+        } else if (attained) {
+                home_end(node, HOME_ATTAINED, 0, now);
+        } else if (now - node->started >=
+                   node->config.timeout * 1000000ull) {
+                STAT(VCS_StopHoming, node_id, stop_err, port, node_id,
+                     &stop_err);
+                home_end(node, HOME_FAILED, PROTO_ERR_TIMED_OUT, now);
+        } else {
+                node->errors = 0;
+                return;
+        }
+
+        evlog(EV_HOME_END, node_id, node->status.state, node->status.err);
+}
+
+int home_poll(void *port, void *ctx)
+{
+        if (!running) {
+                return HOME_IDLE_PERIOD;
+        }
+
+        // the group whose turn it is and the first one with an axis that
+        // failed, axes of later groups are skipped
+        unsigned current = UINT8_MAX + 1;
+        unsigned failed = UINT8_MAX + 1;
+        for (size_t i = 0; i < nactive; i++) {
+                const struct home_node *node = nodes[active[i]];
+                unsigned group = node->config.group;
+                if (node->run != run) {
+                        continue;
+                } else if (home_busy(node) && group < current) {
+                        current = group;
+                } else if ((node->status.state == HOME_FAILED ||
+                            node->status.state == HOME_STOPPED) &&
+                           group < failed) {
+                        failed = group;
+                }
+        }
+
+        uint64_t now = now_ns();
+        running = 0;
+        for (size_t i = 0; i < nactive; i++) {
+                struct home_node *node = nodes[active[i]];
+                if (node->run != run) {
+                        continue;
+                }
+
+                if (node->status.state == HOME_QUEUED &&
+                    node->config.group > failed) {
+                        home_end(node, HOME_SKIPPED, 0, now);
+                } else if (node->status.state == HOME_QUEUED &&
+                           node->config.group == current) {
+                        home_begin(port, active[i], node, now);
+                } else if (node->status.state == HOME_HOMING) {
+                        home_check(port, active[i], node, now);
+                }
+
+                running |= home_busy(node);
+        }
+
+        return running ? HOME_POLL_PERIOD : HOME_IDLE_PERIOD;
+}
+
+void home_status(uint16_t node_id, struct home_status *status)
+{
+        const struct home_node *node = node_id < HOME_MAX_NODES ?
+                                       nodes[node_id] : NULL;
+        if (!node) {
+                memset(status, 0, sizeof(*status));
+                return;
+        }
+
+        *status = node->status;
+        if (node->status.state == HOME_HOMING) {
+                status->elapsed = (now_ns() - node->started) / 1000000;
+        }
+}
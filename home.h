@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+
+// Homing of several axes at once.
+//
+// VCS_WaitForHomingAttained() blocks the library, and with it the bus
+// thread, until a node is homed, so homing one axis after the other takes
+// the sum of all homing times. Instead, homing is started on all axes queued
+// together and the poller checks on every axis still homing with one
+// VCS_GetHomingState() per round, so the axes home at the same time and
+// homing all of them takes about as long as the slowest one.
+//
+// Every axis is queued with a group. Axes of the same group home at the same
+// time, a group only starts once the axes of all groups with lower numbers
+// are homed (e.g. a vertical axis which has to be out of the way goes into
+// group 0, the others into group 1). An axis which fails (the drive reports
+// a homing error, a library call fails or homing takes longer than its
+// timeout) or is stopped does not stop the others of its group, but the
+// groups after it are skipped.
+//
+// Axes must be enabled before they are queued. All functions must only be
+// used by the bus thread.
+
+enum home_state {
+        HOME_IDLE,      // never queued
+        HOME_QUEUED,    // waiting for the groups before it
+        HOME_HOMING,
+        HOME_ATTAINED,
+        HOME_FAILED,    // see home_status.err
+        HOME_SKIPPED,   // an axis of an earlier group failed
+        HOME_STOPPED,   // stopped by home_stop()
+};
+
+struct home_config {
+        int8_t method;              // HM_*
+        uint8_t group;
+        uint32_t acceleration;      // rpm/s
+        uint32_t speed_switch;      // rpm
+        uint32_t speed_index;       // rpm
+        int32_t offset;             // inc
+        uint16_t current_threshold; // mA
+        int32_t position;           // inc, set once homed
+        uint32_t timeout;           // ms
+};
+
+struct home_status {
+        uint8_t state;   // HOME_*
+        uint8_t group;
+        uint32_t err;    // library error code or PROTO_ERR_* if HOME_FAILED
+        uint32_t elapsed; // ms since homing started, until it ended
+};
+
+// Queue an axis for homing, which starts with the next poll once the groups
+// before it are homed. Axes queued while others are still queued or homing
+// join their run. Returns 0, PROTO_ERR_UNKNOWN_NODE, PROTO_ERR_BAD_ARG or
+// PROTO_ERR_NOT_ACTIVE if the axis is already queued or homing.
+uint32_t home_start(uint16_t node_id, const struct home_config *config);
+
+// Stop homing an axis, or take it out of the queue. Returns 0,
+// PROTO_ERR_NOT_ACTIVE or the library error code.
+uint32_t home_stop(void *port, uint16_t node_id);
+
+// Start the queued axes whose turn it is and check on the axes homing.
+// Meant to be registered as bus poller; returns the time in ms until the
+// next poll is due.
+int home_poll(void *port, void *ctx);
+
+// State of the homing of an axis, HOME_IDLE if it was never queued.
+void home_status(uint16_t node_id, struct home_status *status);
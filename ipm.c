@@ -0,0 +1,253 @@
+#include "ipm.h"
+#include "epos.h"
+#include "proto.h"
+#include "stats.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+#define IPM_MAX_NODES           128
+
+// feed period while no trajectory is running, and the longest one while one
+// is, in ms
+#define IPM_IDLE_PERIOD         10
+
+// fed point times remembered to estimate how long the drive buffer lasts
+#define IPM_TIMES               256
+
+struct ipm_node {
+        struct ipm_point *points; // host buffer of IPM_HOST_POINTS
+        uint32_t head;            // next point to feed (free-running)
+        uint32_t tail;            // next point to queue (free-running)
+        uint32_t capacity;        // size of the drive buffer
+        uint8_t times[IPM_TIMES]; // times of the last points fed
+        int underflow_warning;    // last state, to count rising edges
+        int underflow_error;
+        int activated;            // in IPM since ipm_activate(), polled
+        struct ipm_stats stats;
+};
+
+// only accessed by the bus thread
+static struct ipm_node *nodes[IPM_MAX_NODES];
+static uint16_t active[IPM_MAX_NODES]; // nodes activated
+static size_t nactive;
+
+// The node if it is activated, NULL otherwise.
+static struct ipm_node *ipm_node(uint16_t node_id)
+{
+        struct ipm_node *node = node_id < IPM_MAX_NODES ? nodes[node_id] :
+                                NULL;
+        return node && node->activated ? node : NULL;
+}
+
+uint32_t ipm_activate(void *port, uint16_t node_id)
+{
+        if (node_id >= IPM_MAX_NODES) {
+                return PROTO_ERR_UNKNOWN_NODE;
+        }
+
+        uint32_t err;
+        uint16_t underflow_limit = 0;
+        uint16_t overflow_limit = 0;
+        uint32_t capacity = 0;
+        if (!STAT(VCS_ActivateInterpolatedPositionMode, node_id, err,
+                  port, node_id, &err) ||
+            !STAT(VCS_ClearIpmBuffer, node_id, err, port, node_id, &err) ||
+            !STAT(VCS_GetIpmBufferParameter, node_id, err, port, node_id,
+                  &underflow_limit, &overflow_limit, &capacity, &err)) {
+                return err;
+        }
+
+        struct ipm_node *node = nodes[node_id];
+        if (!node) {
+                node = calloc(1, sizeof(*node));
+                if (!node || !(node->points = malloc(IPM_HOST_POINTS *
+                                                     sizeof(*node->points)))) {
+                        die("failed to allocate IPM buffer", 0);
+                }
+
+                nodes[node_id] = node;
+        }
+
+        if (!node->activated) {
+                node->activated = 1;
+                active[nactive++] = node_id;
+        }
+
+        node->head = 0;
+        node->tail = 0;
+        node->capacity = capacity;
+        node->stats.host_depth = 0;
+        node->stats.drive_depth = 0;
+        node->stats.running = 0;
+        return 0;
+}
+
+uint32_t ipm_push(uint16_t node_id, const struct ipm_point *points, size_t n,
+                  uint32_t *free)
+{
+        struct ipm_node *node = ipm_node(node_id);
+        if (!node) {
+                *free = 0;
+                return PROTO_ERR_NOT_ACTIVE;
+        }
+
+        *free = IPM_HOST_POINTS - (node->tail - node->head);
+        if (n > *free) {
+                return PROTO_ERR_BUFFER_FULL;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+                node->points[node->tail++ % IPM_HOST_POINTS] = points[i];
+        }
+
+        *free -= n;
+        node->stats.host_depth = node->tail - node->head;
+        return 0;
+}
+
+uint32_t ipm_start(void *port, uint16_t node_id)
+{
+        struct ipm_node *node = ipm_node(node_id);
+        if (!node) {
+                return PROTO_ERR_NOT_ACTIVE;
+        }
+
+        uint32_t err;
+        if (!STAT(VCS_StartIpmTrajectory, node_id, err, port, node_id,
+                  &err)) {
+                return err;
+        }
+
+        // followed until the feeder sees it finish
+        node->stats.running = 1;
+        return 0;
+}
+
+uint32_t ipm_stop(void *port, uint16_t node_id)
+{
+        struct ipm_node *node = ipm_node(node_id);
+        if (!node) {
+                return PROTO_ERR_NOT_ACTIVE;
+        }
+
+        node->head = node->tail;
+        node->stats.host_depth = 0;
+        node->stats.running = 0;
+        node->activated = 0;
+        for (size_t i = 0; i < nactive; i++) {
+                if (active[i] == node_id) {
+                        active[i] = active[--nactive];
+                        break;
+                }
+        }
+
+        uint32_t err;
+        if (!STAT(VCS_StopIpmTrajectory, node_id, err, port, node_id, &err) ||
+            !STAT(VCS_ClearIpmBuffer, node_id, err, port, node_id, &err)) {
+                return err;
+        }
+
+        node->stats.drive_depth = 0;
+        return 0;
+}
+
+// Top up the drive buffer of a node. Returns the time in ms until the points
+// left in the drive buffer are half used up.
+static int ipm_feed(void *port, uint16_t node_id, struct ipm_node *node)
+{
+        uint32_t err;
+        int running = 0;
+        int underflow_warning = 0;
+        int overflow_warning;
+        int velocity_warning;
+        int acceleration_warning;
+        int underflow_error = 0;
+        int overflow_error;
+        int velocity_error;
+        int acceleration_error;
+        uint32_t free = 0;
+        if (!STAT(VCS_GetIpmStatus, node_id, err, port, node_id, &running,
+                  &underflow_warning, &overflow_warning, &velocity_warning,
+                  &acceleration_warning, &underflow_error, &overflow_error,
+                  &velocity_error, &acceleration_error, &err) ||
+            !STAT(VCS_GetFreeIpmBufferSize, node_id, err, port, node_id,
+                  &free, &err)) {
+                return IPM_IDLE_PERIOD;
+        }
+
+        struct ipm_stats *stats = &node->stats;
+        stats->underflow_warnings += underflow_warning &&
+                                     !node->underflow_warning;
+        stats->underflow_errors += underflow_error && !node->underflow_error;
+        node->underflow_warning = underflow_warning;
+        node->underflow_error = underflow_error;
+        stats->running = running;
+
+        uint32_t depth = node->capacity > free ? node->capacity - free : 0;
+        uint32_t batch = node->tail - node->head;
+        if (batch > free) {
+                batch = free;
+        }
+
+        if (batch > IPM_MAX_BATCH) {
+                batch = IPM_MAX_BATCH;
+        }
+
+        for (uint32_t i = 0; i < batch; i++) {
+                const struct ipm_point *point =
+                        &node->points[node->head % IPM_HOST_POINTS];
+                if (!STAT(VCS_AddPvtValueToIpmBuffer, node_id, err, port,
+                          node_id, point->position, point->velocity,
+                          point->time, &err)) {
+                        break;
+                }
+
+                node->times[stats->fed++ % IPM_TIMES] = point->time;
+                node->head++;
+                depth++;
+        }
+
+        stats->host_depth = node->tail - node->head;
+        stats->drive_depth = depth;
+        if (!running) {
+                return IPM_IDLE_PERIOD;
+        }
+
+        // the drive buffer holds the points fed last
+        unsigned buffered = 0;
+        for (uint32_t i = 1; i <= depth && i <= IPM_TIMES && i <= stats->fed;
+             i++) {
+                buffered += node->times[(stats->fed - i) % IPM_TIMES];
+        }
+
+        int period = buffered / 2;
+        return period < 1 ? 1 : period > IPM_IDLE_PERIOD ?
+                                IPM_IDLE_PERIOD : period;
+}
+
+int ipm_poll(void *port, void *ctx)
+{
+        int period = IPM_IDLE_PERIOD;
+        for (size_t i = 0; i < nactive; i++) {
+                // nothing to feed and nothing to follow
+                struct ipm_node *node = nodes[active[i]];
+                if (node->tail == node->head && !node->stats.running) {
+                        continue;
+                }
+
+                int node_period = ipm_feed(port, active[i], node);
+                if (node_period < period) {
+                        period = node_period;
+                }
+        }
+
+        return period;
+}
+
+const struct ipm_stats *ipm_stats(uint16_t node_id)
+{
+        struct ipm_node *node = node_id < IPM_MAX_NODES ? nodes[node_id] :
+                                NULL;
+        return node ? &node->stats : NULL;
+}
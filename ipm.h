@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming of PVT points into the interpolated position mode (IPM) buffer of
+// the nodes.
+//
+// The IPM buffer of a drive only holds a few dozen points, which is too little
+// to ride out the latency of a client connection. Clients therefore queue
+// their points in a much larger host-side buffer per node, from which the
+// feeder (a bus poller) keeps the drive buffer topped up, moving several
+// points per wake-up. It wakes up again before the points in the drive buffer
+// are used up, so the trajectory only stops with an underflow if the client
+// itself falls behind.
+//
+// All functions must only be used by the bus thread.
+
+// points queued on the host per node
+#define IPM_HOST_POINTS         4096
+
+// points moved into the drive buffer of a node per wake-up at most
+#define IPM_MAX_BATCH           16
+
+struct ipm_point {
+        int32_t position; // inc
+        int32_t velocity; // rpm
+        uint8_t time;     // ms until the next point
+};
+
+struct ipm_stats {
+        uint32_t host_depth;         // points queued on the host
+        uint32_t drive_depth;        // points in the drive buffer
+        uint32_t fed;                // points moved into the drive buffer
+        uint32_t underflow_warnings; // times the drive buffer ran low
+        uint32_t underflow_errors;   // times the drive buffer ran empty
+        uint8_t running;             // trajectory is being executed
+};
+
+// Switch a node to IPM and clear its buffers. Returns 0 or the library error
+// code.
+uint32_t ipm_activate(void *port, uint16_t node_id);
+
+// Queue points for a node. Either all points are queued or, if they do not
+// fit, none. free receives the number of points that can still be queued, so
+// clients can pace themselves. Returns 0, PROTO_ERR_BUFFER_FULL or
+// PROTO_ERR_NOT_ACTIVE.
+uint32_t ipm_push(uint16_t node_id, const struct ipm_point *points, size_t n,
+                  uint32_t *free);
+
+// Start executing the points in the drive buffer. Returns 0 or the library
+// error code.
+uint32_t ipm_start(void *port, uint16_t node_id);
+
+// Stop the trajectory, discard all queued points and stop feeding the node
+// until it is activated again. Returns 0, PROTO_ERR_NOT_ACTIVE or the library
+// error code.
+uint32_t ipm_stop(void *port, uint16_t node_id);
+
+// Feed the drive buffers of all nodes in IPM which have points queued or a
+// trajectory running. Meant to be registered as bus poller; returns the time
+// in ms until the next feed is due.
+int ipm_poll(void *port, void *ctx);
+
+// Current state of a node's buffers, NULL if the node was never switched to
+// IPM.
+const struct ipm_stats *ipm_stats(uint16_t node_id);
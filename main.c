@@ -1,13 +1,29 @@
-#include "deps/Definitions.h"
+#include "epos.h"
+#include "bus.h"
+#include "busload.h"
+#include "comm.h"
+#include "cycle.h"
+#include "discovery.h"
+#include "home.h"
+#include "evlog.h"
+#include "fault.h"
+#include "ipm.h"
+#include "mark.h"
+#include "nodes.h"
+#include "od.h"
+#include "pdo.h"
+#include "rec.h"
+#include "sdo.h"
+#include "shm.h"
+#include "socketcan.h"
+#include "stats.h"
+#include "udp.h"
+#include "util.h"
 #include "settings.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <errno.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <netinet/in.h>
 
 // Open a communication port to TX/RX to/from the CAN bus.
 void *port_open(void);
@@ -18,46 +34,171 @@ void port_close(void *port);
 // Set port settings like baudrate and timeout.
 void port_configure(void *port);
 
+// Find the port and the nodes on the bus (see discovery.h) and keep only the
+// nodes found in the node table, adding those not listed without a name.
+// Returns the port opened and configured and sets recovery to the settings it
+// was found with.
+void *port_discover(struct node_table *nodes, struct fault_port *recovery);
+
 // Reset node, i.e. change NMT state to pre-operational
 // (see https://www.can-cia.org/can-knowledge/canopen/network-management/ for
 // details).
 void node_reset(void *port, uint16_t node_id);
 
-// Configure node parameters by writing parameters to object dictionary.
-// Parameters configured are mode-independent parameters like motor type and
-// number of pole pairs and sensor configuration.
-void node_configure(void *port, uint16_t node_id);
+// Configure the mode-independent parameters of all nodes, like motor type and
+// number of pole pairs, from the settings. The current values are read back
+// from all nodes in one batched pass and only those which differ are written
+// (all of them on a node whose motor type differs) and stored in non-volatile
+// memory, so a restart with unchanged settings only costs the reads.
+void nodes_configure(void *port, struct sdo *sdo, const uint16_t *node_ids,
+                     size_t nnodes);
+
+// Map telemetry into TPDOs and setpoints into RPDOs (see pdo.h) on all nodes
+// as enabled in the settings and switch the nodes to NMT operational so they
+// start transmitting and accepting them.
+void nodes_start_pdo(void *port, struct sdo *sdo, const uint16_t *node_ids,
+                     size_t nnodes);
+
+// Load the node table from path. If optional, a missing or empty table is
+// fine.
+void nodes_open(struct node_table *nodes, const char *path, int optional);
+
+// Open a raw socket on the SocketCAN interface.
+struct can_sock *can_open_interface(void);
+
+// Open a raw socket on the SocketCAN interface which is only sent on. It
+// receives nothing, so the kernel does not queue every frame on the bus for
+// it.
+struct can_sock *can_open_sender(void);
 
 // Test a node by entering profile velocity mode (PVM) and setting the target
 // velocity to 1rpm.
 void node_test_1rpm(void *port, uint16_t node_id);
 
-// start listening for and accepting incoming TCP connections and forwarding
-// commands to the EPOS
-void comm_start(void);
-
-// receive commands for connection until closed
-void comm_loop_enter(int server_fd, int client_fd);
-
 // utility functions
 void driver_info_dump(void);
-void die(const char *what, uint32_t err);
 
 int main(int argc, char *argv[])
 {
+        evlog_open(EVLOG_PATH);
+        busload_init(BAUDRATE, BUSLOAD_THRESHOLD);
         driver_info_dump();
 
-        /* void *port = port_open(); */
-        /* port_configure(port); */
+        // the node table can be passed as the only argument
+        static struct node_table nodes;
+        nodes_open(&nodes, argc > 1 ? argv[1] : NODES_FILE, DISCOVERY);
+
+        if (OD_SHADOW) {
+                od_init(OD_VOLATILE, sizeof(OD_VOLATILE) /
+                                     sizeof(OD_VOLATILE[0]));
+        }
+
+        // a failed port is opened again as it was opened now
+        struct fault_port recovery = {
+                .device = DEV_NAME,
+                .protocol = PROTO_NAME,
+                .interface = IF_NAME,
+                .port = PORT_NAME,
+                .baudrate = BAUDRATE,
+                .timeout = TIMEOUT,
+                .probe_timeout = RECOVERY_TIMEOUT,
+        };
+
+        void *port;
+        if (DISCOVERY) {
+                port = port_discover(&nodes, &recovery);
+        } else {
+                port = port_open();
+                port_configure(port);
+        }
+
+        uint16_t node_ids[NODES_MAX];
+        nodes_ids(&nodes, node_ids);
+
+        // SDO transfers to different nodes only overlap on their own socket,
+        // this one receives TPDOs if any
+        struct can_sock *can = !SOCKETCAN ? NULL : TELEMETRY_PDO ?
+                               can_open_interface() : can_open_sender();
+        struct sdo *sdo = sdo_create(port,
+                                     SOCKETCAN ? can_open_interface() : NULL,
+                                     node_ids, nodes.n, TIMEOUT);
+        if (CONFIGURE_NODES) {
+                nodes_configure(port, sdo, node_ids, nodes.n);
+        }
+
+        // from here on only the bus thread uses the port
+        struct bus *bus = bus_create(port, sdo,
+                                     NET_MAX_CONNS * COMM_MAX_INFLIGHT +
+                                     SHM * SHM_MAX_CONNS * SHM_MAX_INFLIGHT +
+                                     UDP_MAX_INFLIGHT);
+        bus_set_nodes(bus, node_ids, nodes.n);
+        if (RECOVERY) {
+                bus_set_recovery(bus, &recovery);
+        }
+
+        // SYNC-driven TPDOs are admitted against the rate of its SYNC
+        if (CYCLE) {
+                if (!SOCKETCAN) {
+                        die("the cycle thread needs SOCKETCAN", 0);
+                }
+
+                const struct cycle_config cycle_config = {
+                        .period_us = CYCLE_PERIOD_US,
+                        .priority = CYCLE_PRIORITY,
+                        .cpu = CYCLE_CPU,
+                };
+                cycle_start(can_open_sender(), &cycle_config);
+        }
+
+        if (TELEMETRY_PDO || SETPOINT_PDO) {
+                nodes_start_pdo(port, sdo, node_ids, nodes.n);
+        }
+
+        if (TELEMETRY_PDO) {
+                if (can && pdo_can_filter(can) == -1) {
+                        die("failed to set CAN filter", 0);
+                }
+
+                bus_add_poller(bus, pdo_poll, can);
+        }
+
+        // idles until a node is switched to IPM
+        bus_add_poller(bus, ipm_poll, NULL);
 
-        /* node_reset(port, NODE_ID); */
-        // not needed since all parameters are stored in non-volatile memory
-        // node_configure(port, NODE_ID);
+        // idles until a recorder is armed
+        bus_add_poller(bus, rec_poll, NULL);
 
-        /* node_test_1rpm(port, NODE_ID); */
-        comm_start();
+        // idles until an axis is queued for homing
+        bus_add_poller(bus, home_poll, NULL);
 
-        /* port_close(port); */
+        // idles until a position marker is armed
+        bus_add_poller(bus, mark_poll, NULL);
+
+        if (can) {
+                bus_set_can(bus, can);
+        }
+
+        bus_start(bus);
+
+        if (SHM) {
+                const struct shm_config shm_config = {
+                        .path = SHM_PATH,
+                        .max_conns = SHM_MAX_CONNS,
+                };
+                shm_start(bus, &shm_config);
+        }
+
+        const struct comm_config comm_config = {
+                .port = RECV_PORT,
+                .udp_port = UDP_PORT,
+                .udp_timeout_ms = UDP_WATCHDOG_MS,
+                .udp_stop_op = UDP_WATCHDOG_STOP,
+                .backlog = NET_BACKLOG,
+                .max_conns = NET_MAX_CONNS,
+        };
+        comm_start(bus, &comm_config);
+
+        port_close(port);
         return 0;
 }
 
@@ -68,8 +209,8 @@ void *port_open(void)
                " port '%s'...\n", DEV_NAME, PROTO_NAME, IF_NAME, PORT_NAME);
 
         uint32_t err;
-        void *port = VCS_OpenDevice(DEV_NAME, PROTO_NAME, IF_NAME, PORT_NAME,
-                                    &err);
+        void *port = STAT(VCS_OpenDevice, 0, err, DEV_NAME, PROTO_NAME,
+                          IF_NAME, PORT_NAME, &err);
         if (!port) {
                 die("failed to open port", err);
         }
@@ -83,7 +224,7 @@ void port_close(void *port)
         printf("closing port 0x%p...\n", port);
 
         uint32_t err;
-        if (!VCS_CloseDevice(port, &err)) {
+        if (!STAT(VCS_CloseDevice, 0, err, port, &err)) {
                 die("failed to close port", err);
         }
 }
@@ -94,155 +235,322 @@ void port_configure(void *port)
                BAUDRATE / 1000, TIMEOUT);
 
         uint32_t err;
-        if (!VCS_SetProtocolStackSettings(port, BAUDRATE, TIMEOUT, &err)) {
+        if (!STAT(VCS_SetProtocolStackSettings, 0, err, port, BAUDRATE,
+                  TIMEOUT, &err)) {
                 die("failed to set port settings",
                     err);
         }
 }
 
+void *port_discover(struct node_table *nodes, struct fault_port *recovery)
+{
+        printf("discovering port and nodes...\n");
+
+        const struct discovery_config config = {
+                .device = DEV_NAME,
+                .protocol = PROTO_NAME,
+                .interface = IF_NAME,
+                .port = PORT_NAME,
+                .baudrate = BAUDRATE,
+                .probe_timeout = DISCOVERY_TIMEOUT,
+                .timeout = TIMEOUT,
+                .cache = DISCOVERY_CACHE,
+                .can = SOCKETCAN ? can_open_interface() : NULL,
+        };
+
+        static struct discovery found;
+        void *port = discover(&config, &found);
+        if (config.can) {
+                can_close(config.can);
+        }
+
+        if (!port) {
+                die("no node answered on any port", 0);
+        }
+
+        printf("|-> port opened: handle=0x%p\n", port);
+        busload_init(found.baudrate, BUSLOAD_THRESHOLD);
+        recovery->device = found.device;
+        recovery->protocol = found.protocol;
+        recovery->interface = found.interface;
+        recovery->port = found.port;
+        recovery->baudrate = found.baudrate;
+
+        static struct node_table listed;
+        listed = *nodes;
+        nodes->n = 0;
+        for (size_t i = 0; i < found.n; i++) {
+                const struct discovery_node *node = &found.nodes[i];
+                const char *name = "";
+                for (size_t k = 0; k < listed.n; k++) {
+                        if (listed.nodes[k].id == node->id) {
+                                name = listed.nodes[k].name;
+                        }
+                }
+
+                nodes_add(nodes, node->id, name);
+                printf("|-> node %u '%s': hardware 0x%04x, software 0x%04x\n",
+                       node->id, name, node->hardware, node->software);
+        }
+
+        for (size_t k = 0; k < listed.n; k++) {
+                int answered = 0;
+                for (size_t i = 0; i < found.n; i++) {
+                        answered |= found.nodes[i].id == listed.nodes[k].id;
+                }
+
+                if (!answered) {
+                        printf("|-> node %u '%s' did not answer, dropped\n",
+                               listed.nodes[k].id, listed.nodes[k].name);
+                }
+        }
+
+        return port;
+}
+
 void node_reset(void *port, uint16_t node_id)
 {
         printf("resetting node %u...\n", node_id);
         uint32_t err;
-        if (!VCS_SendNMTService(port, node_id, NCS_RESET_NODE, &err)) {
+        if (!STAT(VCS_SendNMTService, node_id, err, port, node_id,
+                  NCS_RESET_NODE, &err)) {
                 die("failed to reset node", err);
         }
+
+        od_invalidate(node_id);
 }
 
-void node_configure(void *port, uint16_t node_id)
+// motor setting written by nodes_configure()
+struct node_param {
+        const char *name;
+        struct cob_id cob_id;
+        uint32_t value;
+        uint8_t size;
+};
+
+static uint32_t param_decode(const uint8_t *data, uint8_t size)
 {
-        printf("configuring node %u...\n", node_id);
+        uint32_t value = 0;
+        for (uint8_t i = 0; i < size; i++) {
+                value |= (uint32_t)data[i] << (8 * i);
+        }
 
-        printf("|-> configuring motor parameters...\n");
+        return value;
+}
 
-        uint32_t err;
-        uint32_t bytes_written;
-        if (!VCS_SetMotorType(port, node_id, MOTOR_TYPE, &err) ||
-            !VCS_SetDcMotorParameterEx(port, node_id, NOMINAL_CURRENT,
-                                       OUTPUT_CURRENT_LIMIT,
-                                       THERMAL_TIME_CONSTANT,
-                                       &err) ||
-            !VCS_SetObject(port, node_id, COB_ID_MAX_MOTOR_SPEED.id,
-                           COB_ID_MAX_MOTOR_SPEED.sid,
-                           &MAX_MOTOR_SPEED, sizeof(MAX_MOTOR_SPEED),
-                           &bytes_written, &err) ||
-            !VCS_SetObject(port, node_id, COB_ID_MAX_GEAR_INPUT_SPEED.id,
-                           COB_ID_MAX_GEAR_INPUT_SPEED.sid,
-                           &MAX_GEAR_INPUT_SPEED, sizeof(MAX_GEAR_INPUT_SPEED),
-                           &bytes_written, &err)) {
-                die("failed to configure motor", err);
-        }
-
-        printf("|-> configured motor with MOTOR_TYPE=%d, NOMINAL_CURRENT=%d, "
-               "OUTPUT_CURRENT_LIMIT=%d, THERMAL_TIME_CONSTANT_WINDING=%d, "
-               "NUMBER_OF_POLE_PAIRS=%d, MAX_MOTOR_SPEED=%d, "
-               "MAX_GEAR_INPUT_SPEED=%d\n", MOTOR_TYPE, NOMINAL_CURRENT,
-               OUTPUT_CURRENT_LIMIT, THERMAL_TIME_CONSTANT,
-               NUMBER_OF_POLE_PAIRS, MAX_MOTOR_SPEED, MAX_GEAR_INPUT_SPEED);
-
-        if (MOTOR_TYPE == MT_EC_BLOCK_COMMUTATED_MOTOR ||
-            MOTOR_TYPE == MT_EC_SINUS_COMMUTATED_MOTOR) {
-                // brushless DC (EC) motor for which the number of pole pairs
-                // needs to be configured as well
-                printf("|-> using brushless DC motor - setting "
-                       "NUMBER_OF_POLE_PAIRS=%d...\n", NUMBER_OF_POLE_PAIRS);
-                if (!VCS_SetObject(port, node_id,
-                                   COB_ID_NUMBER_OF_POLE_PAIRS.id,
-                                   COB_ID_NUMBER_OF_POLE_PAIRS.sid,
-                                   &NUMBER_OF_POLE_PAIRS,
-                                   sizeof(NUMBER_OF_POLE_PAIRS),
-                                   &bytes_written, &err)) {
-                        die("failed to set NUMBER_OF_POLE_PAIRS", err);
+void nodes_configure(void *port, struct sdo *sdo, const uint16_t *node_ids,
+                     size_t nnodes)
+{
+        printf("configuring %zu nodes...\n", nnodes);
+
+        const struct node_param params[] = {
+#define PARAM(name) { #name, COB_ID_##name, name, sizeof(name) }
+                // first, since changing it may reset the motor data, which
+                // is then written whatever was read
+                PARAM(MOTOR_TYPE),
+                PARAM(NOMINAL_CURRENT),
+                PARAM(OUTPUT_CURRENT_LIMIT),
+                PARAM(THERMAL_TIME_CONSTANT),
+                PARAM(MAX_MOTOR_SPEED),
+                PARAM(MAX_GEAR_INPUT_SPEED),
+                // only brushless DC (EC) motors have pole pairs
+                PARAM(NUMBER_OF_POLE_PAIRS),
+#undef PARAM
+        };
+        size_t nparams = sizeof(params) / sizeof(params[0]);
+        if (MOTOR_TYPE != MT_EC_BLOCK_COMMUTATED_MOTOR &&
+            MOTOR_TYPE != MT_EC_SINUS_COMMUTATED_MOTOR) {
+                nparams--;
+        }
+
+        size_t n = nnodes * nparams;
+        struct sdo_req *reads = calloc(n, sizeof(*reads));
+        struct sdo_req *writes = calloc(n, sizeof(*writes));
+        uint8_t *changed = calloc(nnodes, 1);
+        if (!reads || !writes || !changed) {
+                die("failed to allocate node configuration", 0);
+        }
+
+        for (size_t i = 0; i < n; i++) {
+                const struct node_param *param = &params[i % nparams];
+                reads[i] = (struct sdo_req){
+                        .node = node_ids[i / nparams],
+                        .upload = 1,
+                        .index = param->cob_id.id,
+                        .subindex = param->cob_id.sid,
+                        .len = param->size,
+                };
+        }
+
+        uint64_t start = now_ns();
+        sdo_transfer(sdo, reads, n, 0);
+        uint64_t read_ns = now_ns() - start;
+
+        size_t nwrites = 0;
+        int retyped = 0;
+        for (size_t i = 0; i < n; i++) {
+                const struct sdo_req *read = &reads[i];
+                const struct node_param *param = &params[i % nparams];
+                if (read->err) {
+                        printf("|-> node %u: failed to read %s\n", read->node,
+                               param->name);
+                        die("failed to read node configuration", read->err);
+                }
+
+                // the motor data read may be reset by the new motor type, so
+                // all of it is written then
+                uint32_t value = param_decode(read->data, read->len);
+                if (i % nparams == 0) {
+                        retyped = value != param->value;
                 }
 
+                if (value == param->value && !retyped) {
+                        continue;
+                }
+
+                printf("|-> node %u: %s %u -> %u\n", read->node, param->name,
+                       value, param->value);
+                struct sdo_req *write = &writes[nwrites++];
+                *write = *read;
+                write->upload = 0;
+                write->len = param->size;
+                for (uint8_t byte = 0; byte < param->size; byte++) {
+                        write->data[byte] = param->value >> (8 * byte);
+                }
+
+                changed[i / nparams] = 1;
         }
 
-        uint16_t data;
-        uint32_t bytes_read;
-        if (!VCS_GetObject(port, node_id, 0x2200, 0x1, &data, sizeof(data),
-                           &bytes_read, &err)) {
-                die("failed to get position must", err);
+        start = now_ns();
+        sdo_transfer(sdo, writes, nwrites, SDO_STOP_ON_ERROR);
+        uint64_t write_ns = now_ns() - start;
+        for (size_t i = 0; i < nwrites; i++) {
+                if (writes[i].err) {
+                        printf("|-> node %u: failed to write object "
+                               "0x%04x/0x%02x\n", writes[i].node,
+                               writes[i].index, writes[i].subindex);
+                        die("failed to write node configuration",
+                            writes[i].err);
+                }
         }
 
-        printf("%u\n", data);
+        // storing takes the node a while and wears out its flash, so it is
+        // only done if something changed
+        start = now_ns();
+        size_t nstored = 0;
+        for (size_t i = 0; i < nnodes; i++) {
+                uint32_t err;
+                if (!changed[i]) {
+                        continue;
+                } else if (!STAT(VCS_Store, node_ids[i], err, port,
+                                 node_ids[i], &err)) {
+                        die("failed to store node configuration", err);
+                }
+
+                nstored++;
+        }
+
+        uint64_t store_ns = now_ns() - start;
+        printf("|-> read %zu parameters in %.1fms, wrote %zu in %.1fms, "
+               "stored %zu nodes in %.1fms\n", n, read_ns / 1e6, nwrites,
+               write_ns / 1e6, nstored, store_ns / 1e6);
+
+        free(reads);
+        free(writes);
+        free(changed);
 }
 
-void node_test_1rpm(void *port, uint16_t node_id)
+void nodes_start_pdo(void *port, struct sdo *sdo, const uint16_t *node_ids,
+                     size_t nnodes)
 {
+        printf("starting process data on %zu nodes...\n", nnodes);
+
         uint32_t err;
-        if (!VCS_ActivateVelocityMode(port, node_id, &err)) {
-                die("failed to set operational mode to PVM", err);
+        if (TELEMETRY_PDO &&
+            (err = pdo_configure(sdo, node_ids, nnodes, TPDO_MAPS,
+                                 sizeof(TPDO_MAPS) / sizeof(TPDO_MAPS[0])))) {
+                die("failed to configure TPDOs", err);
         }
 
-        // 10'000rpm/s
-        if (!VCS_SetVelocityProfile(port, node_id, 1, 1, &err)) {
-                die("failed to set velocity profile", err);
+        if (SETPOINT_PDO &&
+            (err = pdo_configure_rx(sdo, node_ids, nnodes, RPDO_MAPS,
+                                    sizeof(RPDO_MAPS) / sizeof(RPDO_MAPS[0])))) {
+                die("failed to configure RPDOs", err);
         }
 
-        // move with 1rpm
-        if (!VCS_MoveWithVelocity(port, node_id, 1, &err)) {
-                die("failed to move with target velocity", err);
+        // NMT commands are not confirmed, so this costs no round trips
+        for (size_t i = 0; i < nnodes; i++) {
+                if (!STAT(VCS_SendNMTService, node_ids[i], err, port,
+                          node_ids[i], NCS_START_REMOTE_NODE, &err)) {
+                        die("failed to start node", err);
+                }
         }
 }
 
-void comm_loop_enter(int server_fd, int client_fd)
+void nodes_open(struct node_table *nodes, const char *path, int optional)
 {
-        uint8_t buf[NET_BUF_SIZE];
-        ssize_t nread = 1;
-        while (nread != 0 && nread != -1) {
-                nread = read(client_fd, buf, sizeof(buf));
-                printf("received %ld bytes: [", nread);
-                for (size_t i = 0; i < nread; i++) {
-                        if (i > 0)
-                                printf(", ");
-                        printf("0x%x", buf[i]);
+        printf("loading node table '%s'...\n", path);
+
+        if (nodes_load(nodes, path) == -1) {
+                if (optional && errno == ENOENT) {
+                        printf("|-> not found, nodes are left unnamed\n");
+                        return;
                 }
-                printf("]\n");
+
+                perror("|-> nodes_load");
+                die("failed to load node table", 0);
+        } else if (nodes->n == 0 && !optional) {
+                die("node table is empty", 0);
+        }
+
+        for (size_t i = 0; i < nodes->n; i++) {
+                printf("|-> node %u '%s'\n", nodes->nodes[i].id,
+                       nodes->nodes[i].name);
         }
 }
 
-void comm_start(void)
+struct can_sock *can_open_interface(void)
 {
-        printf("entering communication loop...\n");
+        printf("opening SocketCAN interface '%s'...\n", CAN_IF_NAME);
 
-        int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_fd == -1) {
-                die("failed to instantiate sockfd", 0);
+        struct can_sock *can = can_open(CAN_IF_NAME);
+        if (!can) {
+                perror("|-> can_open");
+                die("failed to open SocketCAN interface", 0);
         }
 
-        printf("|-> created socket with sockfd=%d\n", server_fd);
+        return can;
+}
 
-        const int enable = 1;
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT,
-                       &enable, sizeof(enable)) == -1) {
-                die("failed to set socket options", 0);
+struct can_sock *can_open_sender(void)
+{
+        struct can_sock *can = can_open_interface();
+        if (can_filter(can, NULL, 0) == -1) {
+                perror("|-> can_filter");
+                die("failed to set CAN filter", 0);
         }
 
-        const struct sockaddr_in sockaddr = {
-                .sin_addr.s_addr = INADDR_ANY,
-                .sin_family = AF_INET,
-                .sin_port = htons(RECV_PORT),
-        };
+        return can;
+}
 
-        if (bind(server_fd, &sockaddr, sizeof(sockaddr)) == -1) {
-                die("failed to bind socket", 0);
+void node_test_1rpm(void *port, uint16_t node_id)
+{
+        uint32_t err;
+        if (!STAT(VCS_ActivateVelocityMode, node_id, err, port, node_id,
+                  &err)) {
+                die("failed to set operational mode to PVM", err);
         }
 
-        if (listen(server_fd, 1) == -1) {
-                die("failed to put socket in listen mode", 0);
+        // 10'000rpm/s
+        if (!STAT(VCS_SetVelocityProfile, node_id, err, port, node_id, 1, 1,
+                  &err)) {
+                die("failed to set velocity profile", err);
         }
 
-        while (1) {
-                struct sockaddr_in client_addr;
-                socklen_t client_addr_len;
-                printf("listening for new connection...\n");
-                int client_fd = accept(server_fd, &client_addr, &client_addr_len);
-                if (client_fd == -1) {
-                        die("failed to accept connection", 0);
-                }
-
-                printf("accepted new connection with client_fd=%d\n", client_fd);
-                comm_loop_enter(server_fd, client_fd);
+        // move with 1rpm
+        if (!STAT(VCS_MoveWithVelocity, node_id, err, port, node_id, 1,
+                  &err)) {
+                die("failed to move with target velocity", err);
         }
 }
 
@@ -254,26 +562,10 @@ void driver_info_dump(void)
         char lib_version[MAX_STR_SIZE];
 
         uint32_t err;
-        if (!VCS_GetDriverInfo(lib_name, MAX_STR_SIZE,
-                               lib_version, MAX_STR_SIZE, &err)) {
+        if (!STAT(VCS_GetDriverInfo, 0, err, lib_name, MAX_STR_SIZE,
+                  lib_version, MAX_STR_SIZE, &err)) {
                 die("failed to get driver information", err);
         }
 
         printf("driver name='%s' (version '%s')\n", lib_name, lib_version);
 }
-
-void die(const char *what, uint32_t err)
-{
-        fprintf(stderr, "|-> %s: 0x%x", what, err);
-
-        if (err != 0) {
-                char err_info[MAX_STR_SIZE];
-                if (VCS_GetErrorInfo(err, err_info, MAX_STR_SIZE)) {
-                        fprintf(stderr, " (%s)", err_info);
-                }
-        }
-
-        fprintf(stderr, "\n");
-        exit(err);
-}
-
@@ -0,0 +1,278 @@
+#include "mark.h"
+#include "epos.h"
+#include "proto.h"
+#include "stats.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MARK_MAX_NODES          128
+
+// poll period while a marker is armed but nothing was captured last round,
+// and while none is, in ms; every armed marker costs one SDO transfer per
+// poll, plus two per position read
+#define MARK_POLL_PERIOD        10
+#define MARK_IDLE_PERIOD        100
+
+// positions read per node and round at most, the rest is read next round
+#define MARK_MAX_READS          (2 * MARK_HISTORY)
+
+struct mark_node {
+        struct mark_config config;
+        struct mark_status status;
+        uint8_t compare_output;
+        uint8_t compare_armed;
+        uint32_t nevents; // events ever stored, the last MARK_EVENTS are kept
+        struct mark_event events[MARK_EVENTS];
+};
+
+// only accessed by the bus thread
+static struct mark_node *nodes[MARK_MAX_NODES];
+static uint16_t active[MARK_MAX_NODES];
+static size_t nactive;
+
+static struct mark_node *mark_node(uint16_t node_id)
+{
+        if (node_id >= MARK_MAX_NODES) {
+                return NULL;
+        }
+
+        struct mark_node *node = nodes[node_id];
+        if (!node) {
+                node = calloc(1, sizeof(*node));
+                if (!node) {
+                        die("failed to allocate position marker", 0);
+                }
+
+                nodes[node_id] = node;
+                active[nactive++] = node_id;
+        }
+
+        return node;
+}
+
+uint32_t mark_arm(void *port, uint16_t node_id,
+                  const struct mark_config *config)
+{
+        struct mark_node *node = mark_node(node_id);
+        if (!node) {
+                return PROTO_ERR_UNKNOWN_NODE;
+        }
+
+        uint32_t err;
+        if (node->status.armed) {
+                node->status.armed = 0;
+                if (!STAT(VCS_DeactivatePositionMarker, node_id, err, port,
+                          node_id, node->config.input, &err)) {
+                        return err;
+                }
+        }
+
+        if (!STAT(VCS_SetPositionMarkerParameter, node_id, err, port, node_id,
+                  config->edge, config->mode, &err) ||
+            !STAT(VCS_ActivatePositionMarker, node_id, err, port, node_id,
+                  config->input, config->polarity, &err) ||
+            !STAT(VCS_ResetPositionMarkerCounter, node_id, err, port,
+                  node_id, &err)) {
+                return err;
+        }
+
+        node->config = *config;
+        node->status.armed = 1;
+        node->status.count = 0;
+        node->status.err = 0;
+        return 0;
+}
+
+uint32_t mark_disarm(void *port, uint16_t node_id)
+{
+        struct mark_node *node = node_id < MARK_MAX_NODES ? nodes[node_id] :
+                                 NULL;
+        if (!node || !node->status.armed) {
+                return PROTO_ERR_NOT_ACTIVE;
+        }
+
+        uint32_t err;
+        if (!STAT(VCS_DeactivatePositionMarker, node_id, err, port, node_id,
+                  node->config.input, &err)) {
+                return err;
+        }
+
+        node->status.armed = 0;
+        return 0;
+}
+
+uint32_t mark_compare(void *port, uint16_t node_id,
+                      const struct mark_compare *config)
+{
+        struct mark_node *node = mark_node(node_id);
+        if (!node) {
+                return PROTO_ERR_UNKNOWN_NODE;
+        }
+
+        uint32_t err;
+        if (!STAT(VCS_SetPositionCompareParameter, node_id, err, port, node_id,
+                  config->mode, config->interval_mode, config->direction,
+                  config->interval_width, config->repetitions,
+                  config->pulse_width, &err) ||
+            !STAT(VCS_SetPositionCompareReferencePosition, node_id, err, port,
+                  node_id, config->reference, &err) ||
+            !STAT(VCS_ActivatePositionCompare, node_id, err, port, node_id,
+                  config->output, config->polarity, &err) ||
+            !STAT(VCS_EnablePositionCompare, node_id, err, port, node_id,
+                  &err)) {
+                return err;
+        }
+
+        node->compare_output = config->output;
+        node->compare_armed = 1;
+        return 0;
+}
+
+uint32_t mark_compare_off(void *port, uint16_t node_id)
+{
+        struct mark_node *node = node_id < MARK_MAX_NODES ? nodes[node_id] :
+                                 NULL;
+        if (!node || !node->compare_armed) {
+                return PROTO_ERR_NOT_ACTIVE;
+        }
+
+        uint32_t err;
+        if (!STAT(VCS_DisablePositionCompare, node_id, err, port, node_id,
+                  &err) ||
+            !STAT(VCS_DeactivatePositionCompare, node_id, err, port, node_id,
+                  node->compare_output, &err)) {
+                return err;
+        }
+
+        node->compare_armed = 0;
+        return 0;
+}
+
+static void mark_store(struct mark_node *node, int32_t position,
+                       uint64_t now)
+{
+        node->events[node->nevents++ % MARK_EVENTS] = (struct mark_event){
+                .seq = node->status.next++,
+                .position = position,
+                .time = now,
+        };
+}
+
+// Read the positions a node captured since the last round. Returns whether
+// the counter moved.
+static int mark_capture(void *port, uint16_t node_id, struct mark_node *node,
+                        uint64_t now)
+{
+        struct mark_status *status = &node->status;
+        uint16_t count;
+        uint32_t err;
+        if (!STAT(VCS_ReadPositionMarkerCounter, node_id, err, port, node_id,
+                  &count, &err)) {
+                status->err = err;
+                return 0;
+        } else if (count == status->count) {
+                return 0;
+        }
+
+        // every position is read between two reads of the counter, which
+        // tell which capture it is unless another one came in between; then
+        // it is read again, further back in the history
+        for (unsigned reads = 0;
+             reads < MARK_MAX_READS && count != status->count; reads++) {
+                // index 0 is the latest capture
+                uint16_t index = count - status->count - 1;
+                if (index >= MARK_HISTORY) {
+                        uint16_t overwritten = index - (MARK_HISTORY - 1);
+                        status->lost += overwritten;
+                        status->next += overwritten;
+                        status->count += overwritten;
+                        index = MARK_HISTORY - 1;
+                }
+
+                long position;
+                uint16_t after;
+                if (!STAT(VCS_ReadPositionMarkerCapturedPosition, node_id,
+                          err, port, node_id, index, &position, &err) ||
+                    !STAT(VCS_ReadPositionMarkerCounter, node_id, err, port,
+                          node_id, &after, &err)) {
+                        status->err = err;
+                        return 1;
+                }
+
+                if (after == count) {
+                        mark_store(node, position, now);
+                        status->count++;
+                }
+
+                count = after;
+        }
+
+        return 1;
+}
+
+int mark_poll(void *port, void *ctx)
+{
+        int period = MARK_IDLE_PERIOD;
+        uint64_t now = now_ns();
+        for (size_t i = 0; i < nactive; i++) {
+                struct mark_node *node = nodes[active[i]];
+                if (!node->status.armed) {
+                        continue;
+                }
+
+                if (mark_capture(port, active[i], node, now)) {
+                        period = MARK_FAST_PERIOD;
+                } else if (period > MARK_POLL_PERIOD) {
+                        period = MARK_POLL_PERIOD;
+                }
+        }
+
+        return period;
+}
+
+int mark_read(uint16_t node_id, uint32_t cursor, struct mark_event *events,
+              size_t max, uint32_t *next, uint32_t *lost)
+{
+        const struct mark_node *node = node_id < MARK_MAX_NODES ?
+                                       nodes[node_id] : NULL;
+        if (!node) {
+                return -1;
+        }
+
+        if (cursor > node->status.next) {
+                cursor = node->status.next;
+        }
+
+        // events are stored in sequence order, those past the cursor are
+        // found from the newest back
+        uint32_t first = node->nevents > MARK_EVENTS ?
+                         node->nevents - MARK_EVENTS : 0;
+        uint32_t i = node->nevents;
+        while (i > first && node->events[(i - 1) % MARK_EVENTS].seq >= cursor) {
+                i--;
+        }
+
+        size_t n = node->nevents - i < max ? node->nevents - i : max;
+        for (size_t j = 0; j < n; j++) {
+                events[j] = node->events[(i + j) % MARK_EVENTS];
+        }
+
+        *next = i + n < node->nevents ?
+                node->events[(i + n) % MARK_EVENTS].seq : node->status.next;
+        *lost = *next - cursor - n;
+        return n;
+}
+
+void mark_status(uint16_t node_id, struct mark_status *status)
+{
+        const struct mark_node *node = node_id < MARK_MAX_NODES ?
+                                       nodes[node_id] : NULL;
+        if (!node) {
+                memset(status, 0, sizeof(*status));
+                return;
+        }
+
+        *status = node->status;
+}
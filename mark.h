@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Capture of positions by the position marker (probe) inputs and position
+// compare outputs of the drives.
+//
+// A drive latches the position when an edge arrives on the digital input of
+// its position marker and counts the captures, but only keeps the last
+// MARK_HISTORY captured positions. The poller reads the counter of every
+// armed node each round and then only the positions captured since the last
+// round, oldest first, into a ring of events per node. While captures come
+// in, it comes back after MARK_FAST_PERIOD ms, so up to MARK_HISTORY captures
+// per fast period are kept; any more captured between two rounds are lost
+// and counted.
+//
+// Every capture gets a sequence number, lost ones included, so any number of
+// clients can follow the events of a node with cursors of their own and see
+// the gaps. Clients subscribe by keeping a tagged OP_MARK_WAIT in flight,
+// which is held back until there are events past its cursor (see
+// proto_wait()).
+//
+// Position compare outputs switch on their own once configured, so they are
+// only armed and disarmed here.
+//
+// All functions must only be used by the bus thread.
+
+// positions kept by a drive, the latest and two before it
+#define MARK_HISTORY            3
+
+// poll period while captures come in, in ms
+#define MARK_FAST_PERIOD        2
+
+// events kept per node
+#define MARK_EVENTS             1024
+
+struct mark_config {
+        uint8_t input;    // digital input number
+        uint8_t polarity; // 0 active high, 1 active low
+        uint8_t edge;     // PET_*
+        uint8_t mode;     // PM_*
+};
+
+struct mark_compare {
+        uint8_t output;           // digital output number
+        uint8_t polarity;         // 0 active high, 1 active low
+        uint8_t mode;             // PCO_*
+        uint8_t interval_mode;    // PCI_*
+        uint8_t direction;        // PCD_*
+        uint16_t interval_width;  // inc
+        uint16_t repetitions;
+        uint16_t pulse_width;     // us
+        int32_t reference;        // inc
+};
+
+struct mark_event {
+        uint32_t seq;
+        int32_t position; // inc
+        uint64_t time;    // now_ns() of the round which read it
+};
+
+struct mark_status {
+        uint8_t armed;
+        uint16_t count;   // counter of the drive up to which all is read
+        uint32_t next;    // sequence number of the next capture
+        uint32_t lost;    // captures overwritten before they were read
+        uint32_t err;     // library error code of the last failed round
+};
+
+// Configure the position marker of a node, reset its counter and start
+// capturing. Events of an earlier run are kept and sequence numbers go on.
+// Returns 0, PROTO_ERR_UNKNOWN_NODE or the library error code.
+uint32_t mark_arm(void *port, uint16_t node_id,
+                  const struct mark_config *config);
+
+// Stop capturing. Events captured so far can still be read. Returns 0,
+// PROTO_ERR_NOT_ACTIVE or the library error code.
+uint32_t mark_disarm(void *port, uint16_t node_id);
+
+// Configure the position compare output of a node and enable it. Returns 0
+// or the library error code.
+uint32_t mark_compare(void *port, uint16_t node_id,
+                      const struct mark_compare *config);
+
+// Disable the position compare output armed last. Returns 0,
+// PROTO_ERR_NOT_ACTIVE or the library error code.
+uint32_t mark_compare_off(void *port, uint16_t node_id);
+
+// Read the captures of the armed nodes. Meant to be registered as bus poller;
+// returns the time in ms until the next poll is due.
+int mark_poll(void *port, void *ctx);
+
+// Copy up to max events of a node with sequence numbers from cursor on to
+// events, oldest first. next is set to the cursor to continue with, lost to
+// the sequence numbers between cursor and next which are not among the
+// events, because the drive or the ring overwrote them. Returns the number of
+// events copied or -1 if the node was never armed.
+int mark_read(uint16_t node_id, uint32_t cursor, struct mark_event *events,
+              size_t max, uint32_t *next, uint32_t *lost);
+
+// State of the position marker of a node, all 0 if it was never armed.
+void mark_status(uint16_t node_id, struct mark_status *status);
@@ -0,0 +1,72 @@
+#include "nodes.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int nodes_add(struct node_table *table, uint16_t id, const char *name)
+{
+        if (id < 1 || id > 127 || table->n == NODES_MAX) {
+                return -1;
+        }
+
+        for (size_t i = 0; i < table->n; i++) {
+                if (table->nodes[i].id == id) {
+                        return -1;
+                }
+        }
+
+        struct node_entry *node = &table->nodes[table->n++];
+        node->id = id;
+        snprintf(node->name, sizeof(node->name), "%s", name);
+        return 0;
+}
+
+int nodes_load(struct node_table *table, const char *path)
+{
+        FILE *file = fopen(path, "r");
+        if (!file) {
+                return -1;
+        }
+
+        table->n = 0;
+        char line[256];
+        unsigned lineno = 0;
+        while (fgets(line, sizeof(line), file)) {
+                lineno++;
+                char *comment = strchr(line, '#');
+                if (comment) {
+                        *comment = '\0';
+                }
+
+                char *save;
+                char *id_str = strtok_r(line, " \t\r\n", &save);
+                if (!id_str) {
+                        continue;
+                }
+
+                char *name = strtok_r(NULL, " \t\r\n", &save);
+                char *end;
+                long id = strtol(id_str, &end, 0);
+                if (*end != '\0' || strtok_r(NULL, " \t\r\n", &save) ||
+                    id < 0 || id > UINT16_MAX ||
+                    nodes_add(table, id, name ? name : "") == -1) {
+                        fprintf(stderr, "|-> %s:%u: invalid or duplicate "
+                                "node\n", path, lineno);
+                        fclose(file);
+                        errno = EINVAL;
+                        return -1;
+                }
+        }
+
+        fclose(file);
+        return 0;
+}
+
+void nodes_ids(const struct node_table *table, uint16_t *ids)
+{
+        for (size_t i = 0; i < table->n; i++) {
+                ids[i] = table->nodes[i].id;
+        }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "util.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Table of the nodes on the bus, loaded at startup.
+//
+// The file lists one node per line as "<id> [name]" with ids from 1 to 127.
+// Empty lines and everything after '#' are ignored.
+
+#define NODES_MAX 127
+
+struct node_entry {
+        uint16_t id;
+        char name[MAX_STR_SIZE];
+};
+
+struct node_table {
+        size_t n;
+        struct node_entry nodes[NODES_MAX];
+};
+
+// Load the node table from path. Returns 0, or -1 with errno set if the file
+// cannot be read or EINVAL if it is malformed (the offending line is reported
+// on stderr).
+int nodes_load(struct node_table *table, const char *path);
+
+// Add a node to the table. Returns -1 if the id is invalid, already in the
+// table or the table is full.
+int nodes_add(struct node_table *table, uint16_t id, const char *name);
+
+// Collect the ids of all nodes into ids, which must have room for table->n
+// entries.
+void nodes_ids(const struct node_table *table, uint16_t *ids);
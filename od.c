@@ -0,0 +1,164 @@
+#include "od.h"
+#include "sdo.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define OD_MAX_NODES            128
+#define OD_MAX_VOLATILE         32
+#define OD_INITIAL_SLOTS        64 // per node, doubled when half full
+
+struct od_object {
+        uint32_t key; // index << 8 | subindex, 0 if the slot is empty
+        uint8_t len;
+        uint8_t data[SDO_MAX_SIZE];
+};
+
+// open-addressing hash table with linear probing
+struct od_node {
+        struct od_object *slots;
+        uint32_t nslots; // power of two
+        uint32_t nobjects;
+        uint64_t hits;
+        uint64_t misses;
+};
+
+// only accessed by the bus thread
+static int enabled;
+static struct od_range volatile_ranges[OD_MAX_VOLATILE];
+static size_t nvolatile;
+static struct od_node nodes[OD_MAX_NODES];
+
+void od_init(const struct od_range *ranges, size_t n)
+{
+        if (n > OD_MAX_VOLATILE) {
+                die("too many volatile object ranges", 0);
+        }
+
+        memcpy(volatile_ranges, ranges, n * sizeof(*ranges));
+        nvolatile = n;
+        enabled = 1;
+}
+
+// Whether an object is shadowed at all. Index 0 is not a valid object, which
+// keeps key 0 free to mark empty slots.
+static int od_shadowed(uint16_t node_id, uint16_t index, uint8_t len)
+{
+        if (!enabled || node_id >= OD_MAX_NODES || index == 0 || len == 0 ||
+            len > SDO_MAX_SIZE) {
+                return 0;
+        }
+
+        for (size_t i = 0; i < nvolatile; i++) {
+                if (index >= volatile_ranges[i].first &&
+                    index <= volatile_ranges[i].last) {
+                        return 0;
+                }
+        }
+
+        return 1;
+}
+
+static uint32_t od_hash(uint32_t key)
+{
+        // Fibonacci hashing, the top bits are used
+        return key * 2654435769u;
+}
+
+// Slot of key, or the empty slot where it would be inserted.
+static struct od_object *od_slot(const struct od_node *node, uint32_t key)
+{
+        uint32_t mask = node->nslots - 1;
+        uint32_t i = od_hash(key) >> (32 - __builtin_ctz(node->nslots));
+        while (node->slots[i].key != 0 && node->slots[i].key != key) {
+                i = (i + 1) & mask;
+        }
+
+        return &node->slots[i];
+}
+
+static void od_grow(struct od_node *node)
+{
+        struct od_node grown = *node;
+        grown.nslots = node->nslots ? node->nslots * 2 : OD_INITIAL_SLOTS;
+        grown.slots = calloc(grown.nslots, sizeof(*grown.slots));
+        if (!grown.slots) {
+                die("failed to allocate object dictionary shadow", 0);
+        }
+
+        for (uint32_t i = 0; i < node->nslots; i++) {
+                if (node->slots[i].key != 0) {
+                        *od_slot(&grown, node->slots[i].key) = node->slots[i];
+                }
+        }
+
+        free(node->slots);
+        *node = grown;
+}
+
+int od_get(uint16_t node_id, uint16_t index, uint8_t subindex, void *data,
+           uint8_t len)
+{
+        if (!od_shadowed(node_id, index, len)) {
+                return -1;
+        }
+
+        struct od_node *node = &nodes[node_id];
+        const struct od_object *object = node->nobjects ?
+                od_slot(node, (uint32_t)index << 8 | subindex) : NULL;
+        if (!object || object->key == 0 || object->len != len) {
+                node->misses++;
+                return -1;
+        }
+
+        memcpy(data, object->data, len);
+        node->hits++;
+        return 0;
+}
+
+void od_put(uint16_t node_id, uint16_t index, uint8_t subindex,
+            const void *data, uint8_t len)
+{
+        if (!od_shadowed(node_id, index, len)) {
+                return;
+        }
+
+        struct od_node *node = &nodes[node_id];
+        if (2 * (node->nobjects + 1) > node->nslots) {
+                od_grow(node);
+        }
+
+        struct od_object *object = od_slot(node,
+                                           (uint32_t)index << 8 | subindex);
+        if (object->key == 0) {
+                object->key = (uint32_t)index << 8 | subindex;
+                node->nobjects++;
+        }
+
+        object->len = len;
+        memcpy(object->data, data, len);
+}
+
+void od_invalidate(uint16_t node_id)
+{
+        if (node_id >= OD_MAX_NODES || nodes[node_id].nobjects == 0) {
+                return;
+        }
+
+        struct od_node *node = &nodes[node_id];
+        memset(node->slots, 0, node->nslots * sizeof(*node->slots));
+        node->nobjects = 0;
+}
+
+void od_stats(uint16_t node_id, struct od_stats *stats)
+{
+        memset(stats, 0, sizeof(*stats));
+        if (node_id >= OD_MAX_NODES) {
+                return;
+        }
+
+        stats->hits = nodes[node_id].hits;
+        stats->misses = nodes[node_id].misses;
+        stats->objects = nodes[node_id].nobjects;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Shadow of the object dictionaries of the nodes.
+//
+// Configuration and communication parameters only change when they are
+// written, so once such an object has been read from or written to a node,
+// its value is remembered and further reads are answered from memory instead
+// of costing an SDO round trip. Objects of up to SDO_MAX_SIZE bytes are
+// shadowed.
+//
+// Objects which the node changes by itself (actual values, statusword, ...)
+// or which are written behind the shadow's back (by RPDOs, or by library
+// calls other than VCS_SetObject which do not update it) must be listed as
+// volatile; they are always transferred. The shadow of a node is dropped
+// when the node is reset or seen in fault, as it may have reloaded its
+// parameters from non-volatile memory then.
+//
+// All functions must only be used by the bus thread (and before it is
+// started).
+
+// range of object indices, first and last included
+struct od_range {
+        uint16_t first;
+        uint16_t last;
+};
+
+struct od_stats {
+        uint64_t hits;    // reads answered from the shadow
+        uint64_t misses;  // reads of shadowed objects transferred
+        uint32_t objects; // objects currently shadowed
+};
+
+// Enable the shadow. Objects with an index in one of the n ranges are never
+// shadowed. Until this is called, nothing is.
+void od_init(const struct od_range *volatile_ranges, size_t n);
+
+// Look up an object of len bytes. Returns 0 and copies its value to data if
+// it is shadowed, otherwise -1 (the object has to be read from the node).
+int od_get(uint16_t node_id, uint16_t index, uint8_t subindex, void *data,
+           uint8_t len);
+
+// Remember the value of an object of len bytes which was just read from or
+// successfully written to a node.
+void od_put(uint16_t node_id, uint16_t index, uint8_t subindex,
+            const void *data, uint8_t len);
+
+// Forget all objects of a node.
+void od_invalidate(uint16_t node_id);
+
+// Hit and miss counters of a node.
+void od_stats(uint16_t node_id, struct od_stats *stats);
@@ -0,0 +1,511 @@
+#include "pdo.h"
+#include "busload.h"
+#include "epos.h"
+#include "od.h"
+#include "proto.h"
+#include "sdo.h"
+#include "socketcan.h"
+#include "stats.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PDO_COB_ID_INVALID      0x80000000
+#define PDO_MAX_NUM             4
+
+// SDO abort code "objects to be mapped would exceed PDO length"
+#define PDO_ERR_LENGTH          0x06040042
+
+// time VCS_ReadCANFrame waits for a TPDO in ms
+#define PDO_READ_TIMEOUT        1
+
+// statusword bit set while the node is in fault
+#define PDO_SW_FAULT            0x0008
+
+// poll period for TPDOs whose rate is unknown, e.g. synchronous ones while no
+// SYNC is reserved or event-driven ones with neither event timer nor inhibit
+// time, in ms
+#define PDO_IDLE_PERIOD         10
+
+// lowest rates a TPDO can be reduced to
+#define PDO_MAX_EVENT_TIMER     65535 // ms
+#define PDO_MAX_INHIBIT_TIME    65535 // 100 us
+#define PDO_MAX_SYNC_CYCLIC     240   // every nth SYNC
+
+// object dictionary layout of transmit and receive PDOs
+struct pdo_dir {
+        uint16_t comm_index;
+        uint16_t mapping_index;
+        uint16_t cob_id_base;
+        const char *name;
+};
+
+static const struct pdo_dir TPDO = { 0x1800, 0x1a00, 0x180, "TPDO" };
+static const struct pdo_dir RPDO = { 0x1400, 0x1600, 0x200, "RPDO" };
+
+struct pdo_node {
+        uint16_t node_id;
+        const struct pdo_map *maps;
+        size_t nmaps;
+};
+
+// only accessed by the bus thread once it is started
+static struct pdo_node nodes[PDO_MAX_NODES];
+static size_t nnodes_configured;
+static struct telemetry telemetry[PDO_MAX_NODES];
+static uint8_t configured[PDO_MAX_NODES];
+static int poll_period = -1;
+
+// RPDO mappings by node id and RPDO number
+static const struct pdo_map *rx_maps[PDO_MAX_NODES][PDO_MAX_NUM];
+
+static uint16_t pdo_cob_id(const struct pdo_dir *dir, uint8_t num,
+                           uint16_t node_id)
+{
+        return dir->cob_id_base + 0x100 * (num - 1) + node_id;
+}
+
+// Bytes carried by a PDO.
+static uint8_t pdo_len(const struct pdo_map *map)
+{
+        unsigned bits = 0;
+        for (uint8_t i = 0; i < map->nentries; i++) {
+                bits += map->entries[i].bits;
+        }
+
+        return bits / 8;
+}
+
+// TPDOs transmitted per second by a node at most with SYNC sent sync_rate
+// times per second. Event-driven TPDOs are also sent on change, so their
+// inhibit time bounds the rate unless it is 0 and only the event timer is
+// known; 0 if neither is set and the TPDO is only transmitted on request.
+static double pdo_rate(const struct pdo_map *map, double sync_rate)
+{
+        if (map->transmission_type == PDO_EVENT_DRIVEN) {
+                if (map->inhibit_time) {
+                        return 10000.0 / map->inhibit_time;
+                }
+
+                return map->event_timer ? 1000.0 / map->event_timer : 0;
+        } else if (map->transmission_type >= PDO_SYNC_CYCLIC &&
+                   map->transmission_type <= PDO_MAX_SYNC_CYCLIC) {
+                return sync_rate / map->transmission_type;
+        }
+
+        return 0;
+}
+
+static void add_write(struct sdo_req **req, uint16_t node_id, uint16_t index,
+                      uint8_t subindex, uint32_t value, uint8_t len)
+{
+        **req = (struct sdo_req){
+                .node = node_id,
+                .index = index,
+                .subindex = subindex,
+                .len = len,
+        };
+        for (uint8_t i = 0; i < len; i++) {
+                (*req)->data[i] = value >> (8 * i);
+        }
+
+        (*req)++;
+}
+
+// Append the writes configuring one PDO of a node to req. Returns the end of
+// the appended requests.
+static struct sdo_req *pdo_writes(struct sdo_req *req, uint16_t node_id,
+                                  const struct pdo_dir *dir,
+                                  const struct pdo_map *map)
+{
+        uint16_t comm_index = dir->comm_index + map->num - 1;
+        uint16_t mapping_index = dir->mapping_index + map->num - 1;
+        uint32_t cob_id = pdo_cob_id(dir, map->num, node_id);
+
+        // the mapping can only be changed while the PDO is disabled and its
+        // number of entries is 0
+        add_write(&req, node_id, comm_index, 0x01,
+                  cob_id | PDO_COB_ID_INVALID, 4);
+        add_write(&req, node_id, comm_index, 0x02, map->transmission_type, 1);
+        if (dir == &TPDO && map->transmission_type == PDO_EVENT_DRIVEN) {
+                add_write(&req, node_id, comm_index, 0x03, map->inhibit_time,
+                          2);
+                add_write(&req, node_id, comm_index, 0x05, map->event_timer,
+                          2);
+        }
+
+        add_write(&req, node_id, mapping_index, 0x00, 0, 1);
+        for (uint8_t i = 0; i < map->nentries; i++) {
+                const struct pdo_entry *entry = &map->entries[i];
+                uint32_t value = (uint32_t)entry->index << 16 |
+                                 (uint32_t)entry->subindex << 8 | entry->bits;
+                add_write(&req, node_id, mapping_index, i + 1, value, 4);
+        }
+
+        add_write(&req, node_id, mapping_index, 0x00, map->nentries, 1);
+        add_write(&req, node_id, comm_index, 0x01, cob_id, 4);
+        return req;
+}
+
+// Configure the PDOs of all nodes. The writes to each node are done in
+// order, the nodes are configured concurrently if the SDO client allows.
+static uint32_t pdo_configure_dir(struct sdo *sdo, const uint16_t *node_ids,
+                                  size_t nnodes, const struct pdo_dir *dir,
+                                  const struct pdo_map *maps, size_t nmaps)
+{
+        size_t max_writes = 0;
+        for (size_t i = 0; i < nmaps; i++) {
+                const struct pdo_map *map = &maps[i];
+                unsigned bits = 0;
+                for (uint8_t j = 0; j < map->nentries; j++) {
+                        bits += map->entries[j].bits;
+                }
+
+                if (map->num < 1 || map->num > PDO_MAX_NUM || bits > 64) {
+                        fprintf(stderr, "|-> %s%u maps %u bits, at most 64 "
+                                "fit into a CAN frame\n", dir->name, map->num,
+                                bits);
+                        return PDO_ERR_LENGTH;
+                }
+
+                max_writes += 7 + map->nentries;
+        }
+
+        struct sdo_req *reqs = malloc(nnodes * max_writes * sizeof(*reqs));
+        if (!reqs) {
+                die("failed to allocate PDO configuration", 0);
+        }
+
+        struct sdo_req *end = reqs;
+        for (size_t i = 0; i < nnodes; i++) {
+                for (size_t j = 0; j < nmaps; j++) {
+                        end = pdo_writes(end, node_ids[i], dir, &maps[j]);
+                }
+        }
+
+        sdo_transfer(sdo, reqs, end - reqs, SDO_STOP_ON_ERROR);
+
+        uint32_t err = 0;
+        for (struct sdo_req *req = reqs; req < end && !err; req++) {
+                if (req->err) {
+                        fprintf(stderr, "|-> failed to configure %ss of node "
+                                "%u\n", dir->name, req->node);
+                        err = req->err;
+                }
+        }
+
+        free(reqs);
+        return err;
+}
+
+// Reserve the bus for the TPDOs of all nodes (see busload.h). If they do not
+// fit, all of them are transmitted less often by the same factor. Returns the
+// maps to configure or NULL if not even the lowest rates fit.
+static const struct pdo_map *pdo_admit(const uint16_t *node_ids,
+                                       size_t nnodes,
+                                       const struct pdo_map *maps,
+                                       size_t nmaps)
+{
+        struct pdo_map *admitted = malloc(nmaps * sizeof(*admitted));
+        if (!admitted) {
+                die("failed to allocate TPDO mappings", 0);
+        }
+
+        memcpy(admitted, maps, nmaps * sizeof(*admitted));
+
+        double sync_rate = busload_rate(CAN_COB_ID_SYNC);
+        double bps = 0;
+        for (size_t i = 0; i < nmaps; i++) {
+                bps += nnodes * busload_worst_bits(pdo_len(&maps[i])) *
+                       pdo_rate(&maps[i], sync_rate);
+        }
+
+        // every reservation is rounded up to the next bit/s
+        double headroom = (double)busload_headroom() - nnodes * nmaps;
+        int flags = 0;
+        if (bps > headroom) {
+                double factor = headroom > 0 ? bps / headroom : INFINITY;
+                flags = BUSLOAD_REDUCED;
+                for (size_t i = 0; i < nmaps; i++) {
+                        struct pdo_map *map = &admitted[i];
+                        if (map->transmission_type == PDO_EVENT_DRIVEN) {
+                                map->event_timer = fmin(
+                                        ceil(map->event_timer * factor),
+                                        PDO_MAX_EVENT_TIMER);
+                                map->inhibit_time = fmin(
+                                        ceil(map->inhibit_time * factor),
+                                        PDO_MAX_INHIBIT_TIME);
+                        } else if (pdo_rate(map, sync_rate) > 0) {
+                                map->transmission_type = fmin(
+                                        ceil(map->transmission_type * factor),
+                                        PDO_MAX_SYNC_CYCLIC);
+                        }
+
+                        printf("|-> TPDO%u exceeds the bus load threshold, "
+                               "reduced from %.1f to %.1f per second\n",
+                               map->num, pdo_rate(&maps[i], sync_rate),
+                               pdo_rate(map, sync_rate));
+                }
+        }
+
+        for (size_t i = 0; i < nnodes * nmaps; i++) {
+                const struct pdo_map *map = &admitted[i % nmaps];
+                uint16_t cob_id = pdo_cob_id(&TPDO, map->num,
+                                             node_ids[i / nmaps]);
+                if (busload_reserve(cob_id, pdo_len(map),
+                                    pdo_rate(map, sync_rate), flags) != -1) {
+                        continue;
+                }
+
+                // the streams reserved so far are not going to be configured
+                while (i-- > 0) {
+                        map = &admitted[i % nmaps];
+                        cob_id = pdo_cob_id(&TPDO, map->num,
+                                            node_ids[i / nmaps]);
+                        busload_reserve(cob_id, pdo_len(map), 0, flags);
+                }
+
+                free(admitted);
+                return NULL;
+        }
+
+        return admitted;
+}
+
+uint32_t pdo_configure(struct sdo *sdo, const uint16_t *node_ids,
+                       size_t nnodes, const struct pdo_map *maps, size_t nmaps)
+{
+        printf("|-> mapping telemetry into %zu TPDOs on %zu nodes...\n",
+               nmaps, nnodes);
+
+        maps = pdo_admit(node_ids, nnodes, maps, nmaps);
+        if (!maps) {
+                fprintf(stderr, "|-> TPDOs exceed the bus load threshold\n");
+                return PROTO_ERR_BUS_LOAD;
+        }
+
+        uint32_t err = pdo_configure_dir(sdo, node_ids, nnodes, &TPDO, maps,
+                                         nmaps);
+        if (err) {
+                return err;
+        }
+
+        // polled as often as the most frequent TPDO can come in
+        double sync_rate = busload_rate(CAN_COB_ID_SYNC);
+        for (size_t i = 0; i < nmaps; i++) {
+                double rate = pdo_rate(&maps[i], sync_rate);
+                int period = rate > 0 ? 1000 / rate : PDO_IDLE_PERIOD;
+                if (period < 1) {
+                        period = 1;
+                }
+
+                if (poll_period == -1 || period < poll_period) {
+                        poll_period = period;
+                }
+        }
+
+        for (size_t i = 0; i < nnodes; i++) {
+                uint16_t node_id = node_ids[i];
+                if (!configured[node_id]) {
+                        configured[node_id] = 1;
+                        nodes[nnodes_configured++] =
+                                (struct pdo_node){ node_id, maps, nmaps };
+                }
+        }
+
+        return 0;
+}
+
+uint32_t pdo_configure_rx(struct sdo *sdo, const uint16_t *node_ids,
+                          size_t nnodes, const struct pdo_map *maps,
+                          size_t nmaps)
+{
+        printf("|-> mapping setpoints into %zu RPDOs on %zu nodes...\n", nmaps,
+               nnodes);
+
+        uint32_t err = pdo_configure_dir(sdo, node_ids, nnodes, &RPDO, maps,
+                                         nmaps);
+        if (err) {
+                return err;
+        }
+
+        for (size_t i = 0; i < nnodes; i++) {
+                for (size_t j = 0; j < nmaps; j++) {
+                        rx_maps[node_ids[i]][maps[j].num - 1] = &maps[j];
+                }
+        }
+
+        return 0;
+}
+
+static void pdo_decode(struct telemetry *tlm, const struct pdo_map *map,
+                       const uint8_t *data)
+{
+        unsigned offset = 0;
+        for (uint8_t i = 0; i < map->nentries; i++) {
+                const struct pdo_entry *entry = &map->entries[i];
+                uint32_t raw = 0;
+                for (unsigned byte = 0; byte < entry->bits / 8; byte++) {
+                        raw |= (uint32_t)data[offset + byte] << (8 * byte);
+                }
+
+                // sign-extend values narrower than 32 bits
+                int32_t value = raw;
+                if (entry->bits < 32 && raw & (1u << (entry->bits - 1))) {
+                        value = raw | ~((1u << entry->bits) - 1);
+                }
+
+                switch (entry->signal) {
+                case TLM_STATUSWORD: tlm->statusword = raw; break;
+                case TLM_POSITION: tlm->position = value; break;
+                case TLM_VELOCITY: tlm->velocity = value; break;
+                case TLM_CURRENT: tlm->current = value; break;
+                }
+
+                offset += entry->bits / 8;
+        }
+}
+
+// Store a received TPDO in the telemetry of a node. A node in fault may
+// reload its parameters, so its object dictionary shadow is dropped then.
+static void pdo_receive(uint16_t node_id, const struct pdo_map *map,
+                        const uint8_t *data, uint64_t timestamp)
+{
+        struct telemetry *tlm = &telemetry[node_id];
+        pdo_decode(tlm, map, data);
+        tlm->samples++;
+        tlm->timestamp = timestamp;
+        if (tlm->statusword & PDO_SW_FAULT) {
+                od_invalidate(node_id);
+        }
+}
+
+// Receive all TPDOs queued on the socket without blocking. Unlike
+// VCS_ReadCANFrame this takes one syscall per CAN_BATCH_MAX frames instead of
+// one library call per PDO, and the timestamp is the kernel receive time.
+static void pdo_poll_can(struct can_sock *can)
+{
+        struct can_frame frames[CAN_BATCH_MAX];
+        uint64_t stamps[CAN_BATCH_MAX];
+        int n;
+        while ((n = can_recv(can, frames, stamps, CAN_BATCH_MAX, 0)) > 0) {
+                for (int i = 0; i < n; i++) {
+                        uint16_t cob_id = frames[i].can_id & CAN_SFF_MASK;
+                        uint16_t node_id = cob_id & 0x7f;
+                        if (cob_id < TPDO.cob_id_base ||
+                            cob_id >= pdo_cob_id(&TPDO, PDO_MAX_NUM + 1, 0) ||
+                            !configured[node_id]) {
+                                continue;
+                        }
+
+                        uint8_t num = (cob_id - TPDO.cob_id_base) / 0x100 + 1;
+
+                        const struct pdo_node *node = NULL;
+                        for (size_t j = 0; j < nnodes_configured; j++) {
+                                if (nodes[j].node_id == node_id) {
+                                        node = &nodes[j];
+                                        break;
+                                }
+                        }
+
+                        for (size_t j = 0; j < node->nmaps; j++) {
+                                if (node->maps[j].num != num) {
+                                        continue;
+                                }
+
+                                pdo_receive(node_id, &node->maps[j],
+                                            frames[i].data, stamps[i]);
+                        }
+                }
+
+                if (n < CAN_BATCH_MAX) {
+                        break;
+                }
+        }
+}
+
+int pdo_poll(void *port, void *ctx)
+{
+        if (ctx) {
+                pdo_poll_can(ctx);
+                return poll_period;
+        }
+
+        for (size_t i = 0; i < nnodes_configured; i++) {
+                const struct pdo_node *node = &nodes[i];
+                for (size_t j = 0; j < node->nmaps; j++) {
+                        const struct pdo_map *map = &node->maps[j];
+                        struct can_frame frame = {
+                                .can_id = pdo_cob_id(&TPDO, map->num,
+                                                     node->node_id),
+                                .can_dlc = pdo_len(map),
+                        };
+                        uint32_t err;
+                        if (!STAT(VCS_ReadCANFrame, node->node_id, err, port,
+                                  frame.can_id, sizeof(frame.data),
+                                  frame.data, PDO_READ_TIMEOUT, &err)) {
+                                continue;
+                        }
+
+                        busload_frames(&frame, 1);
+                        pdo_receive(node->node_id, map, frame.data, now_ns());
+                }
+        }
+
+        return poll_period;
+}
+
+const struct telemetry *pdo_telemetry(uint16_t node_id)
+{
+        if (node_id >= PDO_MAX_NODES || !configured[node_id]) {
+                return NULL;
+        }
+
+        return &telemetry[node_id];
+}
+
+int pdo_can_filter(struct can_sock *can)
+{
+        uint16_t cob_ids[CAN_BATCH_MAX];
+        size_t n = 0;
+        for (size_t i = 0; i < nnodes_configured; i++) {
+                for (size_t j = 0; j < nodes[i].nmaps; j++) {
+                        if (n == CAN_BATCH_MAX) {
+                                return -1;
+                        }
+
+                        cob_ids[n++] = pdo_cob_id(&TPDO, nodes[i].maps[j].num,
+                                                  nodes[i].node_id);
+                }
+        }
+
+        return can_filter(can, cob_ids, n);
+}
+
+uint8_t pdo_rx_entries(uint16_t node_id, uint8_t num)
+{
+        if (node_id >= PDO_MAX_NODES || num < 1 || num > PDO_MAX_NUM ||
+            !rx_maps[node_id][num - 1]) {
+                return 0;
+        }
+
+        return rx_maps[node_id][num - 1]->nentries;
+}
+
+void pdo_rx_frame(uint16_t node_id, uint8_t num, const int32_t *values,
+                  struct can_frame *frame)
+{
+        const struct pdo_map *map = rx_maps[node_id][num - 1];
+        frame->can_id = pdo_cob_id(&RPDO, num, node_id);
+        frame->can_dlc = 0;
+        for (uint8_t i = 0; i < map->nentries; i++) {
+                uint32_t raw = values[i];
+                for (unsigned byte = 0; byte < map->entries[i].bits / 8;
+                     byte++) {
+                        frame->data[frame->can_dlc++] = raw >> (8 * byte);
+                }
+        }
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/can.h>
+
+struct can_sock;
+struct sdo;
+
+// PDO-based telemetry and setpoints.
+//
+// Instead of polling every value by SDO (one round trip per value and node),
+// the nodes are configured to transmit the values in TPDOs by themselves.
+// Several values share one CAN frame, which the bus thread receives with
+// VCS_ReadCANFrame (or from a SocketCAN socket) and decodes into a per-node
+// telemetry record.
+//
+// In the other direction setpoints are packed into RPDOs, which are plain CAN
+// frames without a response and can be sent without going through the SDO
+// machinery of the library.
+
+#define PDO_MAX_ENTRIES 8
+#define PDO_MAX_NODES   128
+
+// transmission types (object 0x1800 + n or 0x1400 + n, subindex 2)
+#define PDO_SYNC_CYCLIC         1   // after every SYNC (up to 240 = every nth)
+#define PDO_EVENT_DRIVEN        255 // on change and/or by event timer, RPDOs
+                                    // are applied immediately
+
+enum tlm_signal {
+        TLM_STATUSWORD,
+        TLM_POSITION,
+        TLM_VELOCITY,
+        TLM_CURRENT,
+};
+
+struct pdo_entry {
+        uint16_t index;
+        uint8_t subindex;
+        uint8_t bits;           // 8, 16 or 32
+        enum tlm_signal signal; // telemetry value updated by the entry (TPDOs)
+};
+
+struct pdo_map {
+        uint8_t num;               // TPDO or RPDO number, 1 to 4
+        uint8_t transmission_type;
+        uint16_t event_timer;      // ms, for PDO_EVENT_DRIVEN TPDOs
+        uint16_t inhibit_time;     // 100 us between two transmissions at
+                                   // least, for PDO_EVENT_DRIVEN TPDOs which
+                                   // are also sent on every change
+        uint8_t nentries;
+        struct pdo_entry entries[PDO_MAX_ENTRIES];
+};
+
+struct telemetry {
+        uint16_t statusword;
+        int32_t position; // inc
+        int32_t velocity; // rpm
+        int32_t current;  // mA
+        uint32_t samples; // number of TPDOs received
+        uint64_t timestamp; // now_ns() of the last TPDO received
+};
+
+// Write the communication (0x1800 + n) and mapping (0x1A00 + n) parameters of
+// the given TPDOs on all nodes and register the nodes for reception. The
+// nodes only start transmitting once they are switched to NMT operational.
+// The bus is reserved for the TPDOs first (see busload.h). If they exceed
+// the threshold, their event timers and inhibit times or SYNC intervals are
+// stretched until they fit. Returns 0, PROTO_ERR_BUS_LOAD or the error code of the first
+// failed write.
+uint32_t pdo_configure(struct sdo *sdo, const uint16_t *node_ids,
+                       size_t nnodes, const struct pdo_map *maps, size_t nmaps);
+
+// Write the communication (0x1400 + n) and mapping (0x1600 + n) parameters of
+// the given RPDOs on all nodes so setpoints can be sent with pdo_rx_frame().
+// Returns 0 or the error code of the first failed write.
+uint32_t pdo_configure_rx(struct sdo *sdo, const uint16_t *node_ids,
+                          size_t nnodes, const struct pdo_map *maps,
+                          size_t nmaps);
+
+// Receive the TPDOs of all configured nodes. Meant to be registered as bus
+// poller with either NULL as ctx to read them with VCS_ReadCANFrame or a
+// struct can_sock to receive them from (see pdo_can_filter()); returns the
+// time in ms until the next poll is due.
+int pdo_poll(void *port, void *ctx);
+
+// Restrict can to the TPDOs of the configured nodes.
+int pdo_can_filter(struct can_sock *can);
+
+// Latest telemetry of a node or NULL if the node does not transmit TPDOs.
+// Must only be used by the bus thread.
+const struct telemetry *pdo_telemetry(uint16_t node_id);
+
+// Number of entries mapped into RPDO num of a node, 0 if it is not configured.
+uint8_t pdo_rx_entries(uint16_t node_id, uint8_t num);
+
+// Pack one value per mapped entry into the CAN frame of RPDO num of a node.
+void pdo_rx_frame(uint16_t node_id, uint8_t num, const int32_t *values,
+                  struct can_frame *frame);
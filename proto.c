@@ -0,0 +1,1259 @@
+#include "proto.h"
+#include "bus.h"
+#include "busload.h"
+#include "cycle.h"
+#include "epos.h"
+#include "fault.h"
+#include "home.h"
+#include "ipm.h"
+#include "mark.h"
+#include "od.h"
+#include "pdo.h"
+#include "rec.h"
+#include "sdo.h"
+#include "socketcan.h"
+#include "stats.h"
+#include "traj.h"
+#include "udp.h"
+#include "util.h"
+#include "watchdog.h"
+
+#include <endian.h>
+#include <string.h>
+
+// Executes a decoded request. in points to the request payload inside the
+// receive buffer, the response payload is written to out directly. Returns 0
+// or the error code to report to the client.
+typedef uint32_t (*proto_exec_fn)(void *port, uint16_t node,
+                                  const uint8_t *in, uint16_t in_len,
+                                  uint8_t *out, uint16_t *out_len);
+
+// Builds the CAN frame of a request that is sent without response. Returns 0
+// or the error code to report to the client.
+typedef uint32_t (*proto_frame_fn)(uint16_t node, const uint8_t *in,
+                                   uint16_t in_len, struct can_frame *frame);
+
+struct proto_cmd {
+        const char *name;
+        uint16_t min_len; // minimum request payload length
+        uint16_t max_len; // maximum request payload length
+        proto_exec_fn exec;
+        proto_frame_fn frame; // set if exec only sends this frame
+};
+
+static uint16_t get_u16(const uint8_t *p)
+{
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        return le16toh(v);
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return le32toh(v);
+}
+
+static void put_u16(uint8_t *p, uint16_t v)
+{
+        v = htole16(v);
+        memcpy(p, &v, sizeof(v));
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+        v = htole32(v);
+        memcpy(p, &v, sizeof(v));
+}
+
+static void put_u64(uint8_t *p, uint64_t v)
+{
+        v = htole64(v);
+        memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t exec_nop(void *port, uint16_t node,
+                         const uint8_t *in, uint16_t in_len,
+                         uint8_t *out, uint16_t *out_len)
+{
+        return 0;
+}
+
+static uint32_t exec_get_state(void *port, uint16_t node,
+                               const uint8_t *in, uint16_t in_len,
+                               uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        uint16_t state;
+        if (!STAT(VCS_GetState, node, err, port, node, &state, &err)) {
+                return err;
+        }
+
+        if (state == ST_FAULT) {
+                od_invalidate(node);
+        }
+
+        put_u16(out, state);
+        *out_len = sizeof(state);
+        return 0;
+}
+
+static uint32_t exec_set_enable_state(void *port, uint16_t node,
+                                      const uint8_t *in, uint16_t in_len,
+                                      uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        return STAT(VCS_SetEnableState, node, err, port, node, &err) ? 0 : err;
+}
+
+static uint32_t exec_set_disable_state(void *port, uint16_t node,
+                                       const uint8_t *in, uint16_t in_len,
+                                       uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        return STAT(VCS_SetDisableState, node, err, port, node, &err) ? 0 : err;
+}
+
+static uint32_t exec_set_quick_stop_state(void *port, uint16_t node,
+                                          const uint8_t *in, uint16_t in_len,
+                                          uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        return STAT(VCS_SetQuickStopState, node, err, port, node,
+                    &err) ? 0 : err;
+}
+
+static uint32_t exec_clear_fault(void *port, uint16_t node,
+                                 const uint8_t *in, uint16_t in_len,
+                                 uint8_t *out, uint16_t *out_len)
+{
+        // the node may have reloaded its parameters while in fault
+        od_invalidate(node);
+
+        uint32_t err;
+        return STAT(VCS_ClearFault, node, err, port, node, &err) ? 0 : err;
+}
+
+static uint32_t exec_set_operation_mode(void *port, uint16_t node,
+                                        const uint8_t *in, uint16_t in_len,
+                                        uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        return STAT(VCS_SetOperationMode, node, err, port, node, (char)in[0],
+                    &err) ? 0 : err;
+}
+
+// Applied by the thread serving the session when submitting the request, so
+// it is only validated here.
+static uint32_t exec_set_watchdog(void *port, uint16_t node,
+                                  const uint8_t *in, uint16_t in_len,
+                                  uint8_t *out, uint16_t *out_len)
+{
+        uint32_t timeout_ms;
+        uint8_t stop_op;
+        return watchdog_parse(in, in_len, &timeout_ms, &stop_op);
+}
+
+static uint32_t exec_get_watchdog_stats(void *port, uint16_t node,
+                                        const uint8_t *in, uint16_t in_len,
+                                        uint8_t *out, uint16_t *out_len)
+{
+        struct watchdog_stats stats;
+        struct bus_urgent_stats urgent;
+        watchdog_stats(&stats);
+        bus_urgent_stats(&urgent);
+        put_u64(out, stats.expired);
+        put_u64(out + 8, stats.disconnects);
+        put_u64(out + 16, stats.stops);
+        put_u64(out + 24, stats.failed);
+        put_u64(out + 32, stats.dropped);
+        put_u64(out + 40, urgent.count);
+        put_u32(out + 48, urgent.max_reaction_us);
+        for (int i = 0; i < BUS_URGENT_HIST_BUCKETS; i++) {
+                put_u32(out + 52 + 4 * i, urgent.hist[i]);
+        }
+
+        *out_len = 52 + 4 * BUS_URGENT_HIST_BUCKETS;
+        return 0;
+}
+
+static uint32_t exec_move_with_velocity(void *port, uint16_t node,
+                                        const uint8_t *in, uint16_t in_len,
+                                        uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        int32_t velocity = (int32_t)get_u32(in);
+        return STAT(VCS_MoveWithVelocity, node, err, port, node, velocity,
+                    &err) ? 0 : err;
+}
+
+static uint32_t exec_set_position_must(void *port, uint16_t node,
+                                       const uint8_t *in, uint16_t in_len,
+                                       uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        int32_t position = (int32_t)get_u32(in);
+        return STAT(VCS_SetPositionMust, node, err, port, node, position,
+                    &err) ? 0 : err;
+}
+
+static uint32_t exec_set_current_must(void *port, uint16_t node,
+                                      const uint8_t *in, uint16_t in_len,
+                                      uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        int32_t current = (int32_t)get_u32(in);
+        return STAT(VCS_SetCurrentMustEx, node, err, port, node, current,
+                    &err) ? 0 : err;
+}
+
+static uint32_t exec_move_to_position(void *port, uint16_t node,
+                                      const uint8_t *in, uint16_t in_len,
+                                      uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        int32_t position = (int32_t)get_u32(in);
+        return STAT(VCS_MoveToPosition, node, err, port, node, position, in[4],
+                    in[5], &err) ? 0 : err;
+}
+
+static uint32_t exec_halt_velocity_movement(void *port, uint16_t node,
+                                            const uint8_t *in, uint16_t in_len,
+                                            uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        return STAT(VCS_HaltVelocityMovement, node, err, port, node,
+                    &err) ? 0 : err;
+}
+
+static uint32_t exec_halt_position_movement(void *port, uint16_t node,
+                                            const uint8_t *in, uint16_t in_len,
+                                            uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        return STAT(VCS_HaltPositionMovement, node, err, port, node,
+                    &err) ? 0 : err;
+}
+
+static uint32_t exec_set_velocity_profile(void *port, uint16_t node,
+                                          const uint8_t *in, uint16_t in_len,
+                                          uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        if (!STAT(VCS_SetVelocityProfile, node, err, port, node, get_u32(in),
+                  get_u32(in + 4), &err)) {
+                return err;
+        }
+
+        // profile acceleration and deceleration
+        od_put(node, 0x6083, 0x00, in, 4);
+        od_put(node, 0x6084, 0x00, in + 4, 4);
+        return 0;
+}
+
+static uint32_t exec_set_position_profile(void *port, uint16_t node,
+                                          const uint8_t *in, uint16_t in_len,
+                                          uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        if (!STAT(VCS_SetPositionProfile, node, err, port, node, get_u32(in),
+                  get_u32(in + 4), get_u32(in + 8), &err)) {
+                return err;
+        }
+
+        // profile velocity, acceleration and deceleration
+        od_put(node, 0x6081, 0x00, in, 4);
+        od_put(node, 0x6083, 0x00, in + 4, 4);
+        od_put(node, 0x6084, 0x00, in + 8, 4);
+        return 0;
+}
+
+static uint32_t exec_home_start(void *port, uint16_t node,
+                                const uint8_t *in, uint16_t in_len,
+                                uint8_t *out, uint16_t *out_len)
+{
+        const struct home_config config = {
+                .method = (int8_t)in[0],
+                .group = in[1],
+                .acceleration = get_u32(in + 2),
+                .speed_switch = get_u32(in + 6),
+                .speed_index = get_u32(in + 10),
+                .offset = (int32_t)get_u32(in + 14),
+                .current_threshold = get_u16(in + 18),
+                .position = (int32_t)get_u32(in + 20),
+                .timeout = get_u32(in + 24),
+        };
+        return home_start(node, &config);
+}
+
+static uint32_t exec_home_stop(void *port, uint16_t node,
+                               const uint8_t *in, uint16_t in_len,
+                               uint8_t *out, uint16_t *out_len)
+{
+        return home_stop(port, node);
+}
+
+static uint32_t exec_home_get_status(void *port, uint16_t node,
+                                     const uint8_t *in, uint16_t in_len,
+                                     uint8_t *out, uint16_t *out_len)
+{
+        struct home_status status;
+        home_status(node, &status);
+        out[0] = status.state;
+        out[1] = status.group;
+        put_u32(out + 2, status.err);
+        put_u32(out + 6, status.elapsed);
+        *out_len = 10;
+        return 0;
+}
+
+static uint32_t exec_set_object(void *port, uint16_t node,
+                                const uint8_t *in, uint16_t in_len,
+                                uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        uint32_t bytes_written;
+        // the library only reads from the data pointer
+        if (!STAT(VCS_SetObject, node, err, port, node, get_u16(in), in[2],
+                  (void *)(in + 3), in_len - 3, &bytes_written, &err)) {
+                return err;
+        }
+
+        od_put(node, get_u16(in), in[2], in + 3, in_len - 3);
+        return 0;
+}
+
+static uint32_t exec_get_object(void *port, uint16_t node,
+                                const uint8_t *in, uint16_t in_len,
+                                uint8_t *out, uint16_t *out_len)
+{
+        uint32_t err;
+        uint32_t bytes_read = 0;
+        if (in[3] > PROTO_MAX_OBJECT_SIZE) {
+                return PROTO_ERR_BAD_LENGTH;
+        } else if (od_get(node, get_u16(in), in[2], out, in[3]) == 0) {
+                *out_len = in[3];
+                return 0;
+        }
+
+        if (!STAT(VCS_GetObject, node, err, port, node, get_u16(in), in[2], out,
+                  in[3], &bytes_read, &err)) {
+                return err;
+        }
+
+        *out_len = bytes_read < in[3] ? bytes_read : in[3];
+        od_put(node, get_u16(in), in[2], out, *out_len);
+        return 0;
+}
+
+// Served from the TPDO telemetry if the node transmits it, otherwise every
+// value is read by SDO (samples and age are 0 then).
+static uint32_t exec_get_telemetry(void *port, uint16_t node,
+                                   const uint8_t *in, uint16_t in_len,
+                                   uint8_t *out, uint16_t *out_len)
+{
+        struct telemetry polled = { 0 };
+        const struct telemetry *tlm = pdo_telemetry(node);
+        uint32_t age_us = 0;
+        if (tlm) {
+                // a node silent for over an hour must not look fresh again
+                uint64_t age = (now_ns() - tlm->timestamp) / 1000;
+                age_us = tlm->samples && age < UINT32_MAX ? age : UINT32_MAX;
+        } else {
+                uint32_t err;
+                uint32_t bytes_read;
+                int position;
+                int velocity;
+                int current;
+                if (!STAT(VCS_GetObject, node, err, port, node, 0x6041, 0x00,
+                          &polled.statusword, sizeof(polled.statusword),
+                          &bytes_read, &err) ||
+                    !STAT(VCS_GetPositionIs, node, err, port, node,
+                          &position, &err) ||
+                    !STAT(VCS_GetVelocityIs, node, err, port, node,
+                          &velocity, &err) ||
+                    !STAT(VCS_GetCurrentIsEx, node, err, port, node,
+                          &current, &err)) {
+                        return err;
+                }
+
+                polled.position = position;
+                polled.velocity = velocity;
+                polled.current = current;
+                tlm = &polled;
+        }
+
+        put_u16(out, tlm->statusword);
+        put_u32(out + 2, tlm->position);
+        put_u32(out + 6, tlm->velocity);
+        put_u32(out + 10, tlm->current);
+        put_u32(out + 14, tlm->samples);
+        put_u32(out + 18, age_us);
+        *out_len = 22;
+        return 0;
+}
+
+static uint32_t frame_pdo_setpoint(uint16_t node, const uint8_t *in,
+                                   uint16_t in_len, struct can_frame *frame)
+{
+        uint8_t nentries = pdo_rx_entries(node, in[0]);
+        if (!nentries) {
+                return PROTO_ERR_NOT_MAPPED;
+        } else if (in_len != 1 + 4 * nentries) {
+                return PROTO_ERR_BAD_LENGTH;
+        }
+
+        int32_t values[PDO_MAX_ENTRIES];
+        for (uint8_t i = 0; i < nentries; i++) {
+                values[i] = get_u32(in + 1 + 4 * i);
+        }
+
+        pdo_rx_frame(node, in[0], values, frame);
+        return 0;
+}
+
+static uint32_t frame_sync(uint16_t node, const uint8_t *in, uint16_t in_len,
+                           struct can_frame *frame)
+{
+        frame->can_id = CAN_COB_ID_SYNC;
+        frame->can_dlc = 0;
+        return 0;
+}
+
+static uint32_t exec_pdo_setpoint(void *port, uint16_t node,
+                                  const uint8_t *in, uint16_t in_len,
+                                  uint8_t *out, uint16_t *out_len)
+{
+        struct can_frame frame;
+        uint32_t err = frame_pdo_setpoint(node, in, in_len, &frame);
+        if (err) {
+                return err;
+        }
+
+        if (!STAT(VCS_SendCANFrame, node, err, port, frame.can_id,
+                  frame.can_dlc, frame.data, &err)) {
+                return err;
+        }
+
+        busload_frames(&frame, 1);
+        return 0;
+}
+
+static uint32_t exec_sync(void *port, uint16_t node,
+                          const uint8_t *in, uint16_t in_len,
+                          uint8_t *out, uint16_t *out_len)
+{
+        struct can_frame frame;
+        frame_sync(node, in, in_len, &frame);
+
+        uint32_t err;
+        if (!STAT(VCS_SendCANFrame, 0, err, port, frame.can_id, frame.can_dlc,
+                  NULL, &err)) {
+                return err;
+        }
+
+        busload_frames(&frame, 1);
+        return 0;
+}
+
+static uint32_t exec_get_cycle_stats(void *port, uint16_t node,
+                                     const uint8_t *in, uint16_t in_len,
+                                     uint8_t *out, uint16_t *out_len)
+{
+        struct cycle_stats stats;
+        cycle_stats(&stats);
+        put_u32(out, stats.cycles);
+        put_u32(out + 4, stats.overruns);
+        put_u32(out + 8, stats.max_latency_us);
+        for (int i = 0; i < CYCLE_HIST_BUCKETS; i++) {
+                put_u32(out + 12 + 4 * i, stats.hist[i]);
+        }
+
+        put_u32(out + 12 + 4 * CYCLE_HIST_BUCKETS, stats.superseded);
+        *out_len = 16 + 4 * CYCLE_HIST_BUCKETS;
+        return 0;
+}
+
+static uint32_t exec_get_setpoint_stats(void *port, uint16_t node,
+                                        const uint8_t *in, uint16_t in_len,
+                                        uint8_t *out, uint16_t *out_len)
+{
+        struct bus_setpoint_stats stats;
+        bus_setpoint_stats(node, &stats);
+        put_u64(out, stats.superseded);
+        put_u64(out + 8, stats.dropped);
+        *out_len = 16;
+        return 0;
+}
+
+static uint32_t exec_get_udp_stats(void *port, uint16_t node,
+                                   const uint8_t *in, uint16_t in_len,
+                                   uint8_t *out, uint16_t *out_len)
+{
+        struct udp_stats stats;
+        udp_stats(&stats);
+        const uint64_t fields[] = {
+                stats.datagrams, stats.stale, stats.lost, stats.malformed,
+                stats.setpoints, stats.rejected, stats.overflows,
+                stats.superseded, stats.failed,
+        };
+        for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+                put_u64(out + 8 * i, fields[i]);
+        }
+
+        *out_len = sizeof(fields);
+        return 0;
+}
+
+static uint32_t exec_ipm_activate(void *port, uint16_t node,
+                                  const uint8_t *in, uint16_t in_len,
+                                  uint8_t *out, uint16_t *out_len)
+{
+        return ipm_activate(port, node);
+}
+
+#define IPM_POINT_SIZE 9
+
+static uint32_t exec_ipm_add_points(void *port, uint16_t node,
+                                    const uint8_t *in, uint16_t in_len,
+                                    uint8_t *out, uint16_t *out_len)
+{
+        if (in_len % IPM_POINT_SIZE) {
+                return PROTO_ERR_BAD_LENGTH;
+        }
+
+        struct ipm_point points[PROTO_MAX_PAYLOAD / IPM_POINT_SIZE];
+        size_t n = in_len / IPM_POINT_SIZE;
+        for (size_t i = 0; i < n; i++) {
+                const uint8_t *p = in + i * IPM_POINT_SIZE;
+                points[i].position = get_u32(p);
+                points[i].velocity = get_u32(p + 4);
+                points[i].time = p[8];
+        }
+
+        uint32_t free;
+        uint32_t err = ipm_push(node, points, n, &free);
+        if (err) {
+                return err;
+        }
+
+        put_u32(out, free);
+        *out_len = 4;
+        return 0;
+}
+
+#define IPM_PLAN_HDR_SIZE 17
+
+static uint32_t exec_ipm_plan(void *port, uint16_t node,
+                              const uint8_t *in, uint16_t in_len,
+                              uint8_t *out, uint16_t *out_len)
+{
+        if ((in_len - IPM_PLAN_HDR_SIZE) % 4) {
+                return PROTO_ERR_BAD_LENGTH;
+        }
+
+        uint8_t time_ms = in[0];
+        uint32_t inc_per_rev = get_u32(in + 1);
+        const struct traj_limits limits = {
+                .velocity = get_u32(in + 5),
+                .acceleration = get_u32(in + 9),
+                .jerk = get_u32(in + 13),
+        };
+        double waypoints[(PROTO_MAX_PAYLOAD - IPM_PLAN_HDR_SIZE) / 4];
+        size_t nwaypoints = (in_len - IPM_PLAN_HDR_SIZE) / 4;
+        for (size_t i = 0; i < nwaypoints; i++) {
+                waypoints[i] = (int32_t)get_u32(in + IPM_PLAN_HDR_SIZE +
+                                                4 * i);
+        }
+
+        if (time_ms == 0 || inc_per_rev == 0) {
+                return PROTO_ERR_BAD_ARG;
+        }
+
+        struct traj *traj = traj_plan(waypoints, nwaypoints, 1, &limits);
+        if (!traj) {
+                return PROTO_ERR_BAD_ARG;
+        }
+
+        // only accessed by the bus thread
+        static struct ipm_point points[IPM_HOST_POINTS];
+        size_t n = traj_pvt(traj, 0, time_ms, inc_per_rev, points,
+                            IPM_HOST_POINTS);
+        traj_free(traj);
+
+        uint32_t free;
+        uint32_t err = n > IPM_HOST_POINTS ? PROTO_ERR_BUFFER_FULL :
+                       ipm_push(node, points, n, &free);
+        if (err) {
+                return err;
+        }
+
+        put_u32(out, n);
+        put_u32(out + 4, free);
+        *out_len = 8;
+        return 0;
+}
+
+static uint32_t exec_ipm_start(void *port, uint16_t node,
+                               const uint8_t *in, uint16_t in_len,
+                               uint8_t *out, uint16_t *out_len)
+{
+        return ipm_start(port, node);
+}
+
+static uint32_t exec_ipm_stop(void *port, uint16_t node,
+                              const uint8_t *in, uint16_t in_len,
+                              uint8_t *out, uint16_t *out_len)
+{
+        return ipm_stop(port, node);
+}
+
+static uint32_t exec_ipm_get_status(void *port, uint16_t node,
+                                    const uint8_t *in, uint16_t in_len,
+                                    uint8_t *out, uint16_t *out_len)
+{
+        const struct ipm_stats *stats = ipm_stats(node);
+        if (!stats) {
+                return PROTO_ERR_NOT_ACTIVE;
+        }
+
+        put_u32(out, stats->host_depth);
+        put_u32(out + 4, stats->drive_depth);
+        put_u32(out + 8, stats->fed);
+        put_u32(out + 12, stats->underflow_warnings);
+        put_u32(out + 16, stats->underflow_errors);
+        out[20] = stats->running;
+        *out_len = 21;
+        return 0;
+}
+
+static uint32_t clamp_u32(uint64_t v)
+{
+        return v > UINT32_MAX ? UINT32_MAX : v;
+}
+
+static uint32_t exec_get_call_stats(void *port, uint16_t node,
+                                    const uint8_t *in, uint16_t in_len,
+                                    uint8_t *out, uint16_t *out_len)
+{
+        struct stat_snapshot snap;
+        if (stat_snapshot(in[0], node, &snap) == -1) {
+                return PROTO_ERR_BAD_ARG;
+        }
+
+        put_u64(out, snap.count);
+        put_u64(out + 8, snap.errors);
+        put_u32(out + 16, snap.count ? snap.sum_ns / snap.count : 0);
+        put_u32(out + 20, clamp_u32(snap.p50_ns));
+        put_u32(out + 24, clamp_u32(snap.p90_ns));
+        put_u32(out + 28, clamp_u32(snap.p99_ns));
+        put_u32(out + 32, clamp_u32(snap.p999_ns));
+        put_u32(out + 36, clamp_u32(snap.max_ns));
+        uint16_t len = 40;
+        for (int i = 0; i < STAT_ERR_CODES; i++) {
+                put_u32(out + len, snap.err_codes[i]);
+                put_u32(out + len + 4, clamp_u32(snap.err_counts[i]));
+                len += 8;
+        }
+
+        const char *name = stat_name(in[0]);
+        size_t name_len = strlen(name);
+        memcpy(out + len, name, name_len);
+        *out_len = len + name_len;
+        return 0;
+}
+
+static uint32_t exec_get_od_stats(void *port, uint16_t node,
+                                  const uint8_t *in, uint16_t in_len,
+                                  uint8_t *out, uint16_t *out_len)
+{
+        struct od_stats stats;
+        od_stats(node, &stats);
+        put_u64(out, stats.hits);
+        put_u64(out + 8, stats.misses);
+        put_u32(out + 16, stats.objects);
+        *out_len = 20;
+        return 0;
+}
+
+static uint32_t exec_get_bus_load(void *port, uint16_t node,
+                                  const uint8_t *in, uint16_t in_len,
+                                  uint8_t *out, uint16_t *out_len)
+{
+        struct busload_stats stats;
+        busload_stats(node, &stats);
+        const uint32_t fields[] = {
+                stats.bitrate, stats.limit, stats.reserved, stats.streams,
+                stats.rejected, stats.reduced,
+        };
+        uint8_t *p = out;
+        for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+                put_u32(p, fields[i]);
+                p += 4;
+        }
+
+        for (int i = 0; i < BUSLOAD_WINDOWS; i++) {
+                const struct busload_window *window = &stats.windows[i];
+                put_u32(p, window->ms);
+                put_u32(p + 4, window->total);
+                put_u32(p + 8, window->node);
+                p += 12;
+                for (int j = 0; j < BUSLOAD_CLASSES; j++) {
+                        put_u32(p, window->classes[j]);
+                        p += 4;
+                }
+        }
+
+        *out_len = p - out;
+        return 0;
+}
+
+static uint32_t exec_get_fault_stats(void *port, uint16_t node,
+                                     const uint8_t *in, uint16_t in_len,
+                                     uint8_t *out, uint16_t *out_len)
+{
+        struct fault_stats stats;
+        fault_stats(&stats);
+        out[0] = stats.down;
+        put_u32(out + 1, stats.down_ms);
+        put_u32(out + 5, stats.failures);
+        put_u32(out + 9, stats.reopens);
+        put_u32(out + 13, stats.err);
+        put_u32(out + 17, stats.last_recovery_ms);
+        put_u32(out + 21, stats.max_recovery_ms);
+        put_u64(out + 25, stats.retries);
+        put_u64(out + 33, stats.retried_ok);
+        *out_len = 41;
+        return 0;
+}
+
+#define REC_CHANNEL_SIZE 4
+
+static uint32_t exec_rec_arm(void *port, uint16_t node,
+                             const uint8_t *in, uint16_t in_len,
+                             uint8_t *out, uint16_t *out_len)
+{
+        if ((in_len - 5) % REC_CHANNEL_SIZE) {
+                return PROTO_ERR_BAD_LENGTH;
+        }
+
+        struct rec_config config = {
+                .period = get_u16(in),
+                .preceding = get_u16(in + 2),
+                .trigger = in[4],
+                .nchannels = (in_len - 5) / REC_CHANNEL_SIZE,
+        };
+        for (uint8_t i = 0; i < config.nchannels; i++) {
+                const uint8_t *p = in + 5 + i * REC_CHANNEL_SIZE;
+                config.channels[i].index = get_u16(p);
+                config.channels[i].subindex = p[2];
+                config.channels[i].size = p[3];
+        }
+
+        return rec_arm(port, node, &config);
+}
+
+static uint32_t exec_rec_trigger(void *port, uint16_t node,
+                                 const uint8_t *in, uint16_t in_len,
+                                 uint8_t *out, uint16_t *out_len)
+{
+        return rec_trigger(port, node);
+}
+
+static uint32_t exec_rec_stop(void *port, uint16_t node,
+                              const uint8_t *in, uint16_t in_len,
+                              uint8_t *out, uint16_t *out_len)
+{
+        return rec_stop(port, node);
+}
+
+static uint32_t exec_rec_get_status(void *port, uint16_t node,
+                                    const uint8_t *in, uint16_t in_len,
+                                    uint8_t *out, uint16_t *out_len)
+{
+        struct rec_status status;
+        rec_status(node, &status);
+        out[0] = status.state;
+        put_u32(out + 1, status.err);
+        put_u16(out + 5, status.samples);
+        put_u32(out + 7, status.size);
+        *out_len = 11;
+        return 0;
+}
+
+static uint32_t exec_rec_read(void *port, uint16_t node,
+                              const uint8_t *in, uint16_t in_len,
+                              uint8_t *out, uint16_t *out_len)
+{
+        ssize_t len = rec_read(node, get_u32(in), out, PROTO_MAX_PAYLOAD);
+        if (len < 0) {
+                return PROTO_ERR_NOT_ACTIVE;
+        }
+
+        *out_len = len;
+        return 0;
+}
+
+static uint32_t exec_mark_arm(void *port, uint16_t node,
+                              const uint8_t *in, uint16_t in_len,
+                              uint8_t *out, uint16_t *out_len)
+{
+        const struct mark_config config = {
+                .input = in[0],
+                .polarity = in[1],
+                .edge = in[2],
+                .mode = in[3],
+        };
+        return mark_arm(port, node, &config);
+}
+
+static uint32_t exec_mark_disarm(void *port, uint16_t node,
+                                 const uint8_t *in, uint16_t in_len,
+                                 uint8_t *out, uint16_t *out_len)
+{
+        return mark_disarm(port, node);
+}
+
+#define MARK_WAIT_EVENTS 20
+
+static uint32_t exec_mark_wait(void *port, uint16_t node,
+                               const uint8_t *in, uint16_t in_len,
+                               uint8_t *out, uint16_t *out_len)
+{
+        struct mark_event events[MARK_WAIT_EVENTS];
+        uint32_t next;
+        uint32_t lost;
+        int n = mark_read(node, get_u32(in), events, MARK_WAIT_EVENTS, &next,
+                          &lost);
+        if (n < 0) {
+                return PROTO_ERR_NOT_ACTIVE;
+        } else if (n == 0 && lost == 0) {
+                return PROTO_ERR_TIMED_OUT;
+        }
+
+        uint64_t now = now_ns();
+        put_u32(out, next);
+        put_u32(out + 4, lost);
+        uint8_t *p = out + 8;
+        for (int i = 0; i < n; i++) {
+                put_u32(p, events[i].seq);
+                put_u32(p + 4, events[i].position);
+                put_u32(p + 8, clamp_u32((now - events[i].time) / 1000));
+                p += 12;
+        }
+
+        *out_len = p - out;
+        return 0;
+}
+
+static uint32_t exec_mark_get_status(void *port, uint16_t node,
+                                     const uint8_t *in, uint16_t in_len,
+                                     uint8_t *out, uint16_t *out_len)
+{
+        struct mark_status status;
+        mark_status(node, &status);
+        out[0] = status.armed;
+        put_u16(out + 1, status.count);
+        put_u32(out + 3, status.next);
+        put_u32(out + 7, status.lost);
+        put_u32(out + 11, status.err);
+        *out_len = 15;
+        return 0;
+}
+
+static uint32_t exec_compare_arm(void *port, uint16_t node,
+                                 const uint8_t *in, uint16_t in_len,
+                                 uint8_t *out, uint16_t *out_len)
+{
+        const struct mark_compare config = {
+                .output = in[0],
+                .polarity = in[1],
+                .mode = in[2],
+                .interval_mode = in[3],
+                .direction = in[4],
+                .interval_width = get_u16(in + 5),
+                .repetitions = get_u16(in + 7),
+                .pulse_width = get_u16(in + 9),
+                .reference = get_u32(in + 11),
+        };
+        return mark_compare(port, node, &config);
+}
+
+static uint32_t exec_compare_disarm(void *port, uint16_t node,
+                                    const uint8_t *in, uint16_t in_len,
+                                    uint8_t *out, uint16_t *out_len)
+{
+        return mark_compare_off(port, node);
+}
+
+static const struct proto_cmd commands[256] = {
+        [OP_NOP] = { "nop", 0, 0, exec_nop },
+        [OP_GET_STATE] = { "get_state", 0, 0, exec_get_state },
+        [OP_SET_ENABLE_STATE] = {
+                "set_enable_state", 0, 0, exec_set_enable_state
+        },
+        [OP_SET_DISABLE_STATE] = {
+                "set_disable_state", 0, 0, exec_set_disable_state
+        },
+        [OP_SET_QUICK_STOP_STATE] = {
+                "set_quick_stop_state", 0, 0, exec_set_quick_stop_state
+        },
+        [OP_CLEAR_FAULT] = { "clear_fault", 0, 0, exec_clear_fault },
+        [OP_SET_OPERATION_MODE] = {
+                "set_operation_mode", 1, 1, exec_set_operation_mode
+        },
+        [OP_SET_WATCHDOG] = { "set_watchdog", 5, 5, exec_set_watchdog },
+        [OP_GET_WATCHDOG_STATS] = {
+                "get_watchdog_stats", 0, 0, exec_get_watchdog_stats
+        },
+        [OP_MOVE_WITH_VELOCITY] = {
+                "move_with_velocity", 4, 4, exec_move_with_velocity
+        },
+        [OP_MOVE_TO_POSITION] = {
+                "move_to_position", 6, 6, exec_move_to_position
+        },
+        [OP_HALT_VELOCITY_MOVEMENT] = {
+                "halt_velocity_movement", 0, 0, exec_halt_velocity_movement
+        },
+        [OP_HALT_POSITION_MOVEMENT] = {
+                "halt_position_movement", 0, 0, exec_halt_position_movement
+        },
+        [OP_SET_VELOCITY_PROFILE] = {
+                "set_velocity_profile", 8, 8, exec_set_velocity_profile
+        },
+        [OP_SET_POSITION_PROFILE] = {
+                "set_position_profile", 12, 12, exec_set_position_profile
+        },
+        [OP_SET_POSITION_MUST] = {
+                "set_position_must", 4, 4, exec_set_position_must
+        },
+        [OP_SET_CURRENT_MUST] = {
+                "set_current_must", 4, 4, exec_set_current_must
+        },
+        [OP_HOME_START] = { "home_start", 28, 28, exec_home_start },
+        [OP_HOME_STOP] = { "home_stop", 0, 0, exec_home_stop },
+        [OP_HOME_GET_STATUS] = {
+                "home_get_status", 0, 0, exec_home_get_status
+        },
+        [OP_SET_OBJECT] = {
+                "set_object", 4, 3 + PROTO_MAX_OBJECT_SIZE, exec_set_object
+        },
+        [OP_GET_OBJECT] = { "get_object", 4, 4, exec_get_object },
+        [OP_GET_TELEMETRY] = {
+                "get_telemetry", 0, 0, exec_get_telemetry
+        },
+        [OP_MARK_ARM] = { "mark_arm", 4, 4, exec_mark_arm },
+        [OP_MARK_DISARM] = { "mark_disarm", 0, 0, exec_mark_disarm },
+        [OP_MARK_WAIT] = { "mark_wait", 8, 8, exec_mark_wait },
+        [OP_MARK_GET_STATUS] = {
+                "mark_get_status", 0, 0, exec_mark_get_status
+        },
+        [OP_COMPARE_ARM] = { "compare_arm", 15, 15, exec_compare_arm },
+        [OP_COMPARE_DISARM] = {
+                "compare_disarm", 0, 0, exec_compare_disarm
+        },
+        [OP_PDO_SETPOINT] = {
+                "pdo_setpoint", 5, 1 + 4 * PDO_MAX_ENTRIES, exec_pdo_setpoint,
+                frame_pdo_setpoint
+        },
+        [OP_SYNC] = { "sync", 0, 0, exec_sync, frame_sync },
+        [OP_GET_CYCLE_STATS] = {
+                "get_cycle_stats", 0, 0, exec_get_cycle_stats
+        },
+        [OP_GET_SETPOINT_STATS] = {
+                "get_setpoint_stats", 0, 0, exec_get_setpoint_stats
+        },
+        [OP_GET_UDP_STATS] = {
+                "get_udp_stats", 0, 0, exec_get_udp_stats
+        },
+        [OP_IPM_ACTIVATE] = { "ipm_activate", 0, 0, exec_ipm_activate },
+        [OP_IPM_ADD_POINTS] = {
+                "ipm_add_points", IPM_POINT_SIZE,
+                PROTO_MAX_PAYLOAD / IPM_POINT_SIZE * IPM_POINT_SIZE,
+                exec_ipm_add_points
+        },
+        [OP_IPM_PLAN] = {
+                "ipm_plan", IPM_PLAN_HDR_SIZE + 8,
+                IPM_PLAN_HDR_SIZE + (PROTO_MAX_PAYLOAD - IPM_PLAN_HDR_SIZE) /
+                                    4 * 4,
+                exec_ipm_plan
+        },
+        [OP_IPM_START] = { "ipm_start", 0, 0, exec_ipm_start },
+        [OP_IPM_STOP] = { "ipm_stop", 0, 0, exec_ipm_stop },
+        [OP_IPM_GET_STATUS] = {
+                "ipm_get_status", 0, 0, exec_ipm_get_status
+        },
+        [OP_GET_CALL_STATS] = {
+                "get_call_stats", 1, 1, exec_get_call_stats
+        },
+        [OP_GET_OD_STATS] = { "get_od_stats", 0, 0, exec_get_od_stats },
+        [OP_GET_BUS_LOAD] = { "get_bus_load", 0, 0, exec_get_bus_load },
+        [OP_GET_FAULT_STATS] = {
+                "get_fault_stats", 0, 0, exec_get_fault_stats
+        },
+        [OP_REC_ARM] = {
+                "rec_arm", 5 + REC_CHANNEL_SIZE,
+                5 + REC_MAX_CHANNELS * REC_CHANNEL_SIZE, exec_rec_arm
+        },
+        [OP_REC_TRIGGER] = { "rec_trigger", 0, 0, exec_rec_trigger },
+        [OP_REC_STOP] = { "rec_stop", 0, 0, exec_rec_stop },
+        [OP_REC_GET_STATUS] = {
+                "rec_get_status", 0, 0, exec_rec_get_status
+        },
+        [OP_REC_READ] = { "rec_read", 4, 4, exec_rec_read },
+};
+
+size_t proto_execute(void *port, uint8_t op, uint8_t node,
+                     const uint8_t *in, uint16_t in_len, uint8_t *out)
+{
+        const struct proto_cmd *cmd = &commands[op];
+        uint16_t resp_len = 0;
+        uint32_t err;
+        if (!cmd->exec) {
+                err = PROTO_ERR_UNKNOWN_OP;
+        } else if (in_len < cmd->min_len || in_len > cmd->max_len) {
+                err = PROTO_ERR_BAD_LENGTH;
+        } else {
+                err = cmd->exec(port, node, in, in_len,
+                                out + PROTO_RESP_HDR_SIZE, &resp_len);
+        }
+
+        if (err) {
+                resp_len = 0;
+        }
+
+        proto_response(out, op, node, err);
+        put_u16(out, PROTO_RESP_HDR_SIZE - PROTO_LEN_SIZE + resp_len);
+        return PROTO_RESP_HDR_SIZE + resp_len;
+}
+
+int proto_addressed(uint8_t op)
+{
+        switch (op) {
+        case OP_NOP:
+        case OP_SYNC:
+        case OP_GET_CYCLE_STATS:
+        case OP_GET_CALL_STATS:
+        case OP_GET_BUS_LOAD:
+        case OP_GET_FAULT_STATS:
+        case OP_GET_UDP_STATS:
+        case OP_SET_WATCHDOG:
+        case OP_GET_WATCHDOG_STATS:
+                return 0;
+        default:
+                return 1;
+        }
+}
+
+int proto_local(uint8_t op)
+{
+        switch (op) {
+        case OP_NOP:
+        case OP_SET_WATCHDOG:
+        case OP_GET_WATCHDOG_STATS:
+        case OP_HOME_GET_STATUS:
+        case OP_GET_CYCLE_STATS:
+        case OP_GET_SETPOINT_STATS:
+        case OP_GET_UDP_STATS:
+        case OP_IPM_GET_STATUS:
+        case OP_GET_CALL_STATS:
+        case OP_GET_OD_STATS:
+        case OP_GET_BUS_LOAD:
+        case OP_GET_FAULT_STATS:
+        case OP_REC_GET_STATUS:
+        case OP_REC_READ:
+        case OP_MARK_WAIT:
+        case OP_MARK_GET_STATUS:
+                return 1;
+        default:
+                return 0;
+        }
+}
+
+int proto_retry(uint8_t op, const uint8_t *in, uint16_t in_len)
+{
+        switch (op) {
+        case OP_GET_STATE:
+        case OP_SET_ENABLE_STATE:
+        case OP_SET_DISABLE_STATE:
+        case OP_SET_QUICK_STOP_STATE:
+        case OP_CLEAR_FAULT:
+        case OP_SET_OPERATION_MODE:
+        case OP_MOVE_WITH_VELOCITY:
+        case OP_HALT_VELOCITY_MOVEMENT:
+        case OP_HALT_POSITION_MOVEMENT:
+        case OP_SET_VELOCITY_PROFILE:
+        case OP_SET_POSITION_PROFILE:
+        case OP_SET_POSITION_MUST:
+        case OP_SET_CURRENT_MUST:
+        case OP_SET_OBJECT:
+        case OP_GET_OBJECT:
+        case OP_GET_TELEMETRY:
+                return 1;
+        case OP_MOVE_TO_POSITION:
+                // a relative move would be made twice if the first one got
+                // through and only its answer was lost
+                return in_len == commands[op].max_len && in[4];
+        default:
+                return 0;
+        }
+}
+
+int proto_setpoint(uint8_t op, uint8_t node, const uint8_t *in,
+                   uint16_t in_len, uint32_t *key)
+{
+        // malformed requests must not replace anything
+        const struct proto_cmd *cmd = &commands[op];
+        if (in_len < cmd->min_len || in_len > cmd->max_len) {
+                return 0;
+        }
+
+        switch (op) {
+        case OP_MOVE_WITH_VELOCITY:
+        case OP_SET_POSITION_MUST:
+        case OP_SET_CURRENT_MUST:
+                *key = (uint32_t)op << 16 | node;
+                return 1;
+        case OP_PDO_SETPOINT:
+                // every RPDO carries a setpoint of its own
+                *key = (uint32_t)op << 16 | in[0] << 8 | node;
+                return 1;
+        default:
+                return 0;
+        }
+}
+
+int proto_wait(uint8_t op, const uint8_t *in, uint16_t in_len,
+               uint32_t *timeout)
+{
+        const struct proto_cmd *cmd = &commands[op];
+        if (op != OP_MARK_WAIT || in_len < cmd->min_len ||
+            in_len > cmd->max_len) {
+                return 0;
+        }
+
+        *timeout = get_u32(in + 4);
+        if (*timeout > PROTO_MAX_WAIT_MS) {
+                *timeout = PROTO_MAX_WAIT_MS;
+        }
+
+        return 1;
+}
+
+int proto_motion(uint8_t op)
+{
+        switch (op) {
+        case OP_MOVE_WITH_VELOCITY:
+        case OP_MOVE_TO_POSITION:
+        case OP_SET_POSITION_MUST:
+        case OP_SET_CURRENT_MUST:
+        case OP_PDO_SETPOINT:
+        case OP_HOME_START:
+        case OP_IPM_START:
+                return 1;
+        default:
+                return 0;
+        }
+}
+
+uint32_t proto_frame(uint8_t op, uint8_t node, const uint8_t *in,
+                     uint16_t in_len, struct can_frame *frame)
+{
+        const struct proto_cmd *cmd = &commands[op];
+        if (!cmd->frame) {
+                return PROTO_ERR_UNKNOWN_OP;
+        } else if (in_len < cmd->min_len || in_len > cmd->max_len) {
+                return PROTO_ERR_BAD_LENGTH;
+        }
+
+        return cmd->frame(node, in, in_len, frame);
+}
+
+size_t proto_response(uint8_t *out, uint8_t op, uint8_t node, uint32_t err)
+{
+        put_u16(out, PROTO_RESP_HDR_SIZE - PROTO_LEN_SIZE);
+        out[2] = op | PROTO_OP_RESPONSE;
+        out[3] = node;
+        put_u32(out + 4, err);
+        return PROTO_RESP_HDR_SIZE;
+}
+
+void proto_tag(uint8_t *out, const uint8_t *frame, uint32_t id)
+{
+        put_u16(out, (get_u16(frame) + PROTO_TAG_SIZE) | PROTO_LEN_TAGGED);
+        put_u32(out + PROTO_LEN_SIZE, id);
+}
+
+ssize_t proto_process(const uint8_t *buf, size_t len, proto_submit_fn submit,
+                      void *ctx)
+{
+        size_t pos = 0;
+        while (len - pos >= PROTO_LEN_SIZE) {
+                const uint8_t *frame = buf + pos;
+                uint16_t frame_len = get_u16(frame);
+                int tagged = !!(frame_len & PROTO_LEN_TAGGED);
+                size_t hdr_size = PROTO_HDR_SIZE + tagged * PROTO_TAG_SIZE;
+                frame_len &= ~PROTO_LEN_TAGGED;
+                if (frame_len < hdr_size - PROTO_LEN_SIZE ||
+                    frame_len > hdr_size - PROTO_LEN_SIZE + PROTO_MAX_PAYLOAD) {
+                        return -1;
+                }
+
+                if (len - pos < PROTO_LEN_SIZE + frame_len) {
+                        break;
+                }
+
+                const uint8_t *hdr = frame + hdr_size - PROTO_HDR_SIZE;
+                uint32_t id = tagged ? get_u32(frame + PROTO_LEN_SIZE) : 0;
+                if (submit(ctx, hdr[2], hdr[3], frame + hdr_size,
+                           frame_len + PROTO_LEN_SIZE - hdr_size, tagged,
+                           id) == -1) {
+                        break;
+                }
+
+                pos += PROTO_LEN_SIZE + frame_len;
+        }
+
+        return pos;
+}
+
+uint32_t proto_sdo(uint8_t op, uint8_t node, const uint8_t *in,
+                   uint16_t in_len, struct sdo_req *req)
+{
+        if (op == OP_SET_OBJECT && in_len > 3 && in_len <= 3 + SDO_MAX_SIZE) {
+                *req = (struct sdo_req){
+                        .node = node,
+                        .index = get_u16(in),
+                        .subindex = in[2],
+                        .len = in_len - 3,
+                };
+                memcpy(req->data, in + 3, req->len);
+                return 0;
+        } else if (op == OP_GET_OBJECT && in_len == 4 && in[3] > 0 &&
+                   in[3] <= SDO_MAX_SIZE) {
+                *req = (struct sdo_req){
+                        .node = node,
+                        .upload = 1,
+                        .index = get_u16(in),
+                        .subindex = in[2],
+                        .len = in[3],
+                };
+                return 0;
+        }
+
+        return PROTO_ERR_UNKNOWN_OP;
+}
+
+size_t proto_sdo_response(uint8_t *out, uint8_t op, uint8_t node,
+                          const struct sdo_req *req)
+{
+        size_t len = proto_response(out, op, node, req->err);
+        if (req->err || !req->upload) {
+                return len;
+        }
+
+        memcpy(out + len, req->data, req->len);
+        put_u16(out, PROTO_RESP_HDR_SIZE - PROTO_LEN_SIZE + req->len);
+        return len + req->len;
+}
@@ -0,0 +1,357 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/can.h>
+
+struct sdo_req;
+
+// Binary command protocol spoken over client connections.
+//
+// Every frame starts with a little-endian 16-bit length counting the bytes
+// that follow it, then the opcode and the id of the node the command is
+// addressed to. All multi-byte fields are little-endian.
+//
+//   request:  | len:u16 | op:u8 | node:u8 | payload...          |
+//   response: | len:u16 | op:u8 | node:u8 | err:u32 | payload... |
+//
+// Responses echo the request opcode with PROTO_OP_RESPONSE set. err is 0 on
+// success, the libEposCmd error code if the library call failed or one of the
+// PROTO_ERR_* codes if the request could not be dispatched at all.
+//
+// Several frames may be sent back to back without waiting for the responses;
+// responses are sent in request order.
+//
+// Requests may instead be tagged with an id chosen by the client. Tagged
+// frames have PROTO_LEN_TAGGED set in their length, which then also counts
+// the id following it:
+//
+//   request:  | len:u16 | id:u32 | op:u8 | node:u8 | payload...          |
+//   response: | len:u16 | id:u32 | op:u8 | node:u8 | err:u32 | payload... |
+//
+// The response to a tagged request carries its id and is sent as soon as the
+// request has been carried out, which is not necessarily in request order, so
+// clients can keep many requests in flight and match the responses by id.
+// Tagged and untagged requests can be mixed on the same connection.
+//
+// Setpoints (see proto_setpoint()) only matter until the next one for the
+// same node and kind arrives. A setpoint still waiting to be sent when a newer
+// one comes in is dropped and answered with PROTO_ERR_SUPERSEDED, so clients
+// sending faster than the bus can carry never build up a backlog.
+
+#define PROTO_LEN_SIZE          2
+#define PROTO_HDR_SIZE          (PROTO_LEN_SIZE + 2)
+#define PROTO_RESP_HDR_SIZE     (PROTO_HDR_SIZE + 4)
+#define PROTO_MAX_PAYLOAD       256
+#define PROTO_MAX_FRAME         (PROTO_RESP_HDR_SIZE + PROTO_MAX_PAYLOAD)
+
+// set in the length of tagged frames, which carry an id of PROTO_TAG_SIZE
+// bytes after the length
+#define PROTO_LEN_TAGGED        0x8000
+#define PROTO_TAG_SIZE          4
+#define PROTO_TAG_HDR_SIZE      (PROTO_LEN_SIZE + PROTO_TAG_SIZE)
+
+// longest a request is held back (see proto_wait()), which also bounds how
+// long a closed connection stays around for it
+#define PROTO_MAX_WAIT_MS       10000
+
+// largest object that can be transferred by OP_SET_OBJECT/OP_GET_OBJECT
+#define PROTO_MAX_OBJECT_SIZE   (PROTO_MAX_PAYLOAD - 4)
+
+#define PROTO_OP_RESPONSE       0x80
+
+// error codes which are not produced by libEposCmd
+#define PROTO_ERR_UNKNOWN_OP    0xf0000001
+#define PROTO_ERR_BAD_LENGTH    0xf0000002
+#define PROTO_ERR_NOT_MAPPED    0xf0000003 // RPDO not configured on the node
+#define PROTO_ERR_TX_FAILED     0xf0000004 // CAN frame could not be queued
+#define PROTO_ERR_UNKNOWN_NODE  0xf0000005 // node not in the node table
+#define PROTO_ERR_BUFFER_FULL   0xf0000006 // no room to queue the request
+#define PROTO_ERR_NOT_ACTIVE    0xf0000007 // node not in the required mode
+#define PROTO_ERR_CYCLIC        0xf0000008 // SYNC is sent by the cycle thread
+#define PROTO_ERR_BAD_ARG       0xf0000009 // payload field out of range
+#define PROTO_ERR_SUPERSEDED    0xf000000a // replaced by a newer setpoint
+                                           // before it was sent
+#define PROTO_ERR_CANCELLED     0xf000000b // the session was stopped by its
+                                           // watchdog before it was sent
+#define PROTO_ERR_BUS_LOAD      0xf000000c // the stream would exceed the bus
+                                           // load threshold (see busload.h)
+#define PROTO_ERR_HOMING        0xf000000d // the drive reported a homing
+                                           // error
+#define PROTO_ERR_TIMED_OUT     0xf000000e // not done within its timeout
+#define PROTO_ERR_PORT_DOWN     0xf000000f // the port failed and is being
+                                           // opened again (see fault.h)
+
+enum proto_op {
+        // no operation, answered with an empty response (payload: -)
+        OP_NOP                          = 0x00,
+
+        // state machine
+        OP_GET_STATE                    = 0x01, // - -> state:u16
+        OP_SET_ENABLE_STATE             = 0x02, // -
+        OP_SET_DISABLE_STATE            = 0x03, // -
+        OP_SET_QUICK_STOP_STATE         = 0x04, // -
+        OP_CLEAR_FAULT                  = 0x05, // -
+        OP_SET_OPERATION_MODE           = 0x06, // mode:i8
+
+        // connection watchdog (see watchdog.h, node is ignored)
+        OP_SET_WATCHDOG                 = 0x07, // timeout_ms:u32 action:u8
+                                                // (timeout 0 disarms,
+                                                // action 0 quick stop,
+                                                // 1 halt velocity movement)
+        OP_GET_WATCHDOG_STATS           = 0x08, // - -> expired:u64
+                                                // disconnects:u64 stops:u64
+                                                // failed:u64 dropped:u64
+                                                // urgent:u64
+                                                // max_reaction_us:u32
+                                                // hist:u32[16] (see bus.h)
+
+        // motion
+        OP_MOVE_WITH_VELOCITY           = 0x10, // velocity:i32
+        OP_MOVE_TO_POSITION             = 0x11, // position:i32 absolute:u8
+                                                // immediately:u8
+        OP_HALT_VELOCITY_MOVEMENT       = 0x12, // -
+        OP_HALT_POSITION_MOVEMENT       = 0x13, // -
+        OP_SET_VELOCITY_PROFILE         = 0x14, // acceleration:u32
+                                                // deceleration:u32
+        OP_SET_POSITION_PROFILE         = 0x15, // velocity:u32
+                                                // acceleration:u32
+                                                // deceleration:u32
+        OP_SET_POSITION_MUST            = 0x16, // position:i32
+        OP_SET_CURRENT_MUST             = 0x17, // current:i32 (mA)
+
+        // homing of several axes at once (see home.h)
+        OP_HOME_START                   = 0x18, // method:i8 group:u8
+                                                // acceleration:u32
+                                                // speed_switch:u32
+                                                // speed_index:u32
+                                                // offset:i32
+                                                // current_threshold:u16
+                                                // position:i32
+                                                // timeout_ms:u32
+        OP_HOME_STOP                    = 0x19, // -
+        OP_HOME_GET_STATUS              = 0x1a, // - -> state:u8 group:u8
+                                                // err:u32 elapsed_ms:u32
+
+        // object dictionary
+        OP_SET_OBJECT                   = 0x20, // index:u16 subindex:u8
+                                                // data:u8[1..]
+        OP_GET_OBJECT                   = 0x21, // index:u16 subindex:u8
+                                                // size:u8 -> data:u8[size]
+
+        // telemetry
+        OP_GET_TELEMETRY                = 0x30, // - -> statusword:u16
+                                                // position:i32 velocity:i32
+                                                // current:i32 samples:u32
+                                                // age_us:u32
+
+        // position marker and compare (see mark.h)
+        OP_MARK_ARM                     = 0x31, // input:u8 polarity:u8
+                                                // edge:u8 mode:u8
+        OP_MARK_DISARM                  = 0x32, // -
+        OP_MARK_WAIT                    = 0x33, // cursor:u32 timeout_ms:u32
+                                                // -> next:u32 lost:u32
+                                                // (seq:u32 position:i32
+                                                // age_us:u32)[0..20]
+                                                // events from cursor on,
+                                                // PROTO_ERR_TIMED_OUT if
+                                                // there are none (see
+                                                // proto_wait())
+        OP_MARK_GET_STATUS              = 0x34, // - -> armed:u8 count:u16
+                                                // next:u32 lost:u32 err:u32
+        OP_COMPARE_ARM                  = 0x35, // output:u8 polarity:u8
+                                                // mode:u8 interval_mode:u8
+                                                // direction:u8
+                                                // interval_width:u16
+                                                // repetitions:u16
+                                                // pulse_width:u16
+                                                // reference:i32
+        OP_COMPARE_DISARM               = 0x36, // -
+
+        // process data, sent as single CAN frames without response from the
+        // node (see proto_frame()); with the cycle thread running, setpoints
+        // are sent with its next SYNC, OP_SYNC is rejected and so is the
+        // first setpoint of an RPDO the bus has no room for
+        OP_PDO_SETPOINT                 = 0x40, // rpdo:u8 values:i32[n], one
+                                                // per entry mapped into rpdo
+        OP_SYNC                         = 0x41, // - (node is ignored)
+        OP_GET_CYCLE_STATS              = 0x42, // - -> cycles:u32
+                                                // overruns:u32
+                                                // max_latency_us:u32
+                                                // hist:u32[16] (see cycle.h)
+                                                // superseded:u32
+        OP_GET_SETPOINT_STATS           = 0x43, // - -> superseded:u64
+                                                // dropped:u64
+                                                // setpoints to the node
+                                                // replaced by newer ones and
+                                                // not sent at all
+        OP_GET_UDP_STATS                = 0x44, // - -> datagrams:u64
+                                                // stale:u64 lost:u64
+                                                // malformed:u64
+                                                // setpoints:u64
+                                                // rejected:u64
+                                                // overflows:u64
+                                                // superseded:u64
+                                                // failed:u64
+                                                // (see udp.h, node is
+                                                // ignored)
+
+        // interpolated position mode (see ipm.h)
+        OP_IPM_ACTIVATE                 = 0x50, // -
+        OP_IPM_ADD_POINTS               = 0x51, // (position:i32 velocity:i32
+                                                // time:u8)[1..28]
+                                                // -> free:u32
+        OP_IPM_START                    = 0x52, // -
+        OP_IPM_STOP                     = 0x53, // -
+        OP_IPM_GET_STATUS               = 0x54, // - -> host_depth:u32
+                                                // drive_depth:u32 fed:u32
+                                                // underflow_warnings:u32
+                                                // underflow_errors:u32
+                                                // running:u8
+        OP_IPM_PLAN                     = 0x55, // time_ms:u8
+                                                // inc_per_rev:u32
+                                                // velocity:u32 (inc/s)
+                                                // acceleration:u32
+                                                // (inc/s^2) jerk:u32
+                                                // (inc/s^3)
+                                                // (position:i32)[2..59]
+                                                // -> points:u32 free:u32
+                                                // (plans a jerk-limited move
+                                                // through the positions, of
+                                                // which the first is the
+                                                // start, and queues it as
+                                                // PVT points time_ms apart,
+                                                // see traj.h)
+
+        // diagnostics
+        OP_GET_CALL_STATS               = 0x60, // fn:u8 -> count:u64
+                                                // errors:u64 mean_ns:u32
+                                                // p50_ns:u32 p90_ns:u32
+                                                // p99_ns:u32 p999_ns:u32
+                                                // max_ns:u32
+                                                // (code:u32 count:u32)[4]
+                                                // name:char[]
+                                                // calls of library function
+                                                // fn for node, 0 for calls
+                                                // not addressed to a node
+                                                // (see stats.h)
+        OP_GET_OD_STATS                 = 0x61, // - -> hits:u64 misses:u64
+                                                // objects:u32
+                                                // object dictionary shadow
+                                                // of the node (see od.h)
+        OP_GET_BUS_LOAD                 = 0x62, // - -> bitrate:u32 limit:u32
+                                                // reserved:u32 streams:u32
+                                                // rejected:u32 reduced:u32
+                                                // (ms:u32 total:u32 node:u32
+                                                // class:u32[6])[3]
+                                                // in bit/s over 10 ms, 100 ms
+                                                // and 1 s, classes NMT, SYNC,
+                                                // EMCY, PDO, SDO and others,
+                                                // node 0 for broadcasts
+                                                // (see busload.h)
+        OP_GET_FAULT_STATS              = 0x63, // - -> down:u8 down_ms:u32
+                                                // failures:u32 reopens:u32
+                                                // err:u32
+                                                // last_recovery_ms:u32
+                                                // max_recovery_ms:u32
+                                                // retries:u64
+                                                // retried_ok:u64
+                                                // (see fault.h, node is
+                                                // ignored)
+
+        // data recorder (see rec.h)
+        OP_REC_ARM                      = 0x70, // period:u16 preceding:u16
+                                                // trigger:u8
+                                                // (index:u16 subindex:u8
+                                                // size:u8)[1..4]
+        OP_REC_TRIGGER                  = 0x71, // -
+        OP_REC_STOP                     = 0x72, // -
+        OP_REC_GET_STATUS               = 0x73, // - -> state:u8 err:u32
+                                                // samples:u16 size:u32
+        OP_REC_READ                     = 0x74, // offset:u32
+                                                // -> data:u8[0..256], the
+                                                // capture from offset on
+};
+
+// Called for every complete request frame found by proto_process(). payload
+// points into the receive buffer and is only valid during the call; id is
+// only set if the request is tagged. Returns -1 if the request cannot be
+// accepted right now, in which case processing stops in front of this frame.
+typedef int (*proto_submit_fn)(void *ctx, uint8_t op, uint8_t node,
+                               const uint8_t *payload, uint16_t len,
+                               int tagged, uint32_t id);
+
+// Split buf into request frames and hand every complete frame to submit.
+// Incomplete trailing frames are left untouched so the caller can complete
+// them with the next read.
+//
+// Returns the number of bytes consumed from buf or -1 if the stream contains
+// a frame which can never be valid (the connection should be dropped then).
+ssize_t proto_process(const uint8_t *buf, size_t len, proto_submit_fn submit,
+                      void *ctx);
+
+// Execute a request by calling into the library and write the response frame
+// to out, which must have room for PROTO_MAX_FRAME bytes. Requests with an
+// unknown opcode or a bad payload length are answered with an error. Returns
+// the size of the response frame.
+size_t proto_execute(void *port, uint8_t op, uint8_t node,
+                     const uint8_t *in, uint16_t in_len, uint8_t *out);
+
+// Whether a request is addressed to the node in its header. Requests which
+// are not ignore the node id.
+int proto_addressed(uint8_t op);
+
+// Build the CAN frame of a request which consists of nothing but sending a
+// single frame (OP_PDO_SETPOINT and OP_SYNC), so the caller can send it
+// directly instead of through the library. Returns PROTO_ERR_UNKNOWN_OP for
+// all other requests, otherwise 0 or the error code to respond with.
+uint32_t proto_frame(uint8_t op, uint8_t node, const uint8_t *in,
+                     uint16_t in_len, struct can_frame *frame);
+
+// Whether a request sets a value which a later request with the same key
+// replaces entirely, so only the latest one needs to be carried out
+// (OP_MOVE_WITH_VELOCITY, OP_SET_POSITION_MUST, OP_SET_CURRENT_MUST and
+// OP_PDO_SETPOINT). Sets key if so.
+int proto_setpoint(uint8_t op, uint8_t node, const uint8_t *in,
+                   uint16_t in_len, uint32_t *key);
+
+// Whether a request waits for something to report (OP_MARK_WAIT). If it is
+// tagged, it is held back while it would be answered with
+// PROTO_ERR_TIMED_OUT, at most timeout ms (up to PROTO_MAX_WAIT_MS);
+// otherwise it is answered at once. Sets timeout if so.
+int proto_wait(uint8_t op, const uint8_t *in, uint16_t in_len,
+               uint32_t *timeout);
+
+// Whether a request is carried out without the library, so it can be while
+// the port is down (statistics and state kept by the server).
+int proto_local(uint8_t op);
+
+// Whether a request may be repeated after a transient error (see fault.h)
+// without doing more than once what it was meant to do once, e.g. because it
+// sets an absolute value or only reads.
+int proto_retry(uint8_t op, const uint8_t *in, uint16_t in_len);
+
+// Whether a request may set the node in its header in motion (motion
+// commands, setpoints, OP_HOME_START and OP_IPM_START).
+int proto_motion(uint8_t op);
+
+// Write a response frame without payload to out. Returns its size.
+size_t proto_response(uint8_t *out, uint8_t op, uint8_t node, uint32_t err);
+
+// Write the PROTO_TAG_HDR_SIZE bytes which turn the response frame into the
+// response to a tagged request with id to out. The tagged frame continues
+// with the untagged one from frame + PROTO_LEN_SIZE on.
+void proto_tag(uint8_t *out, const uint8_t *frame, uint32_t id);
+
+// Turn an object dictionary request for an object of up to SDO_MAX_SIZE bytes
+// into an SDO transfer, so the caller can run it concurrently with transfers
+// to other nodes (see sdo.h). Returns PROTO_ERR_UNKNOWN_OP for all other
+// requests, otherwise 0.
+uint32_t proto_sdo(uint8_t op, uint8_t node, const uint8_t *in,
+                   uint16_t in_len, struct sdo_req *req);
+
+// Write the response frame to a request prepared by proto_sdo() once its
+// transfer is done. Returns its size.
+size_t proto_sdo_response(uint8_t *out, uint8_t op, uint8_t node,
+                          const struct sdo_req *req);
@@ -0,0 +1,266 @@
+#include "rec.h"
+#include "busload.h"
+#include "epos.h"
+#include "proto.h"
+#include "stats.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define REC_MAX_NODES           128
+
+// poll period while a recorder is armed, and while none is, in ms
+#define REC_POLL_PERIOD         10
+#define REC_IDLE_PERIOD         100
+
+struct rec_node {
+        struct rec_config config;
+        struct rec_status status;
+        uint8_t *capture; // status.size bytes once REC_READY
+};
+
+// only accessed by the bus thread
+static struct rec_node *nodes[REC_MAX_NODES];
+static uint16_t active[REC_MAX_NODES];
+static size_t nactive;
+static uint8_t buffer[REC_MAX_BUFFER]; // drive buffer being decoded
+
+static int rec_valid(const struct rec_config *config)
+{
+        if (config->period == 0 || config->nchannels == 0 ||
+            config->nchannels > REC_MAX_CHANNELS) {
+                return 0;
+        }
+
+        for (uint8_t i = 0; i < config->nchannels; i++) {
+                uint8_t size = config->channels[i].size;
+                if (size != 1 && size != 2 && size != 4) {
+                        return 0;
+                }
+        }
+
+        return 1;
+}
+
+static void rec_discard(struct rec_node *node)
+{
+        free(node->capture);
+        node->capture = NULL;
+        memset(&node->status, 0, sizeof(node->status));
+}
+
+uint32_t rec_arm(void *port, uint16_t node_id, const struct rec_config *config)
+{
+        if (node_id >= REC_MAX_NODES) {
+                return PROTO_ERR_UNKNOWN_NODE;
+        } else if (!rec_valid(config)) {
+                return PROTO_ERR_BAD_ARG;
+        }
+
+        struct rec_node *node = nodes[node_id];
+        if (!node) {
+                node = calloc(1, sizeof(*node));
+                if (!node) {
+                        die("failed to allocate data recorder", 0);
+                }
+
+                nodes[node_id] = node;
+                active[nactive++] = node_id;
+        }
+
+        rec_discard(node);
+
+        uint32_t err;
+        if (!STAT(VCS_StopRecorder, node_id, err, port, node_id, &err) ||
+            !STAT(VCS_DeactivateAllChannels, node_id, err, port, node_id,
+                  &err)) {
+                return err;
+        }
+
+        for (uint8_t i = 0; i < config->nchannels; i++) {
+                const struct rec_channel *channel = &config->channels[i];
+                if (!STAT(VCS_ActivateChannel, node_id, err, port, node_id,
+                          i + 1, channel->index, channel->subindex,
+                          channel->size, &err)) {
+                        return err;
+                }
+        }
+
+        if (!STAT(VCS_SetRecorderParameter, node_id, err, port, node_id,
+                  config->period, config->preceding, &err) ||
+            !STAT(VCS_DisableAllTriggers, node_id, err, port, node_id,
+                  &err) ||
+            (config->trigger &&
+             !STAT(VCS_EnableTrigger, node_id, err, port, node_id,
+                   config->trigger, &err)) ||
+            !STAT(VCS_StartRecorder, node_id, err, port, node_id, &err)) {
+                return err;
+        }
+
+        node->config = *config;
+        node->status.state = REC_ARMED;
+        return config->trigger ? 0 : rec_trigger(port, node_id);
+}
+
+uint32_t rec_trigger(void *port, uint16_t node_id)
+{
+        struct rec_node *node = node_id < REC_MAX_NODES ? nodes[node_id] :
+                                NULL;
+        if (!node || node->status.state != REC_ARMED) {
+                return PROTO_ERR_NOT_ACTIVE;
+        }
+
+        uint32_t err;
+        if (!STAT(VCS_ForceTrigger, node_id, err, port, node_id, &err)) {
+                return err;
+        }
+
+        node->status.state = REC_TRIGGERED;
+        return 0;
+}
+
+uint32_t rec_stop(void *port, uint16_t node_id)
+{
+        if (node_id >= REC_MAX_NODES) {
+                return PROTO_ERR_UNKNOWN_NODE;
+        }
+
+        if (nodes[node_id]) {
+                rec_discard(nodes[node_id]);
+        }
+
+        uint32_t err;
+        return STAT(VCS_StopRecorder, node_id, err, port, node_id, &err) ?
+               0 : err;
+}
+
+// Download the drive buffer of a node whose recorder is done and decode it
+// into a capture. Returns 0 or the library error code.
+static uint32_t rec_download(void *port, uint16_t node_id,
+                             struct rec_node *node)
+{
+        uint32_t err;
+        uint32_t read = 0;
+        uint16_t start = 0;
+        uint16_t max = 0;
+        uint16_t samples = 0;
+        if (!STAT(VCS_ReadDataBuffer, node_id, err, port, node_id, buffer,
+                  sizeof(buffer), &read, &start, &max, &samples, &err)) {
+                return err;
+        }
+
+        // the buffer is uploaded in segments of 7 bytes
+        busload_expect(BUSLOAD_SDO, node_id, 8, 2 * ((read + 6) / 7));
+
+        const struct rec_config *config = &node->config;
+        size_t size = REC_HEADER_SIZE(config->nchannels);
+        for (uint8_t i = 0; i < config->nchannels; i++) {
+                size += (size_t)samples * config->channels[i].size;
+        }
+
+        uint8_t *capture = malloc(size);
+        if (!capture) {
+                die("failed to allocate data recorder capture", 0);
+        }
+
+        uint8_t *p = capture;
+        *p++ = samples;
+        *p++ = samples >> 8;
+        *p++ = config->period;
+        *p++ = config->period >> 8;
+        *p++ = config->nchannels;
+        for (uint8_t i = 0; i < config->nchannels; i++) {
+                const struct rec_channel *channel = &config->channels[i];
+                *p++ = channel->index;
+                *p++ = channel->index >> 8;
+                *p++ = channel->subindex;
+                *p++ = channel->size;
+        }
+
+        for (uint8_t i = 0; i < config->nchannels; i++) {
+                uint32_t column = (uint32_t)samples * config->channels[i].size;
+                if (column &&
+                    !STAT(VCS_ExtractChannelDataVector, node_id, err, port,
+                          node_id, i + 1, buffer, read, p, column, start, max,
+                          samples, &err)) {
+                        free(capture);
+                        return err;
+                }
+
+                p += column;
+        }
+
+        node->capture = capture;
+        node->status.samples = samples;
+        node->status.size = size;
+        return 0;
+}
+
+// Advance the state of an armed recorder. Returns whether it still is.
+static int rec_watch(void *port, uint16_t node_id, struct rec_node *node)
+{
+        uint32_t err;
+        struct rec_status *status = &node->status;
+        if (status->state == REC_ARMED) {
+                int triggered = 0;
+                if (!STAT(VCS_IsRecorderTriggered, node_id, err, port,
+                          node_id, &triggered, &err) || !triggered) {
+                        return 1;
+                }
+
+                status->state = REC_TRIGGERED;
+        }
+
+        int running = 1;
+        if (!STAT(VCS_IsRecorderRunning, node_id, err, port, node_id,
+                  &running, &err) || running) {
+                return 1;
+        }
+
+        err = rec_download(port, node_id, node);
+        status->state = err ? REC_FAILED : REC_READY;
+        status->err = err;
+        return 0;
+}
+
+int rec_poll(void *port, void *ctx)
+{
+        int period = REC_IDLE_PERIOD;
+        for (size_t i = 0; i < nactive; i++) {
+                struct rec_node *node = nodes[active[i]];
+                if ((node->status.state == REC_ARMED ||
+                     node->status.state == REC_TRIGGERED) &&
+                    rec_watch(port, active[i], node)) {
+                        period = REC_POLL_PERIOD;
+                }
+        }
+
+        return period;
+}
+
+void rec_status(uint16_t node_id, struct rec_status *status)
+{
+        if (node_id < REC_MAX_NODES && nodes[node_id]) {
+                *status = nodes[node_id]->status;
+        } else {
+                memset(status, 0, sizeof(*status));
+        }
+}
+
+ssize_t rec_read(uint16_t node_id, uint32_t offset, void *buf, size_t len)
+{
+        const struct rec_node *node = node_id < REC_MAX_NODES ?
+                                      nodes[node_id] : NULL;
+        if (!node || node->status.state != REC_READY ||
+            offset > node->status.size) {
+                return -1;
+        }
+
+        if (len > node->status.size - offset) {
+                len = node->status.size - offset;
+        }
+
+        memcpy(buf, node->capture + offset, len);
+        return len;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Captures with the data recorder built into the drives.
+//
+// Polling actual values over the bus yields a few hundred samples per second
+// at best and loads the bus while doing so. The data recorder of a drive
+// instead samples up to REC_MAX_CHANNELS objects at its own control rate into
+// a buffer on the drive, starting a configurable number of samples before a
+// trigger (movement start or end, error, digital input, or forced by the
+// client). Once the buffer is full, the poller downloads it in a single bulk
+// transfer and decodes it into a capture, which clients then read in chunks:
+//
+//   | samples:u16 | period:u16 | channels:u8 |
+//   | (index:u16 subindex:u8 size:u8)[channels] |
+//   | column of channel 0: value[samples] | column of channel 1 | ... |
+//
+// Each column holds the values of one channel, oldest first, every value
+// size bytes little-endian. The first sample lies preceding samples before
+// the trigger (fewer if the recorder had not run that long), consecutive
+// samples lie period apart (see struct rec_config).
+//
+// All functions must only be used by the bus thread.
+
+#define REC_MAX_CHANNELS        4
+
+// largest drive buffer that can be downloaded, in bytes
+#define REC_MAX_BUFFER          65536
+
+// size of a capture without its columns
+#define REC_HEADER_SIZE(channels) (5 + 4 * (channels))
+
+enum rec_state {
+        REC_IDLE,       // never armed or stopped
+        REC_ARMED,      // recording, waiting for the trigger
+        REC_TRIGGERED,  // recording the samples after the trigger
+        REC_READY,      // capture downloaded
+        REC_FAILED,     // download failed, see rec_status.err
+};
+
+struct rec_channel {
+        uint16_t index;
+        uint8_t subindex;
+        uint8_t size; // bytes, 1, 2 or 4
+};
+
+struct rec_config {
+        uint16_t period;    // in cycles of the drive's current controller
+        uint16_t preceding; // samples kept from before the trigger
+        uint8_t trigger;    // DR_*_TRIGGER flags, 0 to trigger right away
+        uint8_t nchannels;  // 1 to REC_MAX_CHANNELS
+        struct rec_channel channels[REC_MAX_CHANNELS];
+};
+
+struct rec_status {
+        uint8_t state;    // REC_*
+        uint32_t err;     // library error code if REC_FAILED
+        uint16_t samples; // per channel, once REC_READY
+        uint32_t size;    // bytes of the capture, once REC_READY
+};
+
+// Configure the recorder of a node and start recording. A capture left from
+// an earlier run is discarded. Returns 0, PROTO_ERR_UNKNOWN_NODE,
+// PROTO_ERR_BAD_ARG or the library error code.
+uint32_t rec_arm(void *port, uint16_t node_id, const struct rec_config *config);
+
+// Trigger an armed recorder now. Returns 0, PROTO_ERR_NOT_ACTIVE or the
+// library error code.
+uint32_t rec_trigger(void *port, uint16_t node_id);
+
+// Stop the recorder and discard the capture. Returns 0,
+// PROTO_ERR_UNKNOWN_NODE or the library error code.
+uint32_t rec_stop(void *port, uint16_t node_id);
+
+// Watch the recorders that are armed and download those which are done.
+// Meant to be registered as bus poller; returns the time in ms until the
+// next poll is due.
+int rec_poll(void *port, void *ctx);
+
+// State of the recorder of a node, REC_IDLE if it was never armed.
+void rec_status(uint16_t node_id, struct rec_status *status);
+
+// Copy up to len bytes of the capture of a node from offset on to buf. Returns
+// the number of bytes copied (0 at the end of the capture) or -1 if there is
+// no capture.
+ssize_t rec_read(uint16_t node_id, uint32_t offset, void *buf, size_t len);
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Lock-free bounded rings of fixed-size elements. Elements are accessed in
+// place: producers claim a slot, fill it and publish it, consumers peek at the
+// oldest slot and release it once done. Capacities are rounded up to a power
+// of two.
+
+#define RING_CACHELINE 64
+
+static inline size_t ring_capacity(size_t capacity)
+{
+        size_t n = 1;
+        while (n < capacity) {
+                n <<= 1;
+        }
+
+        return n;
+}
+
+// single producer, single consumer
+struct spsc_ring {
+        // consumer side
+        _Alignas(RING_CACHELINE) _Atomic size_t head;
+        size_t tail_cache;
+
+        // producer side
+        _Alignas(RING_CACHELINE) _Atomic size_t tail;
+        size_t head_cache;
+
+        // read-only
+        _Alignas(RING_CACHELINE) size_t mask;
+        size_t elem_size;
+        unsigned char *buf;
+};
+
+static inline int spsc_init(struct spsc_ring *ring, size_t capacity,
+                            size_t elem_size)
+{
+        capacity = ring_capacity(capacity);
+        ring->buf = calloc(capacity, elem_size);
+        if (!ring->buf) {
+                return -1;
+        }
+
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        ring->tail_cache = 0;
+        ring->head_cache = 0;
+        ring->mask = capacity - 1;
+        ring->elem_size = elem_size;
+        return 0;
+}
+
+static inline void spsc_destroy(struct spsc_ring *ring)
+{
+        free(ring->buf);
+        ring->buf = NULL;
+}
+
+// Returns the next free slot or NULL if the ring is full.
+static inline void *spsc_claim(struct spsc_ring *ring)
+{
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        if (tail - ring->head_cache > ring->mask) {
+                ring->head_cache = atomic_load_explicit(&ring->head,
+                                                        memory_order_acquire);
+                if (tail - ring->head_cache > ring->mask) {
+                        return NULL;
+                }
+        }
+
+        return ring->buf + (tail & ring->mask) * ring->elem_size;
+}
+
+// Make the slot returned by the last spsc_claim() visible to the consumer.
+static inline void spsc_publish(struct spsc_ring *ring)
+{
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// Returns the oldest published slot or NULL if the ring is empty.
+static inline void *spsc_peek(struct spsc_ring *ring)
+{
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        if (head == ring->tail_cache) {
+                ring->tail_cache = atomic_load_explicit(&ring->tail,
+                                                        memory_order_acquire);
+                if (head == ring->tail_cache) {
+                        return NULL;
+                }
+        }
+
+        return ring->buf + (head & ring->mask) * ring->elem_size;
+}
+
+// Returns the published slot i places after the oldest one or NULL if fewer
+// slots are published.
+static inline void *spsc_peek_at(struct spsc_ring *ring, size_t i)
+{
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        if (ring->tail_cache - head <= i) {
+                ring->tail_cache = atomic_load_explicit(&ring->tail,
+                                                        memory_order_acquire);
+                if (ring->tail_cache - head <= i) {
+                        return NULL;
+                }
+        }
+
+        return ring->buf + ((head + i) & ring->mask) * ring->elem_size;
+}
+
+// Hand the slot returned by the last spsc_peek() back to the producer.
+static inline void spsc_release(struct spsc_ring *ring)
+{
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// multiple producers, single consumer
+//
+// Every slot carries a sequence number telling whether it is free for the
+// producer at position pos (seq == pos), holds a published element for the
+// consumer (seq == pos + 1) or is still in use from the previous lap.
+struct mpsc_slot {
+        _Atomic size_t seq;
+        size_t pos;
+};
+
+struct mpsc_ring {
+        // producer side
+        _Alignas(RING_CACHELINE) _Atomic size_t tail;
+
+        // consumer side
+        _Alignas(RING_CACHELINE) size_t head;
+
+        // read-only
+        _Alignas(RING_CACHELINE) size_t mask;
+        size_t stride;
+        unsigned char *buf;
+};
+
+#define MPSC_HDR_SIZE \
+        ((sizeof(struct mpsc_slot) + 15) & ~(size_t)15)
+
+static inline struct mpsc_slot *mpsc_slot_at(struct mpsc_ring *ring,
+                                             size_t pos)
+{
+        return (struct mpsc_slot *)(ring->buf + (pos & ring->mask) *
+                                    ring->stride);
+}
+
+static inline int mpsc_init(struct mpsc_ring *ring, size_t capacity,
+                            size_t elem_size)
+{
+        capacity = ring_capacity(capacity);
+
+        // give every slot its own cache lines
+        ring->stride = (MPSC_HDR_SIZE + elem_size + RING_CACHELINE - 1) &
+                       ~(size_t)(RING_CACHELINE - 1);
+        ring->buf = aligned_alloc(RING_CACHELINE, capacity * ring->stride);
+        if (!ring->buf) {
+                return -1;
+        }
+
+        ring->mask = capacity - 1;
+        for (size_t i = 0; i < capacity; i++) {
+                atomic_init(&mpsc_slot_at(ring, i)->seq, i);
+        }
+
+        atomic_init(&ring->tail, 0);
+        ring->head = 0;
+        return 0;
+}
+
+static inline void mpsc_destroy(struct mpsc_ring *ring)
+{
+        free(ring->buf);
+        ring->buf = NULL;
+}
+
+// Claim a slot, safe to call from any number of threads. Returns NULL if the
+// ring is full.
+static inline void *mpsc_claim(struct mpsc_ring *ring)
+{
+        size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        while (1) {
+                struct mpsc_slot *slot = mpsc_slot_at(ring, pos);
+                size_t seq = atomic_load_explicit(&slot->seq,
+                                                  memory_order_acquire);
+                intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+                if (diff == 0) {
+                        if (atomic_compare_exchange_weak_explicit(
+                                    &ring->tail, &pos, pos + 1,
+                                    memory_order_relaxed,
+                                    memory_order_relaxed)) {
+                                slot->pos = pos;
+                                return (unsigned char *)slot + MPSC_HDR_SIZE;
+                        }
+                } else if (diff < 0) {
+                        return NULL;
+                } else {
+                        pos = atomic_load_explicit(&ring->tail,
+                                                   memory_order_relaxed);
+                }
+        }
+}
+
+// Publish a slot returned by mpsc_claim() to the consumer.
+static inline void mpsc_publish(struct mpsc_ring *ring, void *elem)
+{
+        (void)ring;
+        struct mpsc_slot *slot = (struct mpsc_slot *)((unsigned char *)elem -
+                                                      MPSC_HDR_SIZE);
+        atomic_store_explicit(&slot->seq, slot->pos + 1, memory_order_release);
+}
+
+// Returns the oldest published element or NULL if there is none. Must only
+// be called by the consumer.
+static inline void *mpsc_peek(struct mpsc_ring *ring)
+{
+        struct mpsc_slot *slot = mpsc_slot_at(ring, ring->head);
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != ring->head + 1) {
+                return NULL;
+        }
+
+        return (unsigned char *)slot + MPSC_HDR_SIZE;
+}
+
+// Hand the slot returned by the last mpsc_peek() back to the producers.
+static inline void mpsc_release(struct mpsc_ring *ring)
+{
+        struct mpsc_slot *slot = mpsc_slot_at(ring, ring->head);
+        atomic_store_explicit(&slot->seq, ring->head + ring->mask + 1,
+                              memory_order_release);
+        ring->head++;
+}
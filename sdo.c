@@ -0,0 +1,376 @@
+#include "sdo.h"
+#include "epos.h"
+#include "od.h"
+#include "socketcan.h"
+#include "stats.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SDO_COB_ID_REQUEST      0x600 // client to node
+#define SDO_COB_ID_RESPONSE     0x580 // node to client
+
+// command specifiers (byte 0 of every SDO frame)
+#define SDO_CCS_DOWNLOAD        0x23 // expedited, size indicated
+#define SDO_CCS_UPLOAD          0x40
+#define SDO_SCS_DOWNLOAD        0x60
+#define SDO_SCS_UPLOAD          0x40
+#define SDO_SCS_MASK            0xe0
+#define SDO_EXPEDITED           0x02
+#define SDO_SIZE_INDICATED      0x01
+#define SDO_ABORT               0x80
+
+#define SDO_NODES               128
+#define SDO_NONE                SIZE_MAX
+
+struct sdo {
+        void *port;
+        struct can_sock *can;
+        uint32_t timeout;
+};
+
+// state of one sdo_transfer() over the socket
+struct sdo_run {
+        struct sdo_req *reqs;
+        size_t *next;                // next request to the same node
+        size_t head[SDO_NODES];      // next request to send per node
+        size_t inflight[SDO_NODES];  // request waiting for a response
+        uint64_t deadline[SDO_NODES];
+        uint64_t sent[SDO_NODES];    // now_ns() the request went out
+        size_t ninflight;
+        int backlog;                 // requests the socket did not take
+        int flags;
+};
+
+struct sdo *sdo_create(void *port, struct can_sock *can,
+                       const uint16_t *node_ids, size_t nnodes,
+                       uint32_t timeout)
+{
+        struct sdo *sdo = calloc(1, sizeof(*sdo));
+        if (!sdo) {
+                die("failed to allocate SDO client", 0);
+        }
+
+        sdo->port = port;
+        sdo->timeout = timeout;
+        if (can) {
+                uint16_t cob_ids[SDO_NODES];
+                for (size_t i = 0; i < nnodes; i++) {
+                        cob_ids[i] = SDO_COB_ID_RESPONSE + node_ids[i];
+                }
+
+                // can_filter() takes at most CAN_BATCH_MAX ids, receive all
+                // SDO responses for larger tables
+                if (nnodes <= CAN_BATCH_MAX &&
+                    can_filter(can, cob_ids, nnodes) == -1) {
+                        die("failed to set SDO CAN filter", 0);
+                }
+
+                sdo->can = can;
+        }
+
+        return sdo;
+}
+
+void sdo_destroy(struct sdo *sdo)
+{
+        free(sdo);
+}
+
+void sdo_set_port(struct sdo *sdo, void *port)
+{
+        sdo->port = port;
+}
+
+int sdo_concurrent(const struct sdo *sdo)
+{
+        return sdo->can != NULL;
+}
+
+static void sdo_transfer_library(struct sdo *sdo, struct sdo_req *reqs,
+                                 size_t n, int flags)
+{
+        uint32_t failed[SDO_NODES] = { 0 };
+        for (size_t i = 0; i < n; i++) {
+                struct sdo_req *req = &reqs[i];
+                if (req->node >= SDO_NODES) {
+                        req->err = SDO_ERR_GENERAL;
+                        continue;
+                } else if (flags & SDO_STOP_ON_ERROR && failed[req->node]) {
+                        req->err = failed[req->node];
+                        continue;
+                } else if (req->upload &&
+                           od_get(req->node, req->index, req->subindex,
+                                  req->data, req->len) == 0) {
+                        req->err = 0;
+                        continue;
+                }
+
+                uint32_t bytes;
+                int ok = req->upload ?
+                         STAT(VCS_GetObject, req->node, req->err, sdo->port,
+                              req->node, req->index, req->subindex, req->data,
+                              req->len, &bytes, &req->err) :
+                         STAT(VCS_SetObject, req->node, req->err, sdo->port,
+                              req->node, req->index, req->subindex, req->data,
+                              req->len, &bytes, &req->err);
+                if (!ok) {
+                        failed[req->node] = req->err;
+                        continue;
+                }
+
+                req->err = 0;
+                if (req->upload && bytes < req->len) {
+                        req->len = bytes;
+                }
+
+                od_put(req->node, req->index, req->subindex, req->data,
+                       req->len);
+        }
+}
+
+static void sdo_encode(const struct sdo_req *req, struct can_frame *frame)
+{
+        memset(frame, 0, sizeof(*frame));
+        frame->can_id = SDO_COB_ID_REQUEST + req->node;
+        frame->can_dlc = 8;
+        frame->data[0] = req->upload ?
+                         SDO_CCS_UPLOAD :
+                         SDO_CCS_DOWNLOAD | (SDO_MAX_SIZE - req->len) << 2;
+        frame->data[1] = req->index;
+        frame->data[2] = req->index >> 8;
+        frame->data[3] = req->subindex;
+        if (!req->upload) {
+                memcpy(frame->data + 4, req->data, req->len);
+        }
+}
+
+static void sdo_abort(struct sdo *sdo, const struct sdo_req *req,
+                      uint32_t code)
+{
+        struct can_frame frame;
+        sdo_encode(req, &frame);
+        frame.data[0] = SDO_ABORT;
+        for (int i = 0; i < 4; i++) {
+                frame.data[4 + i] = code >> (8 * i);
+        }
+
+        can_send(sdo->can, &frame, 1);
+}
+
+// Finish the request in flight to node with err. Once a request failed, the
+// remaining ones to the node are failed as well if asked to.
+static void sdo_complete(struct sdo_run *run, uint16_t node, uint32_t err)
+{
+        struct sdo_req *req = &run->reqs[run->inflight[node]];
+        req->err = err;
+        if (!err) {
+                od_put(req->node, req->index, req->subindex, req->data,
+                       req->len);
+        }
+
+        run->inflight[node] = SDO_NONE;
+        run->ninflight--;
+
+        if (err && run->flags & SDO_STOP_ON_ERROR) {
+                for (size_t i = run->head[node]; i != SDO_NONE;
+                     i = run->next[i]) {
+                        run->reqs[i].err = err;
+                }
+
+                run->head[node] = SDO_NONE;
+        }
+}
+
+static void sdo_response(struct sdo *sdo, struct sdo_run *run,
+                         const struct can_frame *frame, uint64_t stamp)
+{
+        // frames received before the request went out answer the library's
+        // own transfers to the node, which may well be to the same object
+        uint16_t node = (frame->can_id & CAN_SFF_MASK) - SDO_COB_ID_RESPONSE;
+        if (node >= SDO_NODES || run->inflight[node] == SDO_NONE ||
+            frame->can_dlc < 8 || stamp < run->sent[node]) {
+                return;
+        }
+
+        struct sdo_req *req = &run->reqs[run->inflight[node]];
+        const uint8_t *data = frame->data;
+        if ((data[1] | data[2] << 8) != req->index ||
+            data[3] != req->subindex) {
+                // response to an earlier transfer, e.g. one that timed out
+                return;
+        }
+
+        uint8_t cs = data[0];
+        if (cs == SDO_ABORT) {
+                sdo_complete(run, node, data[4] | data[5] << 8 |
+                             data[6] << 16 | (uint32_t)data[7] << 24);
+        } else if (!req->upload && cs == SDO_SCS_DOWNLOAD) {
+                sdo_complete(run, node, 0);
+        } else if (req->upload && (cs & SDO_SCS_MASK) == SDO_SCS_UPLOAD &&
+                   cs & SDO_EXPEDITED) {
+                uint8_t len = cs & SDO_SIZE_INDICATED ?
+                              SDO_MAX_SIZE - (cs >> 2 & 0x3) : req->len;
+                if (len < req->len) {
+                        req->len = len;
+                }
+
+                memcpy(req->data, data + 4, req->len);
+                sdo_complete(run, node, 0);
+        } else {
+                // segmented upload of an object larger than requested
+                sdo_abort(sdo, req, SDO_ERR_LENGTH);
+                sdo_complete(run, node, SDO_ERR_LENGTH);
+        }
+}
+
+// Start the next transfer to every node which is idle. Returns -1 if there
+// was nothing left to start. Requests which did not fit into the socket's
+// transmit queue are started again once responses came in.
+static int sdo_send(struct sdo *sdo, struct sdo_run *run)
+{
+        struct can_frame frames[SDO_NODES];
+        uint16_t nodes[SDO_NODES];
+        size_t nframes = 0;
+        uint64_t now = now_ns();
+        uint64_t deadline = now + sdo->timeout * 1000000ull;
+        for (uint16_t node = 0; node < SDO_NODES; node++) {
+                size_t i = run->head[node];
+                if (i == SDO_NONE || run->inflight[node] != SDO_NONE) {
+                        continue;
+                }
+
+                run->head[node] = run->next[i];
+                run->inflight[node] = i;
+                run->deadline[node] = deadline;
+                run->sent[node] = now;
+                run->ninflight++;
+                sdo_encode(&run->reqs[i], &frames[nframes]);
+                nodes[nframes++] = node;
+        }
+
+        if (nframes == 0) {
+                return -1;
+        }
+
+        // frames the full transmit queue did not take are sent again later,
+        // only a broken socket fails the requests
+        int sent = can_send(sdo->can, frames, nframes);
+        run->backlog = sent >= 0 && (size_t)sent < nframes;
+        for (size_t i = sent < 0 ? 0 : sent; i < nframes; i++) {
+                if (sent < 0) {
+                        sdo_complete(run, nodes[i], SDO_ERR_GENERAL);
+                        continue;
+                }
+
+                run->head[nodes[i]] = run->inflight[nodes[i]];
+                run->inflight[nodes[i]] = SDO_NONE;
+                run->ninflight--;
+        }
+
+        return 0;
+}
+
+// Discard the frames queued on the socket since the last transfer, which are
+// the responses to the library's own transfers.
+static void sdo_drain(struct sdo *sdo)
+{
+        struct can_frame frames[CAN_BATCH_MAX];
+        uint64_t stamps[CAN_BATCH_MAX];
+        while (can_recv(sdo->can, frames, stamps, CAN_BATCH_MAX, 0) > 0) {
+        }
+}
+
+static void sdo_transfer_can(struct sdo *sdo, struct sdo_req *reqs, size_t n,
+                             int flags)
+{
+        struct sdo_run run = { .reqs = reqs, .flags = flags };
+        run.next = malloc(n * sizeof(size_t));
+        if (!run.next) {
+                die("failed to allocate SDO transfer", 0);
+        }
+
+        size_t tail[SDO_NODES];
+        for (size_t node = 0; node < SDO_NODES; node++) {
+                run.head[node] = SDO_NONE;
+                run.inflight[node] = SDO_NONE;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+                uint16_t node = reqs[i].node;
+                if (node >= SDO_NODES || reqs[i].len < 1 ||
+                    reqs[i].len > SDO_MAX_SIZE) {
+                        reqs[i].err = SDO_ERR_LENGTH;
+                        continue;
+                } else if (reqs[i].upload &&
+                           od_get(node, reqs[i].index, reqs[i].subindex,
+                                  reqs[i].data, reqs[i].len) == 0) {
+                        reqs[i].err = 0;
+                        continue;
+                }
+
+                run.next[i] = SDO_NONE;
+                if (run.head[node] == SDO_NONE) {
+                        run.head[node] = i;
+                } else {
+                        run.next[tail[node]] = i;
+                }
+
+                tail[node] = i;
+        }
+
+        sdo_drain(sdo);
+        while (sdo_send(sdo, &run) == 0 || run.ninflight > 0) {
+                if (run.ninflight == 0 && !run.backlog) {
+                        continue;
+                }
+
+                // the transmit queue drains within a few frames
+                uint64_t now = now_ns();
+                uint64_t deadline = run.backlog ? now + 1000000 : UINT64_MAX;
+                for (uint16_t node = 0; node < SDO_NODES; node++) {
+                        if (run.inflight[node] != SDO_NONE &&
+                            run.deadline[node] < deadline) {
+                                deadline = run.deadline[node];
+                        }
+                }
+
+                int timeout = deadline > now ?
+                              (deadline - now + 999999) / 1000000 : 0;
+
+                struct can_frame frames[CAN_BATCH_MAX];
+                uint64_t stamps[CAN_BATCH_MAX];
+                int nrecv = can_recv(sdo->can, frames, stamps, CAN_BATCH_MAX,
+                                     timeout);
+                for (int i = 0; i < nrecv; i++) {
+                        sdo_response(sdo, &run, &frames[i], stamps[i]);
+                }
+
+                now = now_ns();
+                for (uint16_t node = 0; node < SDO_NODES; node++) {
+                        if (run.inflight[node] != SDO_NONE &&
+                            run.deadline[node] <= now) {
+                                sdo_abort(sdo, &reqs[run.inflight[node]],
+                                          SDO_ERR_TIMEOUT);
+                                sdo_complete(&run, node, SDO_ERR_TIMEOUT);
+                        }
+                }
+        }
+
+        free(run.next);
+}
+
+void sdo_transfer(struct sdo *sdo, struct sdo_req *reqs, size_t n, int flags)
+{
+        if (n == 0) {
+                return;
+        }
+
+        if (sdo->can) {
+                sdo_transfer_can(sdo, reqs, n, flags);
+        } else {
+                sdo_transfer_library(sdo, reqs, n, flags);
+        }
+}
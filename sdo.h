@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SDO transfers to several nodes at once.
+//
+// Every SDO transfer through the library waits for the node's response
+// before the next one can be started, so talking to N nodes costs N round
+// trips. A node only ever serves one SDO transfer at a time, but different
+// nodes can be served concurrently. With a SocketCAN socket, expedited
+// transfers (objects of up to 4 bytes) are therefore sent to all nodes
+// involved at once and the responses are collected as they arrive.
+//
+// Either way, uploads of objects in the object dictionary shadow (see od.h)
+// are answered from it without a transfer, and successful transfers update it.
+
+struct can_sock;
+
+// largest object transferred by an expedited SDO
+#define SDO_MAX_SIZE            4
+
+// SDO abort codes reported without a response from the node
+#define SDO_ERR_TIMEOUT         0x05040000 // SDO protocol timed out
+#define SDO_ERR_LENGTH          0x06070010 // data type length mismatch
+#define SDO_ERR_GENERAL         0x08000000 // request could not be sent
+
+// sdo_transfer() flags
+#define SDO_STOP_ON_ERROR       1 // skip requests to a node after a failed one
+
+struct sdo_req {
+        uint16_t node;
+        uint8_t upload;         // read the object from the node if set
+        uint8_t subindex;
+        uint16_t index;
+        uint8_t len;            // size of the object, 1 to SDO_MAX_SIZE
+        uint8_t data[SDO_MAX_SIZE];
+        uint32_t err;           // 0 or SDO abort code / library error code
+};
+
+struct sdo;
+
+// Create an SDO client. With can, transfers to the given nodes go over the
+// socket (which must not be used for anything else), otherwise through the
+// library one after another. timeout is in ms.
+struct sdo *sdo_create(void *port, struct can_sock *can,
+                       const uint16_t *node_ids, size_t nnodes,
+                       uint32_t timeout);
+
+// Free the client. The socket is left open.
+void sdo_destroy(struct sdo *sdo);
+
+// Go through port from now on, after the library's port was opened again.
+void sdo_set_port(struct sdo *sdo, void *port);
+
+// Whether transfers to different nodes overlap.
+int sdo_concurrent(const struct sdo *sdo);
+
+// Execute all requests. Requests to the same node are executed in the given
+// order, those to different nodes concurrently if possible. The outcome of
+// every request is stored in its err field (and data for uploads).
+void sdo_transfer(struct sdo *sdo, struct sdo_req *reqs, size_t n,
+                  int flags);
@@ -1,5 +1,9 @@
 #pragma once
 
+#include "od.h"
+#include "pdo.h"
+#include "proto.h"
+
 #include <stdint.h>
 #include <netinet/in.h>
 
@@ -8,9 +12,6 @@ struct cob_id {
         uint8_t sid;
 };
 
-#define NET_BUF_SIZE 8
-#define MAX_STR_SIZE 64
-
 // port settings
 const char *DEV_NAME    = "EPOS4";
 const char *PROTO_NAME  = "CANopen";
@@ -21,10 +22,43 @@ const char *PORT_NAME   = "CAN0";
 const uint32_t BAUDRATE = 250000; // 250 kbit/s
 const uint32_t TIMEOUT  = 500; // 500 ms
 
+// recovery settings
+// If RECOVERY is enabled, requests which may be repeated are repeated after
+// transient errors and a failed port is closed and opened again with the
+// settings it was opened with at startup, probing the known nodes with a
+// timeout of RECOVERY_TIMEOUT, instead of answering every request with an
+// error until restarted (see fault.h).
+const int RECOVERY              = 1;
+const uint32_t RECOVERY_TIMEOUT = 20; // 20 ms
+
+// bus load settings
+// Periodic streams (TPDOs, SYNC and setpoints sent with every SYNC) may
+// reserve up to this share of BAUDRATE together, the rest is left to SDO and
+// NMT traffic. TPDOs which do not fit are transmitted less often, setpoint
+// streams which do not fit are rejected (see busload.h).
+const double BUSLOAD_THRESHOLD = 0.7;
+
 // node settings
-const uint16_t NODE_ID 	= 2;
+// The nodes on the bus are listed in the node table (see nodes.h), which is
+// read from this file unless another one is passed on the command line.
+const char *NODES_FILE  = "nodes.conf";
+
+// discovery settings
+// If DISCOVERY is enabled, the port settings above are only tried after the
+// port found at the last start (cached in DISCOVERY_CACHE) and before all
+// others the library lists, and the nodes on the bus are found by probing
+// every node id with a timeout of DISCOVERY_TIMEOUT (see discovery.h). The
+// node table is then optional and only names nodes: listed nodes which do not
+// answer are dropped, nodes answering which are not listed are added.
+const int DISCOVERY              = 0;
+const uint32_t DISCOVERY_TIMEOUT = 5; // 5 ms
+const char *DISCOVERY_CACHE      = "/tmp/epos.discovery";
 
 // motor settings
+// If CONFIGURE_NODES is enabled, the settings below are written to every node
+// at startup wherever they differ from what the node has stored (see
+// nodes_configure). Fill them in before enabling it.
+const int CONFIGURE_NODES = 0;
 const uint16_t MOTOR_TYPE = MT_EC_SINUS_COMMUTATED_MOTOR; // motor-specific
 const uint32_t NOMINAL_CURRENT; // motor-specific
 const uint32_t OUTPUT_CURRENT_LIMIT; // user-specific
@@ -40,8 +74,144 @@ const uint32_t MAX_GEAR_INPUT_SPEED; // user-specific
 
 // network settings
 const in_port_t RECV_PORT = 12345;
+const int NET_BACKLOG     = 64; // pending connections not yet accepted
+const int NET_MAX_CONNS   = 64; // concurrently served connections
+const in_port_t UDP_PORT  = 12346; // setpoints over UDP (see udp.h), 0 for
+                                   // none
+// the nodes of a UDP stream silent for longer are stopped with the op
+const uint32_t UDP_WATCHDOG_MS   = 100;
+const uint8_t UDP_WATCHDOG_STOP  = OP_SET_QUICK_STOP_STATE;
+
+// shared-memory settings
+// If enabled, clients on the same machine can connect to SHM_PATH and
+// exchange commands with the server through shared memory instead of TCP
+// (see shm.h).
+const int SHM             = 1;
+const char *SHM_PATH      = "/tmp/epos.sock";
+const int SHM_MAX_CONNS   = 8; // concurrently served clients
+
+// logging settings
+// Connection and bus events are recorded into EVLOG_PATH (see evlog.h),
+// which keeps the latest events of every thread across a crash. Decode it
+// with tools/evlog_dump.
+const char *EVLOG_PATH    = "/tmp/epos.evlog";
+
+// simulation settings
+// SIM is defined to 1 when building against the simulated library (make sim,
+// see sim/sim.c), which only provides the library's own CAN layer. SocketCAN
+// and with it the cycle thread are disabled then.
+#ifndef SIM
+#define SIM 0
+#endif
+
+// SocketCAN settings
+// If enabled, setpoint and SYNC frames are written to a raw CAN socket on
+// CAN_IF_NAME and TPDOs are received from it instead of going through the
+// library, which is then only used for configuration by SDO. This has to be
+// the interface behind IF_NAME (see if_reset) or a vcan interface for testing
+// without hardware (see if_vcan).
+const int SOCKETCAN       = !SIM;
+const char *CAN_IF_NAME   = "can0";
 
-// COB-IDs for objects which cannot be configured directly through the library
-const struct cob_id COB_ID_NUMBER_OF_POLE_PAIRS = { .id = 0x3001, .sid = 0x03 };
-const struct cob_id COB_ID_MAX_MOTOR_SPEED      = { .id = 0x6080, .sid = 0x00 };
-const struct cob_id COB_ID_MAX_GEAR_INPUT_SPEED = { .id = 0x3003, .sid = 0x03 };
+// cycle settings
+// If enabled, a real-time thread sends SYNC every CYCLE_PERIOD_US together
+// with the setpoints queued since the last cycle (see cycle.h). Needs
+// SOCKETCAN.
+const int CYCLE                 = !SIM;
+const unsigned CYCLE_PERIOD_US  = 2000; // 1000 to 10000
+const int CYCLE_PRIORITY        = 80;   // SCHED_FIFO priority
+const int CYCLE_CPU             = -1;   // CPU to pin the thread to, -1 for any
+
+// object dictionary shadow settings
+// If enabled, objects which only change when written through this program are
+// answered from memory once they have been read or written (see od.h).
+// Objects with an index in one of the OD_VOLATILE ranges are always read from
+// the node: those it changes by itself and those written by RPDOs or by
+// library calls which bypass the shadow. Objects mapped into RPDO_MAPS must
+// be covered.
+const int OD_SHADOW = 1;
+const struct od_range OD_VOLATILE[] = {
+        { 0x1001, 0x1003 }, // error register, status register, error history
+        { 0x1010, 0x1011 }, // store and restore parameters
+        { 0x2010, 0x201b }, // data recorder
+        { 0x2074, 0x2074 }, // position marker
+        { 0x207a, 0x207a }, // position compare
+        { 0x20c0, 0x20c4 }, // IPM buffer
+        { 0x30b0, 0x30b2 }, // homing position, offset and current threshold
+        { 0x30d0, 0x30d3 }, // current and velocity actual values
+        { 0x603f, 0x6044 }, // error code, controlword, statusword
+        { 0x6060, 0x607a }, // operation mode, actual values, target position
+        { 0x6098, 0x609a }, // homing method, speeds and acceleration
+        { 0x60f4, 0x60ff }, // following error, inputs, target velocity
+};
+
+// COB-IDs of the objects holding the motor settings
+const struct cob_id COB_ID_MOTOR_TYPE            = { .id = 0x6402, .sid = 0x00 };
+const struct cob_id COB_ID_NOMINAL_CURRENT       = { .id = 0x3001, .sid = 0x01 };
+const struct cob_id COB_ID_OUTPUT_CURRENT_LIMIT  = { .id = 0x3001, .sid = 0x02 };
+const struct cob_id COB_ID_NUMBER_OF_POLE_PAIRS  = { .id = 0x3001, .sid = 0x03 };
+const struct cob_id COB_ID_THERMAL_TIME_CONSTANT = { .id = 0x3001, .sid = 0x04 };
+const struct cob_id COB_ID_MAX_MOTOR_SPEED       = { .id = 0x6080, .sid = 0x00 };
+const struct cob_id COB_ID_MAX_GEAR_INPUT_SPEED  = { .id = 0x3003, .sid = 0x03 };
+
+// telemetry settings
+// If enabled, telemetry is mapped into the TPDOs below at startup and received
+// by the bus thread instead of being polled value by value by SDO.
+const int TELEMETRY_PDO = 1;
+
+// TPDOs transmitted by every node. Entries are the index, subindex and size in
+// bits of the mapped object and the telemetry value it updates. Event-driven
+// TPDOs are also sent whenever a mapped value changes, but not more often
+// than their inhibit time allows.
+const struct pdo_map TPDO_MAPS[] = {
+        {
+                .num = 1,
+                .transmission_type = PDO_EVENT_DRIVEN,
+                .event_timer = 5, // ms
+                .inhibit_time = 50, // 5 ms
+                .nentries = 2,
+                .entries = {
+                        { 0x6041, 0x00, 16, TLM_STATUSWORD }, // statusword
+                        { 0x6064, 0x00, 32, TLM_POSITION },   // position actual
+                },
+        },
+        {
+                .num = 2,
+                .transmission_type = PDO_EVENT_DRIVEN,
+                .event_timer = 5, // ms
+                .inhibit_time = 50, // 5 ms
+                .nentries = 2,
+                .entries = {
+                        { 0x606c, 0x00, 32, TLM_VELOCITY },   // velocity actual
+                        { 0x30d1, 0x02, 32, TLM_CURRENT },    // current actual
+                },
+        },
+};
+
+// setpoint settings
+// If enabled, the RPDOs below are configured at startup so setpoints can be
+// sent as process data (OP_PDO_SETPOINT) instead of by SDO.
+const int SETPOINT_PDO = 1;
+
+// RPDOs received by every node. Synchronous RPDOs are applied with the next
+// SYNC (OP_SYNC), so the setpoints of all nodes take effect at the same time.
+const struct pdo_map RPDO_MAPS[] = {
+        {
+                .num = 1,
+                .transmission_type = PDO_SYNC_CYCLIC,
+                .nentries = 2,
+                .entries = {
+                        { 0x6040, 0x00, 16 }, // controlword
+                        { 0x60ff, 0x00, 32 }, // target velocity
+                },
+        },
+        {
+                .num = 2,
+                .transmission_type = PDO_SYNC_CYCLIC,
+                .nentries = 2,
+                .entries = {
+                        { 0x6040, 0x00, 16 }, // controlword
+                        { 0x607a, 0x00, 32 }, // target position
+                },
+        },
+};
@@ -0,0 +1,474 @@
+#define _GNU_SOURCE
+
+#include "shm.h"
+#include "evlog.h"
+#include "util.h"
+#include "watchdog.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SHM_MAX_EVENTS  16
+
+struct shm_conn {
+        struct bus_client client;
+
+        // -1 once closed, the slot is reused when no command is in flight
+        int sock;
+        int req_fd;  // signalled by the client
+        int resp_fd; // signalled by the server
+        struct shm_region *region;
+        struct shm_conn *next_free;
+
+        unsigned inflight;
+        struct watchdog_session session;
+};
+
+struct shm {
+        struct bus *bus;
+        int epoll_fd;
+        int server_fd;
+        // signalled by the bus thread whenever a command completed
+        int notify_fd;
+
+        struct shm_conn *conns;
+        struct shm_conn *free_conns;
+        int nconns;
+        int max_conns;
+
+        // SHM_SPIN_US, 0 on a single CPU where polling only delays the
+        // threads it waits for
+        uint64_t spin_ns;
+
+        struct watchdog watchdog;
+};
+
+// only accessed by the shm thread
+static struct shm shm;
+
+static void shm_conn_free(struct shm_conn *conn)
+{
+        conn->next_free = shm.free_conns;
+        shm.free_conns = conn;
+}
+
+static void shm_conn_close(struct shm_conn *conn)
+{
+        evlog(EV_SHM_CLOSE, conn->sock, 0, 0);
+        watchdog_close(&shm.watchdog, &conn->session);
+
+        // requests still in the ring are dropped, completions of those in
+        // flight are discarded as they come in. The eventfd is shared with the
+        // client, so closing it would not remove it from the epoll set.
+        epoll_ctl(shm.epoll_fd, EPOLL_CTL_DEL, conn->req_fd, NULL);
+        close(conn->sock);
+        close(conn->req_fd);
+        close(conn->resp_fd);
+        munmap(conn->region, sizeof(*conn->region));
+        conn->sock = -1;
+        shm.nconns--;
+        if (conn->inflight == 0) {
+                shm_conn_free(conn);
+        }
+}
+
+static void shm_conn_expired(void *owner)
+{
+        struct shm_conn *conn = owner;
+        evlog(EV_WATCHDOG_EXPIRED, conn->sock, 0, 0);
+        shm_conn_close(conn);
+}
+
+static int shm_submit(void *ctx, uint8_t op, uint8_t node,
+                      const uint8_t *payload, uint16_t len, int tagged,
+                      uint32_t id)
+{
+        struct shm_conn *conn = ctx;
+        struct bus_cmd *cmd = bus_claim(shm.bus);
+        if (!cmd) {
+                return -1;
+        }
+
+        cmd->client = &conn->client;
+        cmd->tag = (struct bus_tag){ .tagged = tagged, .id = id };
+        cmd->op = op;
+        cmd->node = node;
+        cmd->len = len;
+        memcpy(cmd->payload, payload, len);
+        bus_submit(shm.bus, cmd);
+        conn->inflight++;
+        watchdog_request(&shm.watchdog, &conn->session, op, node, payload,
+                         len);
+        return 0;
+}
+
+// Move completed responses to the response ring and requests from the request
+// ring to the bus. Returns whether anything was moved.
+static int shm_service(struct shm_conn *conn)
+{
+        int moved = 0;
+        struct bus_completion *completion;
+        while ((completion = spsc_peek(&conn->client.completions))) {
+                struct shm_slot *slot = NULL;
+                if (conn->sock != -1 &&
+                    !(slot = shm_claim(&conn->region->responses))) {
+                        break; // the client does not keep up
+                }
+
+                if (slot && completion->tag.tagged) {
+                        proto_tag(slot->frame, completion->frame,
+                                  completion->tag.id);
+                        memcpy(slot->frame + PROTO_TAG_HDR_SIZE,
+                               completion->frame + PROTO_LEN_SIZE,
+                               completion->len - PROTO_LEN_SIZE);
+                        slot->len = completion->len + PROTO_TAG_SIZE;
+                } else if (slot) {
+                        memcpy(slot->frame, completion->frame,
+                               completion->len);
+                        slot->len = completion->len;
+                }
+
+                if (slot) {
+                        shm_publish(&conn->region->responses);
+                }
+
+                spsc_release(&conn->client.completions);
+                moved = 1;
+                if (--conn->inflight == 0 && conn->sock == -1) {
+                        shm_conn_free(conn);
+                        return moved;
+                }
+        }
+
+        if (conn->sock == -1) {
+                return moved;
+        }
+
+        if (moved) {
+                shm_wake(&conn->region->responses, conn->resp_fd);
+        }
+
+        int submitted = 0;
+        struct shm_slot *slot;
+        while (conn->inflight < SHM_MAX_INFLIGHT &&
+               (slot = shm_peek(&conn->region->requests))) {
+                // the client may scribble over the slot at any time, so
+                // everything is checked on a copy
+                uint8_t frame[sizeof(slot->frame)];
+                uint16_t len = slot->len;
+                if (len > sizeof(frame)) {
+                        len = 0;
+                }
+
+                memcpy(frame, slot->frame, len);
+                ssize_t consumed = proto_process(frame, len, shm_submit, conn);
+                if (consumed == 0 && len > 0) {
+                        break; // the bus queue is full, retried next time
+                } else if (consumed != len) {
+                        evlog(EV_SHM_MALFORMED, conn->sock, 0, 0);
+                        shm_conn_close(conn);
+                        return 1;
+                }
+
+                shm_release(&conn->region->requests);
+                submitted = 1;
+        }
+
+        if (submitted) {
+                bus_kick(shm.bus);
+                watchdog_feed(&conn->session);
+        }
+
+        return moved || submitted;
+}
+
+static int shm_service_all(void)
+{
+        int moved = 0;
+        for (int i = 0; i < shm.max_conns; i++) {
+                struct shm_conn *conn = &shm.conns[i];
+                if (conn->sock != -1 || conn->inflight > 0) {
+                        moved |= shm_service(conn);
+                }
+        }
+
+        return moved;
+}
+
+// Whether every connection agreed to be woken through its eventfd.
+static int shm_sleep_all(void)
+{
+        for (int i = 0; i < shm.max_conns; i++) {
+                struct shm_conn *conn = &shm.conns[i];
+                if (conn->sock != -1 &&
+                    !shm_sleep(&conn->region->requests)) {
+                        return 0;
+                }
+        }
+
+        return 1;
+}
+
+// Tell the clients that their eventfds need not be signalled anymore.
+static void shm_wake_all(void)
+{
+        for (int i = 0; i < shm.max_conns; i++) {
+                struct shm_conn *conn = &shm.conns[i];
+                if (conn->sock != -1) {
+                        atomic_store(&conn->region->requests.sleeping, 0);
+                }
+        }
+}
+
+static void shm_register(int fd, void *ptr, uint32_t events)
+{
+        struct epoll_event event = {
+                .events = events,
+                .data.ptr = ptr,
+        };
+        if (epoll_ctl(shm.epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+                die("failed to register fd with epoll", 0);
+        }
+}
+
+// Pass fds to the client on sock, along with SHM_MAGIC.
+static int shm_send_fds(int sock, const int *fds, size_t n)
+{
+        union {
+                char buf[CMSG_SPACE(3 * sizeof(int))];
+                struct cmsghdr align;
+        } control;
+        uint32_t magic = SHM_MAGIC;
+        struct iovec iov = { &magic, sizeof(magic) };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = control.buf,
+                .msg_controllen = CMSG_SPACE(n * sizeof(int)),
+        };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+        return sendmsg(sock, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+// Set up the region and hand it to the client together with the eventfds.
+// Returns -1 if the client could not be set up.
+static int shm_conn_open(struct shm_conn *conn, int sock)
+{
+        int mem_fd = memfd_create("epos-shm", MFD_CLOEXEC);
+        if (mem_fd == -1) {
+                return -1;
+        }
+
+        // the region is zeroed by ftruncate(), which makes both rings empty
+        conn->region = MAP_FAILED;
+        conn->req_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        conn->resp_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (conn->req_fd != -1 && conn->resp_fd != -1 &&
+            ftruncate(mem_fd, sizeof(*conn->region)) == 0) {
+                conn->region = mmap(NULL, sizeof(*conn->region),
+                                    PROT_READ | PROT_WRITE, MAP_SHARED,
+                                    mem_fd, 0);
+        }
+
+        int ok = conn->region != MAP_FAILED;
+        if (ok) {
+                conn->region->magic = SHM_MAGIC;
+                const int fds[3] = { mem_fd, conn->req_fd, conn->resp_fd };
+                ok = shm_send_fds(sock, fds, 3) == 0;
+        }
+
+        // the mapping keeps the memory alive
+        close(mem_fd);
+        if (!ok) {
+                if (conn->region != MAP_FAILED) {
+                        munmap(conn->region, sizeof(*conn->region));
+                }
+
+                close(conn->req_fd);
+                close(conn->resp_fd);
+                return -1;
+        }
+
+        conn->sock = sock;
+        return 0;
+}
+
+static void shm_accept(void)
+{
+        while (1) {
+                int sock = accept4(shm.server_fd, NULL, NULL,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (sock == -1) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                return;
+                        } else if (errno == EINTR || errno == ECONNABORTED) {
+                                continue;
+                        }
+
+                        die("failed to accept shared-memory connection", 0);
+                }
+
+                struct shm_conn *conn = shm.free_conns;
+                if (!conn) {
+                        evlog(EV_SHM_REFUSE, sock, 0, 0);
+                        close(sock);
+                        continue;
+                }
+
+                if (shm_conn_open(conn, sock) == -1) {
+                        evlog(EV_SHM_SETUP_FAILED, sock, errno, 0);
+                        close(sock);
+                        continue;
+                }
+
+                shm.free_conns = conn->next_free;
+                watchdog_open(&conn->session, conn, &conn->client);
+                bus_resume(&conn->client);
+                shm_register(conn->sock, conn, EPOLLRDHUP | EPOLLET);
+                shm_register(conn->req_fd, conn, EPOLLIN | EPOLLET);
+                shm.nconns++;
+                evlog(EV_SHM_ACCEPT, sock, shm.nconns, shm.max_conns);
+        }
+}
+
+// Serve the clients until all of them have been idle for SHM_SPIN_US, then
+// wait for the next event or watchdog deadline.
+static void *shm_run(void *arg)
+{
+        struct epoll_event events[SHM_MAX_EVENTS];
+        uint64_t idle_since = now_ns();
+        evlog_thread("shm");
+        while (1) {
+                int sleeping = 0;
+                if (now_ns() - idle_since >= shm.spin_ns) {
+                        sleeping = shm_sleep_all();
+                        if (!sleeping) {
+                                shm_wake_all();
+                                idle_since = now_ns();
+                        }
+                }
+
+                // asleep only until the next watchdog deadline
+                int timeout = sleeping ?
+                              watchdog_timeout(&shm.watchdog, now_ns()) : 0;
+                int nevents = epoll_wait(shm.epoll_fd, events, SHM_MAX_EVENTS,
+                                         timeout);
+                if (nevents == -1 && errno != EINTR) {
+                        die("failed to wait for events", 0);
+                }
+
+                if (sleeping) {
+                        shm_wake_all();
+                }
+
+                watchdog_run(&shm.watchdog, now_ns());
+
+                for (int i = 0; i < nevents; i++) {
+                        void *ptr = events[i].data.ptr;
+                        if (ptr == &shm.server_fd) {
+                                shm_accept();
+                        } else if (ptr == &shm.notify_fd) {
+                                eventfd_t count;
+                                eventfd_read(shm.notify_fd, &count);
+                                watchdog_complete(&shm.watchdog);
+                        } else {
+                                struct shm_conn *conn = ptr;
+                                eventfd_t count;
+                                if (conn->sock != -1 &&
+                                    events[i].events & (EPOLLRDHUP |
+                                                        EPOLLHUP)) {
+                                        shm_conn_close(conn);
+                                } else if (conn->sock != -1) {
+                                        eventfd_read(conn->req_fd, &count);
+                                }
+                        }
+                }
+
+                if (shm_service_all() || nevents > 0) {
+                        idle_since = now_ns();
+                }
+        }
+
+        return NULL;
+}
+
+void shm_start(struct bus *bus, const struct shm_config *config)
+{
+        printf("starting shared-memory server on %s...\n", config->path);
+
+        shm.server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+                               SOCK_CLOEXEC, 0);
+        if (shm.server_fd == -1) {
+                die("failed to instantiate shared-memory socket", 0);
+        }
+
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(config->path) >= sizeof(addr.sun_path)) {
+                die("shared-memory socket path too long", 0);
+        }
+
+        strcpy(addr.sun_path, config->path);
+        unlink(config->path);
+        if (bind(shm.server_fd, (const struct sockaddr *)&addr,
+                 sizeof(addr)) == -1) {
+                die("failed to bind shared-memory socket", 0);
+        }
+
+        if (listen(shm.server_fd, config->max_conns) == -1) {
+                die("failed to put shared-memory socket in listen mode", 0);
+        }
+
+        shm.bus = bus;
+        shm.max_conns = config->max_conns;
+        shm.spin_ns = sysconf(_SC_NPROCESSORS_ONLN) > 1 ?
+                      SHM_SPIN_US * 1000ull : 0;
+        shm.notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        shm.conns = aligned_alloc(RING_CACHELINE, config->max_conns *
+                                  sizeof(struct shm_conn));
+        if (shm.notify_fd == -1) {
+                die("failed to create eventfd", 0);
+        }
+
+        if (!shm.conns) {
+                die("failed to allocate shared-memory connections", 0);
+        }
+
+        memset(shm.conns, 0, config->max_conns * sizeof(struct shm_conn));
+        for (int i = config->max_conns - 1; i >= 0; i--) {
+                struct shm_conn *conn = &shm.conns[i];
+                if (bus_client_init(&conn->client, SHM_MAX_INFLIGHT,
+                                    shm.notify_fd) == -1) {
+                        die("failed to allocate completion queue", 0);
+                }
+
+                conn->sock = -1;
+                shm_conn_free(conn);
+        }
+
+        watchdog_init(&shm.watchdog, bus, shm.notify_fd, shm_conn_expired);
+        shm.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (shm.epoll_fd == -1) {
+                die("failed to create epoll instance", 0);
+        }
+
+        // the listening socket and the completion eventfd are told apart
+        // from connections by their pointers
+        shm_register(shm.server_fd, &shm.server_fd, EPOLLIN | EPOLLET);
+        shm_register(shm.notify_fd, &shm.notify_fd, EPOLLIN | EPOLLET);
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, shm_run, NULL) != 0) {
+                die("failed to start shared-memory thread", 0);
+        }
+}
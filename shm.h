@@ -0,0 +1,136 @@
+#pragma once
+
+#include "bus.h"
+#include "proto.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Shared-memory transport for clients running on the same machine.
+//
+// A client connects to a UNIX socket and receives three file descriptors with
+// SCM_RIGHTS: a memfd holding a struct shm_region and two eventfds, one
+// signalled towards the server and one towards the client. The region holds
+// a request ring written by the client and a response ring written by the
+// server, each slot carrying a single frame in the wire format of proto.h
+// (tagged or not), so the same command set is spoken as over TCP without a
+// syscall or copy through the kernel per frame. The socket stays open only to
+// tell the server when the client is gone.
+//
+// Both sides only signal the eventfd of the other if it announced that it is
+// going to sleep by setting sleeping in the ring it consumes. The server
+// thread keeps polling the rings for SHM_SPIN_US after the last frame it
+// handled, so a client sending at a steady pace hands over its commands
+// without any syscall at all. Neither side polls on a machine with a single
+// CPU, where that would only keep the other threads from running.
+
+// frames per ring, a power of two
+#define SHM_RING_SIZE           64
+
+// commands a client may have queued on the bus, as over TCP
+#define SHM_MAX_INFLIGHT        32
+
+// time the server thread polls the rings before going to sleep
+#define SHM_SPIN_US             200
+
+#define SHM_MAGIC               0x45505331 // "EPS1"
+
+struct shm_slot {
+        uint16_t len; // of frame
+        uint8_t frame[PROTO_TAG_HDR_SIZE + PROTO_MAX_FRAME];
+};
+
+// single producer, single consumer ring of frames
+struct shm_ring {
+        // consumer side
+        _Alignas(64) _Atomic uint32_t head;
+        _Atomic uint32_t sleeping; // consumer waits for its eventfd
+
+        // producer side
+        _Alignas(64) _Atomic uint32_t tail;
+
+        _Alignas(64) struct shm_slot slots[SHM_RING_SIZE];
+};
+
+struct shm_region {
+        uint32_t magic;
+        struct shm_ring requests;  // client to server
+        struct shm_ring responses; // server to client
+};
+
+// Returns the next free slot or NULL if the ring is full.
+static inline struct shm_slot *shm_claim(struct shm_ring *ring)
+{
+        uint32_t tail = atomic_load_explicit(&ring->tail,
+                                             memory_order_relaxed);
+        if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) ==
+            SHM_RING_SIZE) {
+                return NULL;
+        }
+
+        return &ring->slots[tail % SHM_RING_SIZE];
+}
+
+// Make the slot returned by the last shm_claim() visible to the consumer.
+static inline void shm_publish(struct shm_ring *ring)
+{
+        uint32_t tail = atomic_load_explicit(&ring->tail,
+                                             memory_order_relaxed);
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// Returns the oldest published slot or NULL if the ring is empty.
+static inline struct shm_slot *shm_peek(struct shm_ring *ring)
+{
+        uint32_t head = atomic_load_explicit(&ring->head,
+                                             memory_order_relaxed);
+        if (head == atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+                return NULL;
+        }
+
+        return &ring->slots[head % SHM_RING_SIZE];
+}
+
+// Hand the slot returned by the last shm_peek() back to the producer.
+static inline void shm_release(struct shm_ring *ring)
+{
+        uint32_t head = atomic_load_explicit(&ring->head,
+                                             memory_order_relaxed);
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Announce that the consumer is about to wait for fd. Returns 0 if a slot was
+// published meanwhile, in which case it must not wait.
+static inline int shm_sleep(struct shm_ring *ring)
+{
+        atomic_store(&ring->sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (shm_peek(ring)) {
+                atomic_store(&ring->sleeping, 0);
+                return 0;
+        }
+
+        return 1;
+}
+
+// Wake up the consumer of ring through fd if it is waiting. Call once after
+// publishing a batch of slots.
+static inline void shm_wake(struct shm_ring *ring, int fd)
+{
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_exchange(&ring->sleeping, 0)) {
+                eventfd_write(fd, 1);
+        }
+}
+
+struct shm_config {
+        const char *path; // of the UNIX socket to listen on
+        int max_conns;    // clients served concurrently, more are refused
+};
+
+// Start the thread serving shared-memory clients, which forwards their
+// commands to the bus like the TCP server (see comm.h). A stale socket at
+// path is replaced.
+void shm_start(struct bus *bus, const struct shm_config *config);
@@ -0,0 +1,3221 @@
+// Simulated libEposCmd.
+//
+// Implements the library functions used by the server (and their close
+// relatives) on top of a simple motor model per node, so the server can be
+// built, tested and benchmarked without the library, a CAN adapter or drives:
+//
+//   make sim        builds sim/libEposCmd.so and example_sim linked against it
+//   make bench-sim  runs bench/comm_bench against example_sim
+//
+// Every call addressed to a node is delayed by the SDO round trips the real
+// library would wait for and can be made to fail at random. Both are set
+// through the environment:
+//
+//   SIM_LATENCY_US  delay per SDO round trip in us (default 500)
+//   SIM_JITTER_US   random delay added to every round trip, uniformly
+//                   distributed up to this value (default 0)
+//   SIM_ERROR_RATE  probability that a call fails (default 0)
+//   SIM_ERROR_CODE  error code of failed calls (default 0x05040000, SDO
+//                   protocol timed out)
+//   SIM_SEED        seed of the random number generator (default 1)
+//   SIM_NODES       ids of the nodes on the bus, e.g. "2,5-8" (default all),
+//                   calls to other nodes time out
+//   SIM_MARKER_HZ   rate of the edges on every position marker input, up to
+//                   one per model step (default 100)
+//   SIM_PORT_FAIL_MS  time after the port is first opened at which it
+//                     fails as if the cable was pulled: calls to nodes time
+//                     out and no frames arrive until it is opened again
+//                     (default 0, never)
+//   SIM_PORT_DOWN_MS  time after the port failed during which opening it
+//                     fails (default 1000)
+//
+// SIM_<function>_LATENCY_US and SIM_<function>_ERROR_RATE override the
+// defaults for a single function, e.g. SIM_VCS_GetObject_LATENCY_US=2000.
+//
+// The model of a node is integrated in steps of 1 ms whenever the node is
+// accessed. It follows the CiA 402 state machine (disabled, enabled, quick
+// stop, fault), ramps the velocity with the profile acceleration in profile
+// velocity mode, moves along trapezoidal profiles in profile position mode,
+// interpolates PVT points with cubic Hermite splines in interpolated position
+// mode and homes by driving at the switch search speed for a while. The
+// current is constant friction plus a share proportional to the acceleration.
+//
+// The object dictionary serves the model values (statusword, position, ...)
+// and stores everything else written to it; objects never written read as 0.
+// PDOs mapped through it are transmitted by VCS_ReadCANFrame() and received
+// by VCS_SendCANFrame(), synchronous RPDOs take effect with the next SYNC.
+// The data recorder samples objects through it every model step at most, so
+// sampling periods below 10 (1 ms) are recorded at 1 ms. An active position
+// marker captures the position at SIM_MARKER_HZ; position compare outputs
+// only keep their settings.
+//
+// Like the real library, all calls are serialized: a call blocks until the
+// previous one, including its delay, is done.
+
+#define _GNU_SOURCE
+
+#include "../epos.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SIM_NODES               128
+#define SIM_OBJECTS             256       // objects stored per node
+#define SIM_PDOS                4
+#define SIM_IPM_CAPACITY        64        // PVT points in the IPM buffer
+#define SIM_REC_CHANNELS        4         // data recorder channels
+#define SIM_REC_BUFFER          8192      // bytes of data recorder samples
+#define SIM_REC_CYCLES_PER_STEP 10        // data recorder sampling periods
+                                          // (current controller cycles of
+                                          // 0.1 ms) per model step
+#define SIM_BLOCK_BYTES         889       // bytes per round trip of an SDO
+                                          // block transfer (127 segments)
+#define SIM_INC_PER_REV         4096      // encoder increments per revolution
+#define SIM_STEP_NS             1000000   // model time step
+#define SIM_MAX_LAG_NS          10000000000ull // longest stretch integrated,
+                                               // the model skips the rest
+#define SIM_HOMING_NS           500000000 // time homing takes
+#define SIM_FRICTION_MA         50        // current at constant velocity
+#define SIM_MA_PER_RPM_S        0.01      // current per acceleration
+#define SIM_DEFAULT_ACCEL       10000     // rpm/s, profile default
+#define SIM_MARKER_HISTORY      3         // captured positions kept
+
+#define SIM_COB_ID_NMT          0x000
+#define SIM_COB_ID_SYNC         0x080
+#define SIM_COB_ID_INVALID      0x80000000
+
+// error codes produced by the simulator
+#define SIM_ERR_TIMEOUT         0x05040000 // SDO protocol timed out
+#define SIM_ERR_LENGTH          0x06070012 // data type length too high
+#define SIM_ERR_RANGE           0x06090030 // value range exceeded
+#define SIM_ERR_STORE           0x08000020 // data cannot be stored
+#define SIM_ERR_STATE           0x08000022 // not possible in device state
+#define SIM_ERR_OPEN            0x20000001 // opening interface failed
+
+// statusword bits
+#define SW_READY                0x0001
+#define SW_SWITCHED_ON          0x0002
+#define SW_OPERATION_ENABLED    0x0004
+#define SW_FAULT                0x0008
+#define SW_VOLTAGE_ENABLED      0x0010
+#define SW_NO_QUICK_STOP        0x0020
+#define SW_SWITCH_ON_DISABLED   0x0040
+#define SW_REMOTE               0x0200
+#define SW_TARGET_REACHED       0x0400
+#define SW_MODE_SPECIFIC        0x1000 // homing attained, IPM active
+
+// controlword bits
+#define CW_SWITCH_ON            0x0001
+#define CW_ENABLE_VOLTAGE       0x0002
+#define CW_NO_QUICK_STOP        0x0004
+#define CW_ENABLE_OPERATION     0x0008
+#define CW_NEW_SETPOINT         0x0010 // also starts homing and IPM
+#define CW_RELATIVE             0x0040
+#define CW_FAULT_RESET          0x0080
+#define CW_HALT                 0x0100
+
+enum sim_nmt {
+        NMT_PRE_OPERATIONAL,
+        NMT_OPERATIONAL,
+        NMT_STOPPED,
+};
+
+struct sim_object {
+        uint16_t index;
+        uint8_t subindex;
+        uint8_t size;
+        uint32_t value;
+};
+
+struct sim_channel {
+        uint16_t index;
+        uint8_t subindex;
+        uint8_t size; // 0 if the channel is not active
+};
+
+struct sim_pvt {
+        int32_t position; // inc
+        int32_t velocity; // rpm
+        uint8_t time;     // ms until the next point, 0 for the last one
+};
+
+struct sim_node {
+        int present;
+        uint64_t time; // up to which the model is integrated, 0 if never
+        enum sim_nmt nmt;
+
+        // state machine and setpoints
+        uint16_t state; // ST_*
+        uint16_t controlword;
+        int8_t mode;    // OMD_*
+        int32_t target_position;
+        int32_t target_velocity;
+        int32_t current_must;
+        uint32_t profile_velocity;
+        uint32_t profile_acceleration;
+        uint32_t profile_deceleration;
+        uint32_t quick_stop_deceleration;
+        int moving; // profile position move in progress
+        int halted;
+        uint16_t device_error;
+
+        // motor
+        double position;     // inc
+        double velocity;     // rpm
+        double acceleration; // rpm/s
+
+        // homing
+        int homing;
+        int homing_attained;
+        uint64_t homing_end;
+        uint32_t homing_acceleration;
+        uint32_t speed_switch;
+        uint32_t speed_index;
+        int32_t home_offset;
+        uint16_t current_threshold;
+        int32_t home_position;
+
+        // interpolated position mode
+        struct sim_pvt ipm[SIM_IPM_CAPACITY];
+        unsigned ipm_head;
+        unsigned ipm_tail;
+        double ipm_elapsed_ms; // into the segment starting at ipm_head
+        int ipm_running;
+        int ipm_moving;        // first segment of the trajectory complete
+        int ipm_underflow_error;
+        int ipm_overflow_error;
+        uint16_t ipm_underflow_limit;
+        uint16_t ipm_overflow_limit;
+
+        // data recorder, samples are kept in a ring of rec_max
+        struct sim_channel rec_channels[SIM_REC_CHANNELS];
+        uint16_t rec_period;    // current controller cycles per sample
+        uint16_t rec_preceding; // samples kept from before the trigger
+        uint8_t rec_triggers;   // DR_*_TRIGGER flags
+        int rec_running;
+        int rec_triggered;
+        unsigned rec_steps;     // model steps until the next sample
+        unsigned rec_samples;   // taken since the recorder was started
+        unsigned rec_first;     // first sample kept once triggered
+        unsigned rec_max;       // samples the buffer holds
+        int rec_was_moving;     // last state, for the triggers
+        int rec_was_fault;
+        uint8_t rec_buffer[SIM_REC_BUFFER];
+
+        // position marker and compare
+        int marker_active;
+        uint8_t marker_mode;     // PM_*
+        uint16_t marker_count;
+        int32_t marker_history[SIM_MARKER_HISTORY]; // latest first
+        unsigned marker_steps;   // model steps until the next edge
+        int compare_active;
+        int compare_enabled;
+        int32_t compare_reference;
+
+        // process data
+        uint64_t tpdo_sent[SIM_PDOS]; // time the TPDO was last read
+        uint32_t tpdo_syncs[SIM_PDOS]; // SYNC count it was last read at
+        uint8_t rpdo_data[SIM_PDOS][8]; // received, applied with next SYNC
+        uint8_t rpdo_pending[SIM_PDOS];
+
+        size_t nobjects;
+        struct sim_object objects[SIM_OBJECTS];
+};
+
+// delay and error injection of one library function
+struct sim_fn {
+        int initialized;
+        double latency_us;
+        double error_rate;
+};
+
+struct sim_port {
+        uint32_t baudrate;
+        uint32_t timeout; // ms
+        int opened;
+        int failed;
+        uint64_t fail_at; // ns, 0 if the port does not fail
+        uint64_t up_at;   // ns from which it can be opened again
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static struct sim_node nodes[SIM_NODES];
+static struct sim_port port = { 1000000, 500 };
+static uint32_t syncs;
+
+static double jitter_us;
+static unsigned marker_interval; // model steps between marker edges
+static uint64_t port_fail_ns;
+static uint64_t port_down_ns;
+static uint32_t error_code;
+static uint64_t rng;
+static struct sim_fn defaults;
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+        struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) {
+        }
+}
+
+// uniformly distributed in [0, 1)
+static double sim_random(void)
+{
+        // xorshift64*
+        rng ^= rng >> 12;
+        rng ^= rng << 25;
+        rng ^= rng >> 27;
+        return (rng * 0x2545f4914f6cdd1dull >> 11) * 0x1.0p-53;
+}
+
+static double env_double(const char *name, double def)
+{
+        const char *value = getenv(name);
+        return value && *value ? strtod(value, NULL) : def;
+}
+
+// Mark the nodes listed in spec ("2,5-8") as present.
+static void sim_parse_nodes(const char *spec)
+{
+        while (*spec) {
+                char *end;
+                unsigned long first = strtoul(spec, &end, 0);
+                unsigned long last = first;
+                if (*end == '-') {
+                        last = strtoul(end + 1, &end, 0);
+                }
+
+                for (unsigned long id = first; id <= last && id < SIM_NODES;
+                     id++) {
+                        nodes[id].present = 1;
+                }
+
+                if (*end != ',') {
+                        break;
+                }
+
+                spec = end + 1;
+        }
+}
+
+static void sim_init(void)
+{
+        defaults.latency_us = env_double("SIM_LATENCY_US", 500);
+        defaults.error_rate = env_double("SIM_ERROR_RATE", 0);
+        jitter_us = env_double("SIM_JITTER_US", 0);
+        double marker_hz = env_double("SIM_MARKER_HZ", 100);
+        marker_interval = marker_hz > 0 ? 1e9 / SIM_STEP_NS / marker_hz : 0;
+        if (marker_hz > 0 && marker_interval == 0) {
+                marker_interval = 1;
+        }
+        port_fail_ns = env_double("SIM_PORT_FAIL_MS", 0) * 1000000;
+        port_down_ns = env_double("SIM_PORT_DOWN_MS", 1000) * 1000000;
+        error_code = env_double("SIM_ERROR_CODE", SIM_ERR_TIMEOUT);
+        rng = env_double("SIM_SEED", 1);
+        if (!rng) {
+                rng = 1;
+        }
+
+        const char *spec = getenv("SIM_NODES");
+        if (spec) {
+                sim_parse_nodes(spec);
+        } else {
+                for (int id = 1; id < SIM_NODES; id++) {
+                        nodes[id].present = 1;
+                }
+        }
+}
+
+static void sim_fn_init(struct sim_fn *fn, const char *name)
+{
+        char var[128];
+        snprintf(var, sizeof(var), "SIM_%s_LATENCY_US", name);
+        fn->latency_us = env_double(var, defaults.latency_us);
+        snprintf(var, sizeof(var), "SIM_%s_ERROR_RATE", name);
+        fn->error_rate = env_double(var, defaults.error_rate);
+        fn->initialized = 1;
+}
+
+// Reset a node to its power-on state.
+static void sim_reset(struct sim_node *node)
+{
+        int present = node->present;
+        memset(node, 0, sizeof(*node));
+        node->present = present;
+        node->state = ST_DISABLED;
+        node->mode = OMD_PROFILE_POSITION_MODE;
+        node->profile_velocity = 1000;
+        node->profile_acceleration = SIM_DEFAULT_ACCEL;
+        node->profile_deceleration = SIM_DEFAULT_ACCEL;
+        node->quick_stop_deceleration = 10 * SIM_DEFAULT_ACCEL;
+        node->homing_acceleration = SIM_DEFAULT_ACCEL;
+        node->speed_switch = 100;
+        node->speed_index = 10;
+        node->ipm_underflow_limit = 4;
+        node->ipm_overflow_limit = SIM_IPM_CAPACITY - 4;
+}
+
+static double rpm_to_inc_s(double rpm)
+{
+        return rpm * SIM_INC_PER_REV / 60;
+}
+
+// Change the velocity towards target, with accel while speeding up and decel
+// while slowing down.
+static void sim_ramp(struct sim_node *node, double target, double accel,
+                     double decel, double dt)
+{
+        double v = node->velocity;
+        int slowing = fabs(target) < fabs(v) || target * v < 0;
+        double step = (slowing ? decel : accel) * dt;
+        double next = fabs(target - v) <= step ? target :
+                      v + (target > v ? step : -step);
+        node->acceleration = (next - v) / dt;
+        node->velocity = next;
+        node->position += rpm_to_inc_s((v + next) / 2) * dt;
+}
+
+static void sim_stop(struct sim_node *node)
+{
+        node->velocity = 0;
+        node->acceleration = 0;
+        node->moving = 0;
+        node->homing = 0;
+        node->ipm_running = 0;
+}
+
+static void sim_step_position(struct sim_node *node, double dt)
+{
+        if (!node->moving || node->halted) {
+                sim_ramp(node, 0, node->profile_acceleration,
+                         node->profile_deceleration, dt);
+                return;
+        }
+
+        double remaining = node->target_position - node->position;
+        double decel = rpm_to_inc_s(node->profile_deceleration);
+        // fastest speed from which the target can still be reached
+        double reachable = sqrt(2 * decel * fabs(remaining)) * 60 /
+                           SIM_INC_PER_REV;
+        double speed = fmin(node->profile_velocity, reachable);
+        sim_ramp(node, remaining < 0 ? -speed : speed,
+                 node->profile_acceleration, node->profile_deceleration, dt);
+
+        double left = node->target_position - node->position;
+        if (left * remaining <= 0 || fabs(left) < 0.5) {
+                node->position = node->target_position;
+                node->velocity = 0;
+                node->moving = 0;
+        }
+}
+
+static void sim_ipm_underflow(struct sim_node *node)
+{
+        node->ipm_underflow_error = 1;
+        sim_stop(node);
+}
+
+static void sim_step_ipm(struct sim_node *node, double dt)
+{
+        if (!node->ipm_running) {
+                sim_stop(node);
+                return;
+        }
+
+        // the trajectory waits for its first segment, then the buffer must
+        // never run dry
+        unsigned depth = node->ipm_tail - node->ipm_head;
+        if (!node->ipm_moving && depth < 2 &&
+            (depth == 0 || node->ipm[node->ipm_head %
+                                     SIM_IPM_CAPACITY].time != 0)) {
+                return;
+        }
+
+        node->ipm_moving = 1;
+        node->ipm_elapsed_ms += dt * 1000;
+        const struct sim_pvt *p0;
+        while (1) {
+                depth = node->ipm_tail - node->ipm_head;
+                if (depth == 0) {
+                        sim_ipm_underflow(node);
+                        return;
+                }
+
+                p0 = &node->ipm[node->ipm_head % SIM_IPM_CAPACITY];
+                if (p0->time == 0) {
+                        // last point of the trajectory
+                        node->position = p0->position;
+                        node->ipm_head++;
+                        sim_stop(node);
+                        return;
+                } else if (depth < 2) {
+                        sim_ipm_underflow(node);
+                        return;
+                } else if (node->ipm_elapsed_ms < p0->time) {
+                        break;
+                }
+
+                node->ipm_elapsed_ms -= p0->time;
+                node->ipm_head++;
+        }
+
+        const struct sim_pvt *p1 =
+                &node->ipm[(node->ipm_head + 1) % SIM_IPM_CAPACITY];
+        double t = p0->time;
+        double s = node->ipm_elapsed_ms / t;
+        // tangents in increments per segment
+        double m0 = rpm_to_inc_s(p0->velocity) * t / 1000;
+        double m1 = rpm_to_inc_s(p1->velocity) * t / 1000;
+        double s2 = s * s;
+        double s3 = s2 * s;
+        double position = (2 * s3 - 3 * s2 + 1) * p0->position +
+                          (s3 - 2 * s2 + s) * m0 +
+                          (-2 * s3 + 3 * s2) * p1->position +
+                          (s3 - s2) * m1;
+        double slope = (6 * s2 - 6 * s) * p0->position +
+                       (3 * s2 - 4 * s + 1) * m0 +
+                       (-6 * s2 + 6 * s) * p1->position +
+                       (3 * s2 - 2 * s) * m1;
+        double velocity = slope / (t / 1000) * 60 / SIM_INC_PER_REV;
+        node->acceleration = (velocity - node->velocity) / dt;
+        node->velocity = velocity;
+        node->position = position;
+}
+
+static void sim_step_homing(struct sim_node *node, double dt)
+{
+        if (!node->homing) {
+                sim_ramp(node, 0, node->homing_acceleration,
+                         node->homing_acceleration, dt);
+                return;
+        }
+
+        if (node->time >= node->homing_end) {
+                node->position = node->home_position;
+                node->velocity = 0;
+                node->acceleration = 0;
+                node->homing = 0;
+                node->homing_attained = 1;
+                return;
+        }
+
+        sim_ramp(node, node->speed_switch, node->homing_acceleration,
+                 node->homing_acceleration, dt);
+}
+
+static void sim_step(struct sim_node *node, double dt)
+{
+        switch (node->state) {
+        case ST_ENABLED:
+                break;
+        case ST_QUICKSTOP:
+                sim_ramp(node, 0, node->quick_stop_deceleration,
+                         node->quick_stop_deceleration, dt);
+                return;
+        default:
+                sim_stop(node);
+                return;
+        }
+
+        switch (node->mode) {
+        case OMD_PROFILE_POSITION_MODE:
+        case OMD_POSITION_MODE:
+                sim_step_position(node, dt);
+                break;
+        case OMD_PROFILE_VELOCITY_MODE:
+                sim_ramp(node, node->halted ? 0 : node->target_velocity,
+                         node->profile_acceleration,
+                         node->profile_deceleration, dt);
+                break;
+        case OMD_VELOCITY_MODE:
+                sim_ramp(node, node->target_velocity, INFINITY, INFINITY, dt);
+                break;
+        case OMD_CURRENT_MODE: {
+                // torque beyond friction accelerates the motor
+                double accel = (abs(node->current_must) > SIM_FRICTION_MA ?
+                                node->current_must -
+                                copysign(SIM_FRICTION_MA,
+                                         node->current_must) : 0) /
+                               SIM_MA_PER_RPM_S;
+                double target = accel > 0 ? INFINITY :
+                                accel < 0 ? -INFINITY : 0;
+                double rate = fabs(accel) > 0 ? fabs(accel) :
+                              node->quick_stop_deceleration;
+                sim_ramp(node, target, rate, rate, dt);
+                break;
+        }
+        case OMD_HOMING_MODE:
+                sim_step_homing(node, dt);
+                break;
+        case OMD_INTERPOLATED_POSITION_MODE:
+                sim_step_ipm(node, dt);
+                break;
+        default:
+                sim_stop(node);
+                break;
+        }
+}
+
+static void sim_rec_step(struct sim_node *node);
+static void sim_marker_step(struct sim_node *node);
+
+// Integrate the model of a node up to now.
+static void sim_advance(struct sim_node *node, uint64_t now)
+{
+        if (!node->time) {
+                sim_reset(node);
+                node->time = now;
+                return;
+        }
+
+        if (now - node->time > SIM_MAX_LAG_NS) {
+                node->time = now - SIM_MAX_LAG_NS;
+        }
+
+        while (now - node->time >= SIM_STEP_NS) {
+                node->time += SIM_STEP_NS;
+                sim_step(node, SIM_STEP_NS / 1e9);
+                sim_rec_step(node);
+                sim_marker_step(node);
+        }
+}
+
+static int32_t sim_current(const struct sim_node *node)
+{
+        double current = node->acceleration * SIM_MA_PER_RPM_S;
+        if (fabs(node->velocity) >= 0.5) {
+                current += copysign(SIM_FRICTION_MA, node->velocity);
+        }
+
+        return lround(current);
+}
+
+static int sim_target_reached(const struct sim_node *node)
+{
+        switch (node->mode) {
+        case OMD_PROFILE_POSITION_MODE:
+        case OMD_POSITION_MODE:
+                return !node->moving && fabs(node->velocity) < 0.5;
+        case OMD_PROFILE_VELOCITY_MODE:
+        case OMD_VELOCITY_MODE:
+                return fabs(node->velocity -
+                            (node->halted ? 0 : node->target_velocity)) < 0.5;
+        case OMD_HOMING_MODE:
+                return !node->homing;
+        case OMD_INTERPOLATED_POSITION_MODE:
+                return !node->ipm_running;
+        default:
+                return 1;
+        }
+}
+
+static uint16_t sim_statusword(const struct sim_node *node)
+{
+        uint16_t sw = SW_REMOTE;
+        switch (node->state) {
+        case ST_ENABLED:
+                sw |= SW_READY | SW_SWITCHED_ON | SW_OPERATION_ENABLED |
+                      SW_VOLTAGE_ENABLED | SW_NO_QUICK_STOP;
+                break;
+        case ST_QUICKSTOP:
+                sw |= SW_READY | SW_SWITCHED_ON | SW_OPERATION_ENABLED |
+                      SW_VOLTAGE_ENABLED;
+                break;
+        case ST_FAULT:
+                sw |= SW_FAULT | SW_VOLTAGE_ENABLED;
+                break;
+        default:
+                sw |= SW_SWITCH_ON_DISABLED;
+                break;
+        }
+
+        if (sim_target_reached(node)) {
+                sw |= SW_TARGET_REACHED;
+        }
+
+        if ((node->mode == OMD_HOMING_MODE && node->homing_attained) ||
+            (node->mode == OMD_INTERPOLATED_POSITION_MODE &&
+             node->ipm_running)) {
+                sw |= SW_MODE_SPECIFIC;
+        }
+
+        return sw;
+}
+
+static struct sim_object *sim_object(struct sim_node *node, uint16_t index,
+                                     uint8_t subindex)
+{
+        for (size_t i = 0; i < node->nobjects; i++) {
+                struct sim_object *object = &node->objects[i];
+                if (object->index == index && object->subindex == subindex) {
+                        return object;
+                }
+        }
+
+        return NULL;
+}
+
+// Value of a stored object, def if it was never written.
+static uint32_t sim_stored(struct sim_node *node, uint16_t index,
+                           uint8_t subindex, uint32_t def)
+{
+        const struct sim_object *object = sim_object(node, index, subindex);
+        return object ? object->value : def;
+}
+
+static uint32_t sim_store(struct sim_node *node, uint16_t index,
+                          uint8_t subindex, uint32_t value, uint8_t size)
+{
+        struct sim_object *object = sim_object(node, index, subindex);
+        if (!object) {
+                if (node->nobjects == SIM_OBJECTS) {
+                        return SIM_ERR_STORE;
+                }
+
+                object = &node->objects[node->nobjects++];
+                object->index = index;
+                object->subindex = subindex;
+        }
+
+        object->value = value;
+        object->size = size;
+        return 0;
+}
+
+// Start a profile position move to target (relative to the current position
+// if relative is set).
+static uint32_t sim_move(struct sim_node *node, int32_t target, int relative)
+{
+        if (node->state != ST_ENABLED ||
+            (node->mode != OMD_PROFILE_POSITION_MODE &&
+             node->mode != OMD_POSITION_MODE)) {
+                return SIM_ERR_STATE;
+        }
+
+        node->target_position = relative ? lround(node->position) + target :
+                                target;
+        node->moving = 1;
+        node->halted = 0;
+        return 0;
+}
+
+static uint32_t sim_find_home(struct sim_node *node)
+{
+        if (node->state != ST_ENABLED || node->mode != OMD_HOMING_MODE) {
+                return SIM_ERR_STATE;
+        }
+
+        node->homing = 1;
+        node->homing_attained = 0;
+        node->homing_end = node->time + SIM_HOMING_NS;
+        return 0;
+}
+
+static uint32_t sim_start_ipm(struct sim_node *node)
+{
+        if (node->state != ST_ENABLED ||
+            node->mode != OMD_INTERPOLATED_POSITION_MODE) {
+                return SIM_ERR_STATE;
+        }
+
+        node->ipm_running = 1;
+        node->ipm_moving = 0;
+        node->ipm_elapsed_ms = 0;
+        node->ipm_underflow_error = 0;
+        return 0;
+}
+
+static uint32_t sim_controlword(struct sim_node *node, uint16_t cw)
+{
+        uint16_t rising = cw & ~node->controlword;
+        node->controlword = cw;
+        if (rising & CW_FAULT_RESET) {
+                if (node->state == ST_FAULT) {
+                        node->state = ST_DISABLED;
+                        node->device_error = 0;
+                }
+
+                return 0;
+        }
+
+        if (node->state == ST_FAULT) {
+                return 0;
+        }
+
+        if (!(cw & CW_ENABLE_VOLTAGE)) {
+                node->state = ST_DISABLED;
+        } else if (!(cw & CW_NO_QUICK_STOP)) {
+                node->state = node->state == ST_ENABLED ? ST_QUICKSTOP :
+                              ST_DISABLED;
+        } else if ((cw & 0x000f) == (CW_SWITCH_ON | CW_ENABLE_VOLTAGE |
+                                     CW_NO_QUICK_STOP | CW_ENABLE_OPERATION)) {
+                node->state = ST_ENABLED;
+        } else {
+                node->state = ST_DISABLED;
+        }
+
+        if (node->state != ST_ENABLED) {
+                return 0;
+        }
+
+        node->halted = !!(cw & CW_HALT);
+        switch (node->mode) {
+        case OMD_PROFILE_POSITION_MODE:
+                if (rising & CW_NEW_SETPOINT) {
+                        // target_position already holds the new target
+                        return sim_move(node, cw & CW_RELATIVE ?
+                                        node->target_position -
+                                        lround(node->position) :
+                                        node->target_position, 0);
+                }
+                break;
+        case OMD_HOMING_MODE:
+                if (rising & CW_NEW_SETPOINT) {
+                        return sim_find_home(node);
+                }
+                break;
+        case OMD_INTERPOLATED_POSITION_MODE:
+                if (rising & CW_NEW_SETPOINT) {
+                        return sim_start_ipm(node);
+                } else if (!(cw & CW_NEW_SETPOINT)) {
+                        node->ipm_running = 0;
+                }
+                break;
+        }
+
+        return 0;
+}
+
+static int sim_valid_mode(int8_t mode)
+{
+        switch (mode) {
+        case OMD_PROFILE_POSITION_MODE:
+        case OMD_PROFILE_VELOCITY_MODE:
+        case OMD_HOMING_MODE:
+        case OMD_INTERPOLATED_POSITION_MODE:
+        case OMD_POSITION_MODE:
+        case OMD_VELOCITY_MODE:
+        case OMD_CURRENT_MODE:
+                return 1;
+        default:
+                return 0;
+        }
+}
+
+static uint32_t sim_set_mode(struct sim_node *node, int8_t mode)
+{
+        if (!sim_valid_mode(mode)) {
+                return SIM_ERR_RANGE;
+        }
+
+        if (mode != node->mode) {
+                node->moving = 0;
+                node->homing = 0;
+                node->ipm_running = 0;
+        }
+
+        node->mode = mode;
+        return 0;
+}
+
+// Read an object. Returns 0 or an SDO abort code.
+static uint32_t sim_read(struct sim_node *node, uint16_t index,
+                         uint8_t subindex, uint32_t *value, uint8_t *size)
+{
+        *size = 4;
+        switch ((uint32_t)index << 8 | subindex) {
+        case 0x100100: // error register
+                *value = node->device_error ? 1 : 0;
+                *size = 1;
+                break;
+        case 0x603f00: // error code
+                *value = node->device_error;
+                *size = 2;
+                break;
+        case 0x604000:
+                *value = node->controlword;
+                *size = 2;
+                break;
+        case 0x604100:
+                *value = sim_statusword(node);
+                *size = 2;
+                break;
+        case 0x606000:
+        case 0x606100:
+                *value = (uint8_t)node->mode;
+                *size = 1;
+                break;
+        case 0x606400:
+                *value = (int32_t)lround(node->position);
+                break;
+        case 0x606c00:
+                *value = (int32_t)lround(node->velocity);
+                break;
+        case 0x607800: // current actual (EPOS2)
+                *value = (uint16_t)sim_current(node);
+                *size = 2;
+                break;
+        case 0x30d101: // current actual averaged (EPOS4)
+        case 0x30d102: // current actual (EPOS4)
+                *value = sim_current(node);
+                break;
+        case 0x607a00:
+                *value = node->target_position;
+                break;
+        case 0x60ff00:
+                *value = node->target_velocity;
+                break;
+        case 0x608100:
+                *value = node->profile_velocity;
+                break;
+        case 0x608300:
+                *value = node->profile_acceleration;
+                break;
+        case 0x608400:
+                *value = node->profile_deceleration;
+                break;
+        case 0x608500:
+                *value = node->quick_stop_deceleration;
+                break;
+        default: {
+                const struct sim_object *object = sim_object(node, index,
+                                                             subindex);
+                *value = object ? object->value : 0;
+                *size = object ? object->size : 4;
+                break;
+        }
+        }
+
+        return 0;
+}
+
+// Bytes of one data recorder sample (all active channels).
+static unsigned sim_rec_sample_size(const struct sim_node *node)
+{
+        unsigned size = 0;
+        for (int i = 0; i < SIM_REC_CHANNELS; i++) {
+                size += node->rec_channels[i].size;
+        }
+
+        return size;
+}
+
+// Model steps between two data recorder samples. Periods shorter than a step
+// are sampled every step.
+static unsigned sim_rec_interval(const struct sim_node *node)
+{
+        unsigned steps = (node->rec_period + SIM_REC_CYCLES_PER_STEP / 2) /
+                         SIM_REC_CYCLES_PER_STEP;
+        return steps ? steps : 1;
+}
+
+static void sim_rec_trigger(struct sim_node *node)
+{
+        unsigned kept = node->rec_samples < node->rec_preceding ?
+                        node->rec_samples : node->rec_preceding;
+        node->rec_triggered = 1;
+        node->rec_first = node->rec_samples - kept;
+}
+
+// First sample in the data recorder buffer.
+static unsigned sim_rec_first(const struct sim_node *node)
+{
+        if (node->rec_triggered) {
+                return node->rec_first;
+        }
+
+        return node->rec_samples > node->rec_max ?
+               node->rec_samples - node->rec_max : 0;
+}
+
+// Check the data recorder triggers and take a sample if one is due.
+static void sim_rec_step(struct sim_node *node)
+{
+        if (!node->rec_running) {
+                return;
+        }
+
+        int moving = fabs(node->velocity) >= 0.5;
+        int fault = node->state == ST_FAULT;
+        if (!node->rec_triggered &&
+            ((node->rec_triggers & DR_MOVEMENT_START_TRIGGER &&
+              moving && !node->rec_was_moving) ||
+             (node->rec_triggers & DR_MOVEMENT_END_TRIGGER &&
+              !moving && node->rec_was_moving) ||
+             (node->rec_triggers & DR_ERROR_TRIGGER &&
+              fault && !node->rec_was_fault))) {
+                sim_rec_trigger(node);
+        }
+
+        node->rec_was_moving = moving;
+        node->rec_was_fault = fault;
+        if (--node->rec_steps > 0) {
+                return;
+        }
+
+        node->rec_steps = sim_rec_interval(node);
+        uint8_t *sample = node->rec_buffer +
+                          node->rec_samples % node->rec_max *
+                          sim_rec_sample_size(node);
+        for (int i = 0; i < SIM_REC_CHANNELS; i++) {
+                const struct sim_channel *channel = &node->rec_channels[i];
+                uint32_t value;
+                uint8_t size;
+                if (!channel->size) {
+                        continue;
+                }
+
+                sim_read(node, channel->index, channel->subindex, &value,
+                         &size);
+                for (int byte = 0; byte < channel->size; byte++) {
+                        *sample++ = value >> (8 * byte);
+                }
+        }
+
+        node->rec_samples++;
+        if (node->rec_triggered &&
+            node->rec_samples - node->rec_first == node->rec_max) {
+                node->rec_running = 0;
+        }
+}
+
+// Capture the position if an edge arrives at the position marker input.
+static void sim_marker_step(struct sim_node *node)
+{
+        if (!node->marker_active || !marker_interval ||
+            (node->marker_mode == PM_SINGLE && node->marker_count > 0) ||
+            --node->marker_steps > 0) {
+                return;
+        }
+
+        node->marker_steps = marker_interval;
+        memmove(node->marker_history + 1, node->marker_history,
+                (SIM_MARKER_HISTORY - 1) * sizeof(node->marker_history[0]));
+        node->marker_history[0] = lround(node->position);
+        node->marker_count++;
+}
+
+// Write an object. Returns 0 or an SDO abort code.
+static uint32_t sim_write(struct sim_node *node, uint16_t index,
+                          uint8_t subindex, uint32_t value, uint8_t size)
+{
+        switch ((uint32_t)index << 8 | subindex) {
+        case 0x604000:
+                return sim_controlword(node, value);
+        case 0x606000:
+                return sim_set_mode(node, value);
+        case 0x607a00:
+                node->target_position = value;
+                if (node->mode == OMD_POSITION_MODE &&
+                    node->state == ST_ENABLED) {
+                        return sim_move(node, value, 0);
+                }
+                return 0;
+        case 0x60ff00:
+                node->target_velocity = value;
+                return 0;
+        case 0x608100:
+                node->profile_velocity = value;
+                return 0;
+        case 0x608300:
+                node->profile_acceleration = value;
+                return 0;
+        case 0x608400:
+                node->profile_deceleration = value;
+                return 0;
+        case 0x608500:
+                node->quick_stop_deceleration = value;
+                return 0;
+        case 0x603f00:
+        case 0x604100:
+        case 0x606100:
+        case 0x606400:
+        case 0x606c00:
+        case 0x607800:
+        case 0x30d101:
+        case 0x30d102:
+                return SIM_ERR_STATE; // read only
+        default:
+                return sim_store(node, index, subindex, value, size);
+        }
+}
+
+// Build the frame of TPDO num (0-based). Returns the data length or -1 if the
+// TPDO is disabled.
+static int sim_tpdo(struct sim_node *node, unsigned num, uint8_t *data)
+{
+        uint32_t cob_id = sim_stored(node, 0x1800 + num, 0x01,
+                                     SIM_COB_ID_INVALID);
+        if (cob_id & SIM_COB_ID_INVALID || node->nmt != NMT_OPERATIONAL) {
+                return -1;
+        }
+
+        uint8_t nentries = sim_stored(node, 0x1a00 + num, 0x00, 0);
+        int len = 0;
+        for (uint8_t i = 0; i < nentries; i++) {
+                uint32_t entry = sim_stored(node, 0x1a00 + num, i + 1, 0);
+                int bytes = (entry & 0xff) / 8;
+                if (len + bytes > 8) {
+                        break;
+                }
+
+                uint32_t value;
+                uint8_t size;
+                sim_read(node, entry >> 16, entry >> 8, &value, &size);
+                for (int byte = 0; byte < bytes; byte++) {
+                        data[len++] = value >> (8 * byte);
+                }
+        }
+
+        return len;
+}
+
+// Write the values carried by an RPDO frame to the objects mapped into it.
+static void sim_rpdo_apply(struct sim_node *node, unsigned num,
+                           const uint8_t *data)
+{
+        uint8_t nentries = sim_stored(node, 0x1600 + num, 0x00, 0);
+        int offset = 0;
+        for (uint8_t i = 0; i < nentries; i++) {
+                uint32_t entry = sim_stored(node, 0x1600 + num, i + 1, 0);
+                int bytes = (entry & 0xff) / 8;
+                if (offset + bytes > 8) {
+                        break;
+                }
+
+                uint32_t value = 0;
+                for (int byte = 0; byte < bytes; byte++) {
+                        value |= (uint32_t)data[offset + byte] << (8 * byte);
+                }
+
+                // sign-extend narrower values, they may be signed
+                if (bytes && bytes < 4 && value & (1u << (8 * bytes - 1))) {
+                        value |= ~0u << (8 * bytes);
+                }
+
+                sim_write(node, entry >> 16, entry >> 8, value, bytes);
+                offset += bytes;
+        }
+}
+
+static void sim_rpdo(struct sim_node *node, unsigned num, const uint8_t *data,
+                     uint16_t len)
+{
+        uint32_t cob_id = sim_stored(node, 0x1400 + num, 0x01,
+                                     SIM_COB_ID_INVALID);
+        if (cob_id & SIM_COB_ID_INVALID || node->nmt != NMT_OPERATIONAL) {
+                return;
+        }
+
+        uint8_t transmission_type = sim_stored(node, 0x1400 + num, 0x02, 255);
+        if (transmission_type <= 240) {
+                memset(node->rpdo_data[num], 0, sizeof(node->rpdo_data[num]));
+                memcpy(node->rpdo_data[num], data, len > 8 ? 8 : len);
+                node->rpdo_pending[num] = 1;
+        } else {
+                uint8_t frame[8] = { 0 };
+                memcpy(frame, data, len > 8 ? 8 : len);
+                sim_rpdo_apply(node, num, frame);
+        }
+}
+
+static void sim_sync(uint64_t now)
+{
+        syncs++;
+        for (int id = 1; id < SIM_NODES; id++) {
+                struct sim_node *node = &nodes[id];
+                if (!node->present || !node->time) {
+                        continue;
+                }
+
+                sim_advance(node, now);
+                for (unsigned num = 0; num < SIM_PDOS; num++) {
+                        if (node->rpdo_pending[num]) {
+                                node->rpdo_pending[num] = 0;
+                                sim_rpdo_apply(node, num,
+                                               node->rpdo_data[num]);
+                        }
+                }
+        }
+}
+
+static void sim_nmt(struct sim_node *node, uint16_t command)
+{
+        switch (command) {
+        case 1: // NCS_START_REMOTE_NODE
+                node->nmt = NMT_OPERATIONAL;
+                break;
+        case 2: // NCS_STOP_REMOTE_NODE
+                node->nmt = NMT_STOPPED;
+                break;
+        case 128: // NCS_ENTER_PRE_OPERATIONAL
+                node->nmt = NMT_PRE_OPERATIONAL;
+                break;
+        case 129: // NCS_RESET_NODE
+                sim_reset(node);
+                node->time = now_ns();
+                break;
+        case 130: { // NCS_RESET_COMMUNICATION
+                size_t n = 0;
+                for (size_t i = 0; i < node->nobjects; i++) {
+                        if (node->objects[i].index < 0x1000 ||
+                            node->objects[i].index > 0x1fff) {
+                                node->objects[n++] = node->objects[i];
+                        }
+                }
+
+                node->nobjects = n;
+                node->nmt = NMT_PRE_OPERATIONAL;
+                break;
+        }
+        }
+}
+
+// Begin a call to node_id (0 for calls not addressed to a node) which takes
+// transfers SDO round trips: take the lock, wait for the round trips and
+// bring the node's model up to date. Returns the node with the lock held, or
+// NULL with *err set if the call fails.
+static struct sim_node *sim_enter(struct sim_fn *fn, const char *name,
+                                  uint16_t node_id, unsigned transfers,
+                                  uint32_t *err)
+{
+        pthread_once(&once, sim_init);
+        pthread_mutex_lock(&lock);
+        if (!fn->initialized) {
+                sim_fn_init(fn, name);
+        }
+
+        uint64_t start = now_ns();
+        if (port.fail_at && start >= port.fail_at) {
+                port.fail_at = 0;
+                port.failed = 1;
+                port.up_at = start + port_down_ns;
+        }
+
+        if (node_id >= SIM_NODES ||
+            (node_id && (port.failed || !nodes[node_id].present))) {
+                sleep_until(start + port.timeout * 1000000ull);
+                *err = SIM_ERR_TIMEOUT;
+                pthread_mutex_unlock(&lock);
+                return NULL;
+        }
+
+        if (transfers) {
+                double delay_us = 0;
+                for (unsigned i = 0; i < transfers; i++) {
+                        delay_us += fn->latency_us + jitter_us * sim_random();
+                }
+
+                sleep_until(start + (uint64_t)(delay_us * 1000));
+                if (fn->error_rate > 0 && sim_random() < fn->error_rate) {
+                        *err = error_code;
+                        pthread_mutex_unlock(&lock);
+                        return NULL;
+                }
+        }
+
+        struct sim_node *node = &nodes[node_id];
+        if (node_id) {
+                sim_advance(node, now_ns());
+        }
+
+        return node;
+}
+
+// End a call begun by sim_enter(). Returns what the library function returns.
+static int32_t sim_leave(uint32_t result, uint32_t *err)
+{
+        *err = result;
+        pthread_mutex_unlock(&lock);
+        return result == 0;
+}
+
+#define SIM_ENTER(node_id, transfers, err) ({                           \
+        static struct sim_fn fn_;                                       \
+        sim_enter(&fn_, __func__, (node_id), (transfers), (err));       \
+})
+
+// Communication
+
+void *VCS_OpenDevice(char *DeviceName, char *ProtocolStackName,
+                     char *InterfaceName, char *PortName,
+                     uint32_t *pErrorCode)
+{
+        if (!SIM_ENTER(0, 0, pErrorCode)) {
+                return NULL;
+        } else if (port.failed && now_ns() < port.up_at) {
+                sim_leave(SIM_ERR_OPEN, pErrorCode);
+                return NULL;
+        }
+
+        port.failed = 0;
+        if (!port.opened && port_fail_ns) {
+                port.fail_at = now_ns() + port_fail_ns;
+        }
+
+        port.opened = 1;
+        sim_leave(0, pErrorCode);
+        return &port;
+}
+
+int32_t VCS_SetProtocolStackSettings(void *KeyHandle, uint32_t Baudrate,
+                                     uint32_t Timeout, uint32_t *pErrorCode)
+{
+        if (!SIM_ENTER(0, 0, pErrorCode)) {
+                return 0;
+        }
+
+        port.baudrate = Baudrate;
+        port.timeout = Timeout;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetProtocolStackSettings(void *KeyHandle, uint32_t *pBaudrate,
+                                     uint32_t *pTimeout, uint32_t *pErrorCode)
+{
+        if (!SIM_ENTER(0, 0, pErrorCode)) {
+                return 0;
+        }
+
+        *pBaudrate = port.baudrate;
+        *pTimeout = port.timeout;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_CloseDevice(void *KeyHandle, uint32_t *pErrorCode)
+{
+        if (!SIM_ENTER(0, 0, pErrorCode)) {
+                return 0;
+        }
+
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_CloseAllDevices(uint32_t *pErrorCode)
+{
+        if (!SIM_ENTER(0, 0, pErrorCode)) {
+                return 0;
+        }
+
+        return sim_leave(0, pErrorCode);
+}
+
+// Info
+
+int32_t VCS_GetDriverInfo(char *p_pszLibraryName,
+                          uint16_t p_usMaxLibraryNameStrSize,
+                          char *p_pszLibraryVersion,
+                          uint16_t p_usMaxLibraryVersionStrSize,
+                          uint32_t *p_pErrorCode)
+{
+        if (!SIM_ENTER(0, 0, p_pErrorCode)) {
+                return 0;
+        }
+
+        snprintf(p_pszLibraryName, p_usMaxLibraryNameStrSize,
+                 "libEposCmd (simulated)");
+        snprintf(p_pszLibraryVersion, p_usMaxLibraryVersionStrSize, "sim");
+        return sim_leave(0, p_pErrorCode);
+}
+
+int32_t VCS_GetVersion(void *KeyHandle, uint16_t NodeId,
+                       uint16_t *pHardwareVersion, uint16_t *pSoftwareVersion,
+                       uint16_t *pApplicationNumber,
+                       uint16_t *pApplicationVersion, uint32_t *pErrorCode)
+{
+        if (!SIM_ENTER(NodeId, 4, pErrorCode)) {
+                return 0;
+        }
+
+        *pHardwareVersion = 0x6050;
+        *pSoftwareVersion = 0x0170;
+        *pApplicationNumber = 0;
+        *pApplicationVersion = 0;
+        return sim_leave(0, pErrorCode);
+}
+
+// Port selection: the simulation offers a single device, protocol stack,
+// interface and port, whatever is passed to VCS_OpenDevice().
+
+static const uint32_t sim_baudrates[] = {
+        1000000, 800000, 500000, 250000, 125000, 50000, 20000
+};
+
+static unsigned sim_baudrate_next;
+
+static int32_t sim_selection(int32_t start, const char *name, char *sel,
+                             uint16_t max, int *end, uint32_t *err)
+{
+        if (!start) {
+                // past the end
+                *err = SIM_ERR_RANGE;
+                return 0;
+        }
+
+        snprintf(sel, max, "%s", name);
+        *end = 1;
+        *err = 0;
+        return 1;
+}
+
+int32_t VCS_GetDeviceNameSelection(int32_t StartOfSelection,
+                                   char *pDeviceNameSel, uint16_t MaxStrSize,
+                                   int *pEndOfSelection, uint32_t *pErrorCode)
+{
+        return sim_selection(StartOfSelection, "EPOS4", pDeviceNameSel,
+                             MaxStrSize, pEndOfSelection, pErrorCode);
+}
+
+int32_t VCS_GetProtocolStackNameSelection(char *DeviceName,
+                                          int32_t StartOfSelection,
+                                          char *pProtocolStackNameSel,
+                                          uint16_t MaxStrSize,
+                                          int *pEndOfSelection,
+                                          uint32_t *pErrorCode)
+{
+        return sim_selection(StartOfSelection, "CANopen",
+                             pProtocolStackNameSel, MaxStrSize,
+                             pEndOfSelection, pErrorCode);
+}
+
+int32_t VCS_GetInterfaceNameSelection(char *DeviceName,
+                                      char *ProtocolStackName,
+                                      int32_t StartOfSelection,
+                                      char *pInterfaceNameSel,
+                                      uint16_t MaxStrSize,
+                                      int *pEndOfSelection,
+                                      uint32_t *pErrorCode)
+{
+        return sim_selection(StartOfSelection, "CAN_mcp251x 0",
+                             pInterfaceNameSel, MaxStrSize, pEndOfSelection,
+                             pErrorCode);
+}
+
+int32_t VCS_GetPortNameSelection(char *DeviceName, char *ProtocolStackName,
+                                 char *InterfaceName, int32_t StartOfSelection,
+                                 char *pPortSel, uint16_t MaxStrSize,
+                                 int *pEndOfSelection, uint32_t *pErrorCode)
+{
+        return sim_selection(StartOfSelection, "CAN0", pPortSel, MaxStrSize,
+                             pEndOfSelection, pErrorCode);
+}
+
+int32_t VCS_GetBaudrateSelection(char *DeviceName, char *ProtocolStackName,
+                                 char *InterfaceName, char *PortName,
+                                 int32_t StartOfSelection,
+                                 uint32_t *pBaudrateSel, int *pEndOfSelection,
+                                 uint32_t *pErrorCode)
+{
+        size_t n = sizeof(sim_baudrates) / sizeof(sim_baudrates[0]);
+        if (StartOfSelection) {
+                sim_baudrate_next = 0;
+        } else if (sim_baudrate_next >= n) {
+                *pErrorCode = SIM_ERR_RANGE;
+                return 0;
+        }
+
+        *pBaudrateSel = sim_baudrates[sim_baudrate_next++];
+        *pEndOfSelection = sim_baudrate_next == n;
+        *pErrorCode = 0;
+        return 1;
+}
+
+int32_t VCS_GetErrorInfo(uint32_t ErrorCodeValue, char *pErrorInfo,
+                         uint16_t MaxStrSize)
+{
+        const char *info;
+        switch (ErrorCodeValue) {
+        case 0: info = "No error"; break;
+        case SIM_ERR_TIMEOUT: info = "SDO protocol timed out"; break;
+        case SIM_ERR_LENGTH: info = "Length of service parameter too high";
+                break;
+        case SIM_ERR_RANGE: info = "Value range of parameter exceeded"; break;
+        case SIM_ERR_STORE: info = "Data cannot be transferred or stored";
+                break;
+        case SIM_ERR_STATE: info = "Data cannot be transferred or stored "
+                                   "because of the present device state";
+                break;
+        default: info = "Unknown error (simulated)"; break;
+        }
+
+        snprintf(pErrorInfo, MaxStrSize, "%s", info);
+        return 1;
+}
+
+// General
+
+int32_t VCS_SetObject(void *KeyHandle, uint16_t NodeId, uint16_t ObjectIndex,
+                      uint8_t ObjectSubIndex, void *pData,
+                      uint32_t NbOfBytesToWrite,
+                      uint32_t *pNbOfBytesWritten, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (NbOfBytesToWrite > 4) {
+                return sim_leave(SIM_ERR_LENGTH, pErrorCode);
+        }
+
+        uint32_t value = 0;
+        for (uint32_t i = 0; i < NbOfBytesToWrite; i++) {
+                value |= (uint32_t)((uint8_t *)pData)[i] << (8 * i);
+        }
+
+        uint32_t err = sim_write(node, ObjectIndex, ObjectSubIndex, value,
+                                 NbOfBytesToWrite);
+        *pNbOfBytesWritten = err ? 0 : NbOfBytesToWrite;
+        return sim_leave(err, pErrorCode);
+}
+
+int32_t VCS_GetObject(void *KeyHandle, uint16_t NodeId, uint16_t ObjectIndex,
+                      uint8_t ObjectSubIndex, void *pData,
+                      uint32_t NbOfBytesToRead, uint32_t *pNbOfBytesRead,
+                      uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        uint32_t value;
+        uint8_t size;
+        uint32_t err = sim_read(node, ObjectIndex, ObjectSubIndex, &value,
+                                &size);
+        if (!err) {
+                uint32_t n = size < NbOfBytesToRead ? size : NbOfBytesToRead;
+                for (uint32_t i = 0; i < n; i++) {
+                        ((uint8_t *)pData)[i] = value >> (8 * i);
+                }
+
+                *pNbOfBytesRead = n;
+        }
+
+        return sim_leave(err, pErrorCode);
+}
+
+int32_t VCS_Restore(void *KeyHandle, uint16_t NodeId, uint32_t *pErrorCode)
+{
+        if (!SIM_ENTER(NodeId, 1, pErrorCode)) {
+                return 0;
+        }
+
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_Store(void *KeyHandle, uint16_t NodeId, uint32_t *pErrorCode)
+{
+        if (!SIM_ENTER(NodeId, 1, pErrorCode)) {
+                return 0;
+        }
+
+        return sim_leave(0, pErrorCode);
+}
+
+// Motor
+
+int32_t VCS_SetMotorType(void *KeyHandle, uint16_t NodeId, uint16_t MotorType,
+                         uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_store(node, 0x6402, 0x00, MotorType, 2),
+                         pErrorCode);
+}
+
+int32_t VCS_GetMotorType(void *KeyHandle, uint16_t NodeId,
+                         uint16_t *pMotorType, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pMotorType = sim_stored(node, 0x6402, 0x00, MT_DC_MOTOR);
+        return sim_leave(0, pErrorCode);
+}
+
+// Store the motor data in 0x3001 (EPOS4 layout).
+static uint32_t sim_set_motor(struct sim_node *node, uint32_t nominal_current,
+                              uint32_t max_output_current,
+                              uint16_t thermal_time_constant,
+                              int pole_pairs)
+{
+        uint32_t err = sim_store(node, 0x3001, 0x01, nominal_current, 4);
+        if (!err) {
+                err = sim_store(node, 0x3001, 0x02, max_output_current, 4);
+        }
+
+        if (!err) {
+                err = sim_store(node, 0x3001, 0x04, thermal_time_constant, 2);
+        }
+
+        if (!err && pole_pairs >= 0) {
+                err = sim_store(node, 0x3001, 0x03, pole_pairs, 1);
+        }
+
+        return err;
+}
+
+static void sim_get_motor(struct sim_node *node, uint32_t *nominal_current,
+                          uint32_t *max_output_current,
+                          uint16_t *thermal_time_constant,
+                          unsigned char *pole_pairs)
+{
+        *nominal_current = sim_stored(node, 0x3001, 0x01, 0);
+        *max_output_current = sim_stored(node, 0x3001, 0x02, 0);
+        *thermal_time_constant = sim_stored(node, 0x3001, 0x04, 0);
+        if (pole_pairs) {
+                *pole_pairs = sim_stored(node, 0x3001, 0x03, 1);
+        }
+}
+
+int32_t VCS_SetDcMotorParameter(void *KeyHandle, uint16_t NodeId,
+                                uint16_t NominalCurrent,
+                                uint16_t MaxOutputCurrent,
+                                uint16_t ThermalTimeConstant,
+                                uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 3, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_motor(node, NominalCurrent, MaxOutputCurrent,
+                                       ThermalTimeConstant, -1), pErrorCode);
+}
+
+int32_t VCS_SetDcMotorParameterEx(void *KeyHandle, uint16_t NodeId,
+                                  uint32_t NominalCurrent,
+                                  uint32_t MaxOutputCurrent,
+                                  uint16_t ThermalTimeConstant,
+                                  uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 3, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_motor(node, NominalCurrent, MaxOutputCurrent,
+                                       ThermalTimeConstant, -1), pErrorCode);
+}
+
+int32_t VCS_SetEcMotorParameter(void *KeyHandle, uint16_t NodeId,
+                                uint16_t NominalCurrent,
+                                uint16_t MaxOutputCurrent,
+                                uint16_t ThermalTimeConstant,
+                                uint8_t NbOfPolePairs, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 4, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_motor(node, NominalCurrent, MaxOutputCurrent,
+                                       ThermalTimeConstant, NbOfPolePairs),
+                         pErrorCode);
+}
+
+int32_t VCS_SetEcMotorParameterEx(void *KeyHandle, uint16_t NodeId,
+                                  uint32_t NominalCurrent,
+                                  uint32_t MaxOutputCurrent,
+                                  uint16_t ThermalTimeConstant,
+                                  uint8_t NbOfPolePairs, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 4, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_motor(node, NominalCurrent, MaxOutputCurrent,
+                                       ThermalTimeConstant, NbOfPolePairs),
+                         pErrorCode);
+}
+
+int32_t VCS_GetDcMotorParameter(void *KeyHandle, uint16_t NodeId,
+                                uint16_t *pNominalCurrent,
+                                uint16_t *pMaxOutputCurrent,
+                                uint16_t *pThermalTimeConstant,
+                                uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 3, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        uint32_t nominal_current;
+        uint32_t max_output_current;
+        sim_get_motor(node, &nominal_current, &max_output_current,
+                      pThermalTimeConstant, NULL);
+        *pNominalCurrent = nominal_current;
+        *pMaxOutputCurrent = max_output_current;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetDcMotorParameterEx(void *KeyHandle, uint16_t NodeId,
+                                  uint32_t *pNominalCurrent,
+                                  uint32_t *pMaxOutputCurrent,
+                                  uint16_t *pThermalTimeConstant,
+                                  uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 3, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        sim_get_motor(node, pNominalCurrent, pMaxOutputCurrent,
+                      pThermalTimeConstant, NULL);
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetEcMotorParameter(void *KeyHandle, uint16_t NodeId,
+                                uint16_t *pNominalCurrent,
+                                uint16_t *pMaxOutputCurrent,
+                                uint16_t *pThermalTimeConstant,
+                                unsigned char *pNbOfPolePairs,
+                                uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 4, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        uint32_t nominal_current;
+        uint32_t max_output_current;
+        sim_get_motor(node, &nominal_current, &max_output_current,
+                      pThermalTimeConstant, pNbOfPolePairs);
+        *pNominalCurrent = nominal_current;
+        *pMaxOutputCurrent = max_output_current;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetEcMotorParameterEx(void *KeyHandle, uint16_t NodeId,
+                                  uint32_t *pNominalCurrent,
+                                  uint32_t *pMaxOutputCurrent,
+                                  uint16_t *pThermalTimeConstant,
+                                  unsigned char *pNbOfPolePairs,
+                                  uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 4, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        sim_get_motor(node, pNominalCurrent, pMaxOutputCurrent,
+                      pThermalTimeConstant, pNbOfPolePairs);
+        return sim_leave(0, pErrorCode);
+}
+
+// Operation mode
+
+int32_t VCS_SetOperationMode(void *KeyHandle, uint16_t NodeId,
+                             char OperationMode, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_mode(node, OperationMode), pErrorCode);
+}
+
+int32_t VCS_GetOperationMode(void *KeyHandle, uint16_t NodeId,
+                             char *pOperationMode, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pOperationMode = node->mode;
+        return sim_leave(0, pErrorCode);
+}
+
+// State machine
+
+int32_t VCS_ResetDevice(void *KeyHandle, uint16_t NodeId, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        sim_nmt(node, NCS_RESET_NODE);
+        return sim_leave(0, pErrorCode);
+}
+
+static uint32_t sim_set_state(struct sim_node *node, uint16_t state)
+{
+        switch (state) {
+        case ST_DISABLED:
+                node->state = ST_DISABLED;
+                return 0;
+        case ST_ENABLED:
+                if (node->state == ST_FAULT) {
+                        return SIM_ERR_STATE;
+                }
+
+                node->state = ST_ENABLED;
+                node->halted = 0;
+                return 0;
+        case ST_QUICKSTOP:
+                if (node->state == ST_FAULT) {
+                        return SIM_ERR_STATE;
+                }
+
+                node->state = node->state == ST_ENABLED ? ST_QUICKSTOP :
+                              ST_DISABLED;
+                return 0;
+        default:
+                return SIM_ERR_RANGE;
+        }
+}
+
+int32_t VCS_SetState(void *KeyHandle, uint16_t NodeId, uint16_t State,
+                     uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_state(node, State), pErrorCode);
+}
+
+int32_t VCS_SetEnableState(void *KeyHandle, uint16_t NodeId,
+                           uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 3, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_state(node, ST_ENABLED), pErrorCode);
+}
+
+int32_t VCS_SetDisableState(void *KeyHandle, uint16_t NodeId,
+                            uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_state(node, ST_DISABLED), pErrorCode);
+}
+
+int32_t VCS_SetQuickStopState(void *KeyHandle, uint16_t NodeId,
+                              uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_state(node, ST_QUICKSTOP), pErrorCode);
+}
+
+int32_t VCS_ClearFault(void *KeyHandle, uint16_t NodeId, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        if (node->state == ST_FAULT) {
+                node->state = ST_DISABLED;
+                node->device_error = 0;
+        }
+
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetState(void *KeyHandle, uint16_t NodeId, uint16_t *pState,
+                     uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pState = node->state;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetEnableState(void *KeyHandle, uint16_t NodeId, int *pIsEnabled,
+                           uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pIsEnabled = node->state == ST_ENABLED;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetDisableState(void *KeyHandle, uint16_t NodeId,
+                            int *pIsDisabled, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pIsDisabled = node->state == ST_DISABLED;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetQuickStopState(void *KeyHandle, uint16_t NodeId,
+                              int *pIsQuickStopped, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pIsQuickStopped = node->state == ST_QUICKSTOP;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetFaultState(void *KeyHandle, uint16_t NodeId, int *pIsInFault,
+                          uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pIsInFault = node->state == ST_FAULT;
+        return sim_leave(0, pErrorCode);
+}
+
+// Error handling
+
+int32_t VCS_GetNbOfDeviceError(void *KeyHandle, uint16_t NodeId,
+                               uint8_t *pNbDeviceError, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pNbDeviceError = node->device_error ? 1 : 0;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetDeviceErrorCode(void *KeyHandle, uint16_t NodeId,
+                               uint8_t DeviceErrorNumber,
+                               uint32_t *pDeviceErrorCode,
+                               uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (DeviceErrorNumber != 1 || !node->device_error) {
+                return sim_leave(SIM_ERR_RANGE, pErrorCode);
+        }
+
+        *pDeviceErrorCode = node->device_error;
+        return sim_leave(0, pErrorCode);
+}
+
+// Motion info
+
+int32_t VCS_GetMovementState(void *KeyHandle, uint16_t NodeId,
+                             int *pTargetReached, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pTargetReached = sim_target_reached(node);
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetPositionIs(void *KeyHandle, uint16_t NodeId, int *pPositionIs,
+                          uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pPositionIs = lround(node->position);
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetVelocityIs(void *KeyHandle, uint16_t NodeId, int *pVelocityIs,
+                          uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pVelocityIs = lround(node->velocity);
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetVelocityIsAveraged(void *KeyHandle, uint16_t NodeId,
+                                  int *pVelocityIsAveraged,
+                                  uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pVelocityIsAveraged = lround(node->velocity);
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetCurrentIs(void *KeyHandle, uint16_t NodeId, short *pCurrentIs,
+                         uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pCurrentIs = sim_current(node);
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetCurrentIsEx(void *KeyHandle, uint16_t NodeId, int *pCurrentIs,
+                           uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pCurrentIs = sim_current(node);
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetCurrentIsAveraged(void *KeyHandle, uint16_t NodeId,
+                                 short *pCurrentIsAveraged,
+                                 uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pCurrentIsAveraged = sim_current(node);
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetCurrentIsAveragedEx(void *KeyHandle, uint16_t NodeId,
+                                   int *pCurrentIsAveraged,
+                                   uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pCurrentIsAveraged = sim_current(node);
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_WaitForTargetReached(void *KeyHandle, uint16_t NodeId,
+                                 uint32_t Timeout, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        uint64_t end = now_ns() + Timeout * 1000000ull;
+        while (!sim_target_reached(node)) {
+                if (now_ns() >= end) {
+                        return sim_leave(SIM_ERR_TIMEOUT, pErrorCode);
+                }
+
+                sleep_until(now_ns() + SIM_STEP_NS);
+                sim_advance(node, now_ns());
+        }
+
+        return sim_leave(0, pErrorCode);
+}
+
+// Profile position mode
+
+int32_t VCS_ActivateProfilePositionMode(void *KeyHandle, uint16_t NodeId,
+                                        uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_mode(node, OMD_PROFILE_POSITION_MODE),
+                         pErrorCode);
+}
+
+int32_t VCS_SetPositionProfile(void *KeyHandle, uint16_t NodeId,
+                               uint32_t ProfileVelocity,
+                               uint32_t ProfileAcceleration,
+                               uint32_t ProfileDeceleration,
+                               uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 3, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->profile_velocity = ProfileVelocity;
+        node->profile_acceleration = ProfileAcceleration;
+        node->profile_deceleration = ProfileDeceleration;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetPositionProfile(void *KeyHandle, uint16_t NodeId,
+                               uint32_t *pProfileVelocity,
+                               uint32_t *pProfileAcceleration,
+                               uint32_t *pProfileDeceleration,
+                               uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 3, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pProfileVelocity = node->profile_velocity;
+        *pProfileAcceleration = node->profile_acceleration;
+        *pProfileDeceleration = node->profile_deceleration;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_MoveToPosition(void *KeyHandle, uint16_t NodeId,
+                           long TargetPosition, int32_t Absolute,
+                           int32_t Immediately, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 3, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (node->mode != OMD_PROFILE_POSITION_MODE) {
+                return sim_leave(SIM_ERR_STATE, pErrorCode);
+        }
+
+        return sim_leave(sim_move(node, TargetPosition, !Absolute),
+                         pErrorCode);
+}
+
+int32_t VCS_GetTargetPosition(void *KeyHandle, uint16_t NodeId,
+                              long *pTargetPosition, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pTargetPosition = node->target_position;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_HaltPositionMovement(void *KeyHandle, uint16_t NodeId,
+                                 uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->halted = 1;
+        node->moving = 0;
+        return sim_leave(0, pErrorCode);
+}
+
+// Profile velocity mode
+
+int32_t VCS_ActivateProfileVelocityMode(void *KeyHandle, uint16_t NodeId,
+                                        uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_mode(node, OMD_PROFILE_VELOCITY_MODE),
+                         pErrorCode);
+}
+
+int32_t VCS_SetVelocityProfile(void *KeyHandle, uint16_t NodeId,
+                               uint32_t ProfileAcceleration,
+                               uint32_t ProfileDeceleration,
+                               uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->profile_acceleration = ProfileAcceleration;
+        node->profile_deceleration = ProfileDeceleration;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetVelocityProfile(void *KeyHandle, uint16_t NodeId,
+                               uint32_t *pProfileAcceleration,
+                               uint32_t *pProfileDeceleration,
+                               uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pProfileAcceleration = node->profile_acceleration;
+        *pProfileDeceleration = node->profile_deceleration;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_MoveWithVelocity(void *KeyHandle, uint16_t NodeId,
+                             long TargetVelocity, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (node->state != ST_ENABLED ||
+                   node->mode != OMD_PROFILE_VELOCITY_MODE) {
+                return sim_leave(SIM_ERR_STATE, pErrorCode);
+        }
+
+        node->target_velocity = TargetVelocity;
+        node->halted = 0;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetTargetVelocity(void *KeyHandle, uint16_t NodeId,
+                              long *pTargetVelocity, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pTargetVelocity = node->target_velocity;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_HaltVelocityMovement(void *KeyHandle, uint16_t NodeId,
+                                 uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->halted = 1;
+        return sim_leave(0, pErrorCode);
+}
+
+// Homing mode
+
+int32_t VCS_ActivateHomingMode(void *KeyHandle, uint16_t NodeId,
+                               uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_mode(node, OMD_HOMING_MODE), pErrorCode);
+}
+
+int32_t VCS_SetHomingParameter(void *KeyHandle, uint16_t NodeId,
+                               uint32_t HomingAcceleration,
+                               uint32_t SpeedSwitch, uint32_t SpeedIndex,
+                               int32_t HomeOffset, uint16_t CurrentThreshold,
+                               int32_t HomePosition, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 6, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->homing_acceleration = HomingAcceleration;
+        node->speed_switch = SpeedSwitch;
+        node->speed_index = SpeedIndex;
+        node->home_offset = HomeOffset;
+        node->current_threshold = CurrentThreshold;
+        node->home_position = HomePosition;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetHomingParameter(void *KeyHandle, uint16_t NodeId,
+                               uint32_t *pHomingAcceleration,
+                               uint32_t *pSpeedSwitch, uint32_t *pSpeedIndex,
+                               int *pHomeOffset, uint16_t *pCurrentThreshold,
+                               int *pHomePosition, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 6, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pHomingAcceleration = node->homing_acceleration;
+        *pSpeedSwitch = node->speed_switch;
+        *pSpeedIndex = node->speed_index;
+        *pHomeOffset = node->home_offset;
+        *pCurrentThreshold = node->current_threshold;
+        *pHomePosition = node->home_position;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_FindHome(void *KeyHandle, uint16_t NodeId, int8_t HomingMethod,
+                     uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 3, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        uint32_t err = sim_find_home(node);
+        if (!err && HomingMethod == HM_ACTUAL_POSITION) {
+                // defines the current position as home without moving
+                node->homing_end = node->time;
+        }
+
+        return sim_leave(err, pErrorCode);
+}
+
+int32_t VCS_StopHoming(void *KeyHandle, uint16_t NodeId, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->homing = 0;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_DefinePosition(void *KeyHandle, uint16_t NodeId,
+                           int32_t HomePosition, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 4, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (node->moving || node->homing || node->ipm_running) {
+                return sim_leave(SIM_ERR_STATE, pErrorCode);
+        }
+
+        node->position = HomePosition;
+        node->target_position = HomePosition;
+        node->homing_attained = 1;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_WaitForHomingAttained(void *KeyHandle, uint16_t NodeId,
+                                  int32_t Timeout, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        uint64_t end = now_ns() + Timeout * 1000000ull;
+        while (!node->homing_attained) {
+                if (!node->homing || now_ns() >= end) {
+                        return sim_leave(SIM_ERR_TIMEOUT, pErrorCode);
+                }
+
+                sleep_until(now_ns() + SIM_STEP_NS);
+                sim_advance(node, now_ns());
+        }
+
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetHomingState(void *KeyHandle, uint16_t NodeId,
+                           int *pHomingAttained, int *pHomingError,
+                           uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pHomingAttained = node->homing_attained;
+        *pHomingError = 0;
+        return sim_leave(0, pErrorCode);
+}
+
+// Interpolated position mode
+
+int32_t VCS_ActivateInterpolatedPositionMode(void *KeyHandle, uint16_t NodeId,
+                                             uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_mode(node, OMD_INTERPOLATED_POSITION_MODE),
+                         pErrorCode);
+}
+
+int32_t VCS_SetIpmBufferParameter(void *KeyHandle, uint16_t NodeId,
+                                  uint16_t UnderflowWarningLimit,
+                                  uint16_t OverflowWarningLimit,
+                                  uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (UnderflowWarningLimit > SIM_IPM_CAPACITY ||
+                   OverflowWarningLimit > SIM_IPM_CAPACITY) {
+                return sim_leave(SIM_ERR_RANGE, pErrorCode);
+        }
+
+        node->ipm_underflow_limit = UnderflowWarningLimit;
+        node->ipm_overflow_limit = OverflowWarningLimit;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetIpmBufferParameter(void *KeyHandle, uint16_t NodeId,
+                                  uint16_t *pUnderflowWarningLimit,
+                                  uint16_t *pOverflowWarningLimit,
+                                  uint32_t *pMaxBufferSize,
+                                  uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 3, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pUnderflowWarningLimit = node->ipm_underflow_limit;
+        *pOverflowWarningLimit = node->ipm_overflow_limit;
+        *pMaxBufferSize = SIM_IPM_CAPACITY;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_ClearIpmBuffer(void *KeyHandle, uint16_t NodeId,
+                           uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->ipm_head = node->ipm_tail;
+        node->ipm_running = 0;
+        node->ipm_underflow_error = 0;
+        node->ipm_overflow_error = 0;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetFreeIpmBufferSize(void *KeyHandle, uint16_t NodeId,
+                                 uint32_t *pBufferSize, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pBufferSize = SIM_IPM_CAPACITY - (node->ipm_tail - node->ipm_head);
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_AddPvtValueToIpmBuffer(void *KeyHandle, uint16_t NodeId,
+                                   long Position, long Velocity, uint8_t Time,
+                                   uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (node->ipm_tail - node->ipm_head == SIM_IPM_CAPACITY) {
+                node->ipm_overflow_error = 1;
+                return sim_leave(SIM_ERR_STORE, pErrorCode);
+        }
+
+        node->ipm[node->ipm_tail++ % SIM_IPM_CAPACITY] = (struct sim_pvt){
+                .position = Position,
+                .velocity = Velocity,
+                .time = Time,
+        };
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_StartIpmTrajectory(void *KeyHandle, uint16_t NodeId,
+                               uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_start_ipm(node), pErrorCode);
+}
+
+int32_t VCS_StopIpmTrajectory(void *KeyHandle, uint16_t NodeId,
+                              uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        sim_stop(node);
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetIpmStatus(void *KeyHandle, uint16_t NodeId,
+                         int *pTrajectoryRunning, int *pIsUnderflowWarning,
+                         int *pIsOverflowWarning, int *pIsVelocityWarning,
+                         int *pIsAccelerationWarning, int *pIsUnderflowError,
+                         int *pIsOverflowError, int *pIsVelocityError,
+                         int *pIsAccelerationError, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        unsigned depth = node->ipm_tail - node->ipm_head;
+        *pTrajectoryRunning = node->ipm_running;
+        *pIsUnderflowWarning = node->ipm_running &&
+                               depth <= node->ipm_underflow_limit;
+        *pIsOverflowWarning = depth >= node->ipm_overflow_limit;
+        *pIsVelocityWarning = 0;
+        *pIsAccelerationWarning = 0;
+        *pIsUnderflowError = node->ipm_underflow_error;
+        *pIsOverflowError = node->ipm_overflow_error;
+        *pIsVelocityError = 0;
+        *pIsAccelerationError = 0;
+        return sim_leave(0, pErrorCode);
+}
+
+// Position mode
+
+int32_t VCS_ActivatePositionMode(void *KeyHandle, uint16_t NodeId,
+                                 uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_mode(node, OMD_POSITION_MODE), pErrorCode);
+}
+
+int32_t VCS_SetPositionMust(void *KeyHandle, uint16_t NodeId,
+                            long PositionMust, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (node->mode != OMD_POSITION_MODE) {
+                return sim_leave(SIM_ERR_STATE, pErrorCode);
+        }
+
+        return sim_leave(sim_write(node, 0x607a, 0x00, PositionMust, 4),
+                         pErrorCode);
+}
+
+int32_t VCS_GetPositionMust(void *KeyHandle, uint16_t NodeId,
+                            long *pPositionMust, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pPositionMust = node->target_position;
+        return sim_leave(0, pErrorCode);
+}
+
+// Velocity mode
+
+int32_t VCS_ActivateVelocityMode(void *KeyHandle, uint16_t NodeId,
+                                 uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_leave(sim_set_mode(node, OMD_VELOCITY_MODE), pErrorCode);
+}
+
+int32_t VCS_SetVelocityMust(void *KeyHandle, uint16_t NodeId,
+                            long VelocityMust, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (node->mode != OMD_VELOCITY_MODE) {
+                return sim_leave(SIM_ERR_STATE, pErrorCode);
+        }
+
+        node->target_velocity = VelocityMust;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetVelocityMust(void *KeyHandle, uint16_t NodeId,
+                            long *pVelocityMust, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pVelocityMust = node->target_velocity;
+        return sim_leave(0, pErrorCode);
+}
+
+// Current mode
+
+int32_t VCS_ActivateCurrentMode(void *KeyHandle, uint16_t NodeId,
+                                uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->current_must = 0;
+        return sim_leave(sim_set_mode(node, OMD_CURRENT_MODE), pErrorCode);
+}
+
+static int32_t sim_set_current_must(struct sim_node *node, int32_t current,
+                                    uint32_t *err)
+{
+        if (node->mode != OMD_CURRENT_MODE) {
+                return sim_leave(SIM_ERR_STATE, err);
+        }
+
+        node->current_must = current;
+        return sim_leave(0, err);
+}
+
+int32_t VCS_SetCurrentMust(void *KeyHandle, uint16_t NodeId, short CurrentMust,
+                           uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_set_current_must(node, CurrentMust, pErrorCode);
+}
+
+int32_t VCS_SetCurrentMustEx(void *KeyHandle, uint16_t NodeId,
+                             int32_t CurrentMust, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        return sim_set_current_must(node, CurrentMust, pErrorCode);
+}
+
+int32_t VCS_GetCurrentMust(void *KeyHandle, uint16_t NodeId,
+                           short *pCurrentMust, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pCurrentMust = node->current_must;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetCurrentMustEx(void *KeyHandle, uint16_t NodeId,
+                             int *pCurrentMust, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pCurrentMust = node->current_must;
+        return sim_leave(0, pErrorCode);
+}
+
+// CAN layer
+
+int32_t VCS_SendCANFrame(void *KeyHandle, uint16_t CobID, uint16_t Length,
+                         void *pData, uint32_t *pErrorCode)
+{
+        // frames are not confirmed, so sending them takes no round trip
+        if (!SIM_ENTER(0, 0, pErrorCode)) {
+                return 0;
+        } else if (Length > 8) {
+                return sim_leave(SIM_ERR_LENGTH, pErrorCode);
+        }
+
+        const uint8_t *data = pData;
+        uint16_t function = CobID & 0x780;
+        uint16_t node_id = CobID & 0x7f;
+        if (CobID == SIM_COB_ID_SYNC) {
+                sim_sync(now_ns());
+        } else if (CobID == SIM_COB_ID_NMT && Length == 2) {
+                for (int id = 1; id < SIM_NODES; id++) {
+                        if ((data[1] == 0 || data[1] == id) &&
+                            nodes[id].present) {
+                                sim_advance(&nodes[id], now_ns());
+                                sim_nmt(&nodes[id], data[0]);
+                        }
+                }
+        } else if (function >= 0x200 && function <= 0x500 && node_id &&
+                   nodes[node_id].present) {
+                struct sim_node *node = &nodes[node_id];
+                sim_advance(node, now_ns());
+                sim_rpdo(node, (function - 0x200) >> 8, data, Length);
+        }
+
+        return sim_leave(0, pErrorCode);
+}
+
+// Node and number (0-based) of the TPDO with a default COB-ID, NULL if there
+// is none.
+static struct sim_node *sim_tpdo_node(uint16_t cob_id, unsigned *num)
+{
+        uint16_t function = cob_id & 0x780;
+        uint16_t node_id = cob_id & 0x7f;
+        if (function < 0x180 || function > 0x480 || (function & 0x7f) ||
+            !node_id || !nodes[node_id].present || port.failed) {
+                return NULL;
+        }
+
+        *num = (function - 0x180) >> 8;
+        return &nodes[node_id];
+}
+
+int32_t VCS_ReadCANFrame(void *KeyHandle, uint16_t CobID, uint16_t Length,
+                         void *pData, uint32_t Timeout, uint32_t *pErrorCode)
+{
+        if (!SIM_ENTER(0, 0, pErrorCode)) {
+                return 0;
+        }
+
+        uint64_t now = now_ns();
+        uint64_t deadline = now + Timeout * 1000000ull;
+        unsigned num;
+        struct sim_node *node = sim_tpdo_node(CobID, &num);
+        uint8_t data[8];
+        int len = -1;
+        if (node) {
+                sim_advance(node, now);
+                len = sim_tpdo(node, num, data);
+        }
+
+        if (len >= 0) {
+                // event-driven TPDOs arrive every event timer ms, synchronous
+                // ones after every SYNC
+                uint32_t event_timer = sim_stored(node, 0x1800 + num, 0x05,
+                                                  0);
+                uint64_t due = node->tpdo_sent[num] +
+                               event_timer * 1000000ull;
+                if (event_timer && due <= deadline) {
+                        if (due > now) {
+                                sleep_until(due);
+                                now = due;
+                                sim_advance(node, now);
+                                len = sim_tpdo(node, num, data);
+                        }
+
+                        node->tpdo_sent[num] = now;
+                } else if (!event_timer && node->tpdo_syncs[num] != syncs) {
+                        node->tpdo_syncs[num] = syncs;
+                } else {
+                        len = -1;
+                }
+        }
+
+        if (len < 0) {
+                sleep_until(deadline);
+                return sim_leave(SIM_ERR_TIMEOUT, pErrorCode);
+        }
+
+        memcpy(pData, data, len < Length ? len : Length);
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_RequestCANFrame(void *KeyHandle, uint16_t CobID, uint16_t Length,
+                            void *pData, uint32_t *pErrorCode)
+{
+        if (!SIM_ENTER(0, 1, pErrorCode)) {
+                return 0;
+        }
+
+        unsigned num;
+        struct sim_node *node = sim_tpdo_node(CobID, &num);
+        uint8_t data[8];
+        int len = -1;
+        if (node) {
+                sim_advance(node, now_ns());
+                len = sim_tpdo(node, num, data);
+        }
+
+        if (len < 0) {
+                return sim_leave(SIM_ERR_TIMEOUT, pErrorCode);
+        }
+
+        memcpy(pData, data, len < Length ? len : Length);
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_SendNMTService(void *KeyHandle, uint16_t NodeId,
+                           uint16_t CommandSpecifier, uint32_t *pErrorCode)
+{
+        if (!SIM_ENTER(0, 0, pErrorCode)) {
+                return 0;
+        }
+
+        for (int id = 1; id < SIM_NODES; id++) {
+                if ((NodeId == 0 || NodeId == id) && nodes[id].present) {
+                        sim_advance(&nodes[id], now_ns());
+                        sim_nmt(&nodes[id], CommandSpecifier);
+                }
+        }
+
+        return sim_leave(0, pErrorCode);
+}
+
+// Position marker
+
+int32_t VCS_SetPositionMarkerParameter(void *KeyHandle, uint16_t NodeId,
+                                       uint8_t PositionMarkerEdgeType,
+                                       uint8_t PositionMarkerMode,
+                                       uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (PositionMarkerEdgeType > PET_FALLING_EDGE ||
+                   PositionMarkerMode > PM_MULTIPLE) {
+                return sim_leave(SIM_ERR_RANGE, pErrorCode);
+        }
+
+        node->marker_mode = PositionMarkerMode;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_ActivatePositionMarker(void *KeyHandle, uint16_t NodeId,
+                                   uint16_t DigitalInputNumber,
+                                   int32_t Polarity, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->marker_active = 1;
+        node->marker_steps = marker_interval;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_DeactivatePositionMarker(void *KeyHandle, uint16_t NodeId,
+                                     uint16_t DigitalInputNumber,
+                                     uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->marker_active = 0;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_ReadPositionMarkerCounter(void *KeyHandle, uint16_t NodeId,
+                                      uint16_t *pCount, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pCount = node->marker_count;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_ReadPositionMarkerCapturedPosition(void *KeyHandle,
+                                               uint16_t NodeId,
+                                               uint16_t CounterIndex,
+                                               long *pCapturedPosition,
+                                               uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (CounterIndex >= SIM_MARKER_HISTORY) {
+                return sim_leave(SIM_ERR_RANGE, pErrorCode);
+        }
+
+        *pCapturedPosition = node->marker_history[CounterIndex];
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_ResetPositionMarkerCounter(void *KeyHandle, uint16_t NodeId,
+                                       uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->marker_count = 0;
+        return sim_leave(0, pErrorCode);
+}
+
+// Position compare
+
+int32_t VCS_SetPositionCompareParameter(void *KeyHandle, uint16_t NodeId,
+                                        uint8_t OperationalMode,
+                                        uint8_t IntervalMode,
+                                        uint8_t DirectionDependency,
+                                        uint16_t IntervalWidth,
+                                        uint16_t IntervalRepetitions,
+                                        uint16_t PulseWidth,
+                                        uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 6, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (OperationalMode > PCO_POSITION_SEQUENCE_MODE ||
+                   IntervalMode > PCI_BOTH_DIR_TO_REFPOS ||
+                   DirectionDependency > PCD_MOTOR_DIRECTION_BOTH) {
+                return sim_leave(SIM_ERR_RANGE, pErrorCode);
+        }
+
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_SetPositionCompareReferencePosition(void *KeyHandle,
+                                                uint16_t NodeId,
+                                                long ReferencePosition,
+                                                uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->compare_reference = ReferencePosition;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_ActivatePositionCompare(void *KeyHandle, uint16_t NodeId,
+                                    uint16_t DigitalOutputNumber,
+                                    int32_t Polarity, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->compare_active = 1;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_DeactivatePositionCompare(void *KeyHandle, uint16_t NodeId,
+                                      uint16_t DigitalOutputNumber,
+                                      uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->compare_active = 0;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_EnablePositionCompare(void *KeyHandle, uint16_t NodeId,
+                                  uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (!node->compare_active) {
+                return sim_leave(SIM_ERR_STATE, pErrorCode);
+        }
+
+        node->compare_enabled = 1;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_DisablePositionCompare(void *KeyHandle, uint16_t NodeId,
+                                   uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->compare_enabled = 0;
+        return sim_leave(0, pErrorCode);
+}
+
+// Data recorder
+
+int32_t VCS_SetRecorderParameter(void *KeyHandle, uint16_t NodeId,
+                                 uint16_t SamplingPeriod,
+                                 uint16_t NbOfPrecedingSamples,
+                                 uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (node->rec_running) {
+                return sim_leave(SIM_ERR_STATE, pErrorCode);
+        }
+
+        node->rec_period = SamplingPeriod;
+        node->rec_preceding = NbOfPrecedingSamples;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_GetRecorderParameter(void *KeyHandle, uint16_t NodeId,
+                                 uint16_t *pSamplingPeriod,
+                                 uint16_t *pNbOfPrecedingSamples,
+                                 uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pSamplingPeriod = node->rec_period;
+        *pNbOfPrecedingSamples = node->rec_preceding;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_EnableTrigger(void *KeyHandle, uint16_t NodeId,
+                          uint8_t TriggerType, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->rec_triggers |= TriggerType;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_DisableAllTriggers(void *KeyHandle, uint16_t NodeId,
+                               uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->rec_triggers = 0;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_ActivateChannel(void *KeyHandle, uint16_t NodeId,
+                            uint8_t ChannelNumber, uint16_t ObjectIndex,
+                            uint8_t ObjectSubIndex, uint8_t ObjectSize,
+                            uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 2, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (ChannelNumber < 1 || ChannelNumber > SIM_REC_CHANNELS ||
+                   (ObjectSize != 1 && ObjectSize != 2 && ObjectSize != 4)) {
+                return sim_leave(SIM_ERR_RANGE, pErrorCode);
+        } else if (node->rec_running) {
+                return sim_leave(SIM_ERR_STATE, pErrorCode);
+        }
+
+        node->rec_channels[ChannelNumber - 1] = (struct sim_channel){
+                .index = ObjectIndex,
+                .subindex = ObjectSubIndex,
+                .size = ObjectSize,
+        };
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_DeactivateAllChannels(void *KeyHandle, uint16_t NodeId,
+                                  uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (node->rec_running) {
+                return sim_leave(SIM_ERR_STATE, pErrorCode);
+        }
+
+        memset(node->rec_channels, 0, sizeof(node->rec_channels));
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_StartRecorder(void *KeyHandle, uint16_t NodeId,
+                          uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        unsigned size = sim_rec_sample_size(node);
+        if (!size) {
+                return sim_leave(SIM_ERR_STATE, pErrorCode);
+        }
+
+        node->rec_max = SIM_REC_BUFFER / size;
+        if (node->rec_preceding >= node->rec_max) {
+                return sim_leave(SIM_ERR_RANGE, pErrorCode);
+        }
+
+        node->rec_running = 1;
+        node->rec_triggered = 0;
+        node->rec_steps = 1;
+        node->rec_samples = 0;
+        node->rec_first = 0;
+        node->rec_was_moving = fabs(node->velocity) >= 0.5;
+        node->rec_was_fault = node->state == ST_FAULT;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_StopRecorder(void *KeyHandle, uint16_t NodeId,
+                         uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        node->rec_running = 0;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_ForceTrigger(void *KeyHandle, uint16_t NodeId,
+                         uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (!node->rec_running) {
+                return sim_leave(SIM_ERR_STATE, pErrorCode);
+        }
+
+        if (!node->rec_triggered) {
+                sim_rec_trigger(node);
+        }
+
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_IsRecorderRunning(void *KeyHandle, uint16_t NodeId,
+                              int *pRunning, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pRunning = node->rec_running;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_IsRecorderTriggered(void *KeyHandle, uint16_t NodeId,
+                                int *pTriggered, uint32_t *pErrorCode)
+{
+        struct sim_node *node = SIM_ENTER(NodeId, 1, pErrorCode);
+        if (!node) {
+                return 0;
+        }
+
+        *pTriggered = node->rec_triggered;
+        return sim_leave(0, pErrorCode);
+}
+
+// The buffer holds rec_max samples of all active channels back to back, in
+// channel order. The oldest sample starts at VectorStartOffset.
+int32_t VCS_ReadDataBuffer(void *KeyHandle, uint16_t NodeId,
+                           unsigned char *pDataBuffer,
+                           uint32_t BufferSizeToRead,
+                           uint32_t *pBufferSizeRead,
+                           uint16_t *pVectorStartOffset,
+                           uint16_t *pMaxNbOfSamples,
+                           uint16_t *pNbOfRecordedSamples,
+                           uint32_t *pErrorCode)
+{
+        struct sim_node *node = &nodes[NodeId < SIM_NODES ? NodeId : 0];
+        uint32_t size = node->rec_max * sim_rec_sample_size(node);
+        node = SIM_ENTER(NodeId, 1 + size / SIM_BLOCK_BYTES, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (node->rec_running || !node->rec_max) {
+                return sim_leave(SIM_ERR_STATE, pErrorCode);
+        } else if (BufferSizeToRead < size) {
+                return sim_leave(SIM_ERR_LENGTH, pErrorCode);
+        }
+
+        unsigned first = sim_rec_first(node);
+        memcpy(pDataBuffer, node->rec_buffer, size);
+        *pBufferSizeRead = size;
+        *pVectorStartOffset = first % node->rec_max;
+        *pMaxNbOfSamples = node->rec_max;
+        *pNbOfRecordedSamples = node->rec_samples - first;
+        return sim_leave(0, pErrorCode);
+}
+
+int32_t VCS_ExtractChannelDataVector(void *KeyHandle, uint16_t NodeId,
+                                     uint8_t ChannelNumber,
+                                     unsigned char *pDataBuffer,
+                                     uint32_t BufferSize,
+                                     unsigned char *pDataVector,
+                                     uint32_t VectorSize,
+                                     uint16_t VectorStartOffset,
+                                     uint16_t MaxNbOfSamples,
+                                     uint16_t NbOfRecordedSamples,
+                                     uint32_t *pErrorCode)
+{
+        // decoded by the library, no transfer
+        struct sim_node *node = SIM_ENTER(NodeId, 0, pErrorCode);
+        if (!node) {
+                return 0;
+        } else if (ChannelNumber < 1 || ChannelNumber > SIM_REC_CHANNELS ||
+                   !node->rec_channels[ChannelNumber - 1].size ||
+                   !MaxNbOfSamples || NbOfRecordedSamples > MaxNbOfSamples) {
+                return sim_leave(SIM_ERR_RANGE, pErrorCode);
+        }
+
+        unsigned sample_size = sim_rec_sample_size(node);
+        unsigned size = node->rec_channels[ChannelNumber - 1].size;
+        unsigned offset = 0;
+        for (int i = 0; i < ChannelNumber - 1; i++) {
+                offset += node->rec_channels[i].size;
+        }
+
+        if (BufferSize < (uint32_t)MaxNbOfSamples * sample_size ||
+            VectorSize < (uint32_t)NbOfRecordedSamples * size) {
+                return sim_leave(SIM_ERR_LENGTH, pErrorCode);
+        }
+
+        for (unsigned i = 0; i < NbOfRecordedSamples; i++) {
+                unsigned sample = (VectorStartOffset + i) % MaxNbOfSamples;
+                memcpy(pDataVector + i * size,
+                       pDataBuffer + sample * sample_size + offset, size);
+        }
+
+        return sim_leave(0, pErrorCode);
+}
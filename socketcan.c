@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+
+#include "socketcan.h"
+#include "busload.h"
+#include "util.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can/raw.h>
+
+struct can_sock {
+        int fd;
+};
+
+struct can_sock *can_open(const char *ifname)
+{
+        int fd = socket(PF_CAN, SOCK_RAW | SOCK_CLOEXEC, CAN_RAW);
+        if (fd == -1) {
+                return NULL;
+        }
+
+        struct ifreq ifr = { 0 };
+        strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+        if (ioctl(fd, SIOCGIFINDEX, &ifr) == -1) {
+                goto fail;
+        }
+
+        struct sockaddr_can addr = {
+                .can_family = AF_CAN,
+                .can_ifindex = ifr.ifr_ifindex,
+        };
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+                goto fail;
+        }
+
+        const int enable = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable,
+                       sizeof(enable)) == -1) {
+                goto fail;
+        }
+
+        struct can_sock *can = malloc(sizeof(*can));
+        if (!can) {
+                goto fail;
+        }
+
+        can->fd = fd;
+        return can;
+
+fail:
+        close(fd);
+        return NULL;
+}
+
+void can_close(struct can_sock *can)
+{
+        close(can->fd);
+        free(can);
+}
+
+int can_filter(struct can_sock *can, const uint16_t *cob_ids, size_t n)
+{
+        struct can_filter filters[CAN_BATCH_MAX];
+        if (n > CAN_BATCH_MAX) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+                filters[i].can_id = cob_ids[i];
+                filters[i].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG |
+                                      CAN_RTR_FLAG;
+        }
+
+        return setsockopt(can->fd, SOL_CAN_RAW, CAN_RAW_FILTER, filters,
+                          n * sizeof(filters[0]));
+}
+
+int can_send(struct can_sock *can, const struct can_frame *frames, size_t n)
+{
+        struct mmsghdr msgs[CAN_BATCH_MAX];
+        struct iovec iovs[CAN_BATCH_MAX];
+        size_t sent = 0;
+        while (sent < n) {
+                size_t batch = n - sent;
+                if (batch > CAN_BATCH_MAX) {
+                        batch = CAN_BATCH_MAX;
+                }
+
+                memset(msgs, 0, batch * sizeof(msgs[0]));
+                for (size_t i = 0; i < batch; i++) {
+                        iovs[i].iov_base = (void *)&frames[sent + i];
+                        iovs[i].iov_len = sizeof(struct can_frame);
+                        msgs[i].msg_hdr.msg_iov = &iovs[i];
+                        msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+
+                int nsent = sendmmsg(can->fd, msgs, batch, 0);
+                if (nsent == -1) {
+                        if (errno == EINTR) {
+                                continue;
+                        } else if (errno == ENOBUFS) {
+                                // the transmit queue is full, not broken
+                                break;
+                        }
+
+                        return sent > 0 ? (int)sent : -1;
+                }
+
+                busload_frames(&frames[sent], nsent);
+                sent += nsent;
+                if ((size_t)nsent < batch) {
+                        break;
+                }
+        }
+
+        return sent;
+}
+
+// Offset to convert CLOCK_REALTIME socket timestamps to now_ns() time.
+static int64_t realtime_offset(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec -
+               (int64_t)now_ns();
+}
+
+int can_recv(struct can_sock *can, struct can_frame *frames, uint64_t *stamps,
+             size_t n, int timeout)
+{
+        struct pollfd pfd = { .fd = can->fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout);
+        if (ready <= 0) {
+                return ready == -1 && errno != EINTR ? -1 : 0;
+        }
+
+        if (n > CAN_BATCH_MAX) {
+                n = CAN_BATCH_MAX;
+        }
+
+        struct mmsghdr msgs[CAN_BATCH_MAX];
+        struct iovec iovs[CAN_BATCH_MAX];
+        char control[CAN_BATCH_MAX][CMSG_SPACE(sizeof(struct timespec))];
+        memset(msgs, 0, n * sizeof(msgs[0]));
+        for (size_t i = 0; i < n; i++) {
+                iovs[i].iov_base = &frames[i];
+                iovs[i].iov_len = sizeof(struct can_frame);
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_control = control[i];
+                msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+
+        int nrecv = recvmmsg(can->fd, msgs, n, MSG_DONTWAIT, NULL);
+        if (nrecv == -1) {
+                return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+
+        int64_t offset = realtime_offset();
+        for (int i = 0; i < nrecv; i++) {
+                stamps[i] = now_ns();
+                struct cmsghdr *cmsg;
+                for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg;
+                     cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+                        if (cmsg->cmsg_level == SOL_SOCKET &&
+                            cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                                struct timespec ts;
+                                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                                stamps[i] = (int64_t)ts.tv_sec * 1000000000 +
+                                            ts.tv_nsec - offset;
+                        }
+                }
+        }
+
+        busload_frames(frames, nrecv);
+        return nrecv;
+}
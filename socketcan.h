@@ -0,0 +1,43 @@
+#pragma once
+
+#include <linux/can.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Native SocketCAN access for the hot path.
+//
+// libEposCmd sends every frame through its own interface driver with internal
+// locking and timeouts. For RPDO setpoints and SYNC, which need no response,
+// the frames can instead be written to a raw CAN socket on the same interface
+// directly, batched into a single sendmmsg(). TPDOs are received the same way
+// with kernel receive timestamps. libEposCmd is still used for everything
+// that needs the SDO protocol. Every frame sent or received is accounted for
+// the bus load (see busload.h).
+
+// frames sent or received by a single syscall at most
+#define CAN_BATCH_MAX           64
+
+#define CAN_COB_ID_SYNC         0x080
+
+struct can_sock;
+
+// Open a raw CAN socket bound to ifname (e.g. "can0" or "vcan0"). Returns NULL
+// on failure with errno set.
+struct can_sock *can_open(const char *ifname);
+
+void can_close(struct can_sock *can);
+
+// Only receive frames with one of the given 11-bit COB-IDs, none at all if n
+// is 0.
+int can_filter(struct can_sock *can, const uint16_t *cob_ids, size_t n);
+
+// Send n frames with as few syscalls as possible. Returns the number of frames
+// sent, which is less than n, possibly 0, if the transmit queue ran full, or
+// -1 on error.
+int can_send(struct can_sock *can, const struct can_frame *frames, size_t n);
+
+// Receive up to n frames, waiting at most timeout ms for the first one. The
+// kernel receive timestamps are stored in stamps as now_ns() time. Returns the
+// number of frames received, 0 on timeout or -1 on error.
+int can_recv(struct can_sock *can, struct can_frame *frames, uint64_t *stamps,
+             size_t n, int timeout);
@@ -0,0 +1,262 @@
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STAT_NODES 256
+
+struct stat_hist {
+        _Atomic uint64_t count;
+        _Atomic uint64_t errors;
+        _Atomic uint64_t sum_ns;
+        _Atomic uint64_t max_ns;
+        _Atomic uint32_t err_codes[STAT_ERR_CODES];
+        _Atomic uint64_t err_counts[STAT_ERR_CODES];
+        _Atomic uint64_t buckets[STAT_BUCKETS];
+};
+
+// Histograms of one thread, only ever written by it. Threads are long-lived,
+// so they are never freed.
+struct stat_thread {
+        struct stat_thread *next;
+        _Atomic(struct stat_hist *) hists[STAT_FNS][STAT_NODES];
+};
+
+static _Atomic(struct stat_thread *) threads;
+static _Thread_local struct stat_thread *self;
+
+static const char *const names[STAT_FNS] = {
+#define STAT_NAME(fn) #fn,
+        STAT_FUNCTIONS(STAT_NAME)
+#undef STAT_NAME
+};
+
+static unsigned stat_bucket(uint64_t ns)
+{
+        if (ns < STAT_SUB_BUCKETS) {
+                return ns;
+        }
+
+        unsigned msb = 63 - __builtin_clzll(ns);
+        if (msb >= STAT_MAX_SHIFT) {
+                return STAT_BUCKETS - 1;
+        }
+
+        return (msb - STAT_SUB_BITS + 1) * STAT_SUB_BUCKETS +
+               (ns >> (msb - STAT_SUB_BITS) & (STAT_SUB_BUCKETS - 1));
+}
+
+// largest value falling into bucket
+static uint64_t stat_bucket_max(unsigned bucket)
+{
+        unsigned next = bucket + 1;
+        unsigned group = next / STAT_SUB_BUCKETS;
+        unsigned sub = next % STAT_SUB_BUCKETS;
+        if (group == 0) {
+                return sub - 1;
+        }
+
+        return ((uint64_t)(STAT_SUB_BUCKETS + sub) << (group - 1)) - 1;
+}
+
+// Only the owning thread writes, so a plain load and store is enough to
+// increment without losing updates, and readers never see torn values.
+static void add(_Atomic uint64_t *counter, uint64_t value)
+{
+        atomic_store_explicit(counter,
+                              atomic_load_explicit(counter,
+                                                   memory_order_relaxed) +
+                              value, memory_order_relaxed);
+}
+
+static struct stat_thread *stat_self(void)
+{
+        if (!self) {
+                self = calloc(1, sizeof(*self));
+                if (!self) {
+                        die("failed to allocate call statistics", 0);
+                }
+
+                self->next = atomic_load(&threads);
+                while (!atomic_compare_exchange_weak(&threads, &self->next,
+                                                     self)) {
+                }
+        }
+
+        return self;
+}
+
+static struct stat_hist *stat_hist(enum stat_fn fn, uint16_t node)
+{
+        struct stat_thread *thread = stat_self();
+        _Atomic(struct stat_hist *) *slot = &thread->hists[fn][node];
+        struct stat_hist *hist = atomic_load_explicit(slot,
+                                                      memory_order_relaxed);
+        if (!hist) {
+                hist = calloc(1, sizeof(*hist));
+                if (!hist) {
+                        die("failed to allocate call statistics", 0);
+                }
+
+                atomic_store_explicit(slot, hist, memory_order_release);
+        }
+
+        return hist;
+}
+
+void stat_record(enum stat_fn fn, uint16_t node, uint64_t start,
+                 uint32_t err)
+{
+        uint64_t ns = now_ns() - start;
+        struct stat_hist *hist = stat_hist(fn, node % STAT_NODES);
+        add(&hist->count, 1);
+        add(&hist->sum_ns, ns);
+        add(&hist->buckets[stat_bucket(ns)], 1);
+        if (ns > atomic_load_explicit(&hist->max_ns, memory_order_relaxed)) {
+                atomic_store_explicit(&hist->max_ns, ns, memory_order_relaxed);
+        }
+
+        if (!err) {
+                return;
+        }
+
+        add(&hist->errors, 1);
+        for (int i = 0; i < STAT_ERR_CODES; i++) {
+                uint32_t code = atomic_load_explicit(&hist->err_codes[i],
+                                                     memory_order_relaxed);
+                if (code == 0) {
+                        atomic_store_explicit(&hist->err_codes[i], err,
+                                              memory_order_relaxed);
+                } else if (code != err) {
+                        continue;
+                }
+
+                add(&hist->err_counts[i], 1);
+                break;
+        }
+}
+
+static void stat_merge_error(struct stat_snapshot *snap, uint32_t code,
+                             uint64_t count)
+{
+        for (int i = 0; i < STAT_ERR_CODES; i++) {
+                if (snap->err_codes[i] == code || snap->err_codes[i] == 0) {
+                        snap->err_codes[i] = code;
+                        snap->err_counts[i] += count;
+                        return;
+                }
+        }
+
+        // replace the least frequent code if this one is more frequent
+        int min = 0;
+        for (int i = 1; i < STAT_ERR_CODES; i++) {
+                if (snap->err_counts[i] < snap->err_counts[min]) {
+                        min = i;
+                }
+        }
+
+        if (count > snap->err_counts[min]) {
+                snap->err_codes[min] = code;
+                snap->err_counts[min] = count;
+        }
+}
+
+int stat_snapshot(unsigned fn, uint16_t node, struct stat_snapshot *snap)
+{
+        if (fn >= STAT_FNS) {
+                return -1;
+        }
+
+        memset(snap, 0, sizeof(*snap));
+        uint64_t buckets[STAT_BUCKETS] = { 0 };
+        for (struct stat_thread *thread = atomic_load(&threads); thread;
+             thread = thread->next) {
+                struct stat_hist *hist = atomic_load_explicit(
+                        &thread->hists[fn][node % STAT_NODES],
+                        memory_order_acquire);
+                if (!hist) {
+                        continue;
+                }
+
+                snap->count += atomic_load_explicit(&hist->count,
+                                                    memory_order_relaxed);
+                snap->errors += atomic_load_explicit(&hist->errors,
+                                                     memory_order_relaxed);
+                snap->sum_ns += atomic_load_explicit(&hist->sum_ns,
+                                                     memory_order_relaxed);
+                uint64_t max = atomic_load_explicit(&hist->max_ns,
+                                                    memory_order_relaxed);
+                if (max > snap->max_ns) {
+                        snap->max_ns = max;
+                }
+
+                for (int i = 0; i < STAT_BUCKETS; i++) {
+                        buckets[i] += atomic_load_explicit(
+                                &hist->buckets[i], memory_order_relaxed);
+                }
+
+                for (int i = 0; i < STAT_ERR_CODES; i++) {
+                        uint32_t code = atomic_load_explicit(
+                                &hist->err_codes[i], memory_order_relaxed);
+                        if (code) {
+                                stat_merge_error(snap, code,
+                                                 atomic_load_explicit(
+                                                 &hist->err_counts[i],
+                                                 memory_order_relaxed));
+                        }
+                }
+        }
+
+        // sort the error codes by frequency
+        for (int i = 1; i < STAT_ERR_CODES; i++) {
+                for (int j = i; j > 0 && snap->err_counts[j] >
+                                         snap->err_counts[j - 1]; j--) {
+                        uint32_t code = snap->err_codes[j];
+                        uint64_t count = snap->err_counts[j];
+                        snap->err_codes[j] = snap->err_codes[j - 1];
+                        snap->err_counts[j] = snap->err_counts[j - 1];
+                        snap->err_codes[j - 1] = code;
+                        snap->err_counts[j - 1] = count;
+                }
+        }
+
+        // the buckets may have been updated after count was read
+        uint64_t total = 0;
+        for (int i = 0; i < STAT_BUCKETS; i++) {
+                total += buckets[i];
+        }
+
+        struct {
+                uint64_t *value;
+                unsigned permille;
+        } percentiles[] = {
+                { &snap->p50_ns, 500 },
+                { &snap->p90_ns, 900 },
+                { &snap->p99_ns, 990 },
+                { &snap->p999_ns, 999 },
+        };
+        for (size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]);
+             p++) {
+                uint64_t rank = (total * percentiles[p].permille + 999) / 1000;
+                uint64_t seen = 0;
+                for (int i = 0; i < STAT_BUCKETS && total; i++) {
+                        seen += buckets[i];
+                        if (seen >= rank) {
+                                *percentiles[p].value = stat_bucket_max(i);
+                                break;
+                        }
+                }
+
+                if (*percentiles[p].value > snap->max_ns) {
+                        *percentiles[p].value = snap->max_ns;
+                }
+        }
+
+        return 0;
+}
+
+const char *stat_name(unsigned fn)
+{
+        return fn < STAT_FNS ? names[fn] : NULL;
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "busload.h"
+#include "fault.h"
+#include "util.h"
+
+#include <stdint.h>
+
+// Latency histograms and error counters of library calls.
+//
+// Library calls are wrapped in STAT() to record how long they took and with
+// which error code they failed, by function and node. Every thread records
+// into histograms of its own, so recording takes no lock and no atomic
+// read-modify-write, only two clock reads and a few relaxed stores (well
+// below a microsecond). Snapshots merge the histograms of all threads.
+//
+// Histograms are log-linear: every power of two of nanoseconds is split into
+// STAT_SUB_BUCKETS buckets, which bounds the error of reported percentiles to
+// 1 / STAT_SUB_BUCKETS.
+
+#define STAT_SUB_BITS           2
+#define STAT_SUB_BUCKETS        (1 << STAT_SUB_BITS)
+#define STAT_MAX_SHIFT          40 // latencies from 2^40 ns (~18 min) on
+                                   // share the last bucket
+#define STAT_BUCKETS            ((STAT_MAX_SHIFT - STAT_SUB_BITS + 1) * \
+                                 STAT_SUB_BUCKETS)
+
+// distinct error codes counted per function and node, others are only
+// counted as errors
+#define STAT_ERR_CODES          4
+
+// library functions recorded, in the order of their ids
+#define STAT_FUNCTIONS(X)                                               \
+        X(VCS_OpenDevice)                                               \
+        X(VCS_CloseDevice)                                              \
+        X(VCS_SetProtocolStackSettings)                                 \
+        X(VCS_GetDriverInfo)                                            \
+        X(VCS_SendNMTService)                                           \
+        X(VCS_SetMotorType)                                             \
+        X(VCS_SetDcMotorParameterEx)                                    \
+        X(VCS_SetObject)                                                \
+        X(VCS_GetObject)                                                \
+        X(VCS_GetState)                                                 \
+        X(VCS_SetEnableState)                                           \
+        X(VCS_SetDisableState)                                          \
+        X(VCS_SetQuickStopState)                                        \
+        X(VCS_ClearFault)                                               \
+        X(VCS_SetOperationMode)                                         \
+        X(VCS_ActivateVelocityMode)                                     \
+        X(VCS_MoveWithVelocity)                                         \
+        X(VCS_MoveToPosition)                                           \
+        X(VCS_HaltVelocityMovement)                                     \
+        X(VCS_HaltPositionMovement)                                     \
+        X(VCS_SetVelocityProfile)                                       \
+        X(VCS_SetPositionProfile)                                       \
+        X(VCS_GetPositionIs)                                            \
+        X(VCS_GetVelocityIs)                                            \
+        X(VCS_GetCurrentIsEx)                                           \
+        X(VCS_SendCANFrame)                                             \
+        X(VCS_ReadCANFrame)                                             \
+        X(VCS_ActivateInterpolatedPositionMode)                         \
+        X(VCS_ClearIpmBuffer)                                           \
+        X(VCS_GetIpmBufferParameter)                                    \
+        X(VCS_GetFreeIpmBufferSize)                                     \
+        X(VCS_AddPvtValueToIpmBuffer)                                   \
+        X(VCS_StartIpmTrajectory)                                       \
+        X(VCS_StopIpmTrajectory)                                        \
+        X(VCS_GetIpmStatus)                                             \
+        X(VCS_Store)                                                    \
+        X(VCS_SetRecorderParameter)                                     \
+        X(VCS_EnableTrigger)                                            \
+        X(VCS_DisableAllTriggers)                                       \
+        X(VCS_ActivateChannel)                                          \
+        X(VCS_DeactivateAllChannels)                                    \
+        X(VCS_StartRecorder)                                            \
+        X(VCS_StopRecorder)                                             \
+        X(VCS_ForceTrigger)                                             \
+        X(VCS_IsRecorderRunning)                                        \
+        X(VCS_IsRecorderTriggered)                                      \
+        X(VCS_ReadDataBuffer)                                           \
+        X(VCS_ExtractChannelDataVector)                                 \
+        X(VCS_SetPositionMust)                                          \
+        X(VCS_SetCurrentMustEx)                                         \
+        X(VCS_GetDeviceNameSelection)                                   \
+        X(VCS_GetProtocolStackNameSelection)                            \
+        X(VCS_GetInterfaceNameSelection)                                \
+        X(VCS_GetPortNameSelection)                                     \
+        X(VCS_GetBaudrateSelection)                                     \
+        X(VCS_GetVersion)                                               \
+        X(VCS_ActivateHomingMode)                                       \
+        X(VCS_SetHomingParameter)                                       \
+        X(VCS_FindHome)                                                 \
+        X(VCS_StopHoming)                                               \
+        X(VCS_GetHomingState)                                           \
+        X(VCS_SetPositionMarkerParameter)                               \
+        X(VCS_ActivatePositionMarker)                                   \
+        X(VCS_DeactivatePositionMarker)                                 \
+        X(VCS_ReadPositionMarkerCounter)                                \
+        X(VCS_ReadPositionMarkerCapturedPosition)                       \
+        X(VCS_ResetPositionMarkerCounter)                               \
+        X(VCS_SetPositionCompareParameter)                              \
+        X(VCS_SetPositionCompareReferencePosition)                      \
+        X(VCS_ActivatePositionCompare)                                  \
+        X(VCS_DeactivatePositionCompare)                                \
+        X(VCS_EnablePositionCompare)                                    \
+        X(VCS_DisablePositionCompare)
+
+enum stat_fn {
+#define STAT_ENUM(fn) STAT_##fn,
+        STAT_FUNCTIONS(STAT_ENUM)
+#undef STAT_ENUM
+        STAT_FNS
+};
+
+// Call fn with the remaining arguments and record the call for node (0 for
+// calls not addressed to a node). err is the variable the call stores its
+// error code in, which is only read if fn returns 0 (FALSE or NULL).
+// The frames the call puts on the bus are accounted as well (see
+// busload_call()) and so is the outcome (see fault_call()). Evaluates to the
+// return value of fn.
+#define STAT(fn, node, err, ...) ({                                     \
+        uint64_t stat_start_ = now_ns();                                \
+        __auto_type stat_ret_ = fn(__VA_ARGS__);                        \
+        stat_record(STAT_##fn, (node), stat_start_,                     \
+                    stat_ret_ ? 0 : (err));                             \
+        busload_call(STAT_##fn, (node));                                \
+        fault_call(STAT_##fn, stat_ret_ ? 0 : (err));                   \
+        stat_ret_;                                                      \
+})
+
+struct stat_snapshot {
+        uint64_t count;
+        uint64_t errors;
+        uint64_t sum_ns;
+        uint64_t p50_ns;  // percentiles are the upper bound of their bucket
+        uint64_t p90_ns;
+        uint64_t p99_ns;
+        uint64_t p999_ns;
+        uint64_t max_ns;
+        uint32_t err_codes[STAT_ERR_CODES]; // most frequent first, 0 if unused
+        uint64_t err_counts[STAT_ERR_CODES];
+};
+
+// Record a call to fn which started at start (now_ns()) and failed with err
+// (0 on success).
+void stat_record(enum stat_fn fn, uint16_t node, uint64_t start,
+                 uint32_t err);
+
+// Merge the calls to fn for node recorded by all threads. Returns -1 if fn is
+// not a valid id.
+int stat_snapshot(unsigned fn, uint16_t node, struct stat_snapshot *snap);
+
+// Name of the function with id fn, NULL if fn is not a valid id.
+const char *stat_name(unsigned fn);
@@ -0,0 +1,269 @@
+// Checks of the framing and dispatch of the command protocol (see proto.h).
+//
+// Request frames are split with proto_process() the way the connections feed
+// it, and executed with proto_execute() against the simulated library (see
+// sim/sim.c), so no drive is needed. Prints every failed check and exits
+// with 1 if there was one.
+
+#include "../epos.h"
+#include "../proto.h"
+
+#include <endian.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CHECK(cond) check(cond, #cond, __LINE__)
+
+// frames handed to submit, collected by collect()
+#define MAX_FRAMES 8
+
+struct frame {
+        uint8_t op;
+        uint8_t node;
+        const uint8_t *payload;
+        uint16_t len;
+        int tagged;
+        uint32_t id;
+};
+
+struct frames {
+        struct frame frames[MAX_FRAMES];
+        size_t n;
+        size_t accept; // frames accepted before submit returns -1
+};
+
+static int failures;
+
+static void check(int cond, const char *what, int line)
+{
+        if (!cond) {
+                printf("proto_test.c:%d: check failed: %s\n", line, what);
+                failures++;
+        }
+}
+
+static int collect(void *ctx, uint8_t op, uint8_t node,
+                   const uint8_t *payload, uint16_t len, int tagged,
+                   uint32_t id)
+{
+        struct frames *frames = ctx;
+        if (frames->n == frames->accept || frames->n == MAX_FRAMES) {
+                return -1;
+        }
+
+        frames->frames[frames->n++] = (struct frame){
+                op, node, payload, len, tagged, id
+        };
+        return 0;
+}
+
+// Append a request frame to buf, tagged with id if tagged is set. Returns its
+// size.
+static size_t put_frame(uint8_t *buf, uint8_t op, uint8_t node,
+                        const void *payload, uint16_t len, int tagged,
+                        uint32_t id)
+{
+        size_t tag_size = tagged ? PROTO_TAG_SIZE : 0;
+        uint16_t frame_len = htole16((PROTO_HDR_SIZE - PROTO_LEN_SIZE +
+                                      tag_size + len) |
+                                     (tagged ? PROTO_LEN_TAGGED : 0));
+        id = htole32(id);
+        memcpy(buf, &frame_len, sizeof(frame_len));
+        memcpy(buf + PROTO_LEN_SIZE, &id, tag_size);
+        buf[PROTO_LEN_SIZE + tag_size] = op;
+        buf[PROTO_LEN_SIZE + tag_size + 1] = node;
+        memcpy(buf + PROTO_HDR_SIZE + tag_size, payload, len);
+        return PROTO_HDR_SIZE + tag_size + len;
+}
+
+static uint32_t response_err(const uint8_t *resp)
+{
+        uint32_t err;
+        memcpy(&err, resp + PROTO_HDR_SIZE, sizeof(err));
+        return le32toh(err);
+}
+
+// Several frames in one read are all handed over in order, with their
+// payloads pointing into the buffer instead of being copied.
+static void test_pipelined(void)
+{
+        uint8_t buf[256];
+        int32_t velocity = htole32(-1000);
+        size_t len = put_frame(buf, OP_GET_STATE, 1, NULL, 0, 0, 0);
+        size_t second = len;
+        len += put_frame(buf + len, OP_MOVE_WITH_VELOCITY, 2, &velocity,
+                         sizeof(velocity), 0, 0);
+        len += put_frame(buf + len, OP_NOP, 0, NULL, 0, 0, 0);
+
+        struct frames frames = { .accept = MAX_FRAMES };
+        CHECK(proto_process(buf, len, collect, &frames) == (ssize_t)len);
+        CHECK(frames.n == 3);
+        CHECK(frames.frames[0].op == OP_GET_STATE);
+        CHECK(frames.frames[0].node == 1 && frames.frames[0].len == 0);
+        CHECK(frames.frames[1].op == OP_MOVE_WITH_VELOCITY);
+        CHECK(frames.frames[1].node == 2);
+        CHECK(frames.frames[1].len == sizeof(velocity));
+        CHECK(frames.frames[1].payload == buf + second + PROTO_HDR_SIZE);
+        CHECK(frames.frames[2].op == OP_NOP && !frames.frames[2].tagged);
+
+        // a frame that cannot be accepted stops processing in front of it
+        frames = (struct frames){ .accept = 1 };
+        CHECK(proto_process(buf, len, collect, &frames) == (ssize_t)second);
+        CHECK(frames.n == 1);
+}
+
+// A frame arriving in pieces is only handed over once it is complete, and
+// the bytes of an incomplete one are left for the next read.
+static void test_split(void)
+{
+        uint8_t buf[256];
+        int32_t velocity = htole32(500);
+        size_t first = put_frame(buf, OP_GET_STATE, 1, NULL, 0, 0, 0);
+        size_t len = first + put_frame(buf + first, OP_MOVE_WITH_VELOCITY, 1,
+                                       &velocity, sizeof(velocity), 1, 7);
+
+        for (size_t part = 0; part < len - first; part++) {
+                struct frames frames = { .accept = MAX_FRAMES };
+                CHECK(proto_process(buf, first + part, collect, &frames) ==
+                      (ssize_t)first);
+                CHECK(frames.n == 1);
+                CHECK(proto_process(buf + first, part, collect, &frames) ==
+                      0);
+                CHECK(frames.n == 1);
+        }
+
+        struct frames frames = { .accept = MAX_FRAMES };
+        CHECK(proto_process(buf + first, len - first, collect, &frames) ==
+              (ssize_t)(len - first));
+        CHECK(frames.n == 1);
+        CHECK(frames.frames[0].op == OP_MOVE_WITH_VELOCITY);
+        CHECK(frames.frames[0].len == sizeof(velocity));
+        CHECK(!memcmp(frames.frames[0].payload, &velocity, sizeof(velocity)));
+}
+
+// Frames too short for their header or too long for any request break the
+// stream, payloads of the wrong length for the request are answered with
+// PROTO_ERR_BAD_LENGTH.
+static void test_bad_length(void *port)
+{
+        uint8_t buf[PROTO_MAX_FRAME + PROTO_TAG_HDR_SIZE] = { 0 };
+        uint8_t payload[PROTO_MAX_PAYLOAD] = { 0 };
+        struct frames frames = { .accept = MAX_FRAMES };
+
+        uint16_t frame_len = htole16(PROTO_HDR_SIZE - PROTO_LEN_SIZE - 1);
+        memcpy(buf, &frame_len, sizeof(frame_len));
+        CHECK(proto_process(buf, PROTO_HDR_SIZE, collect, &frames) == -1);
+
+        frame_len = htole16((PROTO_HDR_SIZE - PROTO_LEN_SIZE) |
+                            PROTO_LEN_TAGGED);
+        memcpy(buf, &frame_len, sizeof(frame_len));
+        CHECK(proto_process(buf, PROTO_HDR_SIZE, collect, &frames) == -1);
+
+        frame_len = htole16(PROTO_HDR_SIZE - PROTO_LEN_SIZE +
+                            PROTO_MAX_PAYLOAD + 1);
+        memcpy(buf, &frame_len, sizeof(frame_len));
+        CHECK(proto_process(buf, sizeof(buf), collect, &frames) == -1);
+        CHECK(frames.n == 0);
+
+        // the largest payload still makes a frame
+        size_t len = put_frame(buf, OP_SET_OBJECT, 1, payload,
+                               sizeof(payload), 0, 0);
+        CHECK(proto_process(buf, len, collect, &frames) == (ssize_t)len);
+        CHECK(frames.n == 1 && frames.frames[0].len == PROTO_MAX_PAYLOAD);
+
+        uint8_t resp[PROTO_MAX_FRAME];
+        int32_t velocity = 0;
+        CHECK(proto_execute(port, OP_MOVE_WITH_VELOCITY, 1,
+                            (const uint8_t *)&velocity, 3, resp) ==
+              PROTO_RESP_HDR_SIZE);
+        CHECK(response_err(resp) == PROTO_ERR_BAD_LENGTH);
+        CHECK(proto_execute(port, OP_GET_STATE, 1,
+                            (const uint8_t *)&velocity, 1, resp) ==
+              PROTO_RESP_HDR_SIZE);
+        CHECK(response_err(resp) == PROTO_ERR_BAD_LENGTH);
+}
+
+// The id of a tagged request comes back with its response, which parses as
+// a tagged frame again.
+static void test_tagged(void *port)
+{
+        uint8_t buf[64];
+        size_t len = put_frame(buf, OP_NOP, 0, NULL, 0, 1, 0xdeadbeef);
+        len += put_frame(buf + len, OP_GET_STATE, 1, NULL, 0, 1, 0);
+        len += put_frame(buf + len, OP_GET_STATE, 1, NULL, 0, 0, 0);
+
+        struct frames frames = { .accept = MAX_FRAMES };
+        CHECK(proto_process(buf, len, collect, &frames) == (ssize_t)len);
+        CHECK(frames.n == 3);
+        CHECK(frames.frames[0].tagged && frames.frames[0].id == 0xdeadbeef);
+        CHECK(frames.frames[0].op == OP_NOP);
+        CHECK(frames.frames[1].tagged && frames.frames[1].id == 0);
+        CHECK(frames.frames[1].op == OP_GET_STATE);
+        CHECK(!frames.frames[2].tagged);
+
+        for (size_t i = 0; i < 2; i++) {
+                const struct frame *req = &frames.frames[i];
+                uint8_t resp[PROTO_TAG_SIZE + PROTO_MAX_FRAME];
+                size_t resp_len = proto_execute(port, req->op, req->node,
+                                                req->payload, req->len,
+                                                resp + PROTO_TAG_SIZE);
+                CHECK(response_err(resp + PROTO_TAG_SIZE) == 0);
+
+                proto_tag(resp, resp + PROTO_TAG_SIZE, req->id);
+                struct frames tagged = { .accept = MAX_FRAMES };
+                CHECK(proto_process(resp, PROTO_TAG_SIZE + resp_len, collect,
+                                    &tagged) ==
+                      (ssize_t)(PROTO_TAG_SIZE + resp_len));
+                CHECK(tagged.n == 1 && tagged.frames[0].tagged);
+                CHECK(tagged.frames[0].id == req->id);
+                CHECK(tagged.frames[0].op == (req->op | PROTO_OP_RESPONSE));
+                CHECK(tagged.frames[0].node == req->node);
+        }
+}
+
+// Opcodes without a command are framed like any other request and answered
+// with PROTO_ERR_UNKNOWN_OP.
+static void test_unknown_op(void *port)
+{
+        const uint8_t op = 0x7f;
+        uint8_t buf[16];
+        uint8_t payload[2] = { 1, 2 };
+        size_t len = put_frame(buf, op, 1, payload, sizeof(payload), 0, 0);
+
+        struct frames frames = { .accept = MAX_FRAMES };
+        CHECK(proto_process(buf, len, collect, &frames) == (ssize_t)len);
+        CHECK(frames.n == 1 && frames.frames[0].op == op);
+
+        uint8_t resp[PROTO_MAX_FRAME];
+        CHECK(proto_execute(port, op, 1, payload, sizeof(payload), resp) ==
+              PROTO_RESP_HDR_SIZE);
+        CHECK(resp[PROTO_LEN_SIZE] == (op | PROTO_OP_RESPONSE));
+        CHECK(resp[PROTO_LEN_SIZE + 1] == 1);
+        CHECK(response_err(resp) == PROTO_ERR_UNKNOWN_OP);
+}
+
+int main(void)
+{
+        uint32_t err;
+        void *port = VCS_OpenDevice("EPOS2", "MAXON SERIAL V2", "USB", "USB0",
+                                    &err);
+        if (!port) {
+                printf("failed to open the simulated port (0x%08x)\n", err);
+                return 1;
+        }
+
+        test_pipelined();
+        test_split();
+        test_bad_length(port);
+        test_tagged(port);
+        test_unknown_op(port);
+
+        VCS_CloseDevice(port, &err);
+        if (failures) {
+                printf("%d checks failed\n", failures);
+                return 1;
+        }
+
+        printf("all checks passed\n");
+        return 0;
+}
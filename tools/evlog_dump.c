@@ -0,0 +1,148 @@
+// Decoder of the binary event log (see evlog.h).
+//
+// Reads the log of a running or crashed server, merges the rings of all
+// threads by timestamp and prints one line per event with its wall-clock
+// time, the name of the thread that logged it and its formatted arguments.
+
+#include "../evlog.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char *const formats[EVLOG_NEVENTS] = {
+#define EVLOG_FORMAT(id, fmt) fmt,
+        EVLOG_EVENTS(EVLOG_FORMAT)
+#undef EVLOG_FORMAT
+};
+
+struct event {
+        const struct evlog_entry *entry;
+        const char *thread;
+};
+
+static int cmp_ts(const void *a, const void *b)
+{
+        uint64_t x = ((const struct event *)a)->entry->ts;
+        uint64_t y = ((const struct event *)b)->entry->ts;
+        return (x > y) - (x < y);
+}
+
+static void print(const struct event *event, int64_t realtime_offset)
+{
+        const struct evlog_entry *entry = event->entry;
+        int64_t ns = (int64_t)entry->ts + realtime_offset;
+        time_t sec = ns / 1000000000;
+        char date[32];
+        strftime(date, sizeof(date), "%F %T", localtime(&sec));
+        printf("%s.%09lld [%s] ", date, (long long)(ns % 1000000000),
+               event->thread);
+        if (entry->event < EVLOG_NEVENTS) {
+                printf(formats[entry->event], entry->a,
+                       (unsigned long long)entry->b,
+                       (unsigned long long)entry->c);
+        } else {
+                printf("unknown event %u (%u %llu %llu)", entry->event,
+                       entry->a, (unsigned long long)entry->b,
+                       (unsigned long long)entry->c);
+        }
+
+        printf("\n");
+}
+
+static void usage(const char *name)
+{
+        fprintf(stderr, "usage: %s [-s seconds] [log]\n", name);
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        const char *path = "/tmp/epos.evlog";
+        double seconds = 0;
+
+        int opt;
+        while ((opt = getopt(argc, argv, "s:")) != -1) {
+                switch (opt) {
+                case 's': seconds = atof(optarg); break;
+                default: usage(argv[0]);
+                }
+        }
+
+        if (optind < argc) {
+                path = argv[optind];
+        }
+
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1) {
+                perror(path);
+                return 1;
+        }
+
+        if ((size_t)st.st_size < sizeof(struct evlog_file)) {
+                fprintf(stderr, "%s: too small for an event log\n", path);
+                return 1;
+        }
+
+        const struct evlog_file *log = mmap(NULL, sizeof(*log), PROT_READ,
+                                            MAP_SHARED, fd, 0);
+        if (log == MAP_FAILED) {
+                perror("mmap");
+                return 1;
+        }
+
+        if (log->magic != EVLOG_MAGIC || log->version != EVLOG_VERSION ||
+            log->entries != EVLOG_ENTRIES) {
+                fprintf(stderr, "%s: not an event log of this version\n",
+                        path);
+                return 1;
+        }
+
+        uint32_t nthreads = log->nthreads;
+        if (nthreads > EVLOG_MAX_THREADS) {
+                nthreads = EVLOG_MAX_THREADS;
+        }
+
+        struct event *events = malloc(nthreads * EVLOG_ENTRIES *
+                                      sizeof(*events));
+        size_t n = 0;
+        for (uint32_t i = 0; i < nthreads; i++) {
+                const struct evlog_ring *ring = &log->rings[i];
+                const char *thread = ring->name[0] ? ring->name : "?";
+
+                // the slot at head may be half overwritten
+                uint64_t head = ring->head;
+                uint64_t first = head >= EVLOG_ENTRIES ?
+                                 head - EVLOG_ENTRIES + 1 : 0;
+                for (uint64_t k = first; k < head; k++) {
+                        events[n++] = (struct event){
+                                &ring->entries[k % EVLOG_ENTRIES], thread
+                        };
+                }
+        }
+
+        qsort(events, n, sizeof(*events), cmp_ts);
+
+        // only the last seconds before the latest event
+        size_t start = 0;
+        if (seconds > 0 && n > 0) {
+                uint64_t since = events[n - 1].entry->ts - seconds * 1e9;
+                while (start < n && events[start].entry->ts < since) {
+                        start++;
+                }
+        }
+
+        for (size_t i = start; i < n; i++) {
+                print(&events[i], log->realtime_offset);
+        }
+
+        free(events);
+        return 0;
+}
@@ -0,0 +1,372 @@
+#include "traj.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// samples evaluated per block, a multiple of TRAJ_LANES
+#define TRAJ_BLOCK              256
+
+// Adding and subtracting this rounds doubles below 2^51 to the nearest
+// integer (ties to even) in the default rounding mode.
+#define TRAJ_ROUND              0x1.8p52
+
+typedef double traj_vec __attribute__((vector_size(TRAJ_LANES *
+                                                   sizeof(double))));
+typedef int32_t traj_ivec __attribute__((vector_size(TRAJ_LANES *
+                                                     sizeof(int32_t))));
+
+// the path of one move between two waypoints, s(t) from 0 to 1
+struct traj_segment {
+        double start;       // time the move starts at
+        double phase[8];    // start of every phase relative to start,
+                            // phase[7] is the duration of the move
+        double coeff[7][4]; // s, s', s''/2 and s'''/6 at the start of every
+                            // phase
+};
+
+struct traj {
+        size_t naxes;
+        size_t nsegments;
+        double duration;
+        struct traj_segment *segments;
+        double *origin; // [segment * naxes + axis], position at the start
+        double *delta;  // [segment * naxes + axis], distance moved
+        double last[TRAJ_MAX_AXES]; // position at the end
+};
+
+// Plan the time-optimal rest-to-rest S-curve from s = 0 to 1 with path
+// velocity v, acceleration a and jerk j.
+static void traj_path(double v, double a, double j, struct traj_segment *seg)
+{
+        // times of a jerk phase and of the constant acceleration phase,
+        // cruise time and the velocity cruised at
+        double tj, ta, tv, vp;
+        if (v * j >= a * a) {
+                tj = a / j;
+                ta = v / a - tj;
+        } else {
+                tj = sqrt(v / j);
+                ta = 0;
+        }
+
+        // accelerating and braking to v covers v * (2 * tj + ta)
+        vp = v;
+        tv = (1 - v * (2 * tj + ta)) / v;
+        if (tv < 0) {
+                // v is not reached: try reaching a, in which case
+                // vp * (vp / a + a / j) = 1
+                tj = a / j;
+                vp = a * (sqrt(tj * tj + 4 / a) - tj) / 2;
+                ta = vp / a - tj;
+                tv = 0;
+                if (ta < 0) {
+                        // neither is a: vp = j * tj^2 and 2 * vp * tj = 1
+                        tj = cbrt(1 / (2 * j));
+                        ta = 0;
+                }
+        }
+
+        const double durations[7] = { tj, ta, tj, tv, tj, ta, tj };
+        const double jerks[7] = { j, 0, -j, 0, -j, 0, j };
+        double s = 0;
+        double sv = 0;
+        double sa = 0;
+        seg->phase[0] = 0;
+        for (int p = 0; p < 7; p++) {
+                double d = durations[p];
+                seg->coeff[p][0] = s;
+                seg->coeff[p][1] = sv;
+                seg->coeff[p][2] = sa / 2;
+                seg->coeff[p][3] = jerks[p] / 6;
+                s += d * (sv + d * (sa / 2 + d * jerks[p] / 6));
+                sv += d * (sa + d * jerks[p] / 2);
+                sa += d * jerks[p];
+                seg->phase[p + 1] = seg->phase[p] + d;
+        }
+}
+
+struct traj *traj_plan(const double *waypoints, size_t nwaypoints,
+                       size_t naxes, const struct traj_limits *limits)
+{
+        if (naxes == 0 || naxes > TRAJ_MAX_AXES || nwaypoints == 0) {
+                return NULL;
+        }
+
+        for (size_t a = 0; a < naxes; a++) {
+                if (!(limits[a].velocity > 0) ||
+                    !(limits[a].acceleration > 0) || !(limits[a].jerk > 0)) {
+                        return NULL;
+                }
+        }
+
+        struct traj *traj = calloc(1, sizeof(*traj));
+        size_t nmoves = nwaypoints - 1;
+        if (!traj ||
+            !(traj->segments = calloc(nmoves + 1, sizeof(*traj->segments))) ||
+            !(traj->origin = calloc(nmoves * naxes + 1, sizeof(double))) ||
+            !(traj->delta = calloc(nmoves * naxes + 1, sizeof(double)))) {
+                die("failed to allocate trajectory", 0);
+        }
+
+        traj->naxes = naxes;
+        for (size_t a = 0; a < naxes; a++) {
+                traj->last[a] = waypoints[a * nwaypoints + nwaypoints - 1];
+        }
+
+        for (size_t w = 0; w < nmoves; w++) {
+                // the limits of every axis bound the path derivatives to
+                // the limit over its distance
+                double v = INFINITY;
+                double acc = INFINITY;
+                double j = INFINITY;
+                size_t n = traj->nsegments;
+                for (size_t a = 0; a < naxes; a++) {
+                        double from = waypoints[a * nwaypoints + w];
+                        double d = waypoints[a * nwaypoints + w + 1] - from;
+                        traj->origin[n * naxes + a] = from;
+                        traj->delta[n * naxes + a] = d;
+                        if (d != 0) {
+                                v = fmin(v, limits[a].velocity / fabs(d));
+                                acc = fmin(acc,
+                                           limits[a].acceleration / fabs(d));
+                                j = fmin(j, limits[a].jerk / fabs(d));
+                        }
+                }
+
+                if (v == INFINITY) {
+                        continue; // no axis moves
+                }
+
+                struct traj_segment *seg = &traj->segments[n];
+                traj_path(v, acc, j, seg);
+                seg->start = traj->duration;
+                traj->duration += seg->phase[7];
+                traj->nsegments++;
+        }
+
+        return traj;
+}
+
+void traj_free(struct traj *traj)
+{
+        if (traj) {
+                free(traj->segments);
+                free(traj->origin);
+                free(traj->delta);
+                free(traj);
+        }
+}
+
+double traj_duration(const struct traj *traj)
+{
+        return traj->duration;
+}
+
+// Index of the first sample at or after t.
+static size_t traj_index(double t, double period)
+{
+        size_t k = t > 0 ? ceil(t / period) : 0;
+        while (k > 0 && (k - 1) * period >= t) {
+                k--;
+        }
+
+        while (k * period < t) {
+                k++;
+        }
+
+        return k;
+}
+
+size_t traj_samples(const struct traj *traj, double period)
+{
+        return traj_index(traj->duration, period) + 1;
+}
+
+// Segment moving at time t, nsegments if t is past the end.
+static size_t traj_segment_at(const struct traj *traj, double t)
+{
+        size_t lo = 0;
+        size_t hi = traj->nsegments;
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                const struct traj_segment *seg = &traj->segments[mid];
+                if (t >= seg->start + seg->phase[7]) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
+        }
+
+        return lo;
+}
+
+// Evaluate the path of seg at the n samples from sample first on, all within
+// the segment, into s (rounded up to whole vectors).
+static void traj_path_block(const struct traj_segment *seg, double period,
+                            size_t first, size_t n, double *s)
+{
+        traj_vec lanes;
+        for (int l = 0; l < TRAJ_LANES; l++) {
+                lanes[l] = l;
+        }
+
+        size_t i = 0;
+        for (int p = 0; p < 7 && i < n; p++) {
+                size_t end = p == 6 ? first + n :
+                             traj_index(seg->start + seg->phase[p + 1],
+                                        period);
+                if (end > first + n) {
+                        end = first + n;
+                }
+
+                if (first + i >= end) {
+                        continue;
+                }
+
+                const double *c = seg->coeff[p];
+                double origin = seg->start + seg->phase[p];
+                for (; first + i < end; i += TRAJ_LANES) {
+                        traj_vec k = (double)(first + i) + lanes;
+                        traj_vec dt = k * period - origin;
+                        traj_vec v = c[0] + dt * (c[1] + dt * (c[2] +
+                                                               dt * c[3]));
+                        memcpy(s + i, &v, sizeof(v));
+                }
+
+                // the last vector may have run into the next phase, whose
+                // samples are evaluated again with their own polynomial
+                i = end - first;
+        }
+}
+
+// Scale the path s of n samples to every axis moving along segment seg and
+// store the rounded positions.
+static void traj_expand(const struct traj *traj, size_t seg, const double *s,
+                        size_t n, int32_t *out, size_t stride)
+{
+        for (size_t a = 0; a < traj->naxes; a++) {
+                double origin = traj->origin[seg * traj->naxes + a];
+                double delta = traj->delta[seg * traj->naxes + a];
+                int32_t *axis = out + a * stride;
+                size_t i = 0;
+                for (; i + TRAJ_LANES <= n; i += TRAJ_LANES) {
+                        traj_vec v;
+                        memcpy(&v, s + i, sizeof(v));
+                        v = origin + delta * v;
+                        v = (v + TRAJ_ROUND) - TRAJ_ROUND;
+                        traj_ivec iv = __builtin_convertvector(v, traj_ivec);
+                        memcpy(axis + i, &iv, sizeof(iv));
+                }
+
+                for (; i < n; i++) {
+                        axis[i] = lround(origin + delta * s[i]);
+                }
+        }
+}
+
+void traj_sample(const struct traj *traj, double period, size_t first,
+                 size_t n, int32_t *out, size_t stride)
+{
+        // padded so vectors running past the block have room
+        double s[TRAJ_BLOCK + TRAJ_LANES];
+        size_t i = 0;
+        size_t seg = traj_segment_at(traj, first * period);
+        while (i < n && seg < traj->nsegments) {
+                const struct traj_segment *segment = &traj->segments[seg];
+                size_t end = traj_index(segment->start + segment->phase[7],
+                                        period);
+                if (first + i >= end) {
+                        seg++;
+                        continue;
+                }
+
+                size_t m = end - (first + i);
+                if (m > n - i) {
+                        m = n - i;
+                }
+
+                if (m > TRAJ_BLOCK) {
+                        m = TRAJ_BLOCK;
+                }
+
+                traj_path_block(segment, period, first + i, m, s);
+                traj_expand(traj, seg, s, m, out + i, stride);
+                i += m;
+        }
+
+        for (size_t a = 0; a < traj->naxes; a++) {
+                int32_t last = lround(traj->last[a]);
+                for (size_t k = i; k < n; k++) {
+                        out[a * stride + k] = last;
+                }
+        }
+}
+
+void traj_at(const struct traj *traj, double t, double *positions,
+             double *velocities)
+{
+        size_t seg = traj_segment_at(traj, t);
+        if (seg == traj->nsegments) {
+                for (size_t a = 0; a < traj->naxes; a++) {
+                        positions[a] = traj->last[a];
+                        if (velocities) {
+                                velocities[a] = 0;
+                        }
+                }
+
+                return;
+        }
+
+        const struct traj_segment *segment = &traj->segments[seg];
+        int p = 6;
+        while (p > 0 && t < segment->start + segment->phase[p]) {
+                p--;
+        }
+
+        const double *c = segment->coeff[p];
+        double dt = t - segment->start - segment->phase[p];
+        double s = c[0] + dt * (c[1] + dt * (c[2] + dt * c[3]));
+        double sv = c[1] + dt * (2 * c[2] + dt * 3 * c[3]);
+        for (size_t a = 0; a < traj->naxes; a++) {
+                double delta = traj->delta[seg * traj->naxes + a];
+                positions[a] = traj->origin[seg * traj->naxes + a] +
+                               delta * s;
+                if (velocities) {
+                        velocities[a] = delta * sv;
+                }
+        }
+}
+
+size_t traj_pvt(const struct traj *traj, size_t axis, uint8_t time_ms,
+                double inc_per_rev, struct ipm_point *points, size_t max)
+{
+        double duration_ms = traj->duration * 1000;
+        size_t intervals = time_ms ? ceil(duration_ms / time_ms) : 0;
+        for (size_t k = 0; k <= intervals && k < max; k++) {
+                double t_ms = k < intervals ? (double)k * time_ms :
+                              duration_ms;
+                double positions[TRAJ_MAX_AXES];
+                double velocities[TRAJ_MAX_AXES];
+                traj_at(traj, t_ms / 1000, positions, velocities);
+
+                // the last interval is shorter, rounded up to whole ms
+                uint8_t time = 0;
+                if (k + 1 < intervals) {
+                        time = time_ms;
+                } else if (k + 1 == intervals) {
+                        time = ceil(duration_ms - t_ms);
+                        time = time ? time : 1;
+                }
+
+                points[k] = (struct ipm_point){
+                        .position = lround(positions[axis]),
+                        .velocity = lround(velocities[axis] * 60 /
+                                           inc_per_rev),
+                        .time = time,
+                };
+        }
+
+        return intervals + 1;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "ipm.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Jerk-limited multi-axis trajectories.
+//
+// A trajectory moves a set of axes through a list of waypoints, coming to
+// rest at every one of them. Between two waypoints all axes move along a
+// straight line in joint space: every axis follows the same normalized
+// S-curve path s(t) from 0 to 1, scaled by its own distance. The path is
+// planned time-optimally under the velocity, acceleration and jerk limits of
+// all axes at once, so the axes start and arrive together and the slowest
+// one sets the pace. s(t) is a cubic polynomial in each of the seven phases
+// of an S-curve (jerk up, constant acceleration, jerk down, cruise and the
+// mirror image for braking).
+//
+// A trajectory can be sampled into per-cycle position setpoints or turned
+// into PVT points for the interpolated position mode (see ipm.h), which is how
+// clients get single-axis moves planned with OP_IPM_PLAN. Sampling is done in
+// blocks: the path is evaluated once per sample, then expanded to all axes,
+// both with vector instructions over TRAJ_LANES samples at a time.
+//
+// Positions are in increments and times in seconds; the functions are
+// reentrant.
+
+#define TRAJ_MAX_AXES           16
+
+// samples processed per vector instruction
+#define TRAJ_LANES              4
+
+struct traj_limits {
+        double velocity;     // inc/s
+        double acceleration; // inc/s^2
+        double jerk;         // inc/s^3
+};
+
+struct traj;
+
+// Plan a trajectory of naxes axes through nwaypoints waypoints, of which the
+// first is the start. waypoints holds the waypoints of axis 0, then those of
+// axis 1 and so on. Returns NULL if an argument is out of range (no axes, no
+// waypoints, or a limit that is not positive).
+struct traj *traj_plan(const double *waypoints, size_t nwaypoints,
+                       size_t naxes, const struct traj_limits *limits);
+
+void traj_free(struct traj *traj);
+
+// Time from the first to the last waypoint.
+double traj_duration(const struct traj *traj);
+
+// Number of samples period apart it takes to cover the trajectory, including
+// the samples at its start and at its end.
+size_t traj_samples(const struct traj *traj, double period);
+
+// Positions and, unless velocities is NULL, velocities (inc/s) of all axes at
+// time t.
+void traj_at(const struct traj *traj, double t, double *positions,
+             double *velocities);
+
+// Sample n position setpoints period apart, beginning with sample first (at
+// time first * period). The setpoints of axis a are written to
+// out[a * stride] to out[a * stride + n - 1]. Samples past the end hold the
+// last waypoint.
+void traj_sample(const struct traj *traj, double period, size_t first,
+                 size_t n, int32_t *out, size_t stride);
+
+// Turn the trajectory of axis into PVT points time_ms apart (1 to 255), the
+// velocities converted to rpm with the encoder resolution. The last point
+// lies at the end of the trajectory and has time 0. Returns the number of
+// points, which are only written up to max.
+size_t traj_pvt(const struct traj *traj, size_t axis, uint8_t time_ms,
+                double inc_per_rev, struct ipm_point *points, size_t max);
@@ -0,0 +1,434 @@
+#define _GNU_SOURCE
+
+#include "udp.h"
+#include "evlog.h"
+#include "util.h"
+#include "watchdog.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+struct udp_sender {
+        struct udp *udp;
+        struct sockaddr_in addr;
+        uint32_t seq;       // of the last datagram accepted
+        uint64_t last_seen; // ns, 0 if the slot is free
+
+        // cancelled when the watchdog stops the stream, the slot is only
+        // reused once none of its setpoints is in flight anymore
+        struct bus_client client;
+        unsigned inflight;
+        struct watchdog_session session;
+};
+
+// setpoint waiting for room on the bus
+struct udp_held {
+        int used;
+        struct udp_sender *sender;
+        uint32_t key; // see proto_setpoint()
+        uint8_t op;
+        uint8_t node;
+        uint16_t len;
+        uint8_t payload[PROTO_MAX_PAYLOAD];
+};
+
+struct udp {
+        struct bus *bus;
+        int fd;
+        unsigned inflight;
+        struct udp_sender senders[UDP_MAX_SENDERS];
+        struct udp_sender *sender; // of the datagram being handled
+        struct udp_held held[UDP_MAX_HELD];
+        size_t nheld;
+
+        struct watchdog watchdog;
+        uint32_t timeout_ms;
+        uint8_t stop_op;
+
+        struct mmsghdr msgs[UDP_BATCH];
+        struct iovec iovs[UDP_BATCH];
+        struct sockaddr_in addrs[UDP_BATCH];
+        uint8_t bufs[UDP_BATCH][UDP_MAX_DATAGRAM];
+};
+
+// written by the thread owning the socket, read by any
+static struct {
+        _Atomic uint64_t datagrams;
+        _Atomic uint64_t stale;
+        _Atomic uint64_t lost;
+        _Atomic uint64_t malformed;
+        _Atomic uint64_t setpoints;
+        _Atomic uint64_t rejected;
+        _Atomic uint64_t overflows;
+        _Atomic uint64_t superseded;
+        _Atomic uint64_t failed;
+} counters;
+
+static void count(_Atomic uint64_t *counter, uint64_t n)
+{
+        atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+// Drop the setpoints of a stream held back and free its slot.
+static void udp_forget(struct udp *udp, struct udp_sender *sender)
+{
+        for (int i = 0; i < UDP_MAX_HELD; i++) {
+                struct udp_held *held = &udp->held[i];
+                if (held->used && held->sender == sender) {
+                        held->used = 0;
+                        udp->nheld--;
+                }
+        }
+
+        sender->last_seen = 0;
+}
+
+// Called when a stream went silent, after its nodes have been stopped.
+static void udp_expired(void *owner)
+{
+        struct udp_sender *sender = owner;
+        evlog(EV_UDP_EXPIRED, ntohl(sender->addr.sin_addr.s_addr),
+              ntohs(sender->addr.sin_port), 0);
+        udp_forget(sender->udp, sender);
+}
+
+struct udp *udp_open(struct bus *bus, in_port_t port, int notify_fd,
+                     uint32_t timeout_ms, uint8_t stop_op)
+{
+        struct udp *udp = calloc(1, sizeof(*udp));
+        if (!udp) {
+                die("failed to allocate UDP channel", 0);
+        }
+
+        for (int i = 0; i < UDP_MAX_SENDERS; i++) {
+                udp->senders[i].udp = udp;
+                if (bus_client_init(&udp->senders[i].client,
+                                    UDP_MAX_INFLIGHT, notify_fd) == -1) {
+                        die("failed to allocate UDP channel", 0);
+                }
+        }
+
+        watchdog_init(&udp->watchdog, bus, notify_fd, udp_expired);
+        udp->timeout_ms = timeout_ms;
+        udp->stop_op = stop_op;
+        udp->bus = bus;
+        udp->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0);
+        if (udp->fd == -1) {
+                die("failed to instantiate UDP socket", 0);
+        }
+
+        const struct sockaddr_in sockaddr = {
+                .sin_addr.s_addr = INADDR_ANY,
+                .sin_family = AF_INET,
+                .sin_port = htons(port),
+        };
+        if (bind(udp->fd, (const struct sockaddr *)&sockaddr,
+                 sizeof(sockaddr)) == -1) {
+                die("failed to bind UDP socket", 0);
+        }
+
+        for (int i = 0; i < UDP_BATCH; i++) {
+                udp->iovs[i] = (struct iovec){
+                        udp->bufs[i], sizeof(udp->bufs[i])
+                };
+        }
+
+        printf("|-> receiving setpoints on UDP port %u\n", port);
+        return udp;
+}
+
+int udp_fd(const struct udp *udp)
+{
+        return udp->fd;
+}
+
+// Stream of the sender of a datagram, taking over the least recently heard
+// one if the sender is new. Returns NULL if every slot still has setpoints in
+// flight.
+static struct udp_sender *udp_sender(struct udp *udp,
+                                     const struct sockaddr_in *addr,
+                                     uint64_t now, int *fresh)
+{
+        struct udp_sender *oldest = NULL;
+        for (int i = 0; i < UDP_MAX_SENDERS; i++) {
+                struct udp_sender *sender = &udp->senders[i];
+                if (sender->last_seen &&
+                    sender->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+                    sender->addr.sin_port == addr->sin_port) {
+                        *fresh = 0;
+                        return sender;
+                }
+
+                if (sender->inflight == 0 &&
+                    (!oldest || sender->last_seen < oldest->last_seen)) {
+                        oldest = sender;
+                }
+        }
+
+        if (!oldest) {
+                return NULL;
+        } else if (oldest->last_seen) {
+                // nothing watches the stream anymore, so its nodes are
+                // stopped as if it went silent
+                watchdog_close(&udp->watchdog, &oldest->session);
+                udp_forget(udp, oldest);
+        }
+
+        oldest->addr = *addr;
+        oldest->last_seen = now;
+        watchdog_open(&oldest->session, oldest, &oldest->client);
+        watchdog_arm(&udp->watchdog, &oldest->session, udp->timeout_ms,
+                     udp->stop_op);
+        bus_resume(&oldest->client);
+        *fresh = 1;
+        return oldest;
+}
+
+// Queue a setpoint of sender on the bus. Returns -1 if there is no room.
+static int udp_queue(struct udp *udp, struct udp_sender *sender, uint8_t op,
+                     uint8_t node, const uint8_t *payload, uint16_t len)
+{
+        struct bus_cmd *cmd = udp->inflight < UDP_MAX_INFLIGHT ?
+                              bus_claim(udp->bus) : NULL;
+        if (!cmd) {
+                return -1;
+        }
+
+        cmd->client = &sender->client;
+        cmd->tag = (struct bus_tag){ 0 };
+        cmd->op = op;
+        cmd->node = node;
+        cmd->len = len;
+        memcpy(cmd->payload, payload, len);
+        bus_submit(udp->bus, cmd);
+        udp->inflight++;
+        sender->inflight++;
+        count(&counters.setpoints, 1);
+        return 0;
+}
+
+// Hold a setpoint back until there is room on the bus, replacing the one
+// held with the same key.
+static void udp_hold(struct udp *udp, struct udp_sender *sender, uint32_t key,
+                     uint8_t op, uint8_t node, const uint8_t *payload,
+                     uint16_t len)
+{
+        struct udp_held *free = NULL;
+        struct udp_held *held = NULL;
+        for (int i = 0; i < UDP_MAX_HELD && !held; i++) {
+                if (!udp->held[i].used) {
+                        free = free ? free : &udp->held[i];
+                } else if (udp->held[i].key == key) {
+                        held = &udp->held[i];
+                }
+        }
+
+        if (held) {
+                count(&counters.superseded, 1);
+        } else if (free) {
+                held = free;
+                udp->nheld++;
+        } else {
+                count(&counters.overflows, 1);
+                return;
+        }
+
+        *held = (struct udp_held){
+                .used = 1,
+                .sender = sender,
+                .key = key,
+                .op = op,
+                .node = node,
+                .len = len,
+        };
+        memcpy(held->payload, payload, len);
+}
+
+static int udp_submit(void *ctx, uint8_t op, uint8_t node,
+                      const uint8_t *payload, uint16_t len, int tagged,
+                      uint32_t id)
+{
+        struct udp *udp = ctx;
+        struct udp_sender *sender = udp->sender;
+        uint32_t key;
+        if (!proto_setpoint(op, node, payload, len, &key)) {
+                count(&counters.rejected, 1);
+                return 0;
+        }
+
+        watchdog_request(&udp->watchdog, &sender->session, op, node, payload,
+                         len);
+        if (udp->nheld > 0 ||
+            udp_queue(udp, sender, op, node, payload, len) == -1) {
+                // once setpoints are held back, newer ones have to join them
+                // so they are not overtaken
+                udp_hold(udp, sender, key, op, node, payload, len);
+        }
+
+        return 0;
+}
+
+// Check the sequence number of a datagram and submit its requests.
+static void udp_handle(struct udp *udp, const struct sockaddr_in *addr,
+                       const uint8_t *buf, size_t len, uint64_t now)
+{
+        uint32_t seq;
+        if (len < sizeof(seq)) {
+                count(&counters.malformed, 1);
+                return;
+        }
+
+        memcpy(&seq, buf, sizeof(seq));
+        seq = le32toh(seq);
+
+        // sequence numbers wrap around, so they are compared by distance
+        int fresh;
+        struct udp_sender *sender = udp_sender(udp, addr, now, &fresh);
+        if (!sender) {
+                count(&counters.overflows, 1);
+                return;
+        }
+
+        int32_t ahead = seq - sender->seq;
+        if (!fresh && ahead <= 0) {
+                count(&counters.stale, 1);
+                return;
+        } else if (!fresh) {
+                count(&counters.lost, ahead - 1);
+        }
+
+        sender->seq = seq;
+        sender->last_seen = now;
+        watchdog_feed(&sender->session);
+        udp->sender = sender;
+        ssize_t consumed = proto_process(buf + sizeof(seq), len - sizeof(seq),
+                                         udp_submit, udp);
+        if (consumed != (ssize_t)(len - sizeof(seq))) {
+                count(&counters.malformed, 1);
+        }
+}
+
+void udp_receive(struct udp *udp)
+{
+        int submitted = 0;
+        while (1) {
+                for (int i = 0; i < UDP_BATCH; i++) {
+                        udp->msgs[i].msg_hdr = (struct msghdr){
+                                .msg_name = &udp->addrs[i],
+                                .msg_namelen = sizeof(udp->addrs[i]),
+                                .msg_iov = &udp->iovs[i],
+                                .msg_iovlen = 1,
+                        };
+                }
+
+                int n = recvmmsg(udp->fd, udp->msgs, UDP_BATCH, 0, NULL);
+                if (n == -1) {
+                        if (errno == EINTR) {
+                                continue;
+                        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                evlog(EV_UDP_RECV_FAILED, errno, 0, 0);
+                        }
+
+                        break;
+                }
+
+                uint64_t now = now_ns();
+                count(&counters.datagrams, n);
+                for (int i = 0; i < n; i++) {
+                        const struct msghdr *hdr = &udp->msgs[i].msg_hdr;
+                        if (hdr->msg_flags & MSG_TRUNC) {
+                                count(&counters.malformed, 1);
+                                continue;
+                        }
+
+                        udp_handle(udp, &udp->addrs[i], udp->bufs[i],
+                                   udp->msgs[i].msg_len, now);
+                }
+
+                submitted = 1;
+                if (n < UDP_BATCH) {
+                        break;
+                }
+        }
+
+        if (submitted) {
+                bus_kick(udp->bus);
+        }
+}
+
+void udp_run(struct udp *udp, uint64_t now)
+{
+        watchdog_run(&udp->watchdog, now);
+}
+
+int udp_timeout(const struct udp *udp, uint64_t now)
+{
+        return watchdog_timeout(&udp->watchdog, now);
+}
+
+void udp_complete(struct udp *udp)
+{
+        watchdog_complete(&udp->watchdog);
+
+        for (int i = 0; i < UDP_MAX_SENDERS; i++) {
+                struct udp_sender *sender = &udp->senders[i];
+                struct bus_completion *completion;
+                while (sender->inflight > 0 &&
+                       (completion = spsc_peek(&sender->client.completions))) {
+                        uint32_t err;
+                        memcpy(&err, completion->frame + PROTO_HDR_SIZE,
+                               sizeof(err));
+                        err = le32toh(err);
+                        if (err == PROTO_ERR_SUPERSEDED) {
+                                count(&counters.superseded, 1);
+                        } else if (err && err != PROTO_ERR_CANCELLED) {
+                                count(&counters.failed, 1);
+                        }
+
+                        spsc_release(&sender->client.completions);
+                        sender->inflight--;
+                        udp->inflight--;
+                }
+        }
+
+        size_t queued = 0;
+        for (int i = 0; i < UDP_MAX_HELD && udp->nheld > 0; i++) {
+                struct udp_held *held = &udp->held[i];
+                if (held->used) {
+                        if (udp_queue(udp, held->sender, held->op,
+                                      held->node, held->payload,
+                                      held->len) == -1) {
+                                break;
+                        }
+
+                        held->used = 0;
+                        udp->nheld--;
+                        queued++;
+                }
+        }
+
+        if (queued) {
+                bus_kick(udp->bus);
+        }
+}
+
+void udp_stats(struct udp_stats *stats)
+{
+        *stats = (struct udp_stats){
+                .datagrams = atomic_load(&counters.datagrams),
+                .stale = atomic_load(&counters.stale),
+                .lost = atomic_load(&counters.lost),
+                .malformed = atomic_load(&counters.malformed),
+                .setpoints = atomic_load(&counters.setpoints),
+                .rejected = atomic_load(&counters.rejected),
+                .overflows = atomic_load(&counters.overflows),
+                .superseded = atomic_load(&counters.superseded),
+                .failed = atomic_load(&counters.failed),
+        };
+}
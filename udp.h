@@ -0,0 +1,90 @@
+#pragma once
+
+#include "bus.h"
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// UDP channel for streaming setpoints.
+//
+// Only the newest setpoint matters, so waiting for a lost segment to be
+// retransmitted, as TCP does, only delays the ones behind it. Setpoints (see
+// proto_setpoint()) can instead be sent as datagrams, each starting with a
+// sequence number followed by one or more request frames (see proto.h):
+//
+//   | seq:u32 | request frame | request frame | ... |
+//
+// Every sender (source address and port) is a stream of its own whose
+// sequence numbers increase by one per datagram. Datagrams arriving with a
+// sequence number not newer than the last one accepted from the stream are
+// duplicates or overtaken and dropped; gaps are counted as lost. Requests are
+// not answered, and anything but a setpoint is rejected, so configuration
+// stays on TCP where its responses arrive reliably. Bursts of datagrams are
+// received with a single recvmmsg(). While the bus is busy, only the latest
+// setpoint per axis and kind is held back until there is room again.
+//
+// Every stream has a watchdog session (see watchdog.h), armed from its first
+// datagram on. If no datagram of it arrives within the timeout, the nodes it
+// sent setpoints to are stopped, its setpoints still queued or held back are
+// dropped and the stream is forgotten, so should it come back it starts
+// anew. A stream whose slot is taken over by a new one is stopped the same
+// way, since nothing watches it anymore.
+
+// largest datagram accepted
+#define UDP_MAX_DATAGRAM        1472
+
+// datagrams received per recvmmsg()
+#define UDP_BATCH               32
+
+// setpoints received over UDP that can be queued on the bus; while they are,
+// the latest setpoint of up to UDP_MAX_HELD keys is held back
+#define UDP_MAX_INFLIGHT        64
+#define UDP_MAX_HELD            64
+
+// streams tracked at once, the one heard from least recently is forgotten
+// when a new one comes in, unless it still has setpoints in flight
+#define UDP_MAX_SENDERS         16
+
+struct udp;
+
+struct udp_stats {
+        uint64_t datagrams;  // received
+        uint64_t stale;      // dropped as duplicate or reordered
+        uint64_t lost;       // sequence numbers that never arrived
+        uint64_t malformed;  // too short or holding malformed frames
+        uint64_t setpoints;  // queued on the bus
+        uint64_t rejected;   // requests which are not setpoints
+        uint64_t overflows;  // setpoints dropped because neither the queue
+                             // nor the held back ones had room, and
+                             // datagrams of new streams while no slot was
+                             // free
+        uint64_t superseded; // replaced by a newer one before being sent
+        uint64_t failed;     // carried out with an error
+};
+
+// Open the UDP socket on port, submitting the setpoints to bus. The nodes of
+// a stream silent for timeout_ms are stopped with stop_op (see
+// watchdog_parse()). Completions are signalled on notify_fd. Must only be
+// used by the thread calling it.
+struct udp *udp_open(struct bus *bus, in_port_t port, int notify_fd,
+                     uint32_t timeout_ms, uint8_t stop_op);
+
+// The non-blocking socket, to wait for it becoming readable.
+int udp_fd(const struct udp *udp);
+
+// Receive and submit all datagrams that arrived.
+void udp_receive(struct udp *udp);
+
+// Stop the nodes of every stream whose deadline passed.
+void udp_run(struct udp *udp, uint64_t now);
+
+// Time in ms until udp_run() has to be called next, -1 if no stream is
+// tracked.
+int udp_timeout(const struct udp *udp, uint64_t now);
+
+// Account for the setpoints and stops the bus thread has carried out and
+// queue the setpoints held back meanwhile.
+void udp_complete(struct udp *udp);
+
+// Snapshot of the counters, safe to call from any thread.
+void udp_stats(struct udp_stats *stats);
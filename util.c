@@ -0,0 +1,28 @@
+#include "util.h"
+#include "epos.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+void die(const char *what, uint32_t err)
+{
+        fprintf(stderr, "|-> %s: 0x%x", what, err);
+
+        if (err != 0) {
+                char err_info[MAX_STR_SIZE];
+                if (VCS_GetErrorInfo(err, err_info, MAX_STR_SIZE)) {
+                        fprintf(stderr, " (%s)", err_info);
+                }
+        }
+
+        fprintf(stderr, "\n");
+        exit(err);
+}
+
+uint64_t now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
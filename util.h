@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+// size of string buffers handed to the library
+#define MAX_STR_SIZE 64
+
+// Print what failed together with the library's description of err (if any)
+// and exit with err.
+void die(const char *what, uint32_t err);
+
+// Current time of the monotonic clock in nanoseconds.
+uint64_t now_ns(void);
@@ -0,0 +1,278 @@
+#include "watchdog.h"
+#include "evlog.h"
+#include "proto.h"
+#include "util.h"
+
+#include <endian.h>
+#include <stdatomic.h>
+#include <string.h>
+
+// written by the threads serving sessions, read by any
+static struct {
+        _Atomic uint64_t expired;
+        _Atomic uint64_t disconnects;
+        _Atomic uint64_t stops;
+        _Atomic uint64_t failed;
+        _Atomic uint64_t dropped;
+} counters;
+
+static void count(_Atomic uint64_t *counter, uint64_t n)
+{
+        atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+uint32_t watchdog_parse(const uint8_t *in, uint16_t in_len,
+                        uint32_t *timeout_ms, uint8_t *stop_op)
+{
+        if (in_len != 5) {
+                return PROTO_ERR_BAD_LENGTH;
+        }
+
+        memcpy(timeout_ms, in, sizeof(*timeout_ms));
+        *timeout_ms = le32toh(*timeout_ms);
+        if (*timeout_ms > WATCHDOG_MAX_TIMEOUT_MS) {
+                return PROTO_ERR_BAD_ARG;
+        }
+
+        switch (in[4]) {
+        case WATCHDOG_QUICK_STOP:
+                *stop_op = OP_SET_QUICK_STOP_STATE;
+                return 0;
+        case WATCHDOG_HALT:
+                *stop_op = OP_HALT_VELOCITY_MOVEMENT;
+                return 0;
+        default:
+                return PROTO_ERR_BAD_ARG;
+        }
+}
+
+void watchdog_init(struct watchdog *wd, struct bus *bus, int notify_fd,
+                   watchdog_expire_fn expire)
+{
+        memset(wd, 0, sizeof(*wd));
+        if (bus_client_init(&wd->client, WATCHDOG_MAX_STOPS,
+                            notify_fd) == -1) {
+                die("failed to allocate watchdog", 0);
+        }
+
+        wd->bus = bus;
+        wd->expire = expire;
+        wd->tick = now_ns() / WATCHDOG_TICK_NS;
+}
+
+void watchdog_open(struct watchdog_session *session, void *owner,
+                   struct bus_client *client)
+{
+        *session = (struct watchdog_session){
+                .owner = owner,
+                .client = client,
+        };
+}
+
+static void watchdog_link(struct watchdog *wd,
+                          struct watchdog_session *session)
+{
+        // the slot of the tick the deadline falls into, or the last one if
+        // it lies beyond the wheel, from where it is moved on
+        uint64_t tick = (session->deadline + WATCHDOG_TICK_NS - 1) /
+                        WATCHDOG_TICK_NS;
+        if (tick <= wd->tick) {
+                tick = wd->tick + 1;
+        } else if (tick > wd->tick + WATCHDOG_SLOTS) {
+                tick = wd->tick + WATCHDOG_SLOTS;
+        }
+
+        unsigned slot = tick % WATCHDOG_SLOTS;
+        session->next = wd->slots[slot];
+        session->pprev = &wd->slots[slot];
+        if (session->next) {
+                session->next->pprev = &session->next;
+        }
+
+        wd->slots[slot] = session;
+        wd->occupied[slot / 64] |= 1ull << slot % 64;
+}
+
+static void watchdog_unlink(struct watchdog *wd,
+                            struct watchdog_session *session)
+{
+        if (!session->pprev) {
+                return;
+        }
+
+        *session->pprev = session->next;
+        if (session->next) {
+                session->next->pprev = session->pprev;
+        }
+
+        // the head is the only one pointing into the slots
+        struct watchdog_session **head = session->pprev;
+        if (head >= wd->slots && head < wd->slots + WATCHDOG_SLOTS &&
+            !*head) {
+                unsigned slot = head - wd->slots;
+                wd->occupied[slot / 64] &= ~(1ull << slot % 64);
+        }
+
+        session->next = NULL;
+        session->pprev = NULL;
+}
+
+// Queue a stop for every node the session sent motion commands to and cancel
+// its requests still queued. due is when the session was found to be gone.
+static void watchdog_stop(struct watchdog *wd,
+                          struct watchdog_session *session, uint64_t due)
+{
+        bus_cancel(session->client);
+        watchdog_unlink(wd, session);
+        session->timeout_ns = 0;
+
+        size_t queued = 0;
+        for (unsigned node = 0; node < 256; node++) {
+                if (!(session->nodes[node / 64] & 1ull << node % 64)) {
+                        continue;
+                }
+
+                if (wd->inflight < WATCHDOG_MAX_STOPS &&
+                    bus_urgent(wd->bus, &wd->client, session->stop_op, node,
+                               due) == 0) {
+                        wd->inflight++;
+                        queued++;
+                        evlog(EV_WATCHDOG_STOP, node, session->stop_op, 0);
+                } else {
+                        evlog(EV_WATCHDOG_DROPPED, node, 0, 0);
+                        count(&counters.dropped, 1);
+                }
+        }
+
+        memset(session->nodes, 0, sizeof(session->nodes));
+        if (queued) {
+                count(&counters.stops, queued);
+                bus_kick(wd->bus);
+        }
+}
+
+void watchdog_request(struct watchdog *wd, struct watchdog_session *session,
+                      uint8_t op, uint8_t node, const uint8_t *payload,
+                      uint16_t len)
+{
+        if (proto_motion(op)) {
+                session->nodes[node / 64] |= 1ull << node % 64;
+                return;
+        }
+
+        uint32_t timeout_ms;
+        uint8_t stop_op;
+        if (op == OP_SET_WATCHDOG &&
+            watchdog_parse(payload, len, &timeout_ms, &stop_op) == 0) {
+                watchdog_arm(wd, session, timeout_ms, stop_op);
+        }
+}
+
+void watchdog_arm(struct watchdog *wd, struct watchdog_session *session,
+                  uint32_t timeout_ms, uint8_t stop_op)
+{
+        session->timeout_ns = timeout_ms * 1000000ull;
+        session->stop_op = stop_op;
+        if (!session->timeout_ns) {
+                watchdog_unlink(wd, session);
+                return;
+        }
+
+        session->deadline = now_ns() + session->timeout_ns;
+        if (!session->pprev) {
+                watchdog_link(wd, session);
+        }
+}
+
+void watchdog_close(struct watchdog *wd, struct watchdog_session *session)
+{
+        if (session->timeout_ns) {
+                count(&counters.disconnects, 1);
+                watchdog_stop(wd, session, now_ns());
+        }
+}
+
+// Expire or move on the sessions in the slot of the current tick.
+static void watchdog_expire(struct watchdog *wd, uint64_t now)
+{
+        unsigned slot = wd->tick % WATCHDOG_SLOTS;
+        struct watchdog_session *session = wd->slots[slot];
+        wd->slots[slot] = NULL;
+        wd->occupied[slot / 64] &= ~(1ull << slot % 64);
+        while (session) {
+                struct watchdog_session *next = session->next;
+                session->next = NULL;
+                session->pprev = NULL;
+                if (session->deadline > now) {
+                        watchdog_link(wd, session);
+                } else {
+                        count(&counters.expired, 1);
+                        watchdog_stop(wd, session, session->deadline);
+                        wd->expire(session->owner);
+                }
+
+                session = next;
+        }
+}
+
+void watchdog_run(struct watchdog *wd, uint64_t now)
+{
+        uint64_t tick = now / WATCHDOG_TICK_NS;
+
+        // every slot comes up once per WATCHDOG_SLOTS ticks
+        if (tick > wd->tick + WATCHDOG_SLOTS) {
+                wd->tick = tick - WATCHDOG_SLOTS;
+        }
+
+        while (wd->tick < tick) {
+                wd->tick++;
+                watchdog_expire(wd, now);
+        }
+}
+
+int watchdog_timeout(const struct watchdog *wd, uint64_t now)
+{
+        // first occupied slot after the current tick
+        for (unsigned i = 1; i <= WATCHDOG_SLOTS;) {
+                unsigned slot = (wd->tick + i) % WATCHDOG_SLOTS;
+                uint64_t bits = wd->occupied[slot / 64] >> slot % 64;
+                if (bits) {
+                        uint64_t due = (wd->tick + i + __builtin_ctzll(bits)) *
+                                       WATCHDOG_TICK_NS;
+                        return due > now ? (due - now + 999999) / 1000000 : 0;
+                }
+
+                i += 64 - slot % 64;
+        }
+
+        return -1;
+}
+
+void watchdog_complete(struct watchdog *wd)
+{
+        struct bus_completion *completion;
+        while ((completion = spsc_peek(&wd->client.completions))) {
+                uint32_t err;
+                memcpy(&err, completion->frame + PROTO_HDR_SIZE, sizeof(err));
+                err = le32toh(err);
+                if (err) {
+                        evlog(EV_WATCHDOG_FAILED, completion->frame[3], err,
+                              0);
+                        count(&counters.failed, 1);
+                }
+
+                spsc_release(&wd->client.completions);
+                wd->inflight--;
+        }
+}
+
+void watchdog_stats(struct watchdog_stats *stats)
+{
+        *stats = (struct watchdog_stats){
+                .expired = atomic_load(&counters.expired),
+                .disconnects = atomic_load(&counters.disconnects),
+                .stops = atomic_load(&counters.stops),
+                .failed = atomic_load(&counters.failed),
+                .dropped = atomic_load(&counters.dropped),
+        };
+}
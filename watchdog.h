@@ -0,0 +1,125 @@
+#pragma once
+
+#include "bus.h"
+#include "util.h"
+
+#include <stdint.h>
+
+// Connection watchdog stopping the nodes of clients that went silent.
+//
+// A client arms the watchdog of its session (connection) with
+// OP_SET_WATCHDOG. From then on every request it sends counts as a heartbeat
+// (OP_NOP if it has nothing else to say), and if none arrives within the
+// timeout, or the client disconnects, every node the session sent a motion
+// command to (see proto_motion()) is stopped with OP_SET_QUICK_STOP_STATE or
+// OP_HALT_VELOCITY_MOVEMENT. The stops are queued as urgent commands (see
+// bus_urgent()), so they overtake any traffic waiting for the bus, and the
+// requests of the session still queued are cancelled so they cannot set a
+// node in motion again. A session whose watchdog expired is closed. Streams
+// of UDP setpoints (see udp.h) have a session each, which is always armed.
+//
+// Deadlines are kept in a timer wheel of WATCHDOG_SLOTS ticks, one per
+// thread serving sessions. A heartbeat only moves the deadline of its
+// session, which is put into the slot of its new deadline once the old slot
+// comes up, so heartbeats cost no more than reading the clock. The reaction
+// time from a deadline passing until the stop is issued is recorded by the
+// bus (see bus_urgent_stats()).
+
+#define WATCHDOG_TICK_NS        1000000 // resolution of deadlines
+#define WATCHDOG_SLOTS          256     // ticks the wheel spans
+
+#define WATCHDOG_MAX_TIMEOUT_MS 60000
+
+// stops of a thread that can be waiting for the bus at once, more are
+// dropped
+#define WATCHDOG_MAX_STOPS      256
+
+enum watchdog_action {
+        WATCHDOG_QUICK_STOP = 0, // OP_SET_QUICK_STOP_STATE
+        WATCHDOG_HALT = 1,       // OP_HALT_VELOCITY_MOVEMENT
+};
+
+// Called when the watchdog of the session with owner expired, after its
+// nodes have been stopped. The session is to be closed.
+typedef void (*watchdog_expire_fn)(void *owner);
+
+struct watchdog_session {
+        struct watchdog_session *next;   // in the slot of the wheel
+        struct watchdog_session **pprev; // NULL if not in the wheel
+        void *owner;
+        struct bus_client *client;       // cancelled when stopped
+        uint64_t timeout_ns;             // 0 if disarmed
+        uint64_t deadline;               // now_ns() of expiry
+        uint8_t stop_op;
+        uint64_t nodes[256 / 64];        // sent motion commands to
+};
+
+struct watchdog {
+        struct bus *bus;
+        watchdog_expire_fn expire;
+        struct bus_client client; // completions of the stops
+        unsigned inflight;
+
+        uint64_t tick; // last one handled
+        struct watchdog_session *slots[WATCHDOG_SLOTS];
+        uint64_t occupied[WATCHDOG_SLOTS / 64];
+};
+
+struct watchdog_stats {
+        uint64_t expired;     // sessions whose deadline passed
+        uint64_t disconnects; // armed sessions closed by the client
+        uint64_t stops;       // stops issued
+        uint64_t failed;      // stops the library reported an error for
+        uint64_t dropped;     // stops that could not be queued
+};
+
+// Parse the payload of OP_SET_WATCHDOG. Returns 0 or the error code to
+// respond with.
+uint32_t watchdog_parse(const uint8_t *in, uint16_t in_len,
+                        uint32_t *timeout_ms, uint8_t *stop_op);
+
+// Set up the wheel of the calling thread, which stops nodes on bus. Stop
+// completions are signalled on notify_fd.
+void watchdog_init(struct watchdog *wd, struct bus *bus, int notify_fd,
+                   watchdog_expire_fn expire);
+
+// Start a disarmed session of owner, whose requests are submitted by client.
+void watchdog_open(struct watchdog_session *session, void *owner,
+                   struct bus_client *client);
+
+// Note a request submitted by the session, arming or disarming its watchdog
+// if it is OP_SET_WATCHDOG.
+void watchdog_request(struct watchdog *wd, struct watchdog_session *session,
+                      uint8_t op, uint8_t node, const uint8_t *payload,
+                      uint16_t len);
+
+// Arm the watchdog of the session with timeout_ms and stop_op as parsed by
+// watchdog_parse(), or disarm it if timeout_ms is 0.
+void watchdog_arm(struct watchdog *wd, struct watchdog_session *session,
+                  uint32_t timeout_ms, uint8_t stop_op);
+
+// Push the deadline of the session out by its timeout. Call once per batch
+// of requests received.
+static inline void watchdog_feed(struct watchdog_session *session)
+{
+        if (session->timeout_ns) {
+                session->deadline = now_ns() + session->timeout_ns;
+        }
+}
+
+// The session is being closed. Stops its nodes if the watchdog is armed.
+void watchdog_close(struct watchdog *wd, struct watchdog_session *session);
+
+// Stop the nodes of every session whose deadline passed and call the expire
+// function for it.
+void watchdog_run(struct watchdog *wd, uint64_t now);
+
+// Time in ms until watchdog_run() has to be called next, -1 if no watchdog is
+// armed.
+int watchdog_timeout(const struct watchdog *wd, uint64_t now);
+
+// Account for the stops the bus thread has carried out.
+void watchdog_complete(struct watchdog *wd);
+
+// Counters of all threads, safe to call from any thread.
+void watchdog_stats(struct watchdog_stats *stats);